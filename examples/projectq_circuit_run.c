@@ -25,7 +25,7 @@ int main(int argc,char **args){
   PetscReal *gamma_1L,*gamma_2L,*sigma_xL,*sigma_yL,*sigma_zL;
   PetscReal gate_time_step,theta,fidelity,t1,t2;
   PetscScalar mat_val;
-  PetscInt  steps_max,num_qubits2;
+  PetscInt  steps_max,num_qubits2,layer=0,depth;
   Vec rho,rho_base,rho_base2,rho_base3;
   int num_qubits,i,j,h_dim,system,dm_place,logical_qubits,prev_qb,prev_qb2;
   circuit projectq_read,encoded_projectq;
@@ -145,6 +145,13 @@ int main(int argc,char **args){
   strcpy(filename,"NULL");
   PetscOptionsGetString(NULL,NULL,"-file_circ",filename,sizeof(filename),NULL);
   projectq_qasm_read(filename,&num_qubits2,&projectq_read);
+  /* Optionally apply gates on disjoint qubits together, one layer per time unit */
+  PetscOptionsGetInt(NULL,NULL,"-layer_circuit",&layer,NULL);
+  depth = projectq_read.num_gates;
+  if (layer){
+    layer_circuit(&projectq_read,ASAP,1.0,&depth);
+    if (nid==0) printf("Circuit depth: %d\n",(int)depth);
+  }
   logical_qubits = 4;
 
   qubits  = malloc(num_qubits*sizeof(struct operator)); //Only need 3 qubits for teleportation
@@ -345,7 +352,7 @@ int main(int argc,char **args){
   create_circuit(&encoded_projectq,10000);
   encode_circuit(projectq_read,&encoded_projectq,4,L0,L1,L2,L3);
 
-  time_max  = projectq_read.num_gates + 1;
+  time_max  = depth + 1;
   dt        = 0.01;
   steps_max = 1000;
 
@@ -22,7 +22,7 @@ encoded_qubit L0,L1,L2;
 int main(int argc,char **args){
   PetscReal time_max,dt,*gamma_1,*gamma_2,*omega,*sigma_x,*sigma_y,*sigma_z;
   PetscReal *gamma_1L,*gamma_2L,*sigma_xL,*sigma_yL,*sigma_zL;
-  PetscReal gate_time_step,theta,fidelity,t1,t2;
+  PetscReal gate_time_step,theta,fidelity,t1,t2,ec_period;
   PetscScalar mat_val;
   PetscInt  steps_max,num_qubits;
   Vec rho,rho_base,rho_base2,rho_base3;
@@ -183,6 +183,9 @@ int main(int argc,char **args){
   }
 
   PetscOptionsGetReal(NULL,NULL,"-theta",&theta,NULL);
+  /* Discrete error correction every ec_period, instead of continuous */
+  ec_period = 0;
+  PetscOptionsGetReal(NULL,NULL,"-ec_period",&ec_period,NULL);
 
   /* Add terms to the hamiltonian */
   for (i=0;i<num_qubits;i++){
@@ -365,9 +368,15 @@ int main(int argc,char **args){
 
   start_circuit_at_time(&teleportation,0.0);
 
-  add_continuous_error_correction(L0,r_str[0]);
-  add_continuous_error_correction(L1,r_str[1]);
-  add_continuous_error_correction(L2,r_str[2]);
+  if (ec_period>0){
+    add_discrete_error_correction(L0,ec_period);
+    add_discrete_error_correction(L1,ec_period);
+    add_discrete_error_correction(L2,ec_period);
+  } else {
+    add_continuous_error_correction(L0,r_str[0]);
+    add_continuous_error_correction(L1,r_str[1]);
+    add_continuous_error_correction(L2,r_str[2]);
+  }
 
   time_step(rho,0.0,time_max,dt,steps_max);
 
@@ -0,0 +1,564 @@
+#include "coo_p.h"
+#include <stdlib.h>
+#include <stdio.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+/* Matrices that are currently collecting values in a coo_assembly */
+static coo_assembly *_coo_assemblies[MAX_COO_ASSEMBLIES];
+static int           _num_coo_assemblies = 0;
+
+typedef struct coo_sort_entry{
+  PetscInt   row,col;
+  PetscCount k;
+} coo_sort_entry;
+
+static int _coo_compare(const void *a,const void *b){
+  const coo_sort_entry *ea = (const coo_sort_entry*)a;
+  const coo_sort_entry *eb = (const coo_sort_entry*)b;
+
+  if (ea->row!=eb->row) return (ea->row<eb->row) ? -1 : 1;
+  if (ea->col!=eb->col) return (ea->col<eb->col) ? -1 : 1;
+  /* Keep the sort stable, so the summation order is deterministic */
+  if (ea->k!=eb->k) return (ea->k<eb->k) ? -1 : 1;
+  return 0;
+}
+
+/*
+ * _coo_create allocates a coo_list with an initial capacity.
+ * The list grows automatically in _coo_add, so the capacity
+ * is only an estimate.
+ * Inputs:
+ *        PetscCount size: initial number of triplets to allocate
+ * Outputs:
+ *        coo_list *coo:   the new, empty list
+ */
+void _coo_create(coo_list *coo,PetscCount size){
+  if (size<1) size = 1;
+  (*coo).n    = 0;
+  (*coo).size = size;
+  (*coo).rows = malloc(size*sizeof(PetscInt));
+  (*coo).cols = malloc(size*sizeof(PetscInt));
+  (*coo).vals = malloc(size*sizeof(PetscScalar));
+  if ((*coo).rows==NULL||(*coo).cols==NULL||(*coo).vals==NULL){
+    printf("ERROR! Could not allocate COO list in _coo_create\n");
+    exit(0);
+  }
+  return;
+}
+
+/*
+ * _coo_add appends a triplet to the list, doubling the
+ * storage if the list is full. Negative rows or columns
+ * are the 'no nonzero' flag of the _get_val_j functions
+ * and are silently dropped.
+ * Inputs:
+ *        coo_list *coo:   list to append to
+ *        PetscInt row:    global row
+ *        PetscInt col:    global column
+ *        PetscScalar val: value
+ * Outputs:
+ *        none
+ */
+void _coo_add(coo_list *coo,PetscInt row,PetscInt col,PetscScalar val){
+  PetscCount new_size;
+
+  if (row<0||col<0) return;
+
+  if ((*coo).n==(*coo).size){
+    new_size    = 2*(*coo).size;
+    (*coo).rows = realloc((*coo).rows,new_size*sizeof(PetscInt));
+    (*coo).cols = realloc((*coo).cols,new_size*sizeof(PetscInt));
+    (*coo).vals = realloc((*coo).vals,new_size*sizeof(PetscScalar));
+    if ((*coo).rows==NULL||(*coo).cols==NULL||(*coo).vals==NULL){
+      printf("ERROR! Could not grow COO list in _coo_add\n");
+      exit(0);
+    }
+    (*coo).size = new_size;
+  }
+  (*coo).rows[(*coo).n] = row;
+  (*coo).cols[(*coo).n] = col;
+  (*coo).vals[(*coo).n] = val;
+  (*coo).n = (*coo).n + 1;
+  return;
+}
+
+/*
+ * _coo_append copies all triplets of src onto the end of dest.
+ * Inputs:
+ *        coo_list *dest: list to append to
+ *        coo_list *src:  list to copy from; unchanged
+ * Outputs:
+ *        none
+ */
+void _coo_append(coo_list *dest,coo_list *src){
+  PetscCount k;
+
+  for (k=0;k<(*src).n;k++){
+    _coo_add(dest,(*src).rows[k],(*src).cols[k],(*src).vals[k]);
+  }
+  return;
+}
+
+/*
+ * _coo_clear empties the list, but keeps its storage
+ */
+void _coo_clear(coo_list *coo){
+  (*coo).n = 0;
+  return;
+}
+
+void _coo_destroy(coo_list *coo){
+  free((*coo).rows);
+  free((*coo).cols);
+  free((*coo).vals);
+  (*coo).rows = NULL;
+  (*coo).cols = NULL;
+  (*coo).vals = NULL;
+  (*coo).n    = 0;
+  (*coo).size = 0;
+  return;
+}
+
+/*
+ * _coo_add_to_mat adds (ADD_VALUES) all triplets to a matrix which
+ * may already hold other values. Consecutive triplets in the same row
+ * are passed to PETSc in a single MatSetValues call. If A is staged
+ * in a coo_assembly, the triplets are appended to its list instead.
+ * Inputs:
+ *        Mat A:         matrix to add to; must be preallocated
+ *        coo_list *coo: triplets to add
+ * Outputs:
+ *        none
+ */
+void _coo_add_to_mat(Mat A,coo_list *coo){
+  PetscCount   k,k_start;
+  coo_assembly *assembly;
+
+  assembly = _coo_get_assembly(A);
+  if (assembly!=NULL&&(*assembly).staged){
+    _coo_append(&(*assembly).raw,coo);
+    return;
+  }
+  if (assembly!=NULL){
+    /* Finalized; the values go in at the next _coo_assemble_mat */
+    for (k=0;k<(*coo).n;k++){
+      _coo_assembly_record(assembly,(*coo).rows[k],(*coo).cols[k],(*coo).vals[k]);
+    }
+    return;
+  }
+
+  k = 0;
+  while (k<(*coo).n){
+    k_start = k;
+    while (k<(*coo).n && (*coo).rows[k]==(*coo).rows[k_start]){
+      k = k + 1;
+    }
+    MatSetValues(A,1,&(*coo).rows[k_start],(PetscInt)(k-k_start),&(*coo).cols[k_start],
+                 &(*coo).vals[k_start],ADD_VALUES);
+  }
+  return;
+}
+
+/*
+ * _coo_set_mat sets the nonzero pattern and values of a freshly
+ * created matrix directly from the triplets. Repeated (row,col)
+ * pairs are summed by PETSc. Any previous pattern or values
+ * of A are discarded.
+ * Inputs:
+ *        Mat A:         matrix with sizes and type set, not preallocated
+ *        coo_list *coo: triplets that make up A
+ * Outputs:
+ *        none, but A is assembled
+ */
+void _coo_set_mat(Mat A,coo_list *coo){
+  MatSetPreallocationCOO(A,(*coo).n,(*coo).rows,(*coo).cols);
+  MatSetValuesCOO(A,(*coo).vals,ADD_VALUES);
+  return;
+}
+
+/*
+ * _coo_get_ownership_range gives the rows of A owned by this core
+ * before A is preallocated, so that the COO lists for _coo_set_mat
+ * can be generated first. A needs only its sizes set.
+ * Inputs:
+ *        Mat A:             matrix with sizes set
+ * Outputs:
+ *        PetscInt *Istart:  first local row
+ *        PetscInt *Iend:    one past the last local row
+ */
+void _coo_get_ownership_range(Mat A,PetscInt *Istart,PetscInt *Iend){
+  PetscLayout rmap,cmap;
+
+  MatGetLayouts(A,&rmap,&cmap);
+  PetscLayoutSetUp(rmap);
+  PetscLayoutGetRange(rmap,Istart,Iend);
+  return;
+}
+
+/*
+ * _coo_sort_and_merge sorts the triplets by (row,col) and sums repeated
+ * entries. Explicit zeros are kept, since they may be needed in the
+ * nonzero pattern (e.g., placeholders for time dependent terms).
+ * Inputs:
+ *        coo_list *raw:    triplets to sort; unchanged
+ * Outputs:
+ *        coo_list *merged: created here; the sorted, unique triplets
+ *        PetscCount *map:  (optional, may be NULL) map[k] is the position
+ *                          in merged that raw triplet k was summed into
+ */
+void _coo_sort_and_merge(coo_list *raw,coo_list *merged,PetscCount *map){
+  coo_sort_entry *entries;
+  PetscCount     k;
+
+  entries = malloc(((*raw).n+1)*sizeof(coo_sort_entry));
+  for (k=0;k<(*raw).n;k++){
+    entries[k].row = (*raw).rows[k];
+    entries[k].col = (*raw).cols[k];
+    entries[k].k   = k;
+  }
+  qsort(entries,(*raw).n,sizeof(coo_sort_entry),_coo_compare);
+
+  _coo_create(merged,(*raw).n);
+  for (k=0;k<(*raw).n;k++){
+    if ((*merged).n==0 || entries[k].row!=(*merged).rows[(*merged).n-1]
+        || entries[k].col!=(*merged).cols[(*merged).n-1]){
+      /* New (row,col) pair */
+      _coo_add(merged,entries[k].row,entries[k].col,(*raw).vals[entries[k].k]);
+    } else {
+      (*merged).vals[(*merged).n-1] = (*merged).vals[(*merged).n-1] + (*raw).vals[entries[k].k];
+    }
+    if (map!=NULL) map[entries[k].k] = (*merged).n-1;
+  }
+
+  free(entries);
+  return;
+}
+
+/*
+ * _coo_assembly_create starts collecting the values for A
+ * in a coo_assembly. Until _coo_assembly_finalize is called, all values
+ * added to A through _coo_mat_add_value or _coo_add_to_mat are
+ * stored in the list rather than in A.
+ * Inputs:
+ *        Mat A:           matrix to stage; sizes must be set
+ *        PetscCount size: estimated number of triplets
+ * Outputs:
+ *        coo_assembly *assembly: the new assembly
+ */
+void _coo_assembly_create(coo_assembly *assembly,Mat A,PetscCount size){
+
+  (*assembly).mat       = A;
+  (*assembly).map       = NULL;
+  (*assembly).map_size  = 0;
+  (*assembly).added     = NULL;
+  (*assembly).staged    = 1;
+  (*assembly).dirty     = 0;
+  (*assembly).repattern = 0;
+  _coo_create(&(*assembly).raw,size);
+  _coo_create(&(*assembly).merged,1);
+
+  _coo_assembly_register(assembly);
+  return;
+}
+
+/*
+ * _coo_assembly_register makes the assembly visible to _coo_get_assembly,
+ * so that values added to its matrix are staged. Registering an
+ * assembly twice has no effect.
+ */
+void _coo_assembly_register(coo_assembly *assembly){
+  int i;
+
+  for (i=0;i<_num_coo_assemblies;i++){
+    if (_coo_assemblies[i]==assembly) return;
+  }
+  if (_num_coo_assemblies>=MAX_COO_ASSEMBLIES){
+    printf("ERROR! Too many COO assemblies in _coo_assembly_register\n");
+    exit(0);
+  }
+  _coo_assemblies[_num_coo_assemblies] = assembly;
+  _num_coo_assemblies = _num_coo_assemblies + 1;
+  return;
+}
+
+/*
+ * _coo_assembly_unregister removes the assembly from the registry,
+ * without freeing its lists
+ */
+void _coo_assembly_unregister(coo_assembly *assembly){
+  int i,j;
+
+  for (i=0;i<_num_coo_assemblies;i++){
+    if (_coo_assemblies[i]==assembly){
+      for (j=i;j<_num_coo_assemblies-1;j++){
+        _coo_assemblies[j] = _coo_assemblies[j+1];
+      }
+      _num_coo_assemblies = _num_coo_assemblies - 1;
+      break;
+    }
+  }
+  return;
+}
+
+/*
+ * _coo_assembly_destroy frees the lists of the assembly.
+ * The matrix itself is not destroyed.
+ */
+void _coo_assembly_destroy(coo_assembly *assembly){
+
+  if ((*assembly).mat==NULL) return;
+
+  _coo_assembly_unregister(assembly);
+  _coo_destroy(&(*assembly).raw);
+  _coo_destroy(&(*assembly).merged);
+  free((*assembly).map);
+  free((*assembly).added);
+  (*assembly).map    = NULL;
+  (*assembly).added  = NULL;
+  (*assembly).mat    = NULL;
+  (*assembly).staged = 0;
+  return;
+}
+
+/*
+ * _coo_assembly_finalize sorts and merges the collected triplets and
+ * sets the pattern and values of the matrix in one step. After this,
+ * the matrix is assembled, and values added to it are recorded (see
+ * _coo_assembly_record). If some of those were outside the pattern,
+ * calling this again sets the new pattern from scratch, first moving
+ * the values added to the old pattern into the raw list.
+ * The pattern never grows any other way, so MatSetValue on the
+ * matrix outside of it is an error.
+ * Must be called from all cores.
+ */
+void _coo_assembly_finalize(coo_assembly *assembly){
+  PetscCount k;
+
+  if (!(*assembly).staged&&!(*assembly).repattern) return;
+
+  if ((*assembly).added!=NULL){
+    for (k=0;k<(*assembly).merged.n;k++){
+      if ((*assembly).added[k]!=0.0){
+        _coo_add(&(*assembly).raw,(*assembly).merged.rows[k],(*assembly).merged.cols[k],
+                 (*assembly).added[k]);
+      }
+    }
+    free((*assembly).added);
+  }
+  _coo_destroy(&(*assembly).merged);
+  free((*assembly).map);
+  (*assembly).map_size = (*assembly).raw.size;
+  (*assembly).map      = malloc(((*assembly).map_size+1)*sizeof(PetscCount));
+  _coo_sort_and_merge(&(*assembly).raw,&(*assembly).merged,(*assembly).map);
+  (*assembly).added    = calloc((*assembly).merged.n+1,sizeof(PetscScalar));
+
+  _coo_set_mat((*assembly).mat,&(*assembly).merged);
+  (*assembly).staged    = 0;
+  (*assembly).dirty     = 0;
+  (*assembly).repattern = 0;
+  return;
+}
+
+/*
+ * _coo_assembly_set_values rebuilds the values of an already finalized
+ * matrix from the (possibly changed) values of the raw list and the
+ * values added since finalizing, keeping the nonzero pattern. This is a
+ * single MatSetValuesCOO call.
+ * Must be called from all cores.
+ */
+void _coo_assembly_set_values(coo_assembly *assembly){
+  PetscCount k;
+
+  if ((*assembly).staged||(*assembly).repattern){
+    printf("ERROR! The nonzero pattern changed in _coo_assembly_set_values; finalize again\n");
+    exit(0);
+  }
+
+  for (k=0;k<(*assembly).merged.n;k++){
+    (*assembly).merged.vals[k] = (*assembly).added[k];
+  }
+  for (k=0;k<(*assembly).raw.n;k++){
+    (*assembly).merged.vals[(*assembly).map[k]] = (*assembly).merged.vals[(*assembly).map[k]]
+      + (*assembly).raw.vals[k];
+  }
+  MatSetValuesCOO((*assembly).mat,(*assembly).merged.vals,INSERT_VALUES);
+  (*assembly).dirty = 0;
+  return;
+}
+
+/*
+ * _coo_assembly_record adds a value to a finalized assembly; it reaches the
+ * matrix at the next _coo_assemble_mat. If (row,col) is already in the
+ * merged pattern, the value is summed into added (and a zero is dropped),
+ * otherwise it is appended to the raw list and the pattern is set again.
+ */
+void _coo_assembly_record(coo_assembly *assembly,PetscInt row,PetscInt col,PetscScalar val){
+  PetscCount low,high,mid,pos;
+
+  if (row<0||col<0) return;
+
+  /* Binary search for (row,col) in the sorted, merged list */
+  pos  = -1;
+  low  = 0;
+  high = (*assembly).merged.n-1;
+  while (low<=high){
+    mid = (low+high)/2;
+    if ((*assembly).merged.rows[mid]<row||
+        ((*assembly).merged.rows[mid]==row&&(*assembly).merged.cols[mid]<col)){
+      low = mid + 1;
+    } else if ((*assembly).merged.rows[mid]==row&&(*assembly).merged.cols[mid]==col){
+      pos = mid;
+      break;
+    } else {
+      high = mid - 1;
+    }
+  }
+
+  if (pos>=0){
+    if (val!=0.0){
+      (*assembly).added[pos] = (*assembly).added[pos] + val;
+      (*assembly).dirty      = 1;
+    }
+    return;
+  }
+
+  if ((*assembly).raw.n>=(*assembly).map_size){
+    (*assembly).map_size = 2*(*assembly).map_size+1;
+    (*assembly).map = realloc((*assembly).map,((*assembly).map_size+1)*sizeof(PetscCount));
+  }
+  (*assembly).map[(*assembly).raw.n] = -1;
+  _coo_add(&(*assembly).raw,row,col,val);
+  (*assembly).repattern = 1;
+  return;
+}
+
+/*
+ * _coo_get_assembly returns the coo_assembly that holds A,
+ * or NULL if A is not handled through a coo_assembly.
+ */
+coo_assembly* _coo_get_assembly(Mat A){
+  int i;
+
+  for (i=0;i<_num_coo_assemblies;i++){
+    if ((*_coo_assemblies[i]).mat==A){
+      return _coo_assemblies[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * _coo_assemble_mat finalizes A if it is staged or its pattern changed,
+ * and rebuilds its values if any of them were changed since; otherwise
+ * it does nothing. The cores agree on what to do first, since values
+ * are usually added only to local rows.
+ * Must be called from all cores, before MatAssemblyBegin/End on A.
+ */
+void _coo_assemble_mat(Mat A){
+  coo_assembly *assembly;
+  int          flags[3];
+
+  assembly = _coo_get_assembly(A);
+  if (assembly!=NULL){
+    flags[0] = (*assembly).staged;
+    flags[1] = (*assembly).repattern;
+    flags[2] = (*assembly).dirty;
+    MPI_Allreduce(MPI_IN_PLACE,flags,3,MPI_INT,MPI_MAX,PetscObjectComm((PetscObject)A));
+    if (flags[0]||flags[1]){
+      (*assembly).repattern = 1;
+      _coo_assembly_finalize(assembly);
+    } else if (flags[2]){
+      _coo_assembly_set_values(assembly);
+    }
+  }
+  return;
+}
+
+/*
+ * _coo_mat_add_value is the staged equivalent of
+ * MatSetValue(A,row,col,val,ADD_VALUES). Once A is finalized, the value
+ * is recorded and reaches A at the next _coo_assemble_mat.
+ */
+void _coo_mat_add_value(Mat A,PetscInt row,PetscInt col,PetscScalar val){
+  coo_assembly *assembly;
+
+  assembly = _coo_get_assembly(A);
+  if (assembly==NULL){
+    MatSetValue(A,row,col,val,ADD_VALUES);
+  } else if ((*assembly).staged){
+    _coo_add(&(*assembly).raw,row,col,val);
+  } else {
+    _coo_assembly_record(assembly,row,col,val);
+  }
+  return;
+}
+
+/*
+ * _coo_create_thread_lists creates one coo_list per thread, to be
+ * filled in a threaded loop with _coo_get_thread_num() as the index.
+ * Inputs:
+ *        PetscInt num_threads:  number of lists
+ *        PetscCount total_size: estimated total number of triplets
+ * Return value:
+ *        array of num_threads lists
+ */
+coo_list* _coo_create_thread_lists(PetscInt num_threads,PetscCount total_size){
+  coo_list *thread_coo;
+  PetscInt i;
+
+  thread_coo = malloc(num_threads*sizeof(coo_list));
+  for (i=0;i<num_threads;i++){
+    _coo_create(&thread_coo[i],total_size/num_threads+1);
+  }
+  return thread_coo;
+}
+
+/*
+ * _coo_merge_thread_lists appends the per thread lists, in thread
+ * order, to dest and destroys them. With a static schedule each
+ * thread owns a contiguous block of rows, so row order is preserved.
+ */
+void _coo_merge_thread_lists(coo_list *dest,PetscInt num_threads,coo_list *thread_coo){
+  PetscInt i;
+
+  for (i=0;i<num_threads;i++){
+    _coo_append(dest,&thread_coo[i]);
+    _coo_destroy(&thread_coo[i]);
+  }
+  free(thread_coo);
+  return;
+}
+
+/*
+ * _coo_add_thread_lists_to_mat adds the per thread lists to A with
+ * ADD_VALUES and destroys them. MatSetValues is not thread safe,
+ * so this is done serially after the threaded generation.
+ */
+void _coo_add_thread_lists_to_mat(Mat A,PetscInt num_threads,coo_list *thread_coo){
+  PetscInt i;
+
+  for (i=0;i<num_threads;i++){
+    _coo_add_to_mat(A,&thread_coo[i]);
+    _coo_destroy(&thread_coo[i]);
+  }
+  free(thread_coo);
+  return;
+}
+
+PetscInt _coo_get_num_threads(){
+#if defined(_OPENMP)
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+PetscInt _coo_get_thread_num(){
+#if defined(_OPENMP)
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
@@ -0,0 +1,77 @@
+#ifndef COO_P_H_
+#define COO_P_H_
+
+#include <petscmat.h>
+
+/* MatSetPreallocationCOO takes off-process and negative indices only since 3.17 */
+#if !PETSC_VERSION_GE(3,17,0)
+#error "QuaC requires PETSc 3.17 or later"
+#endif
+
+/*
+ * coo_list is a growable list of (row,col,val) triplets.
+ * Assembly loops generate their nonzeros into these lists
+ * (one per thread), and the lists are then handed to PETSc
+ * in bulk, either through MatSetValues or through
+ * MatSetPreallocationCOO / MatSetValuesCOO.
+ */
+typedef struct coo_list{
+  PetscCount  n,size;
+  PetscInt    *rows,*cols;
+  PetscScalar *vals;
+} coo_list;
+
+/*
+ * coo_assembly collects all of the values destined for one matrix
+ * into a COO list (the matrix is 'staged'), instead of inserting them
+ * one by one. When the matrix is needed, the list is sorted and merged
+ * locally and handed to PETSc in a single MatSetPreallocationCOO /
+ * MatSetValuesCOO call. The raw list and the raw->merged map are kept,
+ * so that the values can later be rebuilt without touching the pattern.
+ * Values added after that to a slot of the pattern are summed into
+ * added (one value per merged triplet), so repeated adds take no extra
+ * memory; only values outside the pattern go into the raw list, to be
+ * merged into a new pattern.
+ */
+typedef struct coo_assembly{
+  Mat        mat;
+  coo_list   raw;       /* triplets, in the order they were added */
+  coo_list   merged;    /* sorted, unique triplets handed to PETSc */
+  PetscCount *map;      /* raw index -> merged index, -1 if not in merged */
+  PetscCount map_size;
+  PetscScalar *added;   /* per merged triplet, values added after finalizing */
+  int        staged;    /* 1 while collecting, 0 once handed to PETSc */
+  int        dirty;     /* 1 if raw values changed since the last rebuild */
+  int        repattern; /* 1 if raw has entries outside the merged pattern */
+} coo_assembly;
+
+#define MAX_COO_ASSEMBLIES 10
+
+void _coo_create(coo_list*,PetscCount);
+void _coo_add(coo_list*,PetscInt,PetscInt,PetscScalar);
+void _coo_append(coo_list*,coo_list*);
+void _coo_clear(coo_list*);
+void _coo_destroy(coo_list*);
+void _coo_add_to_mat(Mat,coo_list*);
+void _coo_set_mat(Mat,coo_list*);
+void _coo_get_ownership_range(Mat,PetscInt*,PetscInt*);
+void _coo_sort_and_merge(coo_list*,coo_list*,PetscCount*);
+
+void _coo_assembly_create(coo_assembly*,Mat,PetscCount);
+void _coo_assembly_destroy(coo_assembly*);
+void _coo_assembly_register(coo_assembly*);
+void _coo_assembly_unregister(coo_assembly*);
+void _coo_assembly_finalize(coo_assembly*);
+void _coo_assembly_set_values(coo_assembly*);
+void _coo_assembly_record(coo_assembly*,PetscInt,PetscInt,PetscScalar);
+coo_assembly* _coo_get_assembly(Mat);
+void _coo_assemble_mat(Mat);
+void _coo_mat_add_value(Mat,PetscInt,PetscInt,PetscScalar);
+
+coo_list* _coo_create_thread_lists(PetscInt,PetscCount);
+void _coo_merge_thread_lists(coo_list*,PetscInt,coo_list*);
+void _coo_add_thread_lists_to_mat(Mat,PetscInt,coo_list*);
+PetscInt _coo_get_num_threads();
+PetscInt _coo_get_thread_num();
+
+#endif
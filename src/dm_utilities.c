@@ -1,5 +1,7 @@
 #include "dm_utilities.h"
 #include "operators_p.h"
+#include "quac_p.h"
+#include "symmetry.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <petscblaslapack.h>
@@ -16,12 +18,12 @@ void print_dm(Vec rho,int h_dim){
   for (i=0;i<h_dim;i++){
     for (j=0;j<h_dim;j++){
       get_dm_element(rho,i,j,&val);
-      PetscPrintf(PETSC_COMM_WORLD,"%4.3e + %4.3ei ",PetscRealPart(val),
+      PetscPrintf(quac_comm,"%4.3e + %4.3ei ",PetscRealPart(val),
                   PetscImaginaryPart(val));
     }
-    PetscPrintf(PETSC_COMM_WORLD,"\n");
+    PetscPrintf(quac_comm,"\n");
   }
-    PetscPrintf(PETSC_COMM_WORLD,"\n");
+    PetscPrintf(quac_comm,"\n");
 }
 
 /*
@@ -36,7 +38,7 @@ void print_dm_sparse(Vec rho,int h_dim){
     for (j=0;j<h_dim;j++){
       get_dm_element(rho,i,j,&val);
       if (PetscAbsComplex(val)>1e-10){
-        PetscPrintf(PETSC_COMM_WORLD,"%d %d %e %e\n",i,j,PetscRealPart(val),PetscImaginaryPart(val));
+        PetscPrintf(quac_comm,"%d %d %e %e\n",i,j,PetscRealPart(val),PetscImaginaryPart(val));
       }
     }
   }
@@ -58,7 +60,7 @@ void print_dm_sparse_to_file(Vec rho,int h_dim,char filename[]){
     for (j=0;j<h_dim;j++){
       get_dm_element(rho,i,j,&val);
       if (PetscAbsComplex(val)>1e-10){
-        PetscFPrintf(PETSC_COMM_WORLD,fp,"%d %d %e %e\n",i,j,PetscRealPart(val),PetscImaginaryPart(val));
+        PetscFPrintf(quac_comm,fp,"%d %d %e %e\n",i,j,PetscRealPart(val),PetscImaginaryPart(val));
       }
     }
   }
@@ -81,7 +83,7 @@ void print_mat_sparse_to_file(Mat A,char filename[]){
     MatGetRow(A,i,&ncols,&cols,&vals);
     for (j=0;j<ncols;j++){
       if (PetscAbsComplex(vals[j])>1e-10){
-        PetscFPrintf(PETSC_COMM_WORLD,fp,"%d %d %e %e\n",i,cols[j],PetscRealPart(vals[j]),PetscImaginaryPart(vals[j]));
+        PetscFPrintf(quac_comm,fp,"%d %d %e %e\n",i,cols[j],PetscRealPart(vals[j]),PetscImaginaryPart(vals[j]));
       }
     }
     MatRestoreRow(A,i,&ncols,&cols,&vals);
@@ -104,7 +106,7 @@ void print_mat_sparse(Mat A){
     MatGetRow(A,i,&ncols,&cols,&vals);
     for (j=0;j<ncols;j++){
       if (PetscAbsComplex(vals[j])>1e-10){
-        PetscPrintf(PETSC_COMM_WORLD,"%d %d %e %e\n",i,cols[j],PetscRealPart(vals[j]),PetscImaginaryPart(vals[j]));
+        PetscPrintf(quac_comm,"%d %d %e %e\n",i,cols[j],PetscRealPart(vals[j]),PetscImaginaryPart(vals[j]));
       }
     }
     MatRestoreRow(A,i,&ncols,&cols,&vals);
@@ -125,10 +127,74 @@ void print_psi(Vec rho,int h_dim){
   for (i=0;i<h_dim;i++){
     location[0] = i;
     VecGetValues(rho,1,location,val_array);
-    PetscPrintf(PETSC_COMM_WORLD,"%f + %f i\n",PetscRealPart(val_array[0]),
+    PetscPrintf(quac_comm,"%f + %f i\n",PetscRealPart(val_array[0]),
                 PetscImaginaryPart(val_array[0]));
   }
-  PetscPrintf(PETSC_COMM_WORLD,"\n");
+  PetscPrintf(quac_comm,"\n");
+}
+
+/*
+ * _copy_reduced_dm copies the dm of the kept subsystems, which is in the
+ * order of the Hilbert space layout, into ptraced_dm with the subsystems
+ * in creation order, like every other user facing index. The two orders
+ * only differ after set_subsystem_order.
+ * Inputs:
+ *     Vec reduced_dm:   dm of the kept subsystems, in layout order
+ *     PetscInt n_kept:  number of kept subsystems
+ *     operator kept[]:  the kept subsystems, in creation order
+ * Outputs:
+ *     Vec ptraced_dm:   the same dm, in creation order
+ */
+static void _copy_reduced_dm(Vec reduced_dm,Vec ptraced_dm,PetscInt n_kept,operator kept[]){
+  PetscInt   i,k,low,high,dim,row,col,row_layout,col_layout,levels,*from,*n_after;
+  IS         is_from,is_to;
+  VecScatter ctx;
+
+  if (!_subsystems_reordered){
+    VecCopy(reduced_dm,ptraced_dm);
+    return;
+  }
+
+  /* Stride of each kept subsystem in the reduced layout */
+  PetscMalloc1(n_kept,&n_after);
+  dim = 1;
+  for (k=0;k<n_kept;k++){
+    dim = dim*kept[k]->my_levels;
+    n_after[k] = 1;
+    for (i=0;i<n_kept;i++){
+      if (kept[i]->n_before>kept[k]->n_before) n_after[k] = n_after[k]*kept[i]->my_levels;
+    }
+  }
+
+  /* Each element we own comes from the same row and column in the layout */
+  VecGetOwnershipRange(ptraced_dm,&low,&high);
+  PetscMalloc1(high-low,&from);
+  for (i=low;i<high;i++){
+    row        = i%dim;
+    col        = i/dim;
+    row_layout = 0;
+    col_layout = 0;
+    for (k=n_kept-1;k>=0;k--){
+      levels     = kept[k]->my_levels;
+      row_layout = row_layout + (row%levels)*n_after[k];
+      col_layout = col_layout + (col%levels)*n_after[k];
+      row        = row/levels;
+      col        = col/levels;
+    }
+    from[i-low] = dim*col_layout + row_layout;
+  }
+
+  ISCreateGeneral(PETSC_COMM_SELF,high-low,from,PETSC_OWN_POINTER,&is_from);
+  ISCreateStride(PETSC_COMM_SELF,high-low,low,1,&is_to);
+  VecScatterCreate(reduced_dm,is_from,ptraced_dm,is_to,&ctx);
+  VecScatterBegin(ctx,reduced_dm,ptraced_dm,INSERT_VALUES,SCATTER_FORWARD);
+  VecScatterEnd(ctx,reduced_dm,ptraced_dm,INSERT_VALUES,SCATTER_FORWARD);
+
+  VecScatterDestroy(&ctx);
+  ISDestroy(&is_from);
+  ISDestroy(&is_to);
+  PetscFree(n_after);
+  return;
 }
 
 /*
@@ -150,8 +216,9 @@ void print_psi(Vec rho,int h_dim){
 void partial_trace_over(Vec full_dm,Vec ptraced_dm,int number_of_ops,...){
   va_list ap;
   Vec tmp_dm,tmp_full_dm;
-  operator op;
+  operator op,*kept_systems;
   PetscInt i,j,current_total_levels,*nbef_prev,*nop_prev,dm_size,nbef,naf,previous_total_levels;
+  PetscInt num_kept;
 
   if (number_of_ops>num_subsystems){
     if (nid==0){
@@ -245,8 +312,21 @@ void partial_trace_over(Vec full_dm,Vec ptraced_dm,int number_of_ops,...){
   }
 
 
+  /* The subsystems left, in creation order */
+  PetscMalloc1(num_subsystems,&kept_systems);
+  num_kept = 0;
+  for (i=0;i<num_subsystems;i++){
+    for (j=0;j<number_of_ops;j++){
+      if (nbef_prev[j]==subsystem_list[i]->n_before) break;
+    }
+    if (j==number_of_ops){
+      kept_systems[num_kept] = subsystem_list[i];
+      num_kept = num_kept + 1;
+    }
+  }
+
   /* Assume ptraced_dm has been created, copy ptraced information into in */
-  VecCopy(tmp_full_dm,ptraced_dm);
+  _copy_reduced_dm(tmp_full_dm,ptraced_dm,num_kept,kept_systems);
 
   /* Destroy tmp_full_dm */
   destroy_dm(tmp_full_dm);
@@ -254,6 +334,7 @@ void partial_trace_over(Vec full_dm,Vec ptraced_dm,int number_of_ops,...){
 
   PetscFree(nbef_prev);
   PetscFree(nop_prev);
+  PetscFree(kept_systems);
 
   va_end(ap);
   return;
@@ -273,7 +354,7 @@ void measure_dm(Vec dm,operator op){
   PetscScalar val;
   Vec tmp_dm;
   dim = total_levels*total_levels;
-  MatCreate(PETSC_COMM_WORLD,&tmp_op_mat);
+  MatCreate(quac_comm,&tmp_op_mat);
   MatSetType(tmp_op_mat,MATMPIAIJ);
   MatSetSizes(tmp_op_mat,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
   MatSetFromOptions(tmp_op_mat);
@@ -394,7 +475,7 @@ void mult_dm_left_right(Vec dm,operator op_A,operator op_B){
   PetscScalar val;
   Vec tmp_dm,tmp_dm2;
   dim = total_levels*total_levels;
-  MatCreate(PETSC_COMM_WORLD,&tmp_op_mat);
+  MatCreate(quac_comm,&tmp_op_mat);
   MatSetType(tmp_op_mat,MATMPIAIJ);
   MatSetSizes(tmp_op_mat,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
   MatSetFromOptions(tmp_op_mat);
@@ -414,7 +495,7 @@ void mult_dm_left_right(Vec dm,operator op_A,operator op_B){
   MatMult(tmp_op_mat,dm,tmp_dm);
 
   MatDestroy(&tmp_op_mat);
-  MatCreate(PETSC_COMM_WORLD,&tmp_op_mat);
+  MatCreate(quac_comm,&tmp_op_mat);
   MatSetType(tmp_op_mat,MATMPIAIJ);
   MatSetSizes(tmp_op_mat,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
   MatSetFromOptions(tmp_op_mat);
@@ -451,7 +532,7 @@ void mult_dm_left_right(Vec dm,operator op_A,operator op_B){
 /*
  * partial_trace_keep does the partial trace, keeping only a list of operators
  * tracing out the operators not listed. Assumes systems are listed in order they
- * were created.
+ * were created; the kept systems are in that order in ptraced_dm.
  *
  * Inputs:
  *     Vec full_dm: the full Hilbert space density matrix to trace over.
@@ -589,7 +670,7 @@ void partial_trace_keep(Vec full_dm,Vec ptraced_dm,int number_of_ops,...){
 
 
   /* Assume ptraced_dm has been created, copy ptraced information into in */
-  VecCopy(tmp_full_dm,ptraced_dm);
+  _copy_reduced_dm(tmp_full_dm,ptraced_dm,number_of_ops,keeper_systems);
 
   /* Destroy tmp_full_dm */
   destroy_dm(tmp_full_dm);
@@ -615,7 +696,7 @@ void partial_trace_keep(Vec full_dm,Vec ptraced_dm,int number_of_ops,...){
  */
 void create_dm(Vec* new_dm,PetscInt size){
   /* Create the dm, partition with PETSc */
-  VecCreate(PETSC_COMM_WORLD,new_dm);
+  VecCreate(quac_comm,new_dm);
   VecSetType(*new_dm,VECMPI);
   VecSetSizes(*new_dm,PETSC_DECIDE,pow(size,2));
   /* Set all elements to 0 */
@@ -634,6 +715,11 @@ void create_dm(Vec* new_dm,PetscInt size){
  */
 void create_full_dm(Vec* new_dm){
 
+  if (_permutation_reduce){
+    /* The dm lives in the permutation invariant basis */
+    _permutation_create_dm(new_dm);
+    return;
+  }
   _check_initialized_A();
 
   /* Create the dm, partition with PETSc */
@@ -671,6 +757,11 @@ void set_dm_from_initial_pop(Vec x){
   MatScalar   *rho_mat_array;
   PetscReal   vec_pop;
 
+  if (_permutation_reduce){
+    _permutation_set_initial_pop(x);
+    return;
+  }
+
   /*
    * See if there are any vec operators
    */
@@ -953,6 +1044,8 @@ void set_initial_dm_2qds_first_plus_pop(Vec x,Vec rho_2qds){
  * input density matrix - global version; will grab from other
  * cores.
  * NOTE: This should be called by all processors, or the code will hang!
+ * NOTE: For a full dm, row and col number the states with the subsystems
+ *       in creation order, even after set_subsystem_order.
  *
  * Inputs:
  *        Vec new_dm   - density matrix from which to get element
@@ -967,6 +1060,11 @@ void get_dm_element(Vec dm,PetscInt row,PetscInt col,PetscScalar *val){
   PetscScalar val_array[1];
 
   VecGetSize(dm,&dm_size);
+  if (dm_size==total_levels*total_levels){
+    /* Full dms are indexed in creation order, whatever the layout */
+    row = _layout_index(row);
+    col = _layout_index(col);
+  }
   location[0] = sqrt(dm_size)*col + row;
 
   VecGetOwnershipRange(dm,&my_start,&my_end);
@@ -975,7 +1073,7 @@ void get_dm_element(Vec dm,PetscInt row,PetscInt col,PetscScalar *val){
   } else{
     val_array[0] = 0.0 + 0.0*PETSC_i;
   }
-  MPI_Allreduce(MPI_IN_PLACE,val_array,1,MPIU_SCALAR,MPI_SUM,PETSC_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE,val_array,1,MPIU_SCALAR,MPI_SUM,quac_comm);
 
   *val = val_array[0];
 }
@@ -1043,15 +1141,30 @@ void destroy_dm(Vec dm){
  *         None, but adds the value to the dm
  *
  * NOTE: You MUST call assemble_dm after adding all values.
+ * NOTE: For a full dm, row and col number the states with the subsystems
+ *       in creation order, even after set_subsystem_order.
+ * NOTE: With use_permutation_symmetry, the value is added to the whole
+ *       orbit of (row,col), i.e., the dm is symmetrized.
  *
  */
 
 void add_value_to_dm(Vec dm,PetscInt row,PetscInt col,PetscScalar val){
   PetscInt location,dm_size,low,high;
 
+  if (_permutation_reduce){
+    /* The value goes to the orbit of (row,col) */
+    _permutation_add_value(dm,row,col,val);
+    return;
+  }
+
   /* Get information about the dm */
   VecGetSize(dm,&dm_size);
   VecGetOwnershipRange(dm,&low,&high);
+  if (dm_size==total_levels*total_levels){
+    /* Full dms are indexed in creation order, whatever the layout */
+    row = _layout_index(row);
+    col = _layout_index(col);
+  }
   location = sqrt(dm_size)*col + row;
 
   /* If I own it, set the value */
@@ -1160,6 +1273,11 @@ void get_populations(Vec x,double **populations) {
   PetscInt          x_low,x_high,i,dm_size,diag_index,dim;
   const PetscScalar *xa;
   PetscReal         tmp_real,tmp_imag;
+
+  if (_permutation_reduce){
+    _permutation_populations(x,*populations);
+    return;
+  }
   if(_lindblad_terms) {
     dim = total_levels*total_levels;
   } else {
@@ -1356,6 +1474,13 @@ void get_expectation_value(Vec rho,PetscScalar *trace_val,int number_of_ops,...)
   PetscInt this_loc;
   PetscScalar dm_element,val,op_val;
 
+  if (_permutation_reduce){
+    if (nid==0){
+      printf("ERROR! get_expectation_value needs the full dm, which is not built\n");
+      printf("       with use_permutation_symmetry!\n");
+      exit(0);
+    }
+  }
   va_start(ap,number_of_ops);
   op = malloc(number_of_ops*sizeof(struct operator));
   /* Loop through passed in ops and store in list */
@@ -1462,7 +1587,7 @@ void get_expectation_value(Vec rho,PetscScalar *trace_val,int number_of_ops,...)
     }
   }
 
-  MPI_Allreduce(MPI_IN_PLACE,trace_val,1,MPIU_SCALAR,MPI_SUM,PETSC_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE,trace_val,1,MPIU_SCALAR,MPI_SUM,quac_comm);
 
   free(op);
   return;
@@ -1595,7 +1720,7 @@ void get_bipartite_concurrence(Vec dm,double *concurrence) {
   }
 
   /* Broadcast the value to all cores */
-  MPI_Bcast(concurrence,1,MPI_DOUBLE,0,PETSC_COMM_WORLD);
+  MPI_Bcast(concurrence,1,MPI_DOUBLE,0,quac_comm);
 
   VecDestroy(&dm_local);
   VecScatterDestroy(&ctx_dm);
@@ -1709,7 +1834,7 @@ void get_fidelity(Vec dm,Vec dm_r,double *fidelity) {
   }
 
   /* Broadcast the value to all cores */
-  MPI_Bcast(fidelity,1,MPI_DOUBLE,0,PETSC_COMM_WORLD);
+  MPI_Bcast(fidelity,1,MPI_DOUBLE,0,quac_comm);
 
   VecDestroy(&dm_local);
   VecDestroy(&dm_r_local);
@@ -1854,7 +1979,7 @@ void trace_dm(PetscScalar *trace_val,Vec dm){
         *trace_val = *trace_val + dm_element;
     }
   }
-  MPI_Allreduce(MPI_IN_PLACE,trace_val,1,MPIU_SCALAR,MPI_SUM,PETSC_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE,trace_val,1,MPIU_SCALAR,MPI_SUM,quac_comm);
 
   return;
 }
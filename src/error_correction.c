@@ -8,8 +8,9 @@
 #include <stdio.h>
 #include <stdarg.h>
 
-Mat *_DQEC_mats;
+dqec_channel *_DQEC_list = NULL;
 int _discrete_ec = 0;
+Vec _DQEC_work = NULL;
 
 void build_recovery_lin(Mat *recovery_mat,operator error,char commutation_string[],int n_stabilizers,...){
 
@@ -125,18 +126,30 @@ void destroy_stabilizer(stabilizer *stab){
  */
 
 void add_lin_recovery(PetscScalar a,PetscInt same_rate,operator error,char commutation_string[],int n_stabilizers,...){
-  va_list ap;
-  PetscScalar mat_scalar,add_to_mat,op_val;
-  PetscInt   i,Istart,Iend,this_i,i_stab,j_stab,k_stab,l_stab;
-  PetscInt i1,i2,j1,j2,num_nonzero1,num_nonzero2,i_comb,j_comb;
-  /*
-   * The following arrays are used in C* C calculationsg
-   * Maybe this is memory inefficient, but it takes
-   * far less memory than the DM, so it should be fine
-   */
-  PetscScalar this_row1[total_levels],this_row2[total_levels];
-  PetscInt row_nonzeros1[total_levels],row_nonzeros2[total_levels];
-  stabilizer     *stabs;
+  va_list    ap;
+  PetscInt   i;
+  stabilizer *stabs;
+
+  va_start(ap,n_stabilizers);
+  stabs = malloc(n_stabilizers*sizeof(struct stabilizer));
+  /* Loop through passed in ops and store in list */
+  for (i=0;i<n_stabilizers;i++){
+    stabs[i] = va_arg(ap,stabilizer);
+  }
+  va_end(ap);
+  _add_lin_recovery_stabs(a,same_rate,error,commutation_string,n_stabilizers,stabs);
+  free(stabs);
+  return;
+}
+
+/*
+ * _add_lin_recovery_stabs is add_lin_recovery with the stabilizers in an array
+ */
+void _add_lin_recovery_stabs(PetscScalar a,PetscInt same_rate,operator error,char commutation_string[],
+                             int n_stabilizers,stabilizer stabs[]){
+  PetscInt           Istart,Iend,num_threads;
+  recovery_expansion R,P;
+  coo_list           *thread_coo;
 
   /*
    * We are calculating the recovery operator, which is defined as:
@@ -146,7 +159,7 @@ void add_lin_recovery(PetscScalar a,PetscInt same_rate,operator error,char commu
    *
    * We will directly add the superoperator expanded values into the
    * full_A matrix, never explicitly building R, but rather,
-   * building I cross R^t R + (R^t R)* cross I + R* cross R
+   * building I cross R^t R + (R^t R)^T cross I + R* cross R
    */
   PetscLogEventBegin(add_lin_recovery_event,0,0,0,0);
   _check_initialized_A();
@@ -155,554 +168,361 @@ void add_lin_recovery(PetscScalar a,PetscInt same_rate,operator error,char commu
   if (PetscAbsComplex(a)!=0) {
     MatGetOwnershipRange(full_A,&Istart,&Iend);
 
-    va_start(ap,n_stabilizers);
-    stabs = malloc(n_stabilizers*sizeof(struct stabilizer));
-    /* Loop through passed in ops and store in list */
-    for (i=0;i<n_stabilizers;i++){
-      stabs[i] = va_arg(ap,stabilizer);
-    }
-    va_end(ap);
-
     /*
-     * Construct R^t R. Due to interesting relations among the pauli operators
-     * (sig_i * sig_i) = I and sig_i = sig_i^t, as well as the fact that
-     * pauli operators from different subspaces commute and the stabilizers
-     * themselve commute, R^t R has a rather simple form:
-     *
-     * R^t R = \prod_i (I + M_i)/2
+     * Since E is a Pauli operator and the stabilizers commute and square
+     * to I,
      *
-     * This is almost the same as R, but without the error!
-     * This product is very similar to the elementary symmetric polynomials, and there
-     * are formula for calculating the values (which we don't make use of at this point,
-     * given we plan to have few stabilizers at this time).
-     * An example, with 3 stabilizers:
+     * R^t R = P = \prod_i (1 +/- M_i)/2
      *
-     * R^t R = 1/2^3 (I + M_1 + M_2 + M_3 + M_1*M_2 + M_1*M_3 + M_2*M_3 + M_1*M_2*M_3)
+     * the projector onto the syndrome. Both R and P are expanded into one
+     * Pauli string per subset of the stabilizers (a la elementary
+     * symmetric polynomials):
      *
-     * Generally, the form is:
-     * R^t R = 1/2^n (I + \sum_i M_i + \sum_i<j M_i*M_j + \sum_i<j<k M_i*M_j*M_k + ...)
+     * P = 1/2^n (I +/- M_1 +/- M_2 + ... +/- M_1*M_2 + ...)
      *
-     * Since all M_i are constructed of tensor products (like I \cross Z \cross Z), and each of
-     * the submatrices are very sparse, we can use tricks (like in combine_ops_to_mat) to
-     * efficiently generate each of the members of the sum.
-     *
-     * Due to the form of commutation strings, if all of the error rates for each of
-     * the recover operators are the same, you only need to add the U* cross U terms
+     * Each Pauli string has one nonzero per row, so any row of R or P is
+     * a short sum, computed on the fly.
      */
+    _create_recovery_expansion(&R,error,commutation_string,n_stabilizers,stabs);
+    _create_recovery_expansion(&P,NULL,commutation_string,n_stabilizers,stabs);
 
-    mat_scalar = -1/pow(2,n_stabilizers) * 0.5 * a; //Store the common multiplier for all terms, -0.5*a*1/4^n
-    /* First, do I cross C^t C and (C^t C)* cross I */
     /*
-     * We break it up into different numbers of stabilizers, for the different
-     * numbers of terms (i.e., M_i or M_i*M_j, or M_i*M_j*M_k, etc)
-     * There should be a general way to do this that supports any number,
-     * but we code only to a maximum of 4 for now.
+     * Each thread generates a contiguous chunk of the local rows for every
+     * term into its own COO list; the lists are added to full_A at the end.
      */
-    /* I terms - a * (I cross I + I cross I) = 2*a*I in the total space*/
-    MatGetOwnershipRange(full_A,&Istart,&Iend);
-    for (i=Istart;i<Iend;i++){
-      add_to_mat = 2*mat_scalar;
-      MatSetValue(full_A,i,i,add_to_mat,ADD_VALUES);
-    }
-
-    if (same_rate==0) {
-      /* Single M_i terms */
+    num_threads = _coo_get_num_threads();
+    thread_coo  = _coo_create_thread_lists(num_threads,4*(Iend-Istart));
+
+#if defined(_OPENMP)
+#pragma omp parallel num_threads(num_threads)
+#endif
+    {
+      PetscScalar add_to_mat,*vals1,*vals2;
+      PetscInt    i,i1,i2,j1,j2,num_nonzero1,num_nonzero2,*cols1,*cols2;
+      coo_list    *my_coo = &thread_coo[_coo_get_thread_num()];
+
+      /* Row buffers, one entry per column group; reused for every row */
+      vals1 = malloc(R.n_groups*sizeof(PetscScalar));
+      vals2 = malloc(R.n_groups*sizeof(PetscScalar));
+      cols1 = malloc(R.n_groups*sizeof(PetscInt));
+      cols2 = malloc(R.n_groups*sizeof(PetscInt));
+
+#if defined(_OPENMP)
+#pragma omp for schedule(static)
+#endif
       for (i=Istart;i<Iend;i++){
-        for (i_stab=0;i_stab<2;i_stab++){//n_stabilizers;i_stab++){
-          /* First loop through i_stab's ops */
-          /* Reset this_i and op_val to identity */
-          this_i = i; // The leading index which we check
-          op_val = 1.0;
-          // Add I cross U
-          _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],-1);
-          add_to_mat = op_val * mat_scalar;
-          /* printf("add_to_mat: %f i: %d this_i: %d\n",add_to_mat,i,this_i); */
-          MatSetValue(full_A,i,this_i,add_to_mat,ADD_VALUES);
-
-          // Add  U* cross I
-          /* Reset this_i and op_val to identity */
-          this_i = i; // The leading index which we check
-          op_val = 1.0;
-          _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],1);
-          add_to_mat = op_val * mat_scalar;
-          MatSetValue(full_A,i,this_i,add_to_mat,ADD_VALUES);
-        }
-      }
-
-      if (n_stabilizers > 1) {
-        /* M_i*M_j terms */
-        for (i=Istart;i<Iend;i++){
-          for (i_stab=0;i_stab<n_stabilizers;i_stab++){
-            for (j_stab=i_stab+1;j_stab<n_stabilizers;j_stab++){
-              /* First loop through i_stab's ops */
-              /* Reset this_i and op_val to identity */
-              // Add I cross U
-              this_i = i; // The leading index which we check
-              op_val = 1.0;
-              _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],-1);
-              if (op_val!= 0.0) {
-                _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[j_stab],commutation_string[j_stab],-1);
-              }
-              add_to_mat = op_val * mat_scalar;
-              MatSetValue(full_A,i,this_i,add_to_mat,ADD_VALUES);
-
-              // Add U* cross I
-              this_i = i; // The leading index which we check
-              op_val = 1.0;
-              _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],1);
-              if (op_val!= 0.0) {
-                _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[j_stab],commutation_string[j_stab],1);
-              }
-              add_to_mat = op_val * mat_scalar;
-              MatSetValue(full_A,i,this_i,add_to_mat,ADD_VALUES);
-            }
+        /* -1/2 (I cross R^t R + (R^t R)^T cross I) */
+        if (same_rate) {
+          /*
+           * If all of the recovery operators have the same rate, the
+           * projectors of all syndromes sum to I, so only their identity
+           * parts, -a/2^n * I each, are needed.
+           */
+          add_to_mat = -a*P.coeffs[0];
+          _coo_add(my_coo,i,i,add_to_mat);
+        } else {
+          num_nonzero1 = _recovery_row(&P,i,1,0,vals1,cols1);
+          for (j1=0;j1<num_nonzero1;j1++){
+            add_to_mat = -0.5*a*vals1[j1];
+            _coo_add(my_coo,i,cols1[j1],add_to_mat);
           }
-        }
-      }
-      if (n_stabilizers>2) {
-        /* M_i*M_j*M_k terms */
-        for (i=Istart;i<Iend;i++){
-          for (i_stab=0;i_stab<n_stabilizers;i_stab++){
-            for (j_stab=i_stab+1;j_stab<n_stabilizers;j_stab++){
-              for (k_stab=j_stab+1;k_stab<n_stabilizers;k_stab++){
-                // Add I cross U
-                /* Reset this_i and op_val to identity */
-                this_i = i; // The leading index which we check
-                op_val = 1.0;
-                _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],-1);
-                if (op_val!= 0.0) {
-                  _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[j_stab],commutation_string[j_stab],-1);
-                }
-                if (op_val!= 0.0) {
-                  _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[k_stab],commutation_string[k_stab],-1);
-                }
-                add_to_mat = op_val * mat_scalar;
-                MatSetValue(full_A,i,this_i,add_to_mat,ADD_VALUES);
-
-                // Add I cross U
-                /* Reset this_i and op_val to identity */
-                this_i = i; // The leading index which we check
-                op_val = 1.0;
-                _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],1);
-                if (op_val!= 0.0) {
-                  _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[j_stab],commutation_string[j_stab],1);
-                }
-                if (op_val!= 0.0) {
-                  _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[k_stab],commutation_string[k_stab],1);
-                }
-                add_to_mat = op_val * mat_scalar;
-                MatSetValue(full_A,i,this_i,add_to_mat,ADD_VALUES);
-              }
-            }
+          num_nonzero1 = _recovery_row(&P,i,total_levels,1,vals1,cols1);
+          for (j1=0;j1<num_nonzero1;j1++){
+            add_to_mat = -0.5*a*vals1[j1];
+            _coo_add(my_coo,i,cols1[j1],add_to_mat);
           }
         }
-      }
 
-      if (n_stabilizers>3) {
-        /* M_i*M_j*M_k*M_l terms */
-        for (i=Istart;i<Iend;i++){
-          for (i_stab=0;i_stab<n_stabilizers;i_stab++){
-            for (j_stab=i_stab+1;j_stab<n_stabilizers;j_stab++){
-              for (k_stab=j_stab+1;k_stab<n_stabilizers;k_stab++){
-                for (l_stab=k_stab+1;l_stab<n_stabilizers;l_stab++){
-                  // Add I cross U
-                  /* Reset this_i and op_val to identity */
-                  this_i = i; // The leading index which we check
-                  op_val = 1.0;
-                  _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],-1);
-                  if (op_val!= 0.0) {
-                    _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[j_stab],commutation_string[j_stab],-1);
-                  }
-                  if (op_val!= 0.0) {
-                    _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[k_stab],commutation_string[k_stab],-1);
-                  }
-                  if (op_val!= 0.0) {
-                    _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[l_stab],commutation_string[l_stab],-1);
-                  }
-
-                  add_to_mat = op_val * mat_scalar;
-                  MatSetValue(full_A,i,this_i,add_to_mat,ADD_VALUES);
-
-                  // Add U* cross I
-                  /* Reset this_i and op_val to identity */
-                  this_i = i; // The leading index which we check
-                  op_val = 1.0;
-                  _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],1);
-                  if (op_val!= 0.0) {
-                    _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[j_stab],commutation_string[j_stab],1);
-                  }
-                  if (op_val!= 0.0) {
-                    _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[k_stab],commutation_string[k_stab],1);
-                  }
-                  if (op_val!= 0.0) {
-                    _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[l_stab],commutation_string[l_stab],1);
-                  }
-
-                  add_to_mat = op_val * mat_scalar;
-                  MatSetValue(full_A,i,this_i,add_to_mat,ADD_VALUES);
-
-                }
-              }
-            }
+        /* R* cross R */
+        i1 = i/total_levels;
+        i2 = i%total_levels;
+        num_nonzero1 = _recovery_row(&R,i1,1,0,vals1,cols1);
+        num_nonzero2 = _recovery_row(&R,i2,1,0,vals2,cols2);
+        for (j1=0;j1<num_nonzero1;j1++){
+          for (j2=0;j2<num_nonzero2;j2++){
+            add_to_mat = a*PetscConjComplex(vals1[j1])*vals2[j2];
+            _coo_add(my_coo,i,total_levels*cols1[j1]+cols2[j2],add_to_mat);
           }
         }
       }
-    }
-    if (n_stabilizers>4) {
-      if (nid==0){
-        printf("ERROR! A maximum of 4 stabilizers is supported at this time!\n");
-        exit(0);
-      }
+      free(vals1);
+      free(vals2);
+      free(cols1);
+      free(cols2);
     }
 
-    /*
-     * Add (C* cross C) to the superoperator matrix,
-     * We expand R* and R, get their respective i,j
-     * and use _add_to_PETSc_kron_ij to add the value
-     * to the full_A
-     *
-     *     R = E * (1 +/- M_1)/2 * (1 +/- M_2)/2 * ...
-     * or
-     *     R = E * \prod_i (1 +/- M_i)/2
-     *
-     * Similar to the calculation of R^t R above,
-     * we expand the product as:
-     *
-     *     R = E * (I + M_1 + M_2 + M_3 + M_1 * M_2 + ...)
-     *
-     * a la elementary symmetric polynomials.
-     * We take a given i, calculate the value for each
-     * of the individual terms, then sum it all up.
-     */
-    // Store common prefactors. 2*n_stab because C* cross C
-    mat_scalar = 1/pow(2,2*n_stabilizers) * a;
-    // FIXME Consider distributing this loop in some smart fashion
-    /* for (i1=0;i1<total_levels;i1++){ */
-    /*   /\* Get the nonzeros for row i1 of C *\/ */
-    /*   _get_row_nonzeros(this_row1,row_nonzeros1,&num_nonzero1,i1,error,commutation_string,n_stabilizers,stabs); */
-    /*   for (i2=0;i2<total_levels;i2++){ */
-    /*     /\* Get the nonzeros for row i2 of C *\/ */
-    /*     /\* FIXME: Consider skipping the i1=i2 spot *\/ */
-    /*     _get_row_nonzeros(this_row2,row_nonzeros2,&num_nonzero2,i2,error,commutation_string,n_stabilizers,stabs); */
-    /*     /\* */
-    /*      * Use the general formula for the kronecker product between */
-    /*      * two matrices to find the full value */
-    /*      *\/ */
-    /*     for (j1=0;j1<num_nonzero1;j1++){ */
-    /*       for (j2=0;j2<num_nonzero2;j2++){ */
-    /*         /\* Get the combind indices *\/ */
-    /*         i_comb = total_levels*i1 + i2; */
-    /*         j_comb = total_levels*row_nonzeros1[j1] + row_nonzeros2[j2]; */
-    /*         add_to_mat = mat_scalar * */
-    /*           PetscConjComplex(this_row1[row_nonzeros1[j1]])* */
-    /*           this_row2[row_nonzeros2[j2]]; */
-    /*         if (i_comb>=Istart&&i_comb<Iend) MatSetValue(full_A,i_comb,j_comb,add_to_mat,ADD_VALUES); */
-    /*       } */
-    /*     } */
-
-    /*   } */
-    /* } */
-
-    for (i=Istart;i<Iend;i++){
-      /* Calculate i1, i2 */
-      i1 = i/total_levels;
-      i2 = i%total_levels;
-      _get_row_nonzeros(this_row1,row_nonzeros1,&num_nonzero1,i1,error,commutation_string,n_stabilizers,stabs);
-      _get_row_nonzeros(this_row2,row_nonzeros2,&num_nonzero2,i2,error,commutation_string,n_stabilizers,stabs);
-      for (j1=0;j1<num_nonzero1;j1++){
-        for (j2=0;j2<num_nonzero2;j2++){
-          /* Get the combind indices */
-          i_comb = total_levels*i1 + i2;
-          j_comb = total_levels*row_nonzeros1[j1] + row_nonzeros2[j2];
-          add_to_mat = mat_scalar *
-            PetscConjComplex(this_row1[row_nonzeros1[j1]])*
-            this_row2[row_nonzeros2[j2]];
-          if (PetscAbsComplex(add_to_mat)>1e-5){
-            MatSetValue(full_A,i_comb,j_comb,add_to_mat,ADD_VALUES);
-          }
-        }
-      }
-    }
+    _coo_add_thread_lists_to_mat(full_A,num_threads,thread_coo);
+    _destroy_recovery_expansion(&R);
+    _destroy_recovery_expansion(&P);
   }
   PetscLogEventEnd(add_lin_recovery_event,0,0,0,0);
   return;
 }
 
-/* Get the j and val from a stabilizer - essentially multiply the ops for a given row
-* tensor_control - switch on which superoperator to compute
-*                  -1: I cross G
-*                   0: G* cross G
-*                   1: G* cross I
-*/
-void _get_this_i_and_val_from_stab(PetscInt *this_i, PetscScalar *op_val,stabilizer stab,
-                                   char commutation_char,PetscInt tensor_control){
-  PetscInt j,this_j;
-  PetscScalar val;
-  PetscReal plus_or_minus_1=1.0;
-
-  if (commutation_char=='1') {
-    plus_or_minus_1 = 1.0;
-  } else if (commutation_char=='0') {
-    plus_or_minus_1 = -1.0;
-  } else {
+/*
+ * _pauli_from_op converts a Pauli (or identity) operator on a qubit to
+ * a pauli_string
+ */
+void _pauli_from_op(operator op,pauli_string *p){
+  int      q;
+  uint64_t bit;
+
+  (*p).x = 0;
+  (*p).z = 0;
+  (*p).phase = 0;
+  if (op->my_op_type==IDENTITY) return;
+
+  /* Find which subsystem the operator acts on */
+  for (q=0;q<num_subsystems;q++){
+    if (subsystem_list[q]->n_before==op->n_before) break;
+  }
+  if (q>=64||op->my_levels!=2){
     if (nid==0){
-      printf("ERROR! commutation_string had a bad character! It can \n");
-      printf("       only have 0 or 1!\n");
+      printf("ERROR! Stabilizers and errors must be Pauli operators on one of\n");
+      printf("       the first 64 subsystems, which must be qubits!\n");
       exit(0);
     }
   }
-
-
-  for (j=0;j<stab.n_ops;j++){
-    _get_val_j_from_global_i(*this_i,stab.ops[j],&this_j,&val,tensor_control); // Get the corresponding j and val
-    if (this_j<0) {
-      /*
-       * Negative j says there is no nonzero value for a given this_i
-       * As such, we can immediately break the loop for i
-       */
-      *op_val = 0.0;
-      break;
-    } else {
-      *this_i = this_j;
-      *op_val = *op_val*val;
+  bit = ((uint64_t)1)<<q;
+  if (op->my_op_type==SIGMA_X){
+    (*p).x = bit;
+  } else if (op->my_op_type==SIGMA_Z){
+    (*p).z = bit;
+  } else if (op->my_op_type==SIGMA_Y){
+    /* Y = i X Z */
+    (*p).x = bit;
+    (*p).z = bit;
+    (*p).phase = 1;
+  } else {
+    if (nid==0){
+      printf("ERROR! Stabilizers and errors must be Pauli operators!\n");
+      exit(0);
     }
   }
+  return;
+}
 
-  if (tensor_control!=0){
-    /*
-     * We don't need to apply plus_or_minus_1 if tensor
-     * control is 0 because we would apply it twice (U* and U),
-     * always leading to +1
-     */
-    *op_val = *op_val*plus_or_minus_1; //Include commutation information
-  }
-
+static int _popcount(uint64_t m){
+  int count = 0;
 
+  while (m){
+    m = m & (m-1);
+    count = count + 1;
+  }
+  return count;
 }
 
-/* Gets the nonzeros in a row for a given i, error operator, and stabilizers */
-void _get_row_nonzeros(PetscScalar this_row[],PetscInt row_nonzeros[],PetscInt *num_nonzero,PetscInt i,operator error,char commutation_string[],int n_stabilizers,stabilizer stabs[]){
-  PetscScalar error_val,op_val;
-  PetscInt j,this_i,error_i,i_stab,j_stab,k_stab,l_stab,found;
-  /* Get the error terms nonzero for this i */
-  _get_val_j_from_global_i(i,error,&error_i,&error_val,-1); // Get the corresponding j and val
-  this_i = error_i; // The leading index which we check
-  op_val = error_val;
-
-  /*
-   * Reset num_nonzero. We need not reset the arrays because
-   * we will only access the indices described in the list,
-   * and those values will be correspondingly updated
-   */
+/*
+ * _pauli_mult returns the product a*b of two Pauli strings. Moving the
+ * Z's of a past the X's of b gives (-1)^|a.z & b.x|.
+ */
+pauli_string _pauli_mult(pauli_string a,pauli_string b){
+  pauli_string c;
 
-  *num_nonzero = 0;
-  /* E * I term - since this is the first term, we know we haven't added anything yet*/
-  this_row[this_i] = op_val;
-  row_nonzeros[*num_nonzero] = this_i;
-  *num_nonzero = *num_nonzero + 1;
+  c.x = a.x ^ b.x;
+  c.z = a.z ^ b.z;
+  c.phase = (a.phase + b.phase + 2*_popcount(a.z & b.x)) % 4;
+  return c;
+}
 
-  /*
-   * Single E * M_i terms. The error term is included from the
-   * fact tht this_i and op_val are reset to the error
-   * operator's values for each new stabilizer.
-   */
-  for (i_stab=0;i_stab<n_stabilizers;i_stab++){
-    /* Reset this_i and op_val to error values */
-    this_i = error_i; // The leading index which we check
-    op_val = error_val;
-    _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],-1);
-    if (op_val!=0.0) {
-      /*
-       * Check if we already have a value in this spot.
-       * This is a linear search; it should be fine, since
-       * these matrices are incredibly sparse. But, consider
-       * changing to faster search.
-       */
-      found = 0;
-      for (j=0;j<*num_nonzero;j++){
-        if (this_i==row_nonzeros[j]) {
-          // Found it!
-          found = 1;
-          break;
-        }
-      }
-      /* Add to this_row1 */
-      if (found==1){
-        /* There was a value here, so add to it */
-        this_row[this_i] = this_row[this_i] + op_val;
-      } else {
-        /* This is a new value, so just set */
-        this_row[this_i] = op_val;
-        row_nonzeros[*num_nonzero] = this_i;
-        *num_nonzero = *num_nonzero + 1;
-      }
+/*
+ * _pauli_row finds the one nonzero in row i of a Pauli string,
+ * P[i,j] = i^phase (-1)^(z . bits of j), with j = i with the x qubits flipped.
+ * Inputs:
+ *        pauli_string p:     the Pauli string
+ *        PetscInt i:         the row
+ *        PetscInt extra_after: 1 for P (or I cross P, acting on the low
+ *                            index), total_levels for P cross I
+ * Outputs:
+ *        PetscScalar *val:   the nonzero value
+ * Return:
+ *        j, the column of the nonzero
+ */
+PetscInt _pauli_row(pauli_string p,PetscInt i,PetscInt extra_after,PetscScalar *val){
+  static const PetscScalar i_pow[4] = {1.0,PETSC_i,-1.0,-PETSC_i};
+  PetscInt j,q,stride,bit_val;
+  uint64_t m;
+  int      sign = 1;
+
+  j = i;
+  m = p.x | p.z;
+  for (q=0;m;q++,m=m>>1){
+    if (!(m&1)) continue;
+    stride  = total_levels/(2*subsystem_list[q]->n_before)*extra_after;
+    bit_val = (i/stride)%2;
+    if ((p.x>>q)&1){
+      /* Flip this qubit */
+      j = j + (1-2*bit_val)*stride;
+      bit_val = 1 - bit_val;
+    }
+    if (((p.z>>q)&1) && bit_val){
+      sign = -sign;
     }
   }
+  *val = sign*i_pow[p.phase];
+  return j;
+}
 
-  if (n_stabilizers>1) {
-    /* M_i*M_j terms */
-    for (i_stab=0;i_stab<n_stabilizers;i_stab++){
-      for (j_stab=i_stab+1;j_stab<n_stabilizers;j_stab++){
-        /* Reset this_i and op_val to error values */
-        this_i = error_i; // The leading index which we check
-        op_val = error_val;
+typedef struct x_sort_entry{
+  uint64_t x;
+  PetscInt k;
+} x_sort_entry;
 
-        _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],-1);
+static int _x_compare(const void *a,const void *b){
+  uint64_t xa = ((x_sort_entry*)a)->x,xb = ((x_sort_entry*)b)->x;
 
-        if (op_val!= 0.0) {
-          _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[j_stab],commutation_string[j_stab],-1);
-        }
+  if (xa<xb) return -1;
+  if (xa>xb) return 1;
+  return 0;
+}
 
-        /*
-         * Now we have an element of the matrix form of E*M_i*M_j,
-         * add it to the row_nonzero value
-         */
-        if (op_val!=0.0) {
-          /*
-           * Check if we already have a value in this spot.
-           * This is a linear search; it should be fine, since
-           * these matrices are incredibly sparse. But, consider
-           * changing to faster search.
-           */
-          found = 0;
-          for (j=0;j<*num_nonzero;j++){
-            if (this_i==row_nonzeros[j]) {
-              // Found it!
-              found = 1;
-              break;
-            }
-          }
-          /* Add to this_row1 */
-          if (found==1){
-            /* There was a value here, so add to it */
-            this_row[this_i] = this_row[this_i] + op_val;
-          } else {
-            /* This is a new value, so just set */
-            this_row[this_i] = op_val;
-            row_nonzeros[*num_nonzero] = this_i;
-            *num_nonzero = *num_nonzero + 1;
-          }
-        }
+/*
+ * _create_recovery_expansion expands
+ *     R = E * \prod_i (1 +/- M_i)/2
+ * into its 2^n Pauli strings, one per subset of the stabilizers. The subsets
+ * are visited in Gray-code order, so each product is the previous one times
+ * a single stabilizer (the M_i commute and square to I). Terms with the same
+ * X mask put their nonzero in the same column of any row, so they are grouped.
+ * Inputs:
+ *        operator error:      the error E; NULL for the projector alone
+ *        char commutation_string[]: '1' if E commutes with M_i, '0' if not
+ *        int n_stabilizers:   number of stabilizers
+ *        stabilizer stabs[]:  the stabilizers
+ * Outputs:
+ *        recovery_expansion *R: the expansion
+ */
+void _create_recovery_expansion(recovery_expansion *R,operator error,char commutation_string[],
+                                int n_stabilizers,stabilizer stabs[]){
+  pauli_string stab_paulis[MAX_STABILIZERS],current,tmp;
+  PetscReal    signs[MAX_STABILIZERS],sign;
+  x_sort_entry *entries;
+  PetscInt     k,t;
+  int          i,j;
+
+  if (n_stabilizers>MAX_STABILIZERS){
+    if (nid==0){
+      printf("ERROR! A maximum of %d stabilizers is supported!\n",MAX_STABILIZERS);
+      exit(0);
+    }
+  }
 
+  for (i=0;i<n_stabilizers;i++){
+    /* Look up commutation pattern from commutation_string */
+    if (commutation_string[i]=='1') {
+      signs[i] = 1.0;
+    } else if (commutation_string[i]=='0') {
+      signs[i] = -1.0;
+    } else {
+      if (nid==0){
+        printf("ERROR! commutation_string had a bad character! It can \n");
+        printf("       only have 0 or 1!\n");
+        exit(0);
       }
     }
+    stab_paulis[i].x = 0;
+    stab_paulis[i].z = 0;
+    stab_paulis[i].phase = 0;
+    for (j=0;j<stabs[i].n_ops;j++){
+      _pauli_from_op(stabs[i].ops[j],&tmp);
+      stab_paulis[i] = _pauli_mult(stab_paulis[i],tmp);
+    }
   }
 
-  if (n_stabilizers>2) {
-    /* M_i*M_j*M_k terms */
-    for (i_stab=0;i_stab<n_stabilizers;i_stab++){
-      for (j_stab=i_stab+1;j_stab<n_stabilizers;j_stab++){
-        for (k_stab=j_stab+1;k_stab<n_stabilizers;k_stab++){
-          /* Reset this_i and op_val to error values */
-          this_i = error_i; // The leading index which we check
-          op_val = error_val;
+  (*R).n_terms = ((PetscInt)1)<<n_stabilizers;
+  (*R).terms   = malloc((*R).n_terms*sizeof(pauli_string));
+  (*R).coeffs  = malloc((*R).n_terms*sizeof(PetscScalar));
+  (*R).group   = malloc((*R).n_terms*sizeof(PetscInt));
 
-          _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],-1);
+  if (error!=NULL){
+    _pauli_from_op(error,&current);
+  } else {
+    current.x = 0;
+    current.z = 0;
+    current.phase = 0;
+  }
+  sign = 1.0/(((PetscInt)1)<<n_stabilizers);
+  (*R).terms[0]  = current;
+  (*R).coeffs[0] = sign;
+  for (k=1;k<(*R).n_terms;k++){
+    /* Gray code k^(k>>1) differs from the previous one in the lowest set bit of k */
+    t = 0;
+    while (!((k>>t)&1)) t = t + 1;
+    current = _pauli_mult(current,stab_paulis[t]);
+    sign    = sign*signs[t];
+    (*R).terms[k]  = current;
+    (*R).coeffs[k] = sign;
+  }
 
-          if (op_val!= 0.0) {
-            _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[j_stab],commutation_string[j_stab],-1);
-          }
+  /* Group the terms by X mask */
+  entries = malloc((*R).n_terms*sizeof(x_sort_entry));
+  for (k=0;k<(*R).n_terms;k++){
+    entries[k].x = (*R).terms[k].x;
+    entries[k].k = k;
+  }
+  qsort(entries,(*R).n_terms,sizeof(x_sort_entry),_x_compare);
+  (*R).n_groups = 0;
+  for (k=0;k<(*R).n_terms;k++){
+    if (k==0||entries[k].x!=entries[k-1].x){
+      (*R).n_groups = (*R).n_groups + 1;
+    }
+    (*R).group[entries[k].k] = (*R).n_groups - 1;
+  }
+  free(entries);
+  return;
+}
 
-          if (op_val!= 0.0) {
-            _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[k_stab],commutation_string[k_stab],-1);
-          }
+void _destroy_recovery_expansion(recovery_expansion *R){
+  free((*R).terms);
+  free((*R).coeffs);
+  free((*R).group);
+  return;
+}
 
-          /*
-           * Now we have an element of the matrix form of E*M_i*M_j,
-           * add it to the row_nonzero value
-           */
-          if (op_val!=0.0) {
-            /*
-             * Check if we already have a value in this spot.
-             * This is a linear search; it should be fine, since
-             * these matrices are incredibly sparse. But, consider
-             * changing to faster search.
-             */
-            found = 0;
-            for (j=0;j<*num_nonzero;j++){
-              if (this_i==row_nonzeros[j]) {
-                // Found it!
-                found = 1;
-                break;
-              }
-            }
-            /* Add to this_row1 */
-            if (found==1){
-              /* There was a value here, so add to it */
-              this_row[this_i] = this_row[this_i] + op_val;
-            } else {
-              /* This is a new value, so just set */
-              this_row[this_i] = op_val;
-              row_nonzeros[*num_nonzero] = this_i;
-              *num_nonzero = *num_nonzero + 1;
-            }
-          }
-        }
-      }
+/*
+ * _recovery_row gets the nonzeros in row i of an expanded recovery
+ * operator (or of its transpose). Terms in the same group are summed, and
+ * values that cancel are dropped.
+ * Inputs:
+ *        recovery_expansion *R: the expansion
+ *        PetscInt i:            the row
+ *        PetscInt extra_after:  as in _pauli_row
+ *        int transpose:         1 for a row of R^T
+ * Outputs:
+ *        PetscScalar vals[], PetscInt cols[]: the nonzeros; must hold
+ *                               R->n_groups entries
+ * Return:
+ *        the number of nonzeros
+ */
+PetscInt _recovery_row(recovery_expansion *R,PetscInt i,PetscInt extra_after,int transpose,
+                       PetscScalar vals[],PetscInt cols[]){
+  PetscInt    k,g,num_nonzero;
+  PetscScalar val;
+  PetscReal   scale=0.0;
+
+  for (g=0;g<(*R).n_groups;g++){
+    vals[g] = 0.0;
+  }
+  for (k=0;k<(*R).n_terms;k++){
+    g = (*R).group[k];
+    cols[g] = _pauli_row((*R).terms[k],i,extra_after,&val);
+    if (transpose && _popcount((*R).terms[k].x & (*R).terms[k].z)%2){
+      /* (X^x Z^z)^T = Z^z X^x = (-1)^|x & z| X^x Z^z */
+      val = -val;
     }
+    vals[g] = vals[g] + (*R).coeffs[k]*val;
+    scale   = PetscMax(scale,PetscAbsComplex((*R).coeffs[k]*val));
   }
 
-  if (n_stabilizers>3) {
-    /* M_i*M_j*M_k*M_l terms */
-    for (i_stab=0;i_stab<n_stabilizers;i_stab++){
-      for (j_stab=i_stab+1;j_stab<n_stabilizers;j_stab++){
-        for (k_stab=j_stab+1;k_stab<n_stabilizers;k_stab++){
-          for (l_stab=k_stab+1;l_stab<n_stabilizers;l_stab++){
-            /* Reset this_i and op_val to error values */
-            this_i = error_i; // The leading index which we check
-            op_val = error_val;
-
-            _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[i_stab],commutation_string[i_stab],-1);
-
-            if (op_val!= 0.0) {
-              _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[j_stab],commutation_string[j_stab],-1);
-            }
-
-            if (op_val!= 0.0) {
-              _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[k_stab],commutation_string[k_stab],-1);
-            }
-
-            if (op_val!= 0.0) {
-              _get_this_i_and_val_from_stab(&this_i,&op_val,stabs[l_stab],commutation_string[l_stab],-1);
-            }
-
-            /*
-             * Now we have an element of the matrix form of E*M_i*M_j,
-             * add it to the row_nonzero value
-             */
-            if (op_val!=0.0) {
-              /*
-               * Check if we already have a value in this spot.
-               * This is a linear search; it should be fine, since
-               * these matrices are incredibly sparse. But, consider
-               * changing to faster search.
-               */
-              found = 0;
-              for (j=0;j<*num_nonzero;j++){
-                if (this_i==row_nonzeros[j]) {
-                  // Found it!
-                  found = 1;
-                  break;
-                }
-              }
-              /* Add to this_row1 */
-              if (found==1){
-                /* There was a value here, so add to it */
-                this_row[this_i] = this_row[this_i] + op_val;
-              } else {
-                /* This is a new value, so just set */
-                this_row[this_i] = op_val;
-                row_nonzeros[*num_nonzero] = this_i;
-                *num_nonzero = *num_nonzero + 1;
-              }
-            }
-          }
-        }
-      }
+  /* Drop the groups whose terms cancel, up to rounding of the largest term */
+  num_nonzero = 0;
+  for (g=0;g<(*R).n_groups;g++){
+    if (PetscAbsComplex(vals[g])>10*PETSC_MACHINE_EPSILON*scale){
+      vals[num_nonzero] = vals[g];
+      cols[num_nonzero] = cols[g];
+      num_nonzero = num_nonzero + 1;
     }
   }
-
-  return;
+  return num_nonzero;
 }
 
 
@@ -841,10 +661,10 @@ void create_encoded_qubit(encoded_qubit *new_encoder,encoder_type my_encoder_typ
 
 //The ... are the encoders, assumes we decode to the first of the list in the encoder
 void add_encoded_gate_to_circuit(circuit *circ,PetscReal time,gate_type my_gate_type,...){
-  int num_qubits=0,qubit,i;
+  int num_qubits=0,qubits[2],i;
   va_list ap;
   encoded_qubit *encoders;
-  PetscReal theta;
+  PetscReal theta=0;
 
   if (_gate_array_initialized==0){
     //Initialize the array of gate function pointers
@@ -854,13 +674,6 @@ void add_encoded_gate_to_circuit(circuit *circ,PetscReal time,gate_type my_gate_
 
   _check_gate_type(my_gate_type,&num_qubits);
 
-  if ((*circ).num_gates==(*circ).gate_list_size){
-    if (nid==0){
-      printf("ERROR! Gate list not large enough (encoded)!\n");
-      exit(1);
-    }
-  }
-
   PetscMalloc1(num_qubits,&encoders);
 
   if (my_gate_type==RX||my_gate_type==RY||my_gate_type==RZ) {
@@ -882,29 +695,16 @@ void add_encoded_gate_to_circuit(circuit *circ,PetscReal time,gate_type my_gate_
     }
   }
 
-  // FIXME: Call add_gate_to_circuit here
-  // Store arguments for the logical operation in list
-  (*circ).gate_list[(*circ).num_gates].qubit_numbers = malloc(num_qubits*sizeof(int));
-  (*circ).gate_list[(*circ).num_gates].time = time;
-  (*circ).gate_list[(*circ).num_gates].my_gate_type = my_gate_type;
-  (*circ).gate_list[(*circ).num_gates]._get_val_j_from_global_i = _get_val_j_functions_gates[my_gate_type+_min_gate_enum];
-
-  // Loop through and store qubits
+  // Store the logical operation, on the qubits we decoded to
   for (i=0;i<num_qubits;i++){
-    qubit = encoders[i].qubits[0]; //assumes we decode to the first of the list
-    (*circ).gate_list[(*circ).num_gates].qubit_numbers[i] = qubit;
+    qubits[i] = encoders[i].qubits[0]; //assumes we decode to the first of the list
   }
 
   if (my_gate_type==RX||my_gate_type==RY||my_gate_type==RZ) {
     //Get the theta parameter from the last argument passed in
     theta = va_arg(ap,PetscReal);
-    (*circ).gate_list[(*circ).num_gates].theta = theta;
-  } else {
-    //Set theta to 0
-    (*circ).gate_list[(*circ).num_gates].theta = 0;
   }
-
-  (*circ).num_gates = (*circ).num_gates + 1;
+  _circuit_append(circ,time,my_gate_type,num_qubits,qubits,theta,0,0);
 
   // Now, reencode our qubits
   for (i=0;i<num_qubits;i++){
@@ -928,7 +728,7 @@ void encode_state(Vec rho,PetscInt num_logical_qubits,...){
   for (i=0;i<num_logical_qubits;i++){
     this_qubit = va_arg(ap,encoded_qubit);
     for (j=0;j<this_qubit.encoder_circuit.num_gates;j++) {
-      _apply_gate(this_qubit.encoder_circuit.gate_list[j],rho);
+      _apply_gate(_circuit_gate(this_qubit.encoder_circuit,j),rho);
     }
   }
 
@@ -947,7 +747,7 @@ void decode_state(Vec rho,PetscInt num_logical_qubits,...){
   for (i=0;i<num_logical_qubits;i++){
     this_qubit = va_arg(ap,encoded_qubit);
     for (j=0;j<this_qubit.decoder_circuit.num_gates;j++) {
-      _apply_gate(this_qubit.decoder_circuit.gate_list[j],rho);
+      _apply_gate(_circuit_gate(this_qubit.decoder_circuit,j),rho);
     }
   }
 
@@ -955,10 +755,30 @@ void decode_state(Vec rho,PetscInt num_logical_qubits,...){
 }
 
 
-void add_continuous_error_correction(encoded_qubit this_qubit,PetscReal correction_rate){
-  stabilizer     S1,S2,S3,S4;
-  operator       qubit0,qubit1,qubit2,qubit3,qubit4;
+/*
+ * _add_recovery adds one correctable error, with its syndrome, to a table
+ */
+static void _add_recovery(recovery_table *table,operator error,char commutation_string[]){
+  (*table).errors[(*table).n_recoveries]              = error;
+  (*table).commutation_strings[(*table).n_recoveries] = commutation_string;
+  (*table).n_recoveries = (*table).n_recoveries + 1;
+  return;
+}
+
+/*
+ * _get_recovery_table lists the stabilizers of an encoded qubit and every
+ * error it corrects, with the commutation string (syndrome) of that error.
+ * Inputs:
+ *        encoded_qubit this_qubit: the encoded qubit
+ * Outputs:
+ *        recovery_table *table:    the stabilizers and recoveries; free the
+ *                                  stabilizers with _destroy_recovery_table
+ */
+static void _get_recovery_table(encoded_qubit this_qubit,recovery_table *table){
+  operator qubit0,qubit1,qubit2,qubit3,qubit4;
 
+  (*table).n_stabilizers = 0;
+  (*table).n_recoveries  = 0;
   if (this_qubit.my_encoder_type == NONE){
     //No encoding, no error correction needed
   } else if (this_qubit.my_encoder_type == BIT){
@@ -966,32 +786,28 @@ void add_continuous_error_correction(encoded_qubit this_qubit,PetscReal correcti
     qubit1 = subsystem_list[this_qubit.qubits[1]];
     qubit2 = subsystem_list[this_qubit.qubits[2]];
 
-    create_stabilizer(&S1,2,qubit0->sig_z,qubit1->sig_z);
-    create_stabilizer(&S2,2,qubit1->sig_z,qubit2->sig_z);
+    (*table).n_stabilizers = 2;
+    create_stabilizer(&(*table).stabs[0],2,qubit0->sig_z,qubit1->sig_z);
+    create_stabilizer(&(*table).stabs[1],2,qubit1->sig_z,qubit2->sig_z);
 
-    add_lin_recovery(correction_rate,1,qubit0->eye,(char *)"11",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit0->sig_x,(char *)"01",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit1->sig_x,(char *)"00",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit2->sig_x,(char *)"10",2,S1,S2);
-
-    destroy_stabilizer(&S1);
-    destroy_stabilizer(&S2);
+    _add_recovery(table,qubit0->eye,(char *)"11");
+    _add_recovery(table,qubit0->sig_x,(char *)"01");
+    _add_recovery(table,qubit1->sig_x,(char *)"00");
+    _add_recovery(table,qubit2->sig_x,(char *)"10");
 
   } else if (this_qubit.my_encoder_type == PHASE){
     qubit0 = subsystem_list[this_qubit.qubits[0]];
     qubit1 = subsystem_list[this_qubit.qubits[1]];
     qubit2 = subsystem_list[this_qubit.qubits[2]];
 
-    create_stabilizer(&S1,2,qubit0->sig_x,qubit1->sig_x);
-    create_stabilizer(&S2,2,qubit1->sig_x,qubit2->sig_x);
-
-    add_lin_recovery(correction_rate,1,qubit0->eye,(char *)"11",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit0->sig_z,(char *)"01",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit1->sig_z,(char *)"00",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit2->sig_z,(char *)"10",2,S1,S2);
+    (*table).n_stabilizers = 2;
+    create_stabilizer(&(*table).stabs[0],2,qubit0->sig_x,qubit1->sig_x);
+    create_stabilizer(&(*table).stabs[1],2,qubit1->sig_x,qubit2->sig_x);
 
-    destroy_stabilizer(&S1);
-    destroy_stabilizer(&S2);
+    _add_recovery(table,qubit0->eye,(char *)"11");
+    _add_recovery(table,qubit0->sig_z,(char *)"01");
+    _add_recovery(table,qubit1->sig_z,(char *)"00");
+    _add_recovery(table,qubit2->sig_z,(char *)"10");
 
   } else if (this_qubit.my_encoder_type == FIVE) {
     qubit0 = subsystem_list[this_qubit.qubits[0]];
@@ -1000,42 +816,38 @@ void add_continuous_error_correction(encoded_qubit this_qubit,PetscReal correcti
     qubit3 = subsystem_list[this_qubit.qubits[3]];
     qubit4 = subsystem_list[this_qubit.qubits[4]];
 
-    create_stabilizer(&S1,4,qubit0->sig_x,qubit1->sig_z,qubit2->sig_z,qubit3->sig_x);
-    create_stabilizer(&S2,4,qubit1->sig_x,qubit2->sig_z,qubit3->sig_z,qubit4->sig_x);
-    create_stabilizer(&S3,4,qubit2->sig_x,qubit3->sig_z,qubit4->sig_z,qubit0->sig_x);
-    create_stabilizer(&S4,4,qubit3->sig_x,qubit4->sig_z,qubit0->sig_z,qubit1->sig_x);
+    (*table).n_stabilizers = 4;
+    create_stabilizer(&(*table).stabs[0],4,qubit0->sig_x,qubit1->sig_z,qubit2->sig_z,qubit3->sig_x);
+    create_stabilizer(&(*table).stabs[1],4,qubit1->sig_x,qubit2->sig_z,qubit3->sig_z,qubit4->sig_x);
+    create_stabilizer(&(*table).stabs[2],4,qubit2->sig_x,qubit3->sig_z,qubit4->sig_z,qubit0->sig_x);
+    create_stabilizer(&(*table).stabs[3],4,qubit3->sig_x,qubit4->sig_z,qubit0->sig_z,qubit1->sig_x);
 
-    add_lin_recovery(correction_rate,1,qubit0->eye,(char *)"1111",4,S1,S2,S3,S4);
+    _add_recovery(table,qubit0->eye,(char *)"1111");
 
     //Qubit 0 errors
-    add_lin_recovery(correction_rate,1,qubit0->sig_x,(char *)"1110",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit0->sig_y,(char *)"0100",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit0->sig_z,(char *)"0101",4,S1,S2,S3,S4);
+    _add_recovery(table,qubit0->sig_x,(char *)"1110");
+    _add_recovery(table,qubit0->sig_y,(char *)"0100");
+    _add_recovery(table,qubit0->sig_z,(char *)"0101");
 
     //Qubit 1 errors
-    add_lin_recovery(correction_rate,1,qubit1->sig_x,(char *)"0111",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit1->sig_y,(char *)"0010",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit1->sig_z,(char *)"1010",4,S1,S2,S3,S4);
+    _add_recovery(table,qubit1->sig_x,(char *)"0111");
+    _add_recovery(table,qubit1->sig_y,(char *)"0010");
+    _add_recovery(table,qubit1->sig_z,(char *)"1010");
 
     //Qubit 2 errors
-    add_lin_recovery(correction_rate,1,qubit2->sig_x,(char *)"0011",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit2->sig_y,(char *)"1101",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit2->sig_z,(char *)"0001",4,S1,S2,S3,S4);
+    _add_recovery(table,qubit2->sig_x,(char *)"0011");
+    _add_recovery(table,qubit2->sig_y,(char *)"1101");
+    _add_recovery(table,qubit2->sig_z,(char *)"0001");
 
     //Qubit 3 errors
-    add_lin_recovery(correction_rate,1,qubit3->sig_x,(char *)"1001",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit3->sig_y,(char *)"0110",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit3->sig_z,(char *)"0000",4,S1,S2,S3,S4);
+    _add_recovery(table,qubit3->sig_x,(char *)"1001");
+    _add_recovery(table,qubit3->sig_y,(char *)"0110");
+    _add_recovery(table,qubit3->sig_z,(char *)"0000");
 
     //Qubit 4 errors
-    add_lin_recovery(correction_rate,1,qubit4->sig_x,(char *)"1100",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit4->sig_y,(char *)"1011",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit4->sig_z,(char *)"1000",4,S1,S2,S3,S4);
-
-    destroy_stabilizer(&S1);
-    destroy_stabilizer(&S2);
-    destroy_stabilizer(&S3);
-    destroy_stabilizer(&S4);
+    _add_recovery(table,qubit4->sig_x,(char *)"1100");
+    _add_recovery(table,qubit4->sig_y,(char *)"1011");
+    _add_recovery(table,qubit4->sig_z,(char *)"1000");
 
   } else {
     if (nid==0){
@@ -1046,132 +858,186 @@ void add_continuous_error_correction(encoded_qubit this_qubit,PetscReal correcti
   return;
 }
 
-void add_discrete_error_correction(encoded_qubit this_qubit,PetscReal correction_rate){
-  stabilizer     S1,S2,S3,S4;
-  operator       qubit0,qubit1,qubit2,qubit3,qubit4;
-  if (this_qubit.my_encoder_type == NONE){
-    //No encoding, no error correction needed
-  } else if (this_qubit.my_encoder_type == BIT){
-    qubit0 = subsystem_list[this_qubit.qubits[0]];
-    qubit1 = subsystem_list[this_qubit.qubits[1]];
-    qubit2 = subsystem_list[this_qubit.qubits[2]];
-
-    create_stabilizer(&S1,2,qubit0->sig_z,qubit1->sig_z);
-    create_stabilizer(&S2,2,qubit1->sig_z,qubit2->sig_z);
-
-    add_lin_recovery(correction_rate,1,qubit0->eye,(char *)"11",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit0->sig_x,(char *)"01",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit1->sig_x,(char *)"00",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit2->sig_x,(char *)"10",2,S1,S2);
-
-    destroy_stabilizer(&S1);
-    destroy_stabilizer(&S2);
-  } else if (this_qubit.my_encoder_type == PHASE){
-    qubit0 = subsystem_list[this_qubit.qubits[0]];
-    qubit1 = subsystem_list[this_qubit.qubits[1]];
-    qubit2 = subsystem_list[this_qubit.qubits[2]];
-
-    create_stabilizer(&S1,2,qubit0->sig_x,qubit1->sig_x);
-    create_stabilizer(&S2,2,qubit1->sig_x,qubit2->sig_x);
-    add_lin_recovery(correction_rate,1,qubit0->eye,(char *)"11",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit0->sig_z,(char *)"01",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit1->sig_z,(char *)"00",2,S1,S2);
-    add_lin_recovery(correction_rate,1,qubit2->sig_z,(char *)"10",2,S1,S2);
-
-    destroy_stabilizer(&S1);
-    destroy_stabilizer(&S2);
-
-  } else if (this_qubit.my_encoder_type == FIVE) {
-    qubit0 = subsystem_list[this_qubit.qubits[0]];
-    qubit1 = subsystem_list[this_qubit.qubits[1]];
-    qubit2 = subsystem_list[this_qubit.qubits[2]];
-    qubit3 = subsystem_list[this_qubit.qubits[3]];
-    qubit4 = subsystem_list[this_qubit.qubits[4]];
+static void _destroy_recovery_table(recovery_table *table){
+  int i;
 
-    create_stabilizer(&S1,4,qubit0->sig_x,qubit1->sig_z,qubit2->sig_z,qubit3->sig_x);
-    create_stabilizer(&S2,4,qubit1->sig_x,qubit2->sig_z,qubit3->sig_z,qubit4->sig_x);
-    create_stabilizer(&S3,4,qubit2->sig_x,qubit3->sig_z,qubit4->sig_z,qubit0->sig_x);
-    create_stabilizer(&S4,4,qubit3->sig_x,qubit4->sig_z,qubit0->sig_z,qubit1->sig_x);
+  for (i=0;i<(*table).n_stabilizers;i++){
+    destroy_stabilizer(&(*table).stabs[i]);
+  }
+  (*table).n_stabilizers = 0;
+  (*table).n_recoveries  = 0;
+  return;
+}
 
-    add_lin_recovery(correction_rate,1,qubit0->eye,(char *)"1111",4,S1,S2,S3,S4);
+/*
+ * add_continuous_error_correction adds the recovery of an encoded qubit
+ * as Lindblad terms, one per correctable error, all at correction_rate
+ */
+void add_continuous_error_correction(encoded_qubit this_qubit,PetscReal correction_rate){
+  recovery_table table;
+  int            k;
 
-    //Qubit 0 errors
-    add_lin_recovery(correction_rate,1,qubit0->sig_x,(char *)"1110",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit0->sig_y,(char *)"0100",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit0->sig_z,(char *)"0101",4,S1,S2,S3,S4);
+  _get_recovery_table(this_qubit,&table);
+  for (k=0;k<table.n_recoveries;k++){
+    _add_lin_recovery_stabs(correction_rate,1,table.errors[k],table.commutation_strings[k],
+                            table.n_stabilizers,table.stabs);
+  }
+  _destroy_recovery_table(&table);
+  return;
+}
 
-    //Qubit 1 errors
-    add_lin_recovery(correction_rate,1,qubit1->sig_x,(char *)"0111",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit1->sig_y,(char *)"0010",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit1->sig_z,(char *)"1010",4,S1,S2,S3,S4);
+/*
+ * add_discrete_error_correction applies the full recovery of an encoded
+ * qubit every correction_time during time stepping: at each round,
+ *     rho -> sum_k R_k rho R_k^t
+ * with R_k = E_k * \prod_i (1 +/- M_i)/2 the recovery for the k'th
+ * syndrome. The sum of all R_k* cross R_k is built once, as one sparse
+ * superoperator (the channel), so each round is a single MatMult.
+ * Inputs:
+ *        encoded_qubit this_qubit:  the encoded qubit
+ *        PetscReal correction_time: time between rounds; the first round
+ *                                   is at correction_time
+ */
+void add_discrete_error_correction(encoded_qubit this_qubit,PetscReal correction_time){
+  recovery_table     table;
+  recovery_expansion *expansions;
+  Mat                channel;
+  PetscInt           dim,Istart,Iend,num_threads,k,max_groups;
+  coo_list           channel_coo,*thread_coo;
 
-    //Qubit 2 errors
-    add_lin_recovery(correction_rate,1,qubit2->sig_x,(char *)"0011",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit2->sig_y,(char *)"1101",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit2->sig_z,(char *)"0001",4,S1,S2,S3,S4);
+  if (this_qubit.my_encoder_type == NONE){
+    //No encoding, no error correction needed
+    return;
+  }
+  if (correction_time<=0){
+    if (nid==0){
+      printf("ERROR! correction_time must be positive for discrete error correction!\n");
+      exit(0);
+    }
+  }
+  PetscLogEventBegin(add_lin_recovery_event,0,0,0,0);
+  /* The channel maps pure states to mixed ones, so we need the full dm */
+  _check_initialized_A();
+  _lindblad_terms = 1;
 
-    //Qubit 3 errors
-    add_lin_recovery(correction_rate,1,qubit3->sig_x,(char *)"1001",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit3->sig_y,(char *)"0110",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit3->sig_z,(char *)"0000",4,S1,S2,S3,S4);
+  _get_recovery_table(this_qubit,&table);
+
+  dim = total_levels*total_levels;
+  MatCreate(quac_comm,&channel);
+  MatSetSizes(channel,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
+  MatSetFromOptions(channel);
+  MatSetUp(channel);
+  MatGetOwnershipRange(channel,&Istart,&Iend);
+
+  /* Expand each recovery once; the rows are then sums of a few Pauli strings */
+  expansions = malloc(table.n_recoveries*sizeof(recovery_expansion));
+  max_groups = 0;
+  for (k=0;k<table.n_recoveries;k++){
+    _create_recovery_expansion(&expansions[k],table.errors[k],table.commutation_strings[k],
+                               table.n_stabilizers,table.stabs);
+    if (expansions[k].n_groups>max_groups) max_groups = expansions[k].n_groups;
+  }
 
-    //Qubit 4 errors
-    add_lin_recovery(correction_rate,1,qubit4->sig_x,(char *)"1100",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit4->sig_y,(char *)"1011",4,S1,S2,S3,S4);
-    add_lin_recovery(correction_rate,1,qubit4->sig_z,(char *)"1000",4,S1,S2,S3,S4);
+  /*
+   * Each thread generates a contiguous chunk of the local rows of every
+   * R_k* cross R_k into its own COO list; repeated (i,j) from different
+   * k are summed when the pattern is set.
+   */
+  num_threads = _coo_get_num_threads();
+  thread_coo  = _coo_create_thread_lists(num_threads,4*(Iend-Istart));
+
+#if defined(_OPENMP)
+#pragma omp parallel num_threads(num_threads)
+#endif
+  {
+    PetscScalar add_to_mat,*vals1,*vals2;
+    PetscInt    i,k,i1,i2,j1,j2,num_nonzero1,num_nonzero2,*cols1,*cols2;
+    coo_list    *my_coo = &thread_coo[_coo_get_thread_num()];
+
+    vals1 = malloc(max_groups*sizeof(PetscScalar));
+    vals2 = malloc(max_groups*sizeof(PetscScalar));
+    cols1 = malloc(max_groups*sizeof(PetscInt));
+    cols2 = malloc(max_groups*sizeof(PetscInt));
+
+#if defined(_OPENMP)
+#pragma omp for schedule(static)
+#endif
+    for (i=Istart;i<Iend;i++){
+      /* Calculate i1, i2 */
+      i1 = i/total_levels;
+      i2 = i%total_levels;
+      for (k=0;k<table.n_recoveries;k++){
+        num_nonzero1 = _recovery_row(&expansions[k],i1,1,0,vals1,cols1);
+        num_nonzero2 = _recovery_row(&expansions[k],i2,1,0,vals2,cols2);
+        for (j1=0;j1<num_nonzero1;j1++){
+          for (j2=0;j2<num_nonzero2;j2++){
+            add_to_mat = PetscConjComplex(vals1[j1])*vals2[j2];
+            _coo_add(my_coo,i,total_levels*cols1[j1]+cols2[j2],add_to_mat);
+          }
+        }
+      }
+    }
+    free(vals1);
+    free(vals2);
+    free(cols1);
+    free(cols2);
+  }
 
-    destroy_stabilizer(&S1);
-    destroy_stabilizer(&S2);
-    destroy_stabilizer(&S3);
-    destroy_stabilizer(&S4);
+  _coo_create(&channel_coo,4*(Iend-Istart));
+  _coo_merge_thread_lists(&channel_coo,num_threads,thread_coo);
+  _coo_set_mat(channel,&channel_coo);
+  _coo_destroy(&channel_coo);
+  MatAssemblyBegin(channel,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(channel,MAT_FINAL_ASSEMBLY);
 
-  } else {
-    if (nid==0){
-      printf("ERROR! Encoder type not understood!\n");
-      exit(1);
-    }
+  for (k=0;k<table.n_recoveries;k++){
+    _destroy_recovery_expansion(&expansions[k]);
   }
+  free(expansions);
+  _destroy_recovery_table(&table);
+
+  /* Register the channel; time_step applies it through the event scheduler */
+  _DQEC_list = realloc(_DQEC_list,(_discrete_ec+1)*sizeof(dqec_channel));
+  _DQEC_list[_discrete_ec].channel = channel;
+  _DQEC_list[_discrete_ec].time    = correction_time;
+  _DQEC_list[_discrete_ec].period  = correction_time;
+  _discrete_ec = _discrete_ec + 1;
+  PetscLogEventEnd(add_lin_recovery_event,0,0,0,0);
   return;
 }
 
-
-/* EventFunction is one step in Petsc to apply some action at a specific time.
- * This function checks to see if an event has happened.
+/*
+ * _DQEC_event applies one round of discrete error correction. It is an
+ * event_scheduler action; ctx is the dqec_channel. The work vector is
+ * kept between rounds.
  */
-PetscErrorCode _DQEC_EventFunction(TS ts,PetscReal t,Vec U,PetscScalar *fvalue,void *ctx) {
-  /* Check if the time has passed a gate */
-
-  /* /\* We signal that we passed the time by returning a negative number *\/ */
-  /* for (i=0;i<_num_DQEC;i++){ */
-  /*   fvalue[i] = _correction_time[i] - t; */
-  /*   if (fvalue[i]<0){ */
-  /*     _correction_time[i] = _correction_time[i] + _correction_dt[i]; */
-  /*   } */
-  /* } */
-
-  return(0);
-}
+int _DQEC_event(PetscReal t,Vec U,void *ctx,PetscReal *next_time){
+  dqec_channel *this_channel = (dqec_channel*)ctx;
 
-/* PostEventFunction is the other step in Petsc. If an event has happend, petsc will call this function
- * to apply that event.
-*/
-PetscErrorCode _DQEC_PostEventFunction(TS ts,PetscInt nevents,PetscInt event_list[],PetscReal t,Vec U,PetscBool forward,void* ctx) {
-  PetscInt i,i_ev;
-  Vec tmp_answer;
+  if (_DQEC_work==NULL){
+    VecDuplicate(U,&_DQEC_work);
+  }
+  MatMult(this_channel->channel,U,_DQEC_work);
+  VecCopy(_DQEC_work,U);
+  this_channel->time = *next_time;
+  return 1;
+}
 
-  VecDuplicate(U,&tmp_answer);
+/*
+ * _destroy_discrete_error_correction frees all of the discrete error
+ * correction channels
+ */
+void _destroy_discrete_error_correction(){
+  int i;
 
-  if (nevents) {
-    //Loop through events
-    for (i_ev=0;i_ev<nevents;i_ev++){
-      MatMult(_DQEC_mats[i],U,tmp_answer);
-      VecCopy(tmp_answer,U);
-    }
-    VecDestroy(&tmp_answer);
+  for (i=0;i<_discrete_ec;i++){
+    MatDestroy(&_DQEC_list[i].channel);
   }
-
-  TSSetSolution(ts,U);
-  return(0);
+  free(_DQEC_list);
+  _DQEC_list   = NULL;
+  _discrete_ec = 0;
+  VecDestroy(&_DQEC_work);
+  return;
 }
 
 //Take an old circuit and encode it
@@ -1190,12 +1056,12 @@ void encode_circuit(circuit old_circ,circuit *encoded_circ,PetscInt num_encoders
   }
 
   for (i=0;i<old_circ.num_gates;i++){
-    time = old_circ.gate_list[i].time;
-    my_gate_type = old_circ.gate_list[i].my_gate_type;
+    time = old_circ.times[i];
+    my_gate_type = old_circ.gate_types[i];
     _check_gate_type(my_gate_type,&num_qubits);
-    theta = old_circ.gate_list[i].theta;
+    theta = old_circ.theta[i];
     for (j=0;j<num_qubits;j++){
-      qubit_numbers[j] = old_circ.gate_list[i].qubit_numbers[j];
+      qubit_numbers[j] = old_circ.qubits[old_circ.qubit_start[i]+j];
     }
     if (num_qubits==1){
       // Get the encoder for that qubit
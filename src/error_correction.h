@@ -2,6 +2,7 @@
 #define ERROR_CORRECTION_H_
 
 #include "quantum_gates.h"
+#include <stdint.h>
 typedef enum {
   NONE     = 0,
   BIT      = 1,
@@ -14,6 +15,50 @@ typedef struct stabilizer{
   operator* ops;
 } stabilizer;
 
+#define MAX_STABILIZERS 16
+#define MAX_RECOVERIES  64
+
+/*
+ * recovery_table lists the stabilizers of an encoded qubit and every
+ * error it corrects, with that error's commutation string (syndrome)
+ */
+typedef struct recovery_table{
+  int        n_stabilizers,n_recoveries;
+  stabilizer stabs[MAX_STABILIZERS];
+  operator   errors[MAX_RECOVERIES];
+  char       *commutation_strings[MAX_RECOVERIES];
+} recovery_table;
+
+/*
+ * pauli_string is i^phase X^x Z^z, where bit q of x (z) puts an X (Z) on
+ * subsystem q (which must be a qubit)
+ */
+typedef struct pauli_string{
+  uint64_t x,z;
+  int      phase;
+} pauli_string;
+
+/*
+ * recovery_expansion is a recovery (or projector) expanded as a sum of
+ * Pauli strings, sum_k coeffs[k]*terms[k]. Terms with the same x share
+ * a column in every row and so are in the same group.
+ */
+typedef struct recovery_expansion{
+  PetscInt     n_terms,n_groups;
+  pauli_string *terms;
+  PetscScalar  *coeffs;
+  PetscInt     *group;
+} recovery_expansion;
+
+/*
+ * dqec_channel is the cached recovery channel, sum_k R_k* cross R_k, of
+ * one encoded qubit, applied every period; time is the next round
+ */
+typedef struct dqec_channel{
+  Mat       channel;
+  PetscReal time,period;
+} dqec_channel;
+
 typedef struct encoded_qubit{
   PetscInt *qubits,num_qubits;
   encoder_type my_encoder_type;
@@ -22,17 +67,25 @@ typedef struct encoded_qubit{
 
 void build_recovery_lin(Mat*,operator,char[],int,...);
 void add_lin_recovery(PetscScalar,PetscInt,operator,char[],int,...);
+void _add_lin_recovery_stabs(PetscScalar,PetscInt,operator,char[],int,stabilizer[]);
 void create_stabilizer(stabilizer*,int,...);
 void destroy_stabilizer(stabilizer*);
-void _get_row_nonzeros(PetscScalar[],PetscInt[],PetscInt*,PetscInt,operator,char[],int,stabilizer[]);
-void _get_this_i_and_val_from_stab(PetscInt*, PetscScalar*,stabilizer,char,PetscInt);
+void _pauli_from_op(operator,pauli_string*);
+pauli_string _pauli_mult(pauli_string,pauli_string);
+PetscInt _pauli_row(pauli_string,PetscInt,PetscInt,PetscScalar*);
+void _create_recovery_expansion(recovery_expansion*,operator,char[],int,stabilizer[]);
+void _destroy_recovery_expansion(recovery_expansion*);
+PetscInt _recovery_row(recovery_expansion*,PetscInt,PetscInt,int,PetscScalar[],PetscInt[]);
 void create_encoded_qubit(encoded_qubit*,encoder_type,...);
 void add_encoded_gate_to_circuit(circuit*,PetscReal,gate_type,...);
 void encode_state(Vec,PetscInt,...);
 void decode_state(Vec,PetscInt,...);
 void add_continuous_error_correction(encoded_qubit,PetscReal);
+void add_discrete_error_correction(encoded_qubit,PetscReal);
 void encode_circuit(circuit,circuit*,PetscInt,...);
-PetscErrorCode _DQEC_PostEventFunction(TS,PetscInt,PetscInt[],PetscReal,Vec,PetscBool,void*);
-PetscErrorCode _DQEC_EventFunction(TS,PetscReal,Vec,PetscScalar*,void*);
+int _DQEC_event(PetscReal,Vec,void*,PetscReal*);
+void _destroy_discrete_error_correction();
 extern int _discrete_ec;
+extern dqec_channel *_DQEC_list;
+extern Vec _DQEC_work;
 #endif
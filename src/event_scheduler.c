@@ -0,0 +1,248 @@
+#include "event_scheduler.h"
+#include "quantum_gates.h"
+#include "error_correction.h"
+#include "quac_p.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+timed_action _timed_action_list[MAX_TIMED_ACTIONS];
+int _num_timed_actions = 0;
+
+/*
+ * add_timed_action registers a user action to be applied to the state
+ * during time_step (and any other integration), at an exact time and
+ * optionally periodically after that.
+ * Inputs:
+ *        PetscReal time:   first time to apply the action
+ *        PetscReal period: apply again every period after time; 0 for once
+ *        void (*action)(PetscReal t,Vec U,void *ctx): the action; it may
+ *                          change U in place
+ *        void *ctx:        user context passed to action
+ */
+void add_timed_action(PetscReal time,PetscReal period,void (*action)(PetscReal,Vec,void*),void *ctx){
+
+  if (_num_timed_actions==MAX_TIMED_ACTIONS){
+    if (nid==0){
+      printf("ERROR! Too many timed actions! Increase MAX_TIMED_ACTIONS.\n");
+      exit(0);
+    }
+  }
+  if (period<0){
+    if (nid==0){
+      printf("ERROR! The period of a timed action must not be negative!\n");
+      exit(0);
+    }
+  }
+  _timed_action_list[_num_timed_actions].time   = time;
+  _timed_action_list[_num_timed_actions].period = period;
+  _timed_action_list[_num_timed_actions].active = 1;
+  _timed_action_list[_num_timed_actions].action = action;
+  _timed_action_list[_num_timed_actions].ctx    = ctx;
+  _num_timed_actions = _num_timed_actions + 1;
+  return;
+}
+
+/*
+ * _num_scheduled_sources counts the sources of timed actions; when it is
+ * nonzero the state is changed during integration
+ */
+int _num_scheduled_sources(){
+  return _num_quantum_gates + _num_circuits + _discrete_ec + _num_timed_actions;
+}
+
+/*
+ * _gate_event applies the layer of standalone gates (add_gate) due at t
+ */
+static int _gate_event(PetscReal t,Vec U,void *ctx,PetscReal *next_time){
+  _apply_gates(t,U);
+  return _gate_next_time(next_time);
+}
+
+/*
+ * _circuit_event applies the layer of circuit gates due at t
+ */
+static int _circuit_event(PetscReal t,Vec U,void *ctx,PetscReal *next_time){
+  _apply_circuit_gates(t,U);
+  return _circuit_next_gate_time(next_time);
+}
+
+/*
+ * _timed_action_event calls a user action and remembers when it is due next
+ */
+static int _timed_action_event(PetscReal t,Vec U,void *ctx,PetscReal *next_time){
+  timed_action *this_action = (timed_action*)ctx;
+
+  this_action->action(t,U,this_action->ctx);
+  if (this_action->period>0){
+    this_action->time = *next_time;
+  } else {
+    this_action->active = 0;
+  }
+  return this_action->active;
+}
+
+/*
+ * _event_before orders events by time, then priority, then schedule order
+ */
+static int _event_before(quac_event *a,quac_event *b){
+  if (a->time!=b->time) return a->time<b->time;
+  if (a->priority!=b->priority) return a->priority<b->priority;
+  return a->order<b->order;
+}
+
+static void _scheduler_push(event_scheduler sched,quac_event ev){
+  PetscInt   i,parent;
+  quac_event tmp;
+
+  if (sched->n==sched->size){
+    sched->size = 2*sched->size;
+    sched->heap = realloc(sched->heap,sched->size*sizeof(quac_event));
+  }
+  ev.order = sched->num_scheduled;
+  sched->num_scheduled = sched->num_scheduled + 1;
+  i = sched->n;
+  sched->heap[i] = ev;
+  sched->n = sched->n + 1;
+  /* Sift up */
+  while (i>0){
+    parent = (i-1)/2;
+    if (!_event_before(&sched->heap[i],&sched->heap[parent])) break;
+    tmp = sched->heap[i];
+    sched->heap[i] = sched->heap[parent];
+    sched->heap[parent] = tmp;
+    i = parent;
+  }
+  return;
+}
+
+static quac_event _scheduler_pop(event_scheduler sched){
+  PetscInt   i,child;
+  quac_event top,tmp;
+
+  top = sched->heap[0];
+  sched->n = sched->n - 1;
+  sched->heap[0] = sched->heap[sched->n];
+  /* Sift down */
+  i = 0;
+  while (2*i+1<sched->n){
+    child = 2*i+1;
+    if (child+1<sched->n && _event_before(&sched->heap[child+1],&sched->heap[child])) child = child + 1;
+    if (!_event_before(&sched->heap[child],&sched->heap[i])) break;
+    tmp = sched->heap[i];
+    sched->heap[i] = sched->heap[child];
+    sched->heap[child] = tmp;
+    i = child;
+  }
+  return top;
+}
+
+/*
+ * _scheduler_add schedules an action
+ * Inputs:
+ *        event_scheduler sched: the scheduler
+ *        PetscReal time:        time the action is due
+ *        PetscReal period:      if >0, the default time between firings
+ *        PetscInt priority:     order among actions due at the same time
+ *        quac_event_action action, void *ctx: the action and its context
+ */
+void _scheduler_add(event_scheduler sched,PetscReal time,PetscReal period,PetscInt priority,
+                    quac_event_action action,void *ctx){
+  quac_event ev;
+
+  ev.time     = time;
+  ev.period   = period;
+  ev.priority = priority;
+  ev.action   = action;
+  ev.ctx      = ctx;
+  _scheduler_push(sched,ev);
+  return;
+}
+
+/*
+ * _scheduler_create makes a scheduler holding every registered source of
+ * timed actions: standalone gates, circuits, discrete error correction,
+ * and user actions. It is built
+ * from the current state of each source, so actions already applied in an
+ * earlier integration are not repeated.
+ * Outputs:
+ *        event_scheduler *sched: new scheduler
+ */
+void _scheduler_create(event_scheduler *sched){
+  event_scheduler temp;
+  PetscReal       time;
+  int             i;
+
+  temp = malloc(sizeof(struct event_scheduler_struct));
+  temp->n             = 0;
+  temp->size          = 16;
+  temp->num_scheduled = 0;
+  temp->heap          = malloc(temp->size*sizeof(quac_event));
+
+  if (_gate_next_time(&time)){
+    _scheduler_add(temp,time,0,EVENT_PRIORITY_GATES,_gate_event,NULL);
+  }
+  if (_circuit_next_gate_time(&time)){
+    _scheduler_add(temp,time,0,EVENT_PRIORITY_GATES,_circuit_event,NULL);
+  }
+  for (i=0;i<_discrete_ec;i++){
+    _scheduler_add(temp,_DQEC_list[i].time,_DQEC_list[i].period,
+                   EVENT_PRIORITY_QEC,_DQEC_event,&_DQEC_list[i]);
+  }
+  for (i=0;i<_num_timed_actions;i++){
+    if (_timed_action_list[i].active){
+      _scheduler_add(temp,_timed_action_list[i].time,_timed_action_list[i].period,
+                     EVENT_PRIORITY_USER,_timed_action_event,&_timed_action_list[i]);
+    }
+  }
+
+  *sched = temp;
+  return;
+}
+
+void _scheduler_destroy(event_scheduler *sched){
+  free((*sched)->heap);
+  free(*sched);
+  *sched = NULL;
+  return;
+}
+
+/*
+ * _scheduler_next_time gives the time of the next scheduled action
+ * Return:
+ *       1 if there is an action left, 0 otherwise
+ */
+int _scheduler_next_time(event_scheduler sched,PetscReal *time){
+  if (sched->n==0) return 0;
+  *time = sched->heap[0].time;
+  return 1;
+}
+
+/*
+ * _scheduler_fire applies every action due at or before t, in order, and
+ * reschedules the ones that fire again. An action that asks to fire again
+ * at or before t is dropped, so it cannot loop forever.
+ * Inputs:
+ *        event_scheduler sched: the scheduler
+ *        PetscReal t:           the current time
+ *        Vec U:                 the state
+ * Outputs:
+ *        Vec U:                 the state after the actions
+ */
+void _scheduler_fire(event_scheduler sched,PetscReal t,Vec U){
+  quac_event ev;
+  PetscReal  next_time;
+
+  while (sched->n>0 && sched->heap[0].time<=t){
+    ev = _scheduler_pop(sched);
+    next_time = ev.time + ev.period;
+    if (ev.period>0 && next_time<=t){
+      /* Fired late (e.g. overdue at the start); keep to the period grid */
+      next_time = ev.time + (PetscFloorReal((t-ev.time)/ev.period)+1)*ev.period;
+    }
+    if (ev.action(t,U,ev.ctx,&next_time) && next_time>t){
+      ev.time = next_time;
+      _scheduler_push(sched,ev);
+    }
+  }
+  return;
+}
@@ -0,0 +1,64 @@
+#ifndef EVENT_SCHEDULER_H_
+#define EVENT_SCHEDULER_H_
+
+#include <petscvec.h>
+
+/*
+ * An event action is called with the time it fires at and the state.
+ * It returns 1 if the event should fire again at *next_time (which the
+ * scheduler presets to t+period), 0 if it is done.
+ */
+typedef int (*quac_event_action)(PetscReal,Vec,void*,PetscReal*);
+
+/*
+ * Actions due at the same time fire in priority order (lowest first),
+ * then in the order they were scheduled: gate layers, then error
+ * correction, then user actions.
+ */
+#define EVENT_PRIORITY_GATES 0
+#define EVENT_PRIORITY_QEC   1
+#define EVENT_PRIORITY_USER  2
+
+typedef struct quac_event{
+  PetscReal         time,period;
+  PetscInt          priority,order;
+  quac_event_action action;
+  void              *ctx;
+} quac_event;
+
+/*
+ * event_scheduler merges every timed action (gate layers, circuits,
+ * periodic error correction, user actions) into one priority queue
+ * (a binary heap on time, priority, order), so the integrator sees a
+ * single stream of exact stop times.
+ */
+typedef struct event_scheduler_struct{
+  PetscInt   n,size,num_scheduled;
+  quac_event *heap;
+} *event_scheduler;
+
+/*
+ * timed_action is a user action registered with add_timed_action. time
+ * is the next time it is due; it persists between integrations.
+ */
+typedef struct timed_action{
+  PetscReal time,period;
+  int       active;
+  void      (*action)(PetscReal,Vec,void*);
+  void      *ctx;
+} timed_action;
+
+#define MAX_TIMED_ACTIONS 100
+
+void add_timed_action(PetscReal,PetscReal,void (*)(PetscReal,Vec,void*),void*);
+void _scheduler_create(event_scheduler*);
+void _scheduler_destroy(event_scheduler*);
+void _scheduler_add(event_scheduler,PetscReal,PetscReal,PetscInt,quac_event_action,void*);
+int _scheduler_next_time(event_scheduler,PetscReal*);
+void _scheduler_fire(event_scheduler,PetscReal,Vec);
+int _num_scheduled_sources();
+
+extern timed_action _timed_action_list[MAX_TIMED_ACTIONS];
+extern int _num_timed_actions;
+
+#endif
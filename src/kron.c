@@ -484,209 +484,189 @@ void _get_val_j_from_global_i_vec_vec(PetscInt i,operator this_op1,operator this
   return;
 }
 
-void _add_ops_to_mat_ham(PetscScalar a,Mat A,PetscInt num_ops,operator *ops){
-  PetscInt i,j,j_ig,j_gi,this_j_ig,this_j_gi,Istart,Iend;
-  PetscScalar    val_ig,val_gi,tmp_val;
-  PetscScalar add_to_mat;
-  operator    this_op1,this_op2;
-
-  MatGetOwnershipRange(A,&Istart,&Iend);
-
-  for (i=Istart;i<Iend;i++){
-    this_j_ig = i;
-    this_j_gi = i;
-    val_ig = 1.0;
-    val_gi = 1.0;
-    for (j=0;j<num_ops;j++){
-      this_op1 = ops[j];
-      if(this_op1->my_op_type==VEC){
-        /*
-         * Since this is a VEC operator, the next operator must also
-         * be a VEC operator; it is assumed they always come in pairs.
-         */
-        this_op2 = ops[j+1];
-        if (this_op2->my_op_type!=VEC){
-          if (nid==0){
-            printf("ERROR! VEC operators must come in pairs in _add_ops_to_mat_ham\n");
-            exit(0);
-          }
-        }
-        //Increment j
-        j=j+1;
-
-        //-1 means that it was 0 on a past operator multiplication, so we skip it if it is -1
-        if (this_j_ig!=-1){
-          //Get i cross G
-          _get_val_j_from_global_i_vec_vec(this_j_ig,this_op1,this_op2,&j_ig,&tmp_val,-1);
-          this_j_ig = j_ig;
-          val_ig = tmp_val * val_ig;
-        }
-
-        if (this_j_gi!=-1){
-          //Get G* cross I
-          _get_val_j_from_global_i_vec_vec(this_j_gi,this_op1,this_op2,&j_gi,&tmp_val,1);
-          this_j_gi = j_gi;
-          val_gi = tmp_val * val_gi;
-        }
+/*
+ * _get_val_j_from_global_i_ops returns the val and global j for a given
+ * global i of the product G_1 G_2 ... G_n of a list of operators.
+ * VEC operators must come in pairs, as in add_to_ham_p and add_lin_p.
+ * Inputs:
+ *      PetscInt i:         global i
+ *      PetscInt num_ops:   number of operators in the product
+ *      operator *ops:      list of operators
+ *      tensor_control - switch on which superoperator to compute
+ *                          -1: I cross G or just G
+ *                           0: G* cross G
+ *                           1: G* cross I
+ * Outputs:
+ *      PetscInt *j:        global j for nonzero of given i; or -1 if none
+ *      PetscScalar *val:   value of the product for global i,j
+ */
 
-      } else {
-        //Normal operator
-        if (this_j_ig!=-1){
-          //Get I cross G
-          _get_val_j_from_global_i(this_j_ig,this_op1,&j_ig,&tmp_val,-1);
-          this_j_ig = j_ig;
-          val_ig = tmp_val * val_ig;
-        }
+void _get_val_j_from_global_i_ops(PetscInt i,PetscInt num_ops,operator *ops,PetscInt *j,PetscScalar *val,PetscInt tensor_control){
+  PetscInt    k,this_j,tmp_j;
+  PetscScalar this_val,tmp_val;
 
-        if (this_j_gi!=-1){
-          //Get G* cross I
-          _get_val_j_from_global_i(this_j_gi,this_op1,&j_gi,&tmp_val,1);
-          this_j_gi = j_gi;
-          val_gi = tmp_val * val_gi;
+  this_j   = i;
+  this_val = 1.0;
+  //-1 means that it was 0 on a past operator multiplication, so we can stop
+  for (k=0;k<num_ops&&this_j!=-1;k++){
+    if(ops[k]->my_op_type==VEC){
+      /*
+       * Since this is a VEC operator, the next operator must also
+       * be a VEC operator; it is assumed they always come in pairs.
+       */
+      if (k+1>=num_ops||ops[k+1]->my_op_type!=VEC){
+        if (nid==0){
+          printf("ERROR! VEC operators must come in pairs in _get_val_j_from_global_i_ops\n");
+          exit(0);
         }
       }
+      _get_val_j_from_global_i_vec_vec(this_j,ops[k],ops[k+1],&tmp_j,&tmp_val,tensor_control);
+      //Increment k
+      k = k + 1;
+    } else {
+      //Normal operator
+      _get_val_j_from_global_i(this_j,ops[k],&tmp_j,&tmp_val,tensor_control);
     }
+    this_j   = tmp_j;
+    this_val = tmp_val * this_val;
+  }
 
+  *j = this_j;
+  if (this_j==-1){
+    *val = 0.0;
+  } else {
+    *val = this_val;
+  }
+  return;
+}
 
-    //Add -i * I cross G_1 G_2 ... G_n
-    if (this_j_ig!=-1){
-      add_to_mat = -a*PETSC_i*val_ig;
-      MatSetValue(A,i,this_j_ig,add_to_mat,ADD_VALUES);
-    }
+/*
+ * _add_ops_to_mat_ham adds -i*a*(I cross H) + i*a*(H^T cross I) to A,
+ * where H = G_1 G_2 ... G_n.
+ *
+ * The local rows are split into contiguous chunks among the OpenMP threads
+ * (if QuaC is compiled with OpenMP); each thread generates its nonzeros into its
+ * own COO list. MatSetValues is not thread safe, so the lists are
+ * added to A afterwards, in row order.
+ */
+void _add_ops_to_mat_ham(PetscScalar a,Mat A,PetscInt num_ops,operator *ops){
+  PetscInt Istart,Iend,num_threads;
+  coo_list *thread_coo;
+
+  MatGetOwnershipRange(A,&Istart,&Iend);
+
+  num_threads = _coo_get_num_threads();
+  thread_coo  = _coo_create_thread_lists(num_threads,2*(Iend-Istart));
+
+#if defined(_OPENMP)
+#pragma omp parallel num_threads(num_threads)
+#endif
+  {
+    PetscInt    i,this_j_ig,this_j_gi;
+    PetscScalar val_ig,val_gi;
+    coo_list    *my_coo = &thread_coo[_coo_get_thread_num()];
+
+#if defined(_OPENMP)
+#pragma omp for schedule(static)
+#endif
+    for (i=Istart;i<Iend;i++){
+      //Get I cross G
+      _get_val_j_from_global_i_ops(i,num_ops,ops,&this_j_ig,&val_ig,-1);
+      //Get G* cross I
+      _get_val_j_from_global_i_ops(i,num_ops,ops,&this_j_gi,&val_gi,1);
+
+      //Add -i * I cross G_1 G_2 ... G_n
+      if (this_j_ig!=-1){
+        _coo_add(my_coo,i,this_j_ig,-a*PETSC_i*val_ig);
+      }
 
-    //Add i * G_1*T G_2*T ... G_n*T cross I
-    if (this_j_gi!=-1){
-      add_to_mat = a*PETSC_i*PetscConjComplex(val_gi);
-      MatSetValue(A,this_j_gi,i,add_to_mat,ADD_VALUES);
+      //Add i * G_1*T G_2*T ... G_n*T cross I
+      if (this_j_gi!=-1){
+        _coo_add(my_coo,this_j_gi,i,a*PETSC_i*PetscConjComplex(val_gi));
+      }
     }
   }
 
+  _coo_add_thread_lists_to_mat(A,num_threads,thread_coo);
+
   return;
 }
 
+/*
+ * _add_ops_to_mat_lin adds the Lindblad superoperator of C = G_1 G_2 ... G_n,
+ * a*(C* cross C) - a/2 (I cross C^t C) - a/2 ((C^t C)* cross I), to A.
+ * Threaded in the same way as _add_ops_to_mat_ham.
+ */
 void _add_ops_to_mat_lin(PetscScalar a,Mat A,PetscInt num_ops,operator *ops){
-  PetscInt i,j,j_ig,j_gi,j_gg,this_j_ig,this_j_gi,Istart,Iend,this_j_gg;
-  PetscScalar    val_ig,val_gi,val_gg,tmp_val;
-  PetscScalar add_to_mat;
-  operator    this_op1,this_op2;
+  PetscInt Istart,Iend,num_threads;
+  coo_list *thread_coo;
 
   MatGetOwnershipRange(A,&Istart,&Iend);
-  for (i=Istart;i<Iend;i++){
-    this_j_ig = i;
-    this_j_gi = i;
-    this_j_gg = i;
-    val_ig = 1.0;
-    val_gi = 1.0;
-    val_gg = 1.0;
-    //Loop through operators
-    for (j=0;j<num_ops;j++){
-      this_op1 = ops[j];
-
-      if(this_op1->my_op_type==VEC){
-        /*
-         * Since this is a VEC operator, the next operator must also
-         * be a VEC operator; it is assumed they always come in pairs.
-         */
-        this_op2 = ops[j+1];
-        if (this_op2->my_op_type!=VEC){
-          if (nid==0){
-            printf("ERROR! VEC operators must come in pairs in _add_ops_to_mat_lin\n");
-            exit(0);
-          }
-        }
-        //Increment j
-        j=j+1;
-
-        //-1 for this_j* means that it was 0 on a past operator multiplication, so we skip it if it is -1
-        if (this_j_ig!=-1){
-          //Get I cross G
-          _get_val_j_from_global_i_vec_vec(this_j_ig,this_op1,this_op2,&j_ig,&tmp_val,-1);
-          this_j_ig = j_ig;
-          val_ig = tmp_val * val_ig;
-        }
 
-        if (this_j_gi!=-1){
-          //Get G* cross I
-          _get_val_j_from_global_i_vec_vec(this_j_gi,this_op1,this_op2,&j_gi,&tmp_val,1);
-          this_j_gi = j_gi;
-          val_gi = tmp_val * val_gi;
-        }
-
-        if (this_j_gg!=-1){
-          //Get G* cross G
-          _get_val_j_from_global_i_vec_vec(this_j_gg,this_op1,this_op2,&j_gg,&tmp_val,0);
-          this_j_gg = j_gg;
-          val_gg = tmp_val * val_gg;
-        }
+  num_threads = _coo_get_num_threads();
+  thread_coo  = _coo_create_thread_lists(num_threads,3*(Iend-Istart));
+
+#if defined(_OPENMP)
+#pragma omp parallel num_threads(num_threads)
+#endif
+  {
+    PetscInt    i,this_j_ig,this_j_gi,this_j_gg;
+    PetscScalar val_ig,val_gi,val_gg;
+    coo_list    *my_coo = &thread_coo[_coo_get_thread_num()];
+
+#if defined(_OPENMP)
+#pragma omp for schedule(static)
+#endif
+    for (i=Istart;i<Iend;i++){
+      //Get I cross G
+      _get_val_j_from_global_i_ops(i,num_ops,ops,&this_j_ig,&val_ig,-1);
+      //Get G* cross I
+      _get_val_j_from_global_i_ops(i,num_ops,ops,&this_j_gi,&val_gi,1);
+      //Get G* cross G
+      _get_val_j_from_global_i_ops(i,num_ops,ops,&this_j_gg,&val_gg,0);
 
-      } else {
-        //Normal operator
-        if (this_j_ig!=-1){
-          //Get I cross G
-          _get_val_j_from_global_i(this_j_ig,this_op1,&j_ig,&tmp_val,-1);
-          this_j_ig = j_ig;
-          val_ig = tmp_val * val_ig;
-        }
-
-        if (this_j_gi!=-1){
-          //Get G* cross I
-          _get_val_j_from_global_i(this_j_gi,this_op1,&j_gi,&tmp_val,1);
-          this_j_gi = j_gi;
-          val_gi = tmp_val * val_gi;
-        }
-
-        if (this_j_gg!=-1){
-          //Get G* cross G
-          _get_val_j_from_global_i(this_j_gg,this_op1,&j_gg,&tmp_val,0);
-          this_j_gg = j_gg;
-          val_gg = tmp_val * val_gg;
-        }
+      /*
+       * From above, we only have I cross G = I cross G1 G2 ... Gn
+       * But, we really need is
+       * I cross (G1 G2 ... Gn)^t G1 G2 ... Gn
+       *
+       * First, get I cross G^t G by taking:
+       * (G^t G)_{ij} = sum_k G_^t_{ik}G_{kj}
+       * but, only one value per row:
+       *              = G^t_{ik} G_{kj}
+       *              = G_ki* G_kj
+       * but, again, only one value per row, so i=j
+       *              = G_ki* G_ki
+       * Generally, have G_ik; that is fine, we just
+       * end up calculating G_kk instead of G_ii - so,
+       * maybe we don't own it, but PETSc will figure it out
+       */
 
+      /*
+       * Add (I cross G^t G)
+       */
+      if (this_j_ig!=-1){
+        _coo_add(my_coo,this_j_ig,this_j_ig,-0.5*a*PetscConjComplex(val_ig)*val_ig);
       }
-    }
-    /*
-     * From above, we only have I cross G = I cross G1 G2 ... Gn
-     * But, we really need is
-     * I cross (G1 G2 ... Gn)^t G1 G2 ... Gn
-     *
-     * First, get I cross G^t G by taking:
-     * (G^t G)_{ij} = sum_k G_^t_{ik}G_{kj}
-     * but, only one value per row:
-     *              = G^t_{ik} G_{kj}
-     *              = G_ki* G_kj
-     * but, again, only one value per row, so i=j
-     *              = G_ki* G_ki
-     * Generally, have G_ik; that is fine, we just
-     * end up calculating G_kk instead of G_ii - so,
-     * maybe we don't own it, but PETSc will figure it out
-     */
 
-    /*
-     * Add (I cross G^t G)
-     */
-    if (this_j_ig!=-1){
-      add_to_mat = -0.5*a*PetscConjComplex(val_ig)*val_ig;
-      MatSetValue(A,this_j_ig,this_j_ig,add_to_mat,ADD_VALUES);
-    }
-
-    /*
-     * Add ((G^t G)* cross I)
-     */
-    if (this_j_gi!=-1){
-      //The second conjugate is redundant here?
-      add_to_mat = -0.5*a*PetscConjComplex(PetscConjComplex(val_gi)*val_gi);
-      MatSetValue(A,this_j_gi,this_j_gi,add_to_mat,ADD_VALUES);
-    }
-    /*
-     * Add (G* cross G) to the superoperator matrix, A
-     */
-    if (this_j_gg!=-1){
-      //The second conjugate is redundant here?
-      add_to_mat = a*val_gg;
-      MatSetValue(A,i,this_j_gg,add_to_mat,ADD_VALUES);
+      /*
+       * Add ((G^t G)* cross I)
+       */
+      if (this_j_gi!=-1){
+        //The second conjugate is redundant here?
+        _coo_add(my_coo,this_j_gi,this_j_gi,-0.5*a*PetscConjComplex(PetscConjComplex(val_gi)*val_gi));
+      }
+      /*
+       * Add (G* cross G) to the superoperator matrix, A
+       */
+      if (this_j_gg!=-1){
+        _coo_add(my_coo,i,this_j_gg,a*val_gg);
+      }
     }
   }
 
+  _coo_add_thread_lists_to_mat(A,num_threads,thread_coo);
+
   return;
 }
 
@@ -751,7 +731,7 @@ void _add_to_PETSc_kron_ij(Mat matrix,PetscScalar add_to_mat,int i_op,int j_op,
       i_ham = i_op*n_after+k1+k2*my_levels*n_after;
       j_ham = j_op*n_after+k1+k2*my_levels*n_after;
 
-      if (i_ham>=Istart&&i_ham<Iend) MatSetValue(matrix,i_ham,j_ham,add_to_mat,ADD_VALUES);
+      if (i_ham>=Istart&&i_ham<Iend) _coo_mat_add_value(matrix,i_ham,j_ham,add_to_mat);
     }
   }
 
@@ -1538,7 +1518,7 @@ void _add_to_PETSc_kron_lin2(Mat matrix,PetscScalar a,operator op1,operator op2)
 
     if (PetscAbsComplex(op_val)!=0) {
       //Add to matrix if appropriate
-      MatSetValue(matrix,i,this_i,op_val,ADD_VALUES);
+      _coo_mat_add_value(matrix,i,this_i,op_val);
     }
 
     /* Now get
@@ -1567,7 +1547,7 @@ void _add_to_PETSc_kron_lin2(Mat matrix,PetscScalar a,operator op1,operator op2)
     this_i = this_j;
     if (PetscAbsComplex(op_val)!=0) {
       //Add to matrix if appropriate
-      MatSetValue(matrix,i,this_i,op_val,ADD_VALUES);
+      _coo_mat_add_value(matrix,i,this_i,op_val);
     }
 
     /* Now get
@@ -1588,7 +1568,7 @@ void _add_to_PETSc_kron_lin2(Mat matrix,PetscScalar a,operator op1,operator op2)
 
     if (PetscAbsComplex(op_val)!=0) {
       //Add to matrix if appropriate
-      MatSetValue(matrix,i,this_i,op_val,ADD_VALUES);
+      _coo_mat_add_value(matrix,i,this_i,op_val);
     }
 
 
@@ -3,6 +3,7 @@
 
 #include "operators_p.h"
 #include "operators.h"
+#include "coo_p.h"
 
 long   _get_loop_limit(op_type,int);
 PetscScalar _get_val_in_subspace(long,op_type,int,long*,long*);
@@ -10,6 +11,7 @@ PetscScalar _get_val_in_subspace(long,op_type,int,long*,long*);
 
 void _get_val_j_from_global_i(PetscInt,operator,PetscInt*,PetscScalar*,PetscInt);
 void _get_val_j_from_global_i_vec_vec(PetscInt,operator,operator,PetscInt*,PetscScalar*,PetscInt);
+void _get_val_j_from_global_i_ops(PetscInt,PetscInt,operator*,PetscInt*,PetscScalar*,PetscInt);
 
 void _add_ops_to_mat_ham(PetscScalar,Mat,PetscInt,operator*);
 void _add_ops_to_mat_lin(PetscScalar,Mat,PetscInt,operator*);
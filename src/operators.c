@@ -1,6 +1,7 @@
 #include "kron_p.h" //Includes petscmat.h and operators_p.h
 #include "quac_p.h"
 #include "operators.h"
+#include "symmetry.h"
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -32,6 +33,166 @@ int _num_time_dep_lin = 0;
 time_dep_struct _time_dep_list[MAX_SUB];
 time_dep_struct _time_dep_list_lin[MAX_SUB];
 PetscScalar **_hamiltonian;
+int _coo_assembly = 0;
+coo_assembly _full_A_coo,_ham_A_coo;
+quac_term *_term_list = NULL;
+int _num_terms = 0;
+int _subsystems_reordered = 0;
+
+/*
+ * use_coo_assembly tells QuaC to collect all of the terms added with add_to_ham*
+ * and add_lin* into a COO (row,col,val) list, rather than inserting them
+ * into the matrix one at a time. The list is sorted and merged locally and
+ * handed to PETSc once, in assemble_operators (called by the solvers).
+ * Must be called before any add_to_ham or add_lin. Can also be turned on
+ * with the command line option -quac_coo_assembly.
+ */
+void use_coo_assembly(){
+  if (op_finalized) {
+    if (nid==0){
+      printf("ERROR! use_coo_assembly must be called before add_to_ham or add_lin!\n");
+      exit(0);
+    }
+  }
+  _coo_assembly = 1;
+  return;
+}
+
+/*
+ * assemble_operators hands the collected terms to PETSc and assembles
+ * full_A and ham_A. It is called by steady_state and time_step, and only
+ * needs to be called by the user to inspect the matrices directly.
+ * Must be called from all cores.
+ */
+void assemble_operators(){
+  _check_initialized_A();
+  _coo_assemble_mat(full_A);
+  _coo_assemble_mat(ham_A);
+  MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyBegin(ham_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(ham_A,MAT_FINAL_ASSEMBLY);
+  return;
+}
+
+/*
+ * _term_begin starts recording a term. It notes where the term's triplets
+ * will start in the COO lists of full_A and ham_A. A zero coefficient would
+ * normally skip the term entirely, so it is instead built with a unit
+ * coefficient (and zeroed in _term_end), keeping its pattern in the matrix.
+ * Inputs:
+ *        PetscScalar *a: coefficient of the term; may be set to 1
+ * Return:
+ *        quac_term: new term, or NULL if COO assembly is not in use
+ */
+quac_term _term_begin(PetscScalar *a){
+  quac_term term;
+
+  _check_initialized_A();
+  if (!_coo_assembly||!_full_A_coo.staged) return NULL;
+
+  term = malloc(sizeof(struct quac_term_struct));
+  term->coeff       = *a;
+  term->built_coeff = *a;
+  term->full_start  = _full_A_coo.raw.n;
+  term->ham_start   = _ham_A_coo.raw.n;
+  term->full_unit   = NULL;
+  term->ham_unit    = NULL;
+  if (PetscAbsComplex(*a)==0&&!_print_dense_ham){
+    *a = 1.0;
+    term->built_coeff = 1.0;
+  }
+  return term;
+}
+
+/*
+ * _scale_term_range scales the values of one term's range in a COO list
+ * from the old coefficient to the new one, keeping the unit values around
+ * so that a zero coefficient can be undone.
+ */
+static void _scale_term_range(coo_list *raw,PetscCount start,PetscCount end,
+                              PetscScalar **unit,PetscScalar old_a,PetscScalar new_a){
+  PetscCount k;
+
+  if (end<=start) return;
+  if (*unit==NULL){
+    *unit = malloc((end-start)*sizeof(PetscScalar));
+    for (k=start;k<end;k++){
+      (*unit)[k-start] = (*raw).vals[k]/old_a;
+    }
+  }
+  for (k=start;k<end;k++){
+    (*raw).vals[k] = new_a*(*unit)[k-start];
+  }
+  return;
+}
+
+/*
+ * _term_end finishes recording a term, zeroing it if it was built
+ * with a unit coefficient, and registers it so that it can be freed.
+ */
+void _term_end(quac_term term){
+
+  if (term==NULL) return;
+  term->full_end = _full_A_coo.raw.n;
+  term->ham_end  = _ham_A_coo.raw.n;
+  if (term->built_coeff!=term->coeff){
+    term->coeff = term->built_coeff;
+    update_term_coefficient(term,0.0);
+  }
+  _term_list = realloc(_term_list,(_num_terms+1)*sizeof(quac_term));
+  _term_list[_num_terms] = term;
+  _num_terms++;
+  return;
+}
+
+/*
+ * update_term_coefficient changes the coefficient of a term previously added
+ * with add_to_ham* or add_lin*. Only the values of the term are changed; the
+ * matrices are rebuilt with one MatSetValuesCOO call the next time they are
+ * needed (steady_state, time_step, or assemble_operators), instead of
+ * rebuilding the whole Liouvillian. Requires use_coo_assembly.
+ * Must be called from all cores.
+ * Inputs:
+ *        quac_term term: handle returned by add_to_ham* or add_lin*
+ *        PetscScalar a:  new coefficient
+ */
+void update_term_coefficient(quac_term term,PetscScalar a){
+
+  if (term==NULL){
+    if (nid==0){
+      printf("ERROR! update_term_coefficient requires use_coo_assembly, and the\n");
+      printf("       term must be added before the operators are assembled!\n");
+      exit(0);
+    }
+  }
+  _scale_term_range(&_full_A_coo.raw,term->full_start,term->full_end,
+                    &term->full_unit,term->coeff,a);
+  _scale_term_range(&_ham_A_coo.raw,term->ham_start,term->ham_end,
+                    &term->ham_unit,term->coeff,a);
+  /* MatSetValuesCOO is collective, so mark dirty even if this core has no entries */
+  _full_A_coo.dirty = 1;
+  _ham_A_coo.dirty  = 1;
+  term->coeff = a;
+  return;
+}
+
+/*
+ * _destroy_terms frees all of the term handles
+ */
+void _destroy_terms(){
+  int i;
+
+  for (i=0;i<_num_terms;i++){
+    free(_term_list[i]->full_unit);
+    free(_term_list[i]->ham_unit);
+    free(_term_list[i]);
+  }
+  free(_term_list);
+  _term_list = NULL;
+  _num_terms = 0;
+  return;
+}
 
 /*
  * print_dense_ham tells the program to print the dense hamiltonian when it is constructed.
@@ -140,8 +301,11 @@ void create_op(int number_of_levels,operator *new_op) {
 
 
 
-  /* Increase total_levels */
-  total_levels = total_levels*number_of_levels;
+  /*
+   * Increase total_levels. With permutation symmetry the full space is
+   * never built (and its size could overflow), so it stays 1.
+   */
+  if (!_permutation_reduce) total_levels = total_levels*number_of_levels;
 
   /* Add to list */
   subsystem_list[num_subsystems] = (*new_op);
@@ -181,8 +345,11 @@ void create_vec(int number_of_levels,vec_op *new_vec) {
    */
   (*new_vec)[0]->vec_op_list = (*new_vec);
 
-  /* Increase total_levels */
-  total_levels = total_levels*number_of_levels;
+  /*
+   * Increase total_levels. With permutation symmetry the full space is
+   * never built (and its size could overflow), so it stays 1.
+   */
+  if (!_permutation_reduce) total_levels = total_levels*number_of_levels;
   /*
    * We store just the first VEC in the subsystem list, since it has
    * enough information to define all others
@@ -193,6 +360,139 @@ void create_vec(int number_of_levels,vec_op *new_vec) {
 
 }
 
+/*
+ * _set_n_before moves a subsystem, with all of its operators, to the given
+ * place in the Hilbert space ordering
+ */
+static void _set_n_before(operator op,int n_before){
+  int i;
+
+  if (op->my_op_type==VEC){
+    for (i=0;i<op->my_levels;i++){
+      op->vec_op_list[i]->n_before = n_before;
+    }
+  } else {
+    op->n_before        = n_before;
+    op->dag->n_before   = n_before;
+    op->n->n_before     = n_before;
+    op->eye->n_before   = n_before;
+    op->sig_x->n_before = n_before;
+    op->sig_y->n_before = n_before;
+    op->sig_z->n_before = n_before;
+  }
+  return;
+}
+
+/*
+ * set_subsystem_order sets the order of the subsystems in the Hilbert
+ * space, i.e. the layout of the density matrix, which is creation order by
+ * default. Subsystems late in the order have small strides, so terms and
+ * gates acting on them couple nearby rows, which usually live on the same
+ * core. Only the layout changes: subsystems keep their creation order
+ * numbers in gates, populations, partial traces, get_dm_element and
+ * add_value_to_dm. Must be called after all operators are created and
+ * before anything is added to the Hamiltonian or Lindblad (and before a dm
+ * is filled).
+ * Inputs:
+ *        PetscInt order[]: order[p] is the subsystem (in creation order) put
+ *                          at position p; position 0 has the largest stride
+ */
+void set_subsystem_order(PetscInt order[]){
+  PetscInt p,s,*used;
+  int      n_before;
+
+  if (!op_initialized){
+    if (nid==0){
+      printf("ERROR! You need to create operators before calling set_subsystem_order!\n");
+      exit(0);
+    }
+  }
+  if (_permutation_reduce){
+    if (nid==0){
+      printf("ERROR! set_subsystem_order can not be used with use_permutation_symmetry!\n");
+      exit(0);
+    }
+  }
+  if (op_finalized){
+    if (nid==0){
+      printf("ERROR! set_subsystem_order must be called before\n");
+      printf("       add_to_ham or add_lin!\n");
+      exit(0);
+    }
+  }
+
+  PetscCalloc1(num_subsystems,&used);
+  for (p=0;p<num_subsystems;p++){
+    if (order[p]<0||order[p]>=num_subsystems||used[order[p]]){
+      if (nid==0){
+        printf("ERROR! The order in set_subsystem_order must be a permutation of the subsystems!\n");
+        exit(0);
+      }
+    }
+    used[order[p]] = 1;
+  }
+  PetscFree(used);
+
+  n_before = 1;
+  _subsystems_reordered = 0;
+  for (p=0;p<num_subsystems;p++){
+    s = order[p];
+    if (s!=p) _subsystems_reordered = 1;
+    _set_n_before(subsystem_list[s],n_before);
+    n_before = n_before*subsystem_list[s]->my_levels;
+  }
+  return;
+}
+
+/*
+ * _subsystem_index gives the number (in creation order) of the subsystem
+ * op belongs to
+ */
+PetscInt _subsystem_index(operator op){
+  PetscInt s;
+
+  for (s=0;s<num_subsystems;s++){
+    if (subsystem_list[s]->n_before==op->n_before) return s;
+  }
+  if (nid==0){
+    printf("ERROR! Operator does not belong to any subsystem!\n");
+    exit(0);
+  }
+  return -1;
+}
+
+/*
+ * _subsystem_after gives the subsystem right after subsystem q in the
+ * Hilbert space ordering; that is q+1, unless set_subsystem_order was used
+ */
+PetscInt _subsystem_after(PetscInt q){
+  PetscInt s,n_before;
+
+  n_before = subsystem_list[q]->n_before*subsystem_list[q]->my_levels;
+  if (q+1<num_subsystems&&subsystem_list[q+1]->n_before==n_before) return q+1;
+  for (s=0;s<num_subsystems;s++){
+    if (subsystem_list[s]->n_before==n_before) return s;
+  }
+  return q+1;
+}
+
+/*
+ * _layout_index takes a Hilbert space index with the subsystems in creation
+ * order (first created is the most significant) and gives the index of the
+ * same state in the actual layout
+ */
+PetscInt _layout_index(PetscInt i){
+  PetscInt s,levels,i_layout=0;
+
+  if (!_subsystems_reordered) return i;
+  for (s=num_subsystems-1;s>=0;s--){
+    levels   = subsystem_list[s]->my_levels;
+    i_layout = i_layout + (i%levels)*(total_levels/(levels*subsystem_list[s]->n_before));
+    i        = i/levels;
+  }
+  return i_layout;
+}
+
 /*
  * add_to_ham_time_dep adds a(t)*op to the time dependent hamiltonian list
  * Inputs:
@@ -294,12 +594,31 @@ void add_lin_time_dep_p(double (*time_dep_func)(double),int num_ops,...){
  *        operator op1...: operators to multiply together and add
  * Outputs:
  *        none
+ * Return:
+ *        quac_term: handle for update_term_coefficient (NULL unless
+ *                   use_coo_assembly was called)
  */
-void add_to_ham_p(PetscScalar a,PetscInt num_ops,...){
+quac_term add_to_ham_p(PetscScalar a,PetscInt num_ops,...){
+  quac_term   term;
   va_list  ap;
   operator *ops;
   int      i;
+
+  if (_permutation_reduce){
+    /* Only record the term; the full matrices are never built */
+    ops = malloc(num_ops*sizeof(operator));
+    va_start(ap,num_ops);
+    for (i=0;i<num_ops;i++){
+      ops[i] = va_arg(ap,operator);
+    }
+    va_end(ap);
+    _permutation_add_term(0,a,num_ops,ops);
+    free(ops);
+    return NULL;
+  }
+
   PetscLogEventBegin(add_to_ham_event,0,0,0,0);
+  term = _term_begin(&a);
   _check_initialized_A();
 
   if (PetscAbsComplex(a)!=0) { //Don't add zero numbers to the hamiltonian
@@ -316,7 +635,8 @@ void add_to_ham_p(PetscScalar a,PetscInt num_ops,...){
     free(ops);
   }
   PetscLogEventEnd(add_to_ham_event,0,0,0,0);
-  return;
+  _term_end(term);
+  return term;
 }
 
 
@@ -327,12 +647,23 @@ void add_to_ham_p(PetscScalar a,PetscInt num_ops,...){
  *        operator op: operator to add
  * Outputs:
  *        none
+ * Return:
+ *        quac_term: handle for update_term_coefficient (NULL unless
+ *                   use_coo_assembly was called)
  */
-void add_to_ham(PetscScalar a,operator op){
+quac_term add_to_ham(PetscScalar a,operator op){
+  quac_term   term;
   PetscScalar    mat_scalar;
 
+  if (_permutation_reduce){
+    /* Only record the term; the full matrices are never built */
+    _permutation_add_term(0,a,1,&op);
+    return NULL;
+  }
+
   PetscLogEventBegin(add_to_ham_event,0,0,0,0);
 
+  term = _term_begin(&a);
   _check_initialized_A();
   if (PetscAbsComplex(a)!=0) { //Don't add zero numbers to the hamiltonian
 
@@ -374,7 +705,8 @@ void add_to_ham(PetscScalar a,operator op){
                        op->my_op_type,op->position,1,total_levels,1);
   }
   PetscLogEventEnd(add_to_ham_event,0,0,0,0);
-  return;
+  _term_end(term);
+  return term;
 }
 
 
@@ -390,8 +722,7 @@ void add_to_ham_stiff(PetscScalar a,operator op){
   PetscScalar    mat_scalar;
 
 
-  _check_initialized_A();
-  _stiff_solver = 1;
+  _check_initialized_stiff();
   /*
    * Construct the dense Hamiltonian only on the master node
    */
@@ -442,10 +773,23 @@ void add_to_ham_stiff(PetscScalar a,operator op){
  *        operator op2: the second operator
  * Outputs:
  *        none
+ * Return:
+ *        quac_term: handle for update_term_coefficient (NULL unless
+ *                   use_coo_assembly was called)
  */
-void add_to_ham_mult2(PetscScalar a,operator op1,operator op2){
+quac_term add_to_ham_mult2(PetscScalar a,operator op1,operator op2){
+  quac_term   term;
   PetscScalar mat_scalar;
   int         multiply_vec,n_after;
+
+  if (_permutation_reduce){
+    /* Only record the term; the full matrices are never built */
+    operator ops[2] = {op1,op2};
+    _permutation_add_term(0,a,2,ops);
+    return NULL;
+  }
+
+  term = _term_begin(&a);
   _check_initialized_A();
   multiply_vec = _check_op_type2(op1,op2);
 
@@ -525,7 +869,8 @@ void add_to_ham_mult2(PetscScalar a,operator op1,operator op2){
                             1,1,total_levels,1);
   }
 
-  return;
+  _term_end(term);
+  return term;
 }
 
 /*
@@ -540,9 +885,7 @@ void add_to_ham_mult2(PetscScalar a,operator op1,operator op2){
 void add_to_ham_stiff_mult2(PetscScalar a,operator op1,operator op2){
   PetscScalar mat_scalar;
   int         multiply_vec,n_after;
-  _check_initialized_A();
-
-  _stiff_solver = 1;
+  _check_initialized_stiff();
 
   multiply_vec = _check_op_type2(op1,op2);
 
@@ -638,11 +981,24 @@ void add_to_ham_stiff_mult2(PetscScalar a,operator op1,operator op2){
  *        operator op3: the second operator
  * Outputs:
  *        none
+ * Return:
+ *        quac_term: handle for update_term_coefficient (NULL unless
+ *                   use_coo_assembly was called)
  */
 
-void add_to_ham_mult3(PetscScalar a,operator op1,operator op2,operator op3){
+quac_term add_to_ham_mult3(PetscScalar a,operator op1,operator op2,operator op3){
+  quac_term   term;
   PetscScalar mat_scalar;
   int         first_pair;
+
+  if (_permutation_reduce){
+    /* Only record the term; the full matrices are never built */
+    operator ops[3] = {op1,op2,op3};
+    _permutation_add_term(0,a,3,ops);
+    return NULL;
+  }
+
+  term = _term_begin(&a);
   _check_initialized_A();
   first_pair = _check_op_type3(op1,op2,op3);
 
@@ -701,7 +1057,8 @@ void add_to_ham_mult3(PetscScalar a,operator op1,operator op2,operator op3){
                                 op2->position,op3->position,1,1,total_levels,1);
   }
 
-  return;
+  _term_end(term);
+  return term;
 }
 
 
@@ -717,9 +1074,13 @@ void add_to_ham_mult3(PetscScalar a,operator op1,operator op2,operator op3){
  *        operator op1 ...: ops to make L(C) of
  * Outputs:
  *        none
+ * Return:
+ *        quac_term: handle for update_term_coefficient (NULL unless
+ *                   use_coo_assembly was called)
  */
 
-void add_lin_p(PetscScalar a,PetscInt num_ops,...){
+quac_term add_lin_p(PetscScalar a,PetscInt num_ops,...){
+  quac_term   term;
   va_list  ap;
   operator *ops;
   int      i;
@@ -730,7 +1091,21 @@ void add_lin_p(PetscScalar a,PetscInt num_ops,...){
   /* PetscScalar add_to_mat; */
   /* operator    this_op1,this_op2; */
 
+  if (_permutation_reduce){
+    /* Only record the term; the full matrices are never built */
+    ops = malloc(num_ops*sizeof(operator));
+    va_start(ap,num_ops);
+    for (i=0;i<num_ops;i++){
+      ops[i] = va_arg(ap,operator);
+    }
+    va_end(ap);
+    _permutation_add_term(1,a,num_ops,ops);
+    free(ops);
+    return NULL;
+  }
+
   PetscLogEventBegin(add_lin_event,0,0,0,0);
+  term = _term_begin(&a);
   _check_initialized_A();
   _lindblad_terms = 1;
 
@@ -749,7 +1124,8 @@ void add_lin_p(PetscScalar a,PetscInt num_ops,...){
 
   }
   PetscLogEventEnd(add_lin_event,0,0,0,0);
-  return;
+  _term_end(term);
+  return term;
 }
 
 
@@ -764,12 +1140,23 @@ void add_lin_p(PetscScalar a,PetscInt num_ops,...){
  *        operator op: op to make L(C) of
  * Outputs:
  *        none
+ * Return:
+ *        quac_term: handle for update_term_coefficient (NULL unless
+ *                   use_coo_assembly was called)
  */
 
-void add_lin(PetscScalar a,operator op){
+quac_term add_lin(PetscScalar a,operator op){
+  quac_term   term;
   PetscScalar    mat_scalar;
 
+  if (_permutation_reduce){
+    /* Only record the term; the full matrices are never built */
+    _permutation_add_term(1,a,1,&op);
+    return NULL;
+  }
+
   PetscLogEventBegin(add_lin_event,0,0,0,0);
+  term = _term_begin(&a);
   _check_initialized_A();
   _lindblad_terms = 1;
 
@@ -805,6 +1192,30 @@ void add_lin(PetscScalar a,operator op){
                                 op->position);
   }
   PetscLogEventEnd(add_lin_event,0,0,0,0);
+  _term_end(term);
+  return term;
+}
+
+/*
+ * add_lin_stiff adds a Lindblad L(C) term (see add_lin) to the stiff part
+ * of the system, which time_step integrates implicitly. Use it for
+ * fast decay or dephasing that would otherwise force tiny explicit steps.
+ * Inputs:
+ *        PetscScalar a:    scalar to multiply L term (note: Full term, not sqrt())
+ *        operator op: op to make L(C) of
+ * Outputs:
+ *        none
+ */
+void add_lin_stiff(PetscScalar a,operator op){
+
+  PetscLogEventBegin(add_lin_event,0,0,0,0);
+  _check_initialized_stiff();
+  _lindblad_terms = 1;
+
+  if (PetscAbsComplex(a)!=0){
+    _add_ops_to_mat_lin(a,full_stiff_A,1,&op);
+  }
+  PetscLogEventEnd(add_lin_event,0,0,0,0);
   return;
 }
 
@@ -828,13 +1239,25 @@ void add_lin(PetscScalar a,operator op){
  *        operator op2: VEC 2
  * Outputs:
  *        none
+ * Return:
+ *        quac_term: handle for update_term_coefficient (NULL unless
+ *                   use_coo_assembly was called)
  */
 
-void add_lin_mult2(PetscScalar a,operator op1,operator op2){
+quac_term add_lin_mult2(PetscScalar a,operator op1,operator op2){
+  quac_term   term;
   PetscScalar mat_scalar;
   int         k3,i1,j1,i2,j2,i_comb,j_comb,comb_levels;
   int         multiply_vec,n_after;
 
+  if (_permutation_reduce){
+    /* Only record the term; the full matrices are never built */
+    operator ops[2] = {op1,op2};
+    _permutation_add_term(1,a,2,ops);
+    return NULL;
+  }
+
+  term = _term_begin(&a);
   _check_initialized_A();
   _lindblad_terms = 1;
   multiply_vec =  _check_op_type2(op1,op2);
@@ -907,7 +1330,8 @@ void add_lin_mult2(PetscScalar a,operator op1,operator op2){
 
   }
 
-  return;
+  _term_end(term);
+  return term;
 }
 
 /*
@@ -977,7 +1401,7 @@ void add_lin_mat(PetscScalar a,Mat add_to_lin){
           i_add = total_levels * i + i2;
           j_add = total_levels * cols[j] + cols2[j2];
           val_to_add = a*PetscConjComplex(vals[j])*vals2[j2];
-          MatSetValue(full_A,i_add,j_add,val_to_add,ADD_VALUES);
+          _coo_mat_add_value(full_A,i_add,j_add,val_to_add);
         }
         MatRestoreRow(add_to_lin,i2,&ncols2,&cols2,&vals2);
       }
@@ -1028,7 +1452,7 @@ void combine_ops_to_mat(Mat *matrix_out,int number_of_ops,...){
   dim = total_levels;
 
   // Should this inherit its stucture from full_A?
-  MatCreate(PETSC_COMM_WORLD,matrix_out);
+  MatCreate(quac_comm,matrix_out);
   MatSetType(*matrix_out,MATMPIAIJ);
   MatSetSizes(*matrix_out,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
   MatSetFromOptions(*matrix_out);
@@ -1084,6 +1508,8 @@ void combine_ops_to_mat(Mat *matrix_out,int number_of_ops,...){
  */
 
 void _check_initialized_op(){
+  PetscBool flag;
+
   /* Check to make sure petsc was initialize */
   if (!petsc_initialized){
     if (nid==0){
@@ -1095,12 +1521,15 @@ void _check_initialized_op(){
 
   /* Set up counters on first call */
   if (!op_initialized){
+    PetscOptionsHasName(NULL,NULL,"-quac_permutation_reduce",&flag);
+    if (flag) _permutation_reduce = 1;
     op_finalized   = 0;
     _lindblad_terms = 0;
     _stiff_solver   = 0;
     total_levels   = 1;
     op_initialized = 1;
     num_subsystems = 0;
+    _subsystems_reordered = 0;
   }
 
   if (num_subsystems+1>MAX_SUB&&nid==0){
@@ -1263,6 +1692,7 @@ void _check_initialized_A(){
   int            i;
   long           dim;
   PetscInt       *d_nz,*o_nz,local;
+  PetscBool      coo_flag;
 
   /* Check to make sure petsc was initialize */
   if (!petsc_initialized){
@@ -1281,6 +1711,15 @@ void _check_initialized_A(){
     }
   }
 
+  if (_permutation_reduce){
+    if (nid==0){
+      printf("ERROR! With use_permutation_symmetry, the full Liouvillian and dm are never\n");
+      printf("       built; only add_to_ham*, add_lin*, create_full_dm, add_value_to_dm,\n");
+      printf("       steady_state, time_step and get_populations can be used.\n");
+      exit(0);
+    }
+  }
+
   if (!op_finalized){
     op_finalized = 1;
     /* Allocate space for (dense) Hamiltonian matrix in operator space
@@ -1299,13 +1738,23 @@ void _check_initialized_A(){
     dim = total_levels*total_levels;
     /* Setup petsc matrix */
 
-    MatCreate(PETSC_COMM_WORLD,&full_A);
+    MatCreate(quac_comm,&full_A);
     MatSetType(full_A,MATMPIAIJ);
     MatSetSizes(full_A,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
     MatSetFromOptions(full_A);
 
+    PetscOptionsHasName(NULL,NULL,"-quac_coo_assembly",&coo_flag);
+    if (coo_flag) _coo_assembly = 1;
 
-    if (nid==0){
+    if (_coo_assembly){
+      /*
+       * The nonzero pattern is set from the collected terms in
+       * assemble_operators, so only a minimal preallocation is done here.
+       * We estimate ~10 nonzeros per local row for the list.
+       */
+      MatMPIAIJSetPreallocation(full_A,1,NULL,0,NULL);
+      _coo_assembly_create(&_full_A_coo,full_A,10*(dim/np+1));
+    } else if (nid==0){
       /*
        * Only the first row has extra nonzeros, from the stabilization.
        * We want to allocate extra memory for that row, but not for any others.
@@ -1429,11 +1878,14 @@ void _check_initialized_A(){
 
 
     /* Setup ham_A matrix */
-    MatCreate(PETSC_COMM_WORLD,&ham_A);
+    MatCreate(quac_comm,&ham_A);
     MatSetType(ham_A,MATMPIAIJ);
     MatSetSizes(ham_A,PETSC_DECIDE,PETSC_DECIDE,total_levels,total_levels);
     MatSetFromOptions(ham_A);
-    if (MAX_NNZ_PER_ROW>total_levels/2) {
+    if (_coo_assembly){
+      MatMPIAIJSetPreallocation(ham_A,1,NULL,0,NULL);
+      _coo_assembly_create(&_ham_A_coo,ham_A,5*(total_levels/np+1));
+    } else if (MAX_NNZ_PER_ROW>total_levels/2) {
       if (np==1){
         MatMPIAIJSetPreallocation(ham_A,total_levels,NULL,0,NULL);
       } else {
@@ -1461,6 +1913,47 @@ void _check_initialized_A(){
   return;
 }
 
+/*
+ * _check_initialized_stiff sets up full_A and ham_A (if needed) and, on
+ * the first stiff term, the stiff matrices full_stiff_A and ham_stiff_A,
+ * with the same layout. Stiff matrices are always assembled directly
+ * (not through COO staging).
+ */
+void _check_initialized_stiff(){
+  long dim;
+
+  _check_initialized_A();
+  if (_stiff_solver) return;
+
+  dim = total_levels*total_levels;
+  MatCreate(quac_comm,&full_stiff_A);
+  MatSetType(full_stiff_A,MATMPIAIJ);
+  MatSetSizes(full_stiff_A,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
+  MatSetFromOptions(full_stiff_A);
+  if (MAX_NNZ_PER_ROW>dim) {
+    MatMPIAIJSetPreallocation(full_stiff_A,total_levels,NULL,total_levels,NULL);
+  } else {
+    MatMPIAIJSetPreallocation(full_stiff_A,MAX_NNZ_PER_ROW,NULL,MAX_NNZ_PER_ROW,NULL);
+  }
+  MatSetOption(full_stiff_A,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);
+  MatSetUp(full_stiff_A);
+
+  MatCreate(quac_comm,&ham_stiff_A);
+  MatSetType(ham_stiff_A,MATMPIAIJ);
+  MatSetSizes(ham_stiff_A,PETSC_DECIDE,PETSC_DECIDE,total_levels,total_levels);
+  MatSetFromOptions(ham_stiff_A);
+  if (MAX_NNZ_PER_ROW>total_levels/2) {
+    MatMPIAIJSetPreallocation(ham_stiff_A,total_levels,NULL,total_levels,NULL);
+  } else {
+    MatMPIAIJSetPreallocation(ham_stiff_A,MAX_NNZ_PER_ROW,NULL,MAX_NNZ_PER_ROW,NULL);
+  }
+  MatSetOption(ham_stiff_A,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);
+  MatSetUp(ham_stiff_A);
+
+  _stiff_solver = 1;
+  return;
+}
+
 /*
  * set_initial_pop_op sets the initial population for a single operator
  * Inputs:
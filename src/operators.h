@@ -25,6 +25,23 @@ typedef struct operator{
 
 typedef operator *vec_op; /* Treat vec_op as an array of operators  */
 
+/*
+ * quac_term is a handle to one add_to_ham* or add_lin* term, returned when
+ * COO assembly is in use. It remembers where the term's triplets live in the
+ * COO lists of full_A and ham_A, so that its coefficient can be changed later
+ * with update_term_coefficient, without rebuilding the sparsity pattern.
+ */
+typedef struct quac_term_struct{
+  PetscScalar coeff,built_coeff;
+  PetscCount  full_start,full_end;
+  PetscCount  ham_start,ham_end;
+  /* Values of the term with a unit coefficient; filled in lazily */
+  PetscScalar *full_unit,*ham_unit;
+} *quac_term;
+
+extern quac_term *_term_list;
+extern int _num_terms;
+
 typedef struct time_dep_struct{
   double (*time_dep_func)(double);
   operator *ops;
@@ -36,30 +53,36 @@ typedef struct time_dep_struct{
 void create_op(int,operator*);
 void create_vec(int,vec_op*);
 
-void add_to_ham_p(PetscScalar,PetscInt,...);
-void add_lin_p(PetscScalar,PetscInt,...);
+quac_term add_to_ham_p(PetscScalar,PetscInt,...);
+quac_term add_lin_p(PetscScalar,PetscInt,...);
 void add_to_ham_time_dep_p(double (*)(double),int,...);
 void add_lin_time_dep_p(double (*)(double),int,...);
 
 
-void add_to_ham(PetscScalar,operator);
+quac_term add_to_ham(PetscScalar,operator);
 void add_to_ham_stiff(PetscScalar,operator);
 void add_to_ham_time_dep(double(*pulse)(double),int,...);
-void add_to_ham_mult2(PetscScalar,operator,operator);
+quac_term add_to_ham_mult2(PetscScalar,operator,operator);
 void add_to_ham_stiff_mult2(PetscScalar,operator,operator);
-void add_to_ham_mult3(PetscScalar,operator,operator,operator);
+void add_lin_stiff(PetscScalar,operator);
+quac_term add_to_ham_mult3(PetscScalar,operator,operator,operator);
 int  _check_op_type2(operator,operator);
 int  _check_op_type3(operator,operator,operator);
-void add_lin(PetscScalar,operator);
+quac_term add_lin(PetscScalar,operator);
 void add_lin_mat(PetscScalar,Mat);
-void add_lin_mult2(PetscScalar,operator,operator);
+quac_term add_lin_mult2(PetscScalar,operator,operator);
 void print_dense_ham();
+void use_coo_assembly();
+void assemble_operators();
+void update_term_coefficient(quac_term,PetscScalar);
 void set_initial_pop(operator,double);
 void combine_ops_to_mat(Mat*,int,...);
+void set_subsystem_order(PetscInt[]);
+PetscInt _subsystem_index(operator);
 
 extern int nid; /* a ranks id */
 extern int np; /* number of processors */
-#define MAX_SUB 100  //Consider making this not a define
+#define MAX_SUB 512  //Consider making this not a define
 extern operator subsystem_list[MAX_SUB];
 
 extern time_dep_struct _time_dep_list[MAX_SUB];
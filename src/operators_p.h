@@ -2,6 +2,7 @@
 #define OPERATORS_P_H_
 
 #include <petscmat.h>
+#include "coo_p.h"
 
 typedef enum {
     RAISE  = -1,
@@ -16,7 +17,11 @@ typedef enum {
 
 
 void _check_initialized_A();
+void _check_initialized_stiff();
 void _check_initialized_op();
+void _destroy_terms();
+PetscInt _subsystem_after(PetscInt);
+PetscInt _layout_index(PetscInt);
 
 extern int  _num_time_dep;
 extern int  _num_time_dep_lin;
@@ -30,4 +35,7 @@ extern int  num_subsystems;
 extern int  op_initialized;
 extern PetscScalar **_hamiltonian;
 extern int _print_dense_ham;
+extern int _coo_assembly;
+extern int _subsystems_reordered;
+extern coo_assembly _full_A_coo,_ham_A_coo;
 #endif
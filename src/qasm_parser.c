@@ -581,7 +581,7 @@ void _qiskit_qasm_add_gate(char *line,circuit *circ,PetscReal time){
       // qubit numbers
       if (skip_gate==0){
         if (my_gate_type==NULL_GATE){
-          PetscPrintf(PETSC_COMM_WORLD,"ERROR! NULL_GATE type encounterd!\n");
+          PetscPrintf(quac_comm,"ERROR! NULL_GATE type encounterd!\n");
           exit(0);
         } else if (my_gate_type<0){
           //Multiqubit gate
@@ -626,7 +626,7 @@ void _qiskit_qasm_add_gate(char *line,circuit *circ,PetscReal time){
         skip_gate = 1;
       } else {
         printf("%s\n",token);
-        PetscPrintf(PETSC_COMM_WORLD,"ERROR! Gate type not recognized in qiskit_qasm!\n");
+        PetscPrintf(quac_comm,"ERROR! Gate type not recognized in qiskit_qasm!\n");
         exit(0);
       }
     }
@@ -3,9 +3,18 @@
 #include "quac.h"
 #include "operators_p.h"
 #include "operators.h"
+#include "solver.h"
+#include "quantum_gates.h"
+#include "event_scheduler.h"
+#include "error_correction.h"
+#include "tensor_pc.h"
 #include <petsc.h>
+#if defined(QUAC_USE_SLEPC)
+#include <slepcsys.h>
+#endif
 
 int petsc_initialized = 0;
+MPI_Comm quac_comm;
 int nid;
 int np;
 
@@ -17,15 +26,21 @@ int np;
  */
 void QuaC_initialize(int argc,char **args){
 
-  /* Initialize Petsc */
+  /* Initialize Petsc (and SLEPc, which initializes Petsc) */
+#if defined(QUAC_USE_SLEPC)
+  SlepcInitialize(&argc,&args,(char*)0,NULL);
+#else
   PetscInitialize(&argc,&args,(char*)0,NULL);
+#endif
 #if !defined(PETSC_USE_COMPLEX)
   SETERRQ(PETSC_COMM_WORLD,1,"This example requires complex numbers");
 #endif
+  /* All QuaC objects live on quac_comm; run_sweep may swap it for a subgroup */
+  quac_comm = PETSC_COMM_WORLD;
   /* Get core's id */
-  MPI_Comm_rank(PETSC_COMM_WORLD,&nid);
+  MPI_Comm_rank(quac_comm,&nid);
   /* Get number of processors */
-  MPI_Comm_size(PETSC_COMM_WORLD,&np);
+  MPI_Comm_size(quac_comm,&np);
 
   petsc_initialized = 1;
   PetscLogStageRegister("Pre-solve",&pre_solve_stage);
@@ -47,22 +62,37 @@ void QuaC_initialize(int argc,char **args){
 /*
  * QuaC_clear clears the internal state of many of QuaC's
  * variables so that multiple systems can be run in one file.
+ * The settings turned on with use_coo_assembly, use_eigen_steady_state,
+ * use_symmetry_reduction, use_permutation_symmetry and
+ * use_tensor_preconditioner are turned off again.
  */
 
 void QuaC_clear(){
   int i;
   /* Destroy Matrix */
+  _destroy_terms();
+  _permutation_destroy_terms();
+  _coo_assembly_destroy(&_full_A_coo);
+  _coo_assembly_destroy(&_ham_A_coo);
   MatDestroy(&full_A);
   MatDestroy(&ham_A);
   MatDestroy(&full_stiff_A);
   MatDestroy(&ham_stiff_A);
+  _destroy_discrete_error_correction();
 
   for (i=0;i<_num_time_dep;i++){
     MatDestroy(&_time_dep_list[i].mat);
   }
-  //stab_added       = 0;
+  stab_added       = 0;
   _print_dense_ham = 0;
   _num_time_dep = 0;
+  _destroy_circuit_list();
+  _num_timed_actions = 0;
+  _tensor_pc = 0;
+  _eigen_steady_state = 0;
+  _symmetry_reduce    = 0;
+  _permutation_reduce = 0;
+  _coo_assembly       = 0;
   op_initialized = 0;
 }
 
@@ -76,17 +106,27 @@ void QuaC_clear(){
 void QuaC_finalize(){
   int i;
   /* Destroy Matrix */
+  _destroy_terms();
+  _permutation_destroy_terms();
+  _coo_assembly_destroy(&_full_A_coo);
+  _coo_assembly_destroy(&_ham_A_coo);
   MatDestroy(&full_A);
   MatDestroy(&ham_A);
   MatDestroy(&full_stiff_A);
   MatDestroy(&ham_stiff_A);
+  _destroy_discrete_error_correction();
+  _destroy_circuit_list();
 
   for (i=0;i<_num_time_dep;i++){
     MatDestroy(&_time_dep_list[i].mat);
   }
   /* Finalize Petsc */
   PetscLogStagePop();
+#if defined(QUAC_USE_SLEPC)
+  SlepcFinalize();
+#else
   PetscFinalize();
+#endif
   return;
 }
 
@@ -2,6 +2,7 @@
 #define QUAC_P_H_
 #include <petsc.h>
 extern int  petsc_initialized;
+extern MPI_Comm quac_comm; /* communicator all QuaC objects live on */
 PetscLogEvent add_lin_event,add_to_ham_event,add_lin_recovery_event,add_encoded_gate_to_circuit_event;
 PetscLogEvent _qc_event_function_event,_qc_postevent_function_event,_apply_gate_event;
 PetscClassId quac_class_id;
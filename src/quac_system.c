@@ -0,0 +1,233 @@
+#include "quac_system.h"
+#include "quac_p.h"
+#include "quac.h"
+#include "solver.h"
+#include "error_correction.h"
+#include "symmetry.h"
+#include "tensor_pc.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * The active system lives in the library globals; every other system is
+ * parked in its quac_system struct. _default_system holds the state
+ * set up by QuaC_initialize while another system is active.
+ */
+static struct quac_system_struct _default_system;
+static quac_system _active_system = &_default_system;
+
+/*
+ * Only one thread may swap systems in and out of the globals: the first
+ * one to activate a system. _swap_lock catches two threads swapping at
+ * the same time.
+ */
+static pthread_t _owner_thread;
+static int       _owner_set = 0;
+static int       _swap_lock = 0;
+
+/*
+ * _save_system copies the library globals into sys
+ */
+static void _save_system(quac_system sys){
+
+  sys->comm             = quac_comm;
+  sys->nid              = nid;
+  sys->np               = np;
+
+  sys->op_initialized   = op_initialized;
+  sys->op_finalized     = op_finalized;
+  sys->stiff_solver     = _stiff_solver;
+  sys->lindblad_terms   = _lindblad_terms;
+  sys->print_dense_ham  = _print_dense_ham;
+  sys->full_A           = full_A;
+  sys->full_stiff_A     = full_stiff_A;
+  sys->ham_A            = ham_A;
+  sys->ham_stiff_A      = ham_stiff_A;
+  sys->total_levels     = total_levels;
+  sys->num_subsystems   = num_subsystems;
+  sys->subsystems_reordered = _subsystems_reordered;
+  memcpy(sys->subsystem_list,subsystem_list,sizeof(subsystem_list));
+  sys->num_time_dep     = _num_time_dep;
+  sys->num_time_dep_lin = _num_time_dep_lin;
+  memcpy(sys->time_dep_list,_time_dep_list,sizeof(_time_dep_list));
+  memcpy(sys->time_dep_list_lin,_time_dep_list_lin,sizeof(_time_dep_list_lin));
+  sys->hamiltonian      = _hamiltonian;
+  sys->coo_assembly     = _coo_assembly;
+  /* The assemblies are registered by address, so park them unregistered */
+  _coo_assembly_unregister(&_full_A_coo);
+  _coo_assembly_unregister(&_ham_A_coo);
+  sys->full_A_coo       = _full_A_coo;
+  sys->ham_A_coo        = _ham_A_coo;
+  sys->term_list        = _term_list;
+  sys->num_terms        = _num_terms;
+
+  sys->num_quantum_gates = _num_quantum_gates;
+  sys->current_gate      = _current_gate;
+  memcpy(sys->quantum_gate_list,_quantum_gate_list,sizeof(_quantum_gate_list));
+  sys->num_circuits      = _num_circuits;
+  sys->current_circuit   = _current_circuit;
+  memcpy(sys->circuit_list,_circuit_list,sizeof(_circuit_list));
+  sys->num_timed_actions = _num_timed_actions;
+  memcpy(sys->timed_action_list,_timed_action_list,sizeof(_timed_action_list));
+
+  sys->stab_added        = stab_added;
+  sys->matrix_assembled  = matrix_assembled;
+  sys->eigen_steady_state = _eigen_steady_state;
+  sys->ts_monitor        = _ts_monitor;
+  sys->tsctx             = _tsctx;
+  sys->DQEC_list         = _DQEC_list;
+  sys->DQEC_work         = _DQEC_work;
+  sys->discrete_ec       = _discrete_ec;
+  sys->symmetry_reduce   = _symmetry_reduce;
+  sys->permutation_reduce = _permutation_reduce;
+  sys->permutation_terms = _permutation_terms;
+  sys->num_permutation_terms = _num_permutation_terms;
+  sys->tensor_pc         = _tensor_pc;
+  return;
+}
+
+/*
+ * _load_system copies sys into the library globals
+ */
+static void _load_system(quac_system sys){
+
+  quac_comm         = sys->comm;
+  nid               = sys->nid;
+  np                = sys->np;
+
+  op_initialized    = sys->op_initialized;
+  op_finalized      = sys->op_finalized;
+  _stiff_solver     = sys->stiff_solver;
+  _lindblad_terms   = sys->lindblad_terms;
+  _print_dense_ham  = sys->print_dense_ham;
+  full_A            = sys->full_A;
+  full_stiff_A      = sys->full_stiff_A;
+  ham_A             = sys->ham_A;
+  ham_stiff_A       = sys->ham_stiff_A;
+  total_levels      = sys->total_levels;
+  num_subsystems    = sys->num_subsystems;
+  _subsystems_reordered = sys->subsystems_reordered;
+  memcpy(subsystem_list,sys->subsystem_list,sizeof(subsystem_list));
+  _num_time_dep     = sys->num_time_dep;
+  _num_time_dep_lin = sys->num_time_dep_lin;
+  memcpy(_time_dep_list,sys->time_dep_list,sizeof(_time_dep_list));
+  memcpy(_time_dep_list_lin,sys->time_dep_list_lin,sizeof(_time_dep_list_lin));
+  _hamiltonian      = sys->hamiltonian;
+  _coo_assembly     = sys->coo_assembly;
+  _full_A_coo       = sys->full_A_coo;
+  _ham_A_coo        = sys->ham_A_coo;
+  if (_full_A_coo.mat!=NULL) _coo_assembly_register(&_full_A_coo);
+  if (_ham_A_coo.mat!=NULL) _coo_assembly_register(&_ham_A_coo);
+  _term_list        = sys->term_list;
+  _num_terms        = sys->num_terms;
+
+  _num_quantum_gates = sys->num_quantum_gates;
+  _current_gate      = sys->current_gate;
+  memcpy(_quantum_gate_list,sys->quantum_gate_list,sizeof(_quantum_gate_list));
+  _num_circuits      = sys->num_circuits;
+  _current_circuit   = sys->current_circuit;
+  memcpy(_circuit_list,sys->circuit_list,sizeof(_circuit_list));
+  _num_timed_actions = sys->num_timed_actions;
+  memcpy(_timed_action_list,sys->timed_action_list,sizeof(_timed_action_list));
+
+  stab_added         = sys->stab_added;
+  matrix_assembled   = sys->matrix_assembled;
+  _eigen_steady_state = sys->eigen_steady_state;
+  _ts_monitor        = sys->ts_monitor;
+  _tsctx             = sys->tsctx;
+  _DQEC_list         = sys->DQEC_list;
+  _DQEC_work         = sys->DQEC_work;
+  _discrete_ec       = sys->discrete_ec;
+  _symmetry_reduce   = sys->symmetry_reduce;
+  _permutation_reduce = sys->permutation_reduce;
+  _permutation_terms = sys->permutation_terms;
+  _num_permutation_terms = sys->num_permutation_terms;
+  _tensor_pc         = sys->tensor_pc;
+  return;
+}
+
+/*
+ * create_quac_system creates a new, empty system on comm. All cores of
+ * comm must call this, and the system must be activated with
+ * quac_system_activate before operators are created for it.
+ * Inputs:
+ *        MPI_Comm comm: communicator for the system's matrices and vectors
+ * Outputs:
+ *        quac_system *sys: the new system
+ */
+void create_quac_system(quac_system *sys,MPI_Comm comm){
+
+  if (!petsc_initialized){
+    printf("ERROR! You need to call QuaC_initialize before creating a quac_system!\n");
+    exit(0);
+  }
+  *sys = calloc(1,sizeof(struct quac_system_struct));
+  (*sys)->comm = comm;
+  MPI_Comm_rank(comm,&(*sys)->nid);
+  MPI_Comm_size(comm,&(*sys)->np);
+  (*sys)->total_levels = 1;
+  return;
+}
+
+/*
+ * quac_system_activate makes sys the system that the rest of the API acts
+ * on. Passing NULL goes back to the default system. Exits with an error
+ * if called from a different thread than the first activation.
+ * Inputs:
+ *        quac_system sys: system to activate, or NULL
+ */
+void quac_system_activate(quac_system sys){
+
+  if (__sync_lock_test_and_set(&_swap_lock,1)){
+    printf("ERROR! quac_system_activate was called from two threads at once!\n");
+    exit(0);
+  }
+  if (!_owner_set){
+    _owner_thread = pthread_self();
+    _owner_set    = 1;
+  } else if (!pthread_equal(_owner_thread,pthread_self())){
+    printf("ERROR! quac_systems can only be activated from one thread!\n");
+    exit(0);
+  }
+
+  if (sys==NULL) sys = &_default_system;
+  if (sys!=_active_system){
+    _save_system(_active_system);
+    _load_system(sys);
+    _active_system = sys;
+  }
+  __sync_lock_release(&_swap_lock);
+  return;
+}
+
+/*
+ * quac_system_get_active returns the active system, so that it can be
+ * activated again after switching to another one.
+ */
+quac_system quac_system_get_active(){
+  return _active_system;
+}
+
+/*
+ * destroy_quac_system destroys the matrices of sys (as QuaC_clear does)
+ * and frees it. If sys is active, the default system is activated.
+ * The user is responsible for destroying operators, dms, and circuits.
+ * Must be called from all cores of the system's communicator.
+ */
+void destroy_quac_system(quac_system *sys){
+  quac_system previous;
+
+  if (*sys==NULL) return;
+  previous = _active_system;
+  if (previous==*sys) previous = &_default_system;
+
+  quac_system_activate(*sys);
+  QuaC_clear();
+  quac_system_activate(previous);
+
+  free(*sys);
+  *sys = NULL;
+  return;
+}
@@ -0,0 +1,72 @@
+#ifndef QUAC_SYSTEM_H_
+#define QUAC_SYSTEM_H_
+
+#include "operators.h"
+#include "quantum_gates.h"
+#include "event_scheduler.h"
+#include "error_correction.h"
+#include "symmetry.h"
+#include <petscts.h>
+
+/*
+ * quac_system holds everything that describes one simulation: its
+ * communicator, operators, matrices, time dependent terms, gates,
+ * circuits, timed actions, and time step monitor. The usual API (create_op,
+ * add_to_ham, add_lin, add_gate, steady_state, time_step, ...) always acts
+ * on the active system; quac_system_activate switches between systems, and
+ * quac_system_activate(NULL) goes back to the default system set up by
+ * QuaC_initialize. Systems on disjoint sub-communicators can run at the
+ * same time in one job.
+ *
+ * A system is not a reentrant context: activating one swaps it into the
+ * library globals, so only one system per process may be active at a
+ * time, and all systems must be used from a single thread (threads can
+ * not each run their own system). quac_system_activate exits with an error
+ * if it is called from another thread. Code that activates another system
+ * should save the active one (quac_system_get_active) and restore it.
+ */
+typedef struct quac_system_struct{
+  MPI_Comm        comm;
+  int             nid,np;
+
+  /* Operators and matrices */
+  int             op_initialized,op_finalized,stiff_solver,lindblad_terms;
+  int             print_dense_ham;
+  Mat             full_A,full_stiff_A,ham_A,ham_stiff_A;
+  PetscInt        total_levels;
+  int             num_subsystems,subsystems_reordered;
+  operator        subsystem_list[MAX_SUB];
+  int             num_time_dep,num_time_dep_lin;
+  time_dep_struct time_dep_list[MAX_SUB],time_dep_list_lin[MAX_SUB];
+  PetscScalar     **hamiltonian;
+  int             coo_assembly;
+  coo_assembly    full_A_coo,ham_A_coo;
+  quac_term       *term_list;
+  int             num_terms;
+
+  /* Gates and circuits */
+  int             num_quantum_gates,current_gate;
+  struct quantum_gate_struct quantum_gate_list[MAX_GATES];
+  int             num_circuits,current_circuit;
+  circuit         circuit_list[MAX_GATES];
+  int             num_timed_actions;
+  timed_action    timed_action_list[MAX_TIMED_ACTIONS];
+
+  /* Solver */
+  int             stab_added,matrix_assembled,eigen_steady_state;
+  PetscErrorCode  (*ts_monitor)(TS,PetscInt,PetscReal,Vec,void*);
+  void            *tsctx;
+  dqec_channel    *DQEC_list;
+  Vec             DQEC_work;
+  int             discrete_ec;
+  int             symmetry_reduce,permutation_reduce,tensor_pc;
+  permutation_term *permutation_terms;
+  int             num_permutation_terms;
+} *quac_system;
+
+void create_quac_system(quac_system*,MPI_Comm);
+void destroy_quac_system(quac_system*);
+void quac_system_activate(quac_system);
+quac_system quac_system_get_active();
+
+#endif
@@ -1,7 +1,9 @@
 #include "quantum_gates.h"
 #include "quac_p.h"
+#include "coo_p.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <petsc.h>
 #include <stdarg.h>
 
@@ -16,106 +18,87 @@ int _current_circuit = 0;
 circuit _circuit_list[MAX_GATES];
 void (*_get_val_j_functions_gates[MAX_GATES])(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
 
-/* EventFunction is one step in Petsc to apply some action at a specific time.
- * This function checks to see if an event has happened.
+/*
+ * _gate_next_time finds the time of the next standalone gate (add_gate)
+ * still to be applied.
+ * Outputs:
+ *       PetscReal *time: time of the next gate
+ * Return:
+ *       1 if there is a gate left, 0 otherwise
  */
-PetscErrorCode _QG_EventFunction(TS ts,PetscReal t,Vec U,PetscScalar *fvalue,void *ctx) {
-  /* Check if the time has passed a gate */
-
-  if (_current_gate<_num_quantum_gates) {
-    /* We signal that we passed the time by returning a negative number */
-    fvalue[0] = _quantum_gate_list[_current_gate].time - t;
-  } else {
-    fvalue[0] = t;
-  }
-
-  return(0);
+int _gate_next_time(PetscReal *time){
+  if (_current_gate>=_num_quantum_gates) return 0;
+  *time = _quantum_gate_list[_current_gate].time;
+  return 1;
 }
 
-/* PostEventFunction is the other step in Petsc. If an event has happend, petsc will call this function
- * to apply that event.
-*/
-PetscErrorCode _QG_PostEventFunction(TS ts,PetscInt nevents,PetscInt event_list[],PetscReal t,
-                                     Vec U,PetscBool forward,void* ctx) {
-
-   /* We only have one event at the moment, so we do not need to branch.
-    * If we had more than one event, we would put some logic here.
-    */
-  if (nevents) {
-    /* Apply the current gate */
-    //Deprecated?
-    /* _apply_gate(_quantum_gate_list[_current_gate].my_gate_type,_quantum_gate_list[_current_gate].qubit_numbers,U); */
-    /* Increment our gate counter */
+/*
+ * _apply_gates applies, in order, every remaining standalone gate whose
+ * time is at or before t.
+ * Inputs:
+ *       PetscReal t: current time
+ *       Vec U:       the state
+ * Outputs:
+ *       Vec U:       the state after the gates
+ */
+void _apply_gates(PetscReal t,Vec U){
+  PetscReal gate_time;
+
+  while (_gate_next_time(&gate_time) && gate_time<=t){
+    _apply_gate(_quantum_gate_list[_current_gate],U);
     _current_gate = _current_gate + 1;
   }
-
-  TSSetSolution(ts,U);
-  return(0);
+  return;
 }
 
-/* EventFunction is one step in Petsc to apply some action at a specific time.
- * This function checks to see if an event has happened.
+/*
+ * _circuit_next_gate_time finds the time of the next gate still to be
+ * applied in the registered circuits. Gate times are known in advance, so
+ * the event scheduler can stop the integrator exactly there.
+ * Outputs:
+ *       PetscReal *time: absolute time of the next gate
+ * Return:
+ *       1 if there is a gate left, 0 otherwise
  */
-PetscErrorCode _QC_EventFunction(TS ts,PetscReal t,Vec U,PetscScalar *fvalue,void *ctx) {
-  /* Check if the time has passed a gate */
-  PetscInt current_gate,num_gates;
+int _circuit_next_gate_time(PetscReal *time){
+  PetscInt current_gate;
+
   PetscLogEventBegin(_qc_event_function_event,0,0,0,0);
-  if (_current_circuit<_num_circuits) {
-    current_gate = _circuit_list[_current_circuit].current_gate;
-    num_gates    = _circuit_list[_current_circuit].num_gates;
-    if (current_gate<num_gates) {
-      /* We signal that we passed the time by returning a negative number */
-      fvalue[0] = _circuit_list[_current_circuit].gate_list[current_gate].time
-        +_circuit_list[_current_circuit].start_time - t;
-    } else {
-      if (nid==0){
-        printf("ERROR! current_gate should never be larger than num_gates in _QC_EventFunction\n");
-        exit(0);
-      }
-    }
-  } else {
-    fvalue[0] = t;
+  while (_current_circuit<_num_circuits &&
+         _circuit_list[_current_circuit].current_gate>=_circuit_list[_current_circuit].num_gates){
+    /* We've exhausted this circuit (or it was empty); move on to the next. */
+    _current_circuit = _current_circuit + 1;
+  }
+  if (_current_circuit>=_num_circuits) {
+    PetscLogEventEnd(_qc_event_function_event,0,0,0,0);
+    return 0;
   }
+  current_gate = _circuit_list[_current_circuit].current_gate;
+  *time = _circuit_list[_current_circuit].times[current_gate]
+    + _circuit_list[_current_circuit].start_time;
   PetscLogEventEnd(_qc_event_function_event,0,0,0,0);
-  return(0);
+  return 1;
 }
 
-/* PostEventFunction is the other step in Petsc. If an event has happend, petsc will call this function
- * to apply that event.
-*/
-PetscErrorCode _QC_PostEventFunction(TS ts,PetscInt nevents,PetscInt event_list[],
-                                     PetscReal t,Vec U,PetscBool forward,void* ctx) {
-  PetscInt current_gate,num_gates;
+/*
+ * _apply_circuit_gates applies, in order, every remaining gate of the
+ * registered circuits whose time is at or before t (the gate layer at t).
+ * Inputs:
+ *       PetscReal t: current time
+ *       Vec U:       the state
+ * Outputs:
+ *       Vec U:       the state after the gates
+ */
+void _apply_circuit_gates(PetscReal t,Vec U){
   PetscReal gate_time;
-   /* We only have one event at the moment, so we do not need to branch.
-    * If we had more than one event, we would put some logic here.
-    */
 
   PetscLogEventBegin(_qc_postevent_function_event,0,0,0,0);
-
-  if (nevents) {
-    num_gates    = _circuit_list[_current_circuit].num_gates;
-    current_gate = _circuit_list[_current_circuit].current_gate;
-    gate_time = _circuit_list[_current_circuit].gate_list[current_gate].time;
-    /* Apply all gates at a given time incrementally  */
-    while (current_gate<num_gates && _circuit_list[_current_circuit].gate_list[current_gate].time == gate_time){
-      /* apply the current gate */
-      _apply_gate(_circuit_list[_current_circuit].gate_list[current_gate],U);
-
-      /* Increment our gate counter */
-      _circuit_list[_current_circuit].current_gate = _circuit_list[_current_circuit].current_gate + 1;
-      current_gate = _circuit_list[_current_circuit].current_gate;
-    }
-    if(_circuit_list[_current_circuit].current_gate>=_circuit_list[_current_circuit].num_gates){
-      /* We've exhausted this circuit; move on to the next. */
-      _current_circuit = _current_circuit + 1;
-    }
-
+  while (_circuit_next_gate_time(&gate_time) && gate_time<=t){
+    _apply_gate(_circuit_gate(_circuit_list[_current_circuit],_circuit_list[_current_circuit].current_gate),U);
+    _circuit_list[_current_circuit].current_gate = _circuit_list[_current_circuit].current_gate + 1;
   }
-
-  TSSetSolution(ts,U);
   PetscLogEventEnd(_qc_postevent_function_event,0,0,0,0);
-  return(0);
+  return;
 }
 
 /* Add a gate to the list */
@@ -123,6 +106,12 @@ void add_gate(PetscReal time,gate_type my_gate_type,...) {
   int num_qubits=0,qubit,i;
   va_list ap;
 
+  if (_gate_array_initialized==0){
+    //Initialize the array of gate function pointers
+    _initialize_gate_function_array();
+    _gate_array_initialized = 1;
+  }
+
   if (my_gate_type==HADAMARD) {
     num_qubits = 1;
   } else if (my_gate_type==CNOT){
@@ -133,18 +122,32 @@ void add_gate(PetscReal time,gate_type my_gate_type,...) {
       exit(0);
     }
   }
+  if (_num_quantum_gates==MAX_GATES){
+    if (nid==0){
+      printf("ERROR! Too many gates! Use a circuit instead.\n");
+      exit(0);
+    }
+  }
 
   // Store arguments in list
   _quantum_gate_list[_num_quantum_gates].qubit_numbers = malloc(num_qubits*sizeof(int));
   _quantum_gate_list[_num_quantum_gates].time = time;
   _quantum_gate_list[_num_quantum_gates].my_gate_type = my_gate_type;
-  _quantum_gate_list[_num_quantum_gates]._get_val_j_from_global_i = HADAMARD_get_val_j_from_global_i;
+  _quantum_gate_list[_num_quantum_gates]._get_val_j_from_global_i = _get_val_j_functions_gates[my_gate_type+_min_gate_enum];
+  _quantum_gate_list[_num_quantum_gates].theta  = 0;
+  _quantum_gate_list[_num_quantum_gates].phi    = 0;
+  _quantum_gate_list[_num_quantum_gates].lambda = 0;
+  _quantum_gate_list[_num_quantum_gates].noise.my_noise_type = NO_NOISE;
+  _quantum_gate_list[_num_quantum_gates].noise.p = 0;
+
+  va_start(ap,my_gate_type);
 
   // Loop through and store qubits
   for (i=0;i<num_qubits;i++){
     qubit = va_arg(ap,int);
     _quantum_gate_list[_num_quantum_gates].qubit_numbers[i] = qubit;
   }
+  va_end(ap);
 
   _num_quantum_gates = _num_quantum_gates + 1;
 }
@@ -152,11 +155,10 @@ void add_gate(PetscReal time,gate_type my_gate_type,...) {
 
 /* Apply a specific gate */
 void _apply_gate(struct quantum_gate_struct this_gate,Vec rho){
-  PetscScalar op_vals[total_levels*2];
   Mat gate_mat; //FIXME Consider having only one static Mat for all gates, rather than creating new ones every time
   Vec tmp_answer;
-  PetscInt dim,i,Istart,Iend,num_js,these_js[total_levels*2];
-  // FIXME: maybe total_levels*2 is too much or not enough? Consider having a better bound.
+  PetscInt dim,Istart,Iend,num_threads;
+  coo_list gate_coo,*thread_coo;
 
   PetscLogEventBegin(_apply_gate_event,0,0,0,0);
 
@@ -168,26 +170,56 @@ void _apply_gate(struct quantum_gate_struct this_gate,Vec rho){
 
   VecDuplicate(rho,&tmp_answer); //Create a new vec with the same size as rho
 
-  MatCreate(PETSC_COMM_WORLD,&gate_mat);
+  MatCreate(quac_comm,&gate_mat);
   MatSetSizes(gate_mat,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
   MatSetFromOptions(gate_mat);
-  MatMPIAIJSetPreallocation(gate_mat,4,NULL,4,NULL); //This matrix is incredibly sparse!
-  MatSetUp(gate_mat);
-  /* Construct the gate matrix, on the fly */
-  MatGetOwnershipRange(gate_mat,&Istart,&Iend);
-
-  for (i=Istart;i<Iend;i++){
-    if (_lindblad_terms){
-      // Get the corresponding j and val for the superoperator U* cross U
-      this_gate._get_val_j_from_global_i(i,this_gate,&num_js,these_js,op_vals,0);
-    } else {
-      // Get the corresponding j and val for just the matrix U
-      this_gate._get_val_j_from_global_i(i,this_gate,&num_js,these_js,op_vals,-1);
+  /*
+   * Construct the gate matrix, on the fly.
+   * Each thread generates a contiguous chunk of the local rows into its own COO list;
+   * the lists are merged and the pattern and values are set at once. This
+   * matrix is incredibly sparse, so no explicit preallocation is needed.
+   */
+  _coo_get_ownership_range(gate_mat,&Istart,&Iend);
+
+  num_threads = _coo_get_num_threads();
+  thread_coo  = _coo_create_thread_lists(num_threads,4*(Iend-Istart));
+
+#if defined(_OPENMP)
+#pragma omp parallel num_threads(num_threads)
+#endif
+  {
+    PetscScalar *op_vals;
+    PetscInt    i,k,num_js,*these_js;
+    coo_list    *my_coo = &thread_coo[_coo_get_thread_num()];
+
+    /* A gate row has at most 2 nonzeros, so a row of U* cross U has at most 4 */
+    op_vals  = malloc(4*sizeof(PetscScalar));
+    these_js = malloc(4*sizeof(PetscInt));
+
+#if defined(_OPENMP)
+#pragma omp for schedule(static)
+#endif
+    for (i=Istart;i<Iend;i++){
+      if (_lindblad_terms){
+        // Get the corresponding j and val for the superoperator U* cross U
+        this_gate._get_val_j_from_global_i(i,this_gate,&num_js,these_js,op_vals,0);
+      } else {
+        // Get the corresponding j and val for just the matrix U
+        this_gate._get_val_j_from_global_i(i,this_gate,&num_js,these_js,op_vals,-1);
+      }
+      for (k=0;k<num_js;k++){
+        _coo_add(my_coo,i,these_js[k],op_vals[k]);
+      }
     }
-    MatSetValues(gate_mat,1,&i,num_js,these_js,op_vals,ADD_VALUES);
+    free(op_vals);
+    free(these_js);
   }
-  MatAssemblyBegin(gate_mat,MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(gate_mat,MAT_FINAL_ASSEMBLY);
+
+  _coo_create(&gate_coo,4*(Iend-Istart));
+  _coo_merge_thread_lists(&gate_coo,num_threads,thread_coo);
+  _coo_set_mat(gate_mat,&gate_coo);
+  _coo_destroy(&gate_coo);
+
   /* MatView(gate_mat,PETSC_VIEWER_STDOUT_SELF); */
   MatMult(gate_mat,rho,tmp_answer);
   VecCopy(tmp_answer,rho); //Copy our tmp_answer array into rho
@@ -195,9 +227,187 @@ void _apply_gate(struct quantum_gate_struct this_gate,Vec rho){
   VecDestroy(&tmp_answer); //Destroy the temp answer
   MatDestroy(&gate_mat);
 
+  if (this_gate.noise.my_noise_type!=NO_NOISE){
+    _apply_gate_noise(this_gate,rho);
+  }
+
   PetscLogEventEnd(_apply_gate_event,0,0,0,0);
 }
 
+/*
+ * _get_noise_superop gets the superoperator of a single qubit noise channel,
+ * S[2*r'+c'][2*r+c] = sum_k K_k[r'][r] K_k*[c'][c], from its Kraus operators
+ * Inputs:
+ *        gate_noise noise: the channel
+ * Outputs:
+ *        PetscScalar S[4][4]: the superoperator on the (row,col) elements
+ *                             of the qubit's 2x2 block of rho
+ */
+void _get_noise_superop(gate_noise noise,PetscScalar S[4][4]){
+  PetscScalar kraus[4][2][2];
+  PetscReal   p = noise.p;
+  PetscInt    n_kraus,k,r,c,r2,c2;
+
+  if (p<0||p>1){
+    if (nid==0){
+      printf("ERROR! Noise probabilities must be between 0 and 1!\n");
+      exit(0);
+    }
+  }
+  for (k=0;k<4;k++){
+    kraus[k][0][0] = 0; kraus[k][0][1] = 0;
+    kraus[k][1][0] = 0; kraus[k][1][1] = 0;
+  }
+  if (noise.my_noise_type==DEPOLARIZING){
+    /* rho -> (1-p) rho + p/3 (X rho X + Y rho Y + Z rho Z) */
+    n_kraus = 4;
+    kraus[0][0][0] = PetscSqrtReal(1-p);      kraus[0][1][1] = PetscSqrtReal(1-p);
+    kraus[1][0][1] = PetscSqrtReal(p/3);      kraus[1][1][0] = PetscSqrtReal(p/3);
+    kraus[2][0][1] = -PETSC_i*PetscSqrtReal(p/3); kraus[2][1][0] = PETSC_i*PetscSqrtReal(p/3);
+    kraus[3][0][0] = PetscSqrtReal(p/3);      kraus[3][1][1] = -PetscSqrtReal(p/3);
+  } else if (noise.my_noise_type==AMPLITUDE_DAMPING){
+    /* |1> decays to |0> with probability gamma = p */
+    n_kraus = 2;
+    kraus[0][0][0] = 1.0;                     kraus[0][1][1] = PetscSqrtReal(1-p);
+    kraus[1][0][1] = PetscSqrtReal(p);
+  } else if (noise.my_noise_type==DEPHASING){
+    /* rho -> (1-p) rho + p Z rho Z */
+    n_kraus = 2;
+    kraus[0][0][0] = PetscSqrtReal(1-p);      kraus[0][1][1] = PetscSqrtReal(1-p);
+    kraus[1][0][0] = PetscSqrtReal(p);        kraus[1][1][1] = -PetscSqrtReal(p);
+  } else {
+    if (nid==0){
+      printf("ERROR! Noise type not recognized!\n");
+      exit(0);
+    }
+  }
+
+  for (r2=0;r2<2;r2++){
+    for (c2=0;c2<2;c2++){
+      for (r=0;r<2;r++){
+        for (c=0;c<2;c++){
+          S[2*r2+c2][2*r+c] = 0;
+          for (k=0;k<n_kraus;k++){
+            S[2*r2+c2][2*r+c] += kraus[k][r2][r]*PetscConjComplex(kraus[k][c2][c]);
+          }
+        }
+      }
+    }
+  }
+  return;
+}
+
+/*
+ * _apply_qubit_channel applies a single qubit channel to the density matrix.
+ * The channel mixes only the four elements (row,col) of each 2x2 block of the
+ * qubit, so when every block is on one core it is applied in place, one block
+ * at a time; otherwise the (very sparse) superoperator is built and applied.
+ * Inputs:
+ *        PetscInt qubit:      the qubit (subsystem number)
+ *        PetscScalar S[4][4]: the channel, from _get_noise_superop
+ *        Vec rho:             the density matrix
+ * Outputs:
+ *        Vec rho:             rho after the channel
+ */
+void _apply_qubit_channel(PetscInt qubit,PetscScalar S[4][4],Vec rho){
+  PetscInt    i,k,k2,Istart,Iend,stride,row,col,base,index[4];
+  PetscScalar *rho_array,block[4];
+  int         all_local=1;
+  Mat         channel_mat;
+  Vec         tmp_answer;
+  coo_list    channel_coo;
+
+  if (!_lindblad_terms){
+    if (nid==0){
+      printf("ERROR! Gate noise needs the density matrix, not the wavefunction!\n");
+      exit(0);
+    }
+  }
+  if (subsystem_list[qubit]->my_levels!=2){
+    if (nid==0){
+      printf("ERROR! Gate noise is only defined for qubits!\n");
+      exit(0);
+    }
+  }
+  stride = total_levels/(2*subsystem_list[qubit]->n_before);
+
+  VecGetOwnershipRange(rho,&Istart,&Iend);
+  /* Blocks are contiguous from their first to last element */
+  for (i=Istart;i<Iend&&all_local;i++){
+    row  = i%total_levels;
+    col  = i/total_levels;
+    base = i - ((row/stride)%2)*stride - ((col/stride)%2)*stride*total_levels;
+    if (base<Istart||base+stride+stride*total_levels>=Iend){
+      all_local = 0;
+    }
+  }
+  MPI_Allreduce(MPI_IN_PLACE,&all_local,1,MPI_INT,MPI_MIN,quac_comm);
+
+  if (all_local){
+    VecGetArray(rho,&rho_array);
+    for (i=Istart;i<Iend;i++){
+      row = i%total_levels;
+      col = i/total_levels;
+      if ((row/stride)%2||(col/stride)%2) continue;
+      /* k = 2*r+c for the element (row + r*stride, col + c*stride) */
+      for (k=0;k<4;k++){
+        index[k] = i - Istart + (k/2)*stride + (k%2)*stride*total_levels;
+        block[k] = rho_array[index[k]];
+      }
+      for (k2=0;k2<4;k2++){
+        rho_array[index[k2]] = 0;
+        for (k=0;k<4;k++){
+          rho_array[index[k2]] += S[k2][k]*block[k];
+        }
+      }
+    }
+    VecRestoreArray(rho,&rho_array);
+  } else {
+    MatCreate(quac_comm,&channel_mat);
+    MatSetSizes(channel_mat,Iend-Istart,Iend-Istart,PETSC_DETERMINE,PETSC_DETERMINE);
+    MatSetFromOptions(channel_mat);
+    MatSetUp(channel_mat);
+    _coo_create(&channel_coo,4*(Iend-Istart));
+    for (i=Istart;i<Iend;i++){
+      row  = i%total_levels;
+      col  = i/total_levels;
+      k2   = 2*((row/stride)%2) + (col/stride)%2;
+      base = i - (k2/2)*stride - (k2%2)*stride*total_levels;
+      for (k=0;k<4;k++){
+        if (PetscAbsComplex(S[k2][k])>0){
+          _coo_add(&channel_coo,i,base+(k/2)*stride+(k%2)*stride*total_levels,S[k2][k]);
+        }
+      }
+    }
+    _coo_set_mat(channel_mat,&channel_coo);
+    _coo_destroy(&channel_coo);
+    MatAssemblyBegin(channel_mat,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(channel_mat,MAT_FINAL_ASSEMBLY);
+
+    VecDuplicate(rho,&tmp_answer);
+    MatMult(channel_mat,rho,tmp_answer);
+    VecCopy(tmp_answer,rho);
+    VecDestroy(&tmp_answer);
+    MatDestroy(&channel_mat);
+  }
+  return;
+}
+
+/*
+ * _apply_gate_noise applies the noise channel of a gate to each of its qubits
+ */
+void _apply_gate_noise(struct quantum_gate_struct this_gate,Vec rho){
+  PetscScalar S[4][4];
+  PetscInt    i,num_qubits;
+
+  num_qubits = (this_gate.my_gate_type<0) ? 2 : 1;
+  _get_noise_superop(this_gate.noise,S);
+  for (i=0;i<num_qubits;i++){
+    _apply_qubit_channel(this_gate.qubit_numbers[i],S,rho);
+  }
+  return;
+}
+
 /*z
  * _construct_gate_mat constructs the matrix needed for the quantum
  * computing gates.
@@ -271,7 +481,7 @@ void _construct_gate_mat(gate_type my_gate_type,int *systems,Mat gate_mat){
            * we switched the system immediately before that one with the
            * stored variable moved_system
            */
-           _change_basis_ij_pair(&i1,&j1,systems[control]+1,moved_system);
+           _change_basis_ij_pair(&i1,&j1,_subsystem_after(systems[control]),moved_system);
           for (k3=0;k3<n_after;k3++){
             for (k4=0;k4<n_before1;k4++){
               for (j=0;j<4;j++){ //4 is hardcoded because there are only 4 entries
@@ -282,7 +492,7 @@ void _construct_gate_mat(gate_type my_gate_type,int *systems,Mat gate_mat){
                 j2 = j2*n_after + k3 + k4*my_levels*n_after;
 
                 /* Permute to computational basis */
-                _change_basis_ij_pair(&i2,&j2,systems[control]+1,moved_system);
+                _change_basis_ij_pair(&i2,&j2,_subsystem_after(systems[control]),moved_system);
 
                 add_to_mat = val1*val2;
                 /* Do the normal kron product expansion */
@@ -597,17 +807,18 @@ PetscScalar _get_val_in_subspace_gate(PetscInt i,gate_type my_gate_type,PetscInt
  *                               the circuit; can be negative, if no
  *                               estimate is known.
  * Outputs:
- *       operator *new_op: lowering op (op), raising op (op->dag), and number op (op->n)
+ *       circuit circ: the empty circuit
  */
 
 void create_circuit(circuit *circ,PetscInt num_gates_est){
-  (*circ).start_time   = 0.0;
-  (*circ).num_gates    = 0;
-  (*circ).current_gate = 0;
+  (*circ).start_time        = 0.0;
+  (*circ).num_gates         = 0;
+  (*circ).current_gate      = 0;
+  (*circ).num_qubit_entries = 0;
   /*
    * If num_gates_est was positive when passed in, use that
-   * as the initial gate_list size, otherwise set to
-   * 100. gate_list will be dynamically resized when needed.
+   * as the initial size, otherwise set to 100. The arrays
+   * are resized when needed.
    */
   if (num_gates_est>0) {
     (*circ).gate_list_size = num_gates_est;
@@ -615,8 +826,124 @@ void create_circuit(circuit *circ,PetscInt num_gates_est){
     // Default gate_list_size
     (*circ).gate_list_size = 100;
   }
-  // Allocate gate list
-  (*circ).gate_list = malloc((*circ).gate_list_size * sizeof(struct quantum_gate_struct));
+  // Room for two qubits per gate
+  (*circ).qubit_arena_size = 2*(*circ).gate_list_size;
+
+  (*circ).gate_types  = malloc((*circ).gate_list_size*sizeof(gate_type));
+  (*circ).times       = malloc((*circ).gate_list_size*sizeof(PetscReal));
+  (*circ).theta       = malloc((*circ).gate_list_size*sizeof(PetscReal));
+  (*circ).phi         = malloc((*circ).gate_list_size*sizeof(PetscReal));
+  (*circ).lambda      = malloc((*circ).gate_list_size*sizeof(PetscReal));
+  (*circ).noise       = malloc((*circ).gate_list_size*sizeof(gate_noise));
+  (*circ).qubit_start = malloc((*circ).gate_list_size*sizeof(PetscInt));
+  (*circ).qubits      = malloc((*circ).qubit_arena_size*sizeof(int));
+}
+
+/*
+ * destroy_circuit frees the storage of a circuit. Plain struct copies of
+ * it share the storage, but start_circuit_at_time keeps its own copy, so a
+ * registered circuit can be destroyed right away.
+ */
+void destroy_circuit(circuit *circ){
+  free((*circ).gate_types);
+  free((*circ).times);
+  free((*circ).theta);
+  free((*circ).phi);
+  free((*circ).lambda);
+  free((*circ).noise);
+  free((*circ).qubit_start);
+  free((*circ).qubits);
+  (*circ).num_gates         = 0;
+  (*circ).gate_list_size    = 0;
+  (*circ).num_qubit_entries = 0;
+  (*circ).qubit_arena_size  = 0;
+  return;
+}
+
+/*
+ * _circuit_reserve makes room for num_gates gates with num_qubit_entries
+ * qubits in total, doubling the arrays as needed
+ */
+static void _circuit_reserve(circuit *circ,PetscInt num_gates,PetscInt num_qubit_entries){
+  PetscInt size;
+
+  if (num_gates>(*circ).gate_list_size){
+    size = PetscMax(2*(*circ).gate_list_size,1);
+    while (size<num_gates) size = 2*size;
+    (*circ).gate_types     = realloc((*circ).gate_types,size*sizeof(gate_type));
+    (*circ).times          = realloc((*circ).times,size*sizeof(PetscReal));
+    (*circ).theta          = realloc((*circ).theta,size*sizeof(PetscReal));
+    (*circ).phi            = realloc((*circ).phi,size*sizeof(PetscReal));
+    (*circ).lambda         = realloc((*circ).lambda,size*sizeof(PetscReal));
+    (*circ).noise          = realloc((*circ).noise,size*sizeof(gate_noise));
+    (*circ).qubit_start    = realloc((*circ).qubit_start,size*sizeof(PetscInt));
+    (*circ).gate_list_size = size;
+  }
+  if (num_qubit_entries>(*circ).qubit_arena_size){
+    size = PetscMax(2*(*circ).qubit_arena_size,2);
+    while (size<num_qubit_entries) size = 2*size;
+    (*circ).qubits           = realloc((*circ).qubits,size*sizeof(int));
+    (*circ).qubit_arena_size = size;
+  }
+  return;
+}
+
+/*
+ * _circuit_append adds a noiseless gate to the end of a circuit
+ * Inputs:
+ *        circuit *circ:          circuit to add to
+ *        PetscReal time:         time of the gate
+ *        gate_type my_gate_type: which gate
+ *        int num_qubits:         number of qubits of the gate
+ *        int qubits[]:           the qubits
+ *        PetscReal theta,phi,lambda: angles of rotation and U3 gates
+ * Return:
+ *        the number of the new gate
+ */
+PetscInt _circuit_append(circuit *circ,PetscReal time,gate_type my_gate_type,int num_qubits,
+                         int qubits[],PetscReal theta,PetscReal phi,PetscReal lambda){
+  PetscInt g,i;
+
+  _circuit_reserve(circ,(*circ).num_gates+1,(*circ).num_qubit_entries+num_qubits);
+  g = (*circ).num_gates;
+  (*circ).gate_types[g]          = my_gate_type;
+  (*circ).times[g]               = time;
+  (*circ).theta[g]               = theta;
+  (*circ).phi[g]                 = phi;
+  (*circ).lambda[g]              = lambda;
+  (*circ).noise[g].my_noise_type = NO_NOISE;
+  (*circ).noise[g].p             = 0;
+  (*circ).qubit_start[g]         = (*circ).num_qubit_entries;
+  for (i=0;i<num_qubits;i++){
+    (*circ).qubits[(*circ).num_qubit_entries+i] = qubits[i];
+  }
+  (*circ).num_qubit_entries = (*circ).num_qubit_entries + num_qubits;
+  (*circ).num_gates         = g + 1;
+  return g;
+}
+
+/*
+ * _circuit_gate gives gate g of a circuit as a quantum_gate_struct, for
+ * the gate routines. Its qubit_numbers point into the circuit's qubit
+ * arena, so nothing is allocated.
+ */
+struct quantum_gate_struct _circuit_gate(circuit circ,PetscInt g){
+  struct quantum_gate_struct gate;
+
+  if (_gate_array_initialized==0){
+    //Initialize the array of gate function pointers
+    _initialize_gate_function_array();
+    _gate_array_initialized = 1;
+  }
+  gate.time          = circ.times[g];
+  gate.my_gate_type  = circ.gate_types[g];
+  gate.qubit_numbers = &circ.qubits[circ.qubit_start[g]];
+  gate._get_val_j_from_global_i = _get_val_j_functions_gates[gate.my_gate_type+_min_gate_enum];
+  gate.theta         = circ.theta[g];
+  gate.phi           = circ.phi[g];
+  gate.lambda        = circ.lambda[g];
+  gate.noise         = circ.noise[g];
+  return gate;
 }
 
 /*
@@ -629,8 +956,8 @@ void create_circuit(circuit *circ,PetscInt num_gates_est){
  *        ...:   list of qubit gate will act on, other (U for controlled_U?)
  */
 void add_gate_to_circuit(circuit *circ,PetscReal time,gate_type my_gate_type,...){
-  PetscReal theta,phi,lambda;
-  int num_qubits=0,qubit,i;
+  PetscReal theta=0,phi=0,lambda=0;
+  int num_qubits=0,qubits[2],i;
   va_list ap;
 
   if (_gate_array_initialized==0){
@@ -641,18 +968,6 @@ void add_gate_to_circuit(circuit *circ,PetscReal time,gate_type my_gate_type,...
 
   _check_gate_type(my_gate_type,&num_qubits);
 
-  if ((*circ).num_gates==(*circ).gate_list_size){
-    if (nid==0){
-      printf("ERROR! Gate list not large enough!\n");
-      exit(1);
-    }
-  }
-  // Store arguments in list
-  (*circ).gate_list[(*circ).num_gates].qubit_numbers = malloc(num_qubits*sizeof(int));
-  (*circ).gate_list[(*circ).num_gates].time = time;
-  (*circ).gate_list[(*circ).num_gates].my_gate_type = my_gate_type;
-  (*circ).gate_list[(*circ).num_gates]._get_val_j_from_global_i = _get_val_j_functions_gates[my_gate_type+_min_gate_enum];
-
   if (my_gate_type==RX||my_gate_type==RY||my_gate_type==RZ) {
     va_start(ap,num_qubits+1);
   } else if (my_gate_type==U3){
@@ -663,88 +978,414 @@ void add_gate_to_circuit(circuit *circ,PetscReal time,gate_type my_gate_type,...
 
   // Loop through and store qubits
   for (i=0;i<num_qubits;i++){
-    qubit = va_arg(ap,int);
-    if (qubit>=num_subsystems) {
+    qubits[i] = va_arg(ap,int);
+    if (qubits[i]>=num_subsystems) {
       if (nid==0){
         // Disable warning because of qasm parser will make the circuit before
         // the qubits are allocated
         //printf("Warning! Qubit number greater than total systems\n");
       }
     }
-    (*circ).gate_list[(*circ).num_gates].qubit_numbers[i] = qubit;
   }
   if (my_gate_type==RX||my_gate_type==RY||my_gate_type==RZ){
     //Get the theta parameter from the last argument passed in
     theta = va_arg(ap,PetscReal);
-    (*circ).gate_list[(*circ).num_gates].theta = theta;
-    (*circ).gate_list[(*circ).num_gates].phi = 0;
-    (*circ).gate_list[(*circ).num_gates].lambda = 0;
   } else if (my_gate_type==U3){
-    theta = va_arg(ap,PetscReal);
-    (*circ).gate_list[(*circ).num_gates].theta = theta;
-    phi = va_arg(ap,PetscReal);
-    (*circ).gate_list[(*circ).num_gates].phi = phi;
+    theta  = va_arg(ap,PetscReal);
+    phi    = va_arg(ap,PetscReal);
     lambda = va_arg(ap,PetscReal);
-    (*circ).gate_list[(*circ).num_gates].lambda = lambda;
-  } else {
-    //Set theta to 0
-    (*circ).gate_list[(*circ).num_gates].theta = 0;
-    (*circ).gate_list[(*circ).num_gates].phi = 0;
-    (*circ).gate_list[(*circ).num_gates].lambda = 0;
   }
+  va_end(ap);
 
-  (*circ).num_gates = (*circ).num_gates + 1;
+  _circuit_append(circ,time,my_gate_type,num_qubits,qubits,theta,phi,lambda);
   return;
 }
 
 
 /*
  * Add a circuit to another circuit.
- * Assumes whole circuit happens at time
+ * Assumes whole circuit happens at time. The gates are copied array by
+ * array, with one block copy of the qubit arena.
  */
 void add_circuit_to_circuit(circuit *circ,circuit circ_to_add,PetscReal time){
-  int num_qubits=0,i,j;
+  PetscInt i,n,n_old,q_old,self;
+
+  n     = circ_to_add.num_gates;
+  n_old = (*circ).num_gates;
+  q_old = (*circ).num_qubit_entries;
+  self  = (circ_to_add.gate_types==(*circ).gate_types);
+  _circuit_reserve(circ,n_old+n,q_old+circ_to_add.num_qubit_entries);
+  /* Adding a circuit to itself; its storage may have just moved */
+  if (self) circ_to_add = *circ;
+
+  memcpy(&(*circ).gate_types[n_old],circ_to_add.gate_types,n*sizeof(gate_type));
+  memcpy(&(*circ).theta[n_old],circ_to_add.theta,n*sizeof(PetscReal));
+  memcpy(&(*circ).phi[n_old],circ_to_add.phi,n*sizeof(PetscReal));
+  memcpy(&(*circ).lambda[n_old],circ_to_add.lambda,n*sizeof(PetscReal));
+  memcpy(&(*circ).noise[n_old],circ_to_add.noise,n*sizeof(gate_noise));
+  memcpy(&(*circ).qubits[q_old],circ_to_add.qubits,circ_to_add.num_qubit_entries*sizeof(int));
+  for (i=0;i<n;i++){
+    (*circ).times[n_old+i]       = time;
+    (*circ).qubit_start[n_old+i] = circ_to_add.qubit_start[i] + q_old;
+  }
+  (*circ).num_gates         = n_old + n;
+  (*circ).num_qubit_entries = q_old + circ_to_add.num_qubit_entries;
 
-  // Check that we can fit the circuit in
-  if (((*circ).num_gates+circ_to_add.num_gates-1)==(*circ).gate_list_size){
+  return;
+}
+
+/*
+ * add_noise_to_last_gate attaches a noise channel to the most recently
+ * added gate of a circuit. It is applied to each qubit of the gate right
+ * after the gate, so noisy circuits need the density matrix.
+ * Inputs:
+ *        circuit *circ:         the circuit
+ *        noise_type my_noise_type: DEPOLARIZING, AMPLITUDE_DAMPING or DEPHASING
+ *        PetscReal p:           probability of the error (gamma for damping)
+ */
+void add_noise_to_last_gate(circuit *circ,noise_type my_noise_type,PetscReal p){
+
+  if ((*circ).num_gates==0){
     if (nid==0){
-      printf("ERROR! Gate list not large enough to add this circuit!\n");
-      exit(1);
+      printf("ERROR! The circuit has no gates to add noise to!\n");
+      exit(0);
     }
   }
+  (*circ).noise[(*circ).num_gates-1].my_noise_type = my_noise_type;
+  (*circ).noise[(*circ).num_gates-1].p = p;
+  _lindblad_terms = 1;
+  return;
+}
 
-  for (i=0;i<circ_to_add.num_gates;i++){
-    // Copy gate information over
-    (*circ).gate_list[(*circ).num_gates].time = time;
-    if (circ_to_add.gate_list[i].my_gate_type<0){
-      num_qubits = 2;
-    } else {
-      num_qubits = 1;
+/*
+ * add_noise_to_circuit attaches the same noise channel to every gate
+ * already in a circuit (e.g., a fixed error per gate from T1 or T2)
+ * Inputs:
+ *        circuit *circ:         the circuit
+ *        noise_type my_noise_type: DEPOLARIZING, AMPLITUDE_DAMPING or DEPHASING
+ *        PetscReal p:           probability of the error (gamma for damping)
+ */
+void add_noise_to_circuit(circuit *circ,noise_type my_noise_type,PetscReal p){
+  PetscInt i;
+
+  for (i=0;i<(*circ).num_gates;i++){
+    (*circ).noise[i].my_noise_type = my_noise_type;
+    (*circ).noise[i].p = p;
+  }
+  _lindblad_terms = 1;
+  return;
+}
+
+/*
+ * apply_circuit applies every gate of a circuit, in order, with its noise,
+ * directly to the state: gate-by-gate simulation with no time integration.
+ * Inputs:
+ *        circuit circ: the circuit
+ *        Vec rho:      the state
+ * Outputs:
+ *        Vec rho:      the state after the circuit
+ */
+void apply_circuit(circuit circ,Vec rho){
+  PetscInt i;
+
+  for (i=0;i<circ.num_gates;i++){
+    _apply_gate(_circuit_gate(circ,i),rho);
+  }
+  return;
+}
+
+/*
+ * create_circuit_dag builds the dependency graph of a circuit and the
+ * ASAP and ALAP layer of every gate. Gates are taken in circuit order,
+ * which is the order they are applied in.
+ * Inputs:
+ *        circuit circ:      the circuit
+ * Outputs:
+ *        circuit_dag *dag:  its dependency graph
+ */
+void create_circuit_dag(circuit_dag *dag,circuit circ){
+  PetscInt g,k,j,num_qubits,max_qubit=0,*last_gate,height,n_preds;
+  int      *qubits;
+
+  (*dag).num_gates  = circ.num_gates;
+  (*dag).num_layers = 0;
+  (*dag).pred_start = malloc((circ.num_gates+1)*sizeof(PetscInt));
+  (*dag).preds      = malloc((2*circ.num_gates+1)*sizeof(PetscInt));
+  (*dag).asap       = malloc((circ.num_gates+1)*sizeof(PetscInt));
+  (*dag).alap       = malloc((circ.num_gates+1)*sizeof(PetscInt));
+
+  for (g=0;g<circ.num_gates;g++){
+    num_qubits = (circ.gate_types[g]<0) ? 2 : 1;
+    qubits     = &circ.qubits[circ.qubit_start[g]];
+    for (k=0;k<num_qubits;k++){
+      if (qubits[k]>max_qubit) max_qubit = qubits[k];
     }
-    (*circ).gate_list[(*circ).num_gates].qubit_numbers = malloc(num_qubits*sizeof(int));
-    for (j=0;j<num_qubits;j++){
-      (*circ).gate_list[(*circ).num_gates].qubit_numbers[j] = circ_to_add.gate_list[i].qubit_numbers[j];
+  }
+  last_gate = malloc((max_qubit+1)*sizeof(PetscInt));
+  for (k=0;k<=max_qubit;k++){
+    last_gate[k] = -1;
+  }
+
+  /* Forward pass: predecessors and ASAP layers */
+  n_preds = 0;
+  for (g=0;g<circ.num_gates;g++){
+    (*dag).pred_start[g] = n_preds;
+    (*dag).asap[g] = 0;
+    num_qubits = (circ.gate_types[g]<0) ? 2 : 1;
+    qubits     = &circ.qubits[circ.qubit_start[g]];
+    for (k=0;k<num_qubits;k++){
+      j = last_gate[qubits[k]];
+      if (j>=0){
+        (*dag).preds[n_preds] = j;
+        n_preds = n_preds + 1;
+        if ((*dag).asap[j]+1>(*dag).asap[g]) (*dag).asap[g] = (*dag).asap[j] + 1;
+      }
+      last_gate[qubits[k]] = g;
     }
+    if ((*dag).asap[g]+1>(*dag).num_layers) (*dag).num_layers = (*dag).asap[g] + 1;
+  }
+  (*dag).pred_start[circ.num_gates] = n_preds;
 
-    (*circ).gate_list[(*circ).num_gates].my_gate_type = circ_to_add.gate_list[i].my_gate_type;
-    (*circ).gate_list[(*circ).num_gates]._get_val_j_from_global_i = circ_to_add.gate_list[i]._get_val_j_from_global_i;
-    (*circ).gate_list[(*circ).num_gates].theta = circ_to_add.gate_list[i].theta;
-    (*circ).num_gates = (*circ).num_gates + 1;
+  /*
+   * Backward pass: the height of a gate is the longest chain of gates
+   * that depend on it; ALAP puts it that many layers before the last
+   */
+  for (g=0;g<circ.num_gates;g++){
+    (*dag).alap[g] = 0; //Holds the height until it is converted
+  }
+  for (g=circ.num_gates-1;g>=0;g--){
+    height = (*dag).alap[g];
+    for (k=(*dag).pred_start[g];k<(*dag).pred_start[g+1];k++){
+      j = (*dag).preds[k];
+      if (height+1>(*dag).alap[j]) (*dag).alap[j] = height + 1;
+    }
+    (*dag).alap[g] = (*dag).num_layers - 1 - height;
   }
 
+  free(last_gate);
+  return;
+}
 
+void destroy_circuit_dag(circuit_dag *dag){
+  free((*dag).pred_start);
+  free((*dag).preds);
+  free((*dag).asap);
+  free((*dag).alap);
+  return;
+}
+
+/*
+ * layer_circuit schedules a circuit by its dependencies: gates on disjoint
+ * qubits share a layer, and layer k (from 0) gets the time
+ * (k+1)*layer_time. The gates are reordered by layer (keeping their order
+ * within a layer), so each layer is one contiguous block with one time, and
+ * the integrator stops once per layer instead of once per gate. The number
+ * of layers is the circuit depth. Call it before start_circuit_at_time,
+ * since the circuit's storage is replaced.
+ * Inputs:
+ *        circuit *circ:          the circuit, e.g. from a qasm reader
+ *        layer_type my_layer_type: ASAP (each gate as early as possible) or
+ *                                ALAP (as late as possible)
+ *        PetscReal layer_time:   time between layers
+ * Outputs:
+ *        circuit *circ:          the layered circuit
+ *        PetscInt *num_layers:   the depth (may be NULL)
+ */
+void layer_circuit(circuit *circ,layer_type my_layer_type,PetscReal layer_time,PetscInt *num_layers){
+  circuit_dag dag;
+  circuit     sorted;
+  PetscInt    g,k,*layer,*layer_count,*order;
+
+  create_circuit_dag(&dag,*circ);
+  layer = (my_layer_type==ALAP) ? dag.alap : dag.asap;
+
+  /* Counting sort of the gates by layer; stable, so dependencies stay in order */
+  layer_count = malloc((dag.num_layers+1)*sizeof(PetscInt));
+  for (k=0;k<=dag.num_layers;k++){
+    layer_count[k] = 0;
+  }
+  for (g=0;g<(*circ).num_gates;g++){
+    layer_count[layer[g]+1] = layer_count[layer[g]+1] + 1;
+  }
+  for (k=0;k<dag.num_layers;k++){
+    layer_count[k+1] = layer_count[k+1] + layer_count[k];
+  }
+  order = malloc(((*circ).num_gates+1)*sizeof(PetscInt));
+  for (g=0;g<(*circ).num_gates;g++){
+    order[layer_count[layer[g]]] = g;
+    layer_count[layer[g]] = layer_count[layer[g]] + 1;
+  }
+
+  create_circuit(&sorted,(*circ).gate_list_size);
+  for (k=0;k<(*circ).num_gates;k++){
+    g = order[k];
+    _circuit_append(&sorted,(layer[g]+1)*layer_time,(*circ).gate_types[g],((*circ).gate_types[g]<0) ? 2 : 1,
+                    &(*circ).qubits[(*circ).qubit_start[g]],(*circ).theta[g],(*circ).phi[g],(*circ).lambda[g]);
+    sorted.noise[k] = (*circ).noise[g];
+  }
+  sorted.start_time   = (*circ).start_time;
+  sorted.current_gate = (*circ).current_gate;
+  destroy_circuit(circ);
+  *circ = sorted;
+
+  if (num_layers!=NULL) *num_layers = dag.num_layers;
+  free(layer_count);
+  free(order);
+  destroy_circuit_dag(&dag);
+  return;
+}
 
+/*
+ * _circuit_copy makes copy a deep copy of circ, with its own storage
+ */
+static void _circuit_copy(circuit circ,circuit *copy){
+  PetscInt n,q;
+
+  n = circ.num_gates;
+  q = circ.num_qubit_entries;
+  create_circuit(copy,n);
+  _circuit_reserve(copy,n,q);
+  memcpy((*copy).gate_types,circ.gate_types,n*sizeof(gate_type));
+  memcpy((*copy).times,circ.times,n*sizeof(PetscReal));
+  memcpy((*copy).theta,circ.theta,n*sizeof(PetscReal));
+  memcpy((*copy).phi,circ.phi,n*sizeof(PetscReal));
+  memcpy((*copy).lambda,circ.lambda,n*sizeof(PetscReal));
+  memcpy((*copy).noise,circ.noise,n*sizeof(gate_noise));
+  memcpy((*copy).qubit_start,circ.qubit_start,n*sizeof(PetscInt));
+  memcpy((*copy).qubits,circ.qubits,q*sizeof(int));
+  (*copy).num_gates         = n;
+  (*copy).num_qubit_entries = q;
+  (*copy).start_time        = circ.start_time;
+  (*copy).current_gate      = circ.current_gate;
   return;
 }
 
-/* register a circuit to be run a specific time during the time stepping */
+/*
+ * register a circuit to be run a specific time during the time stepping.
+ * The circuit is copied, so circ can be changed or destroyed afterwards
+ * without affecting the registered one; the copy is freed by QuaC_clear.
+ */
 void start_circuit_at_time(circuit *circ,PetscReal time){
   (*circ).start_time = time;
-  _circuit_list[_num_circuits] = *circ;
+  _circuit_copy(*circ,&_circuit_list[_num_circuits]);
   _num_circuits = _num_circuits + 1;
 
 }
 
+/*
+ * _destroy_circuit_list frees the circuits registered with
+ * start_circuit_at_time
+ */
+void _destroy_circuit_list(){
+  int i;
+
+  for (i=0;i<_num_circuits;i++){
+    destroy_circuit(&_circuit_list[i]);
+  }
+  _num_circuits    = 0;
+  _current_circuit = 0;
+  return;
+}
+
+/*
+ * _add_gate_weight counts a gate in the interaction weights used by
+ * optimize_subsystem_order: a two qubit gate couples its qubits, and a
+ * non-diagonal single qubit gate couples rows along its qubit
+ */
+static void _add_gate_weight(struct quantum_gate_struct gate,PetscInt n,PetscReal *weight){
+  PetscInt q0,q1;
+
+  q0 = gate.qubit_numbers[0];
+  if (gate.my_gate_type<0){
+    q1 = gate.qubit_numbers[1];
+    weight[q0*n+q1] = weight[q0*n+q1] + 1;
+    weight[q1*n+q0] = weight[q1*n+q0] + 1;
+  } else if (gate.my_gate_type!=EYE&&gate.my_gate_type!=SIGMAZ&&gate.my_gate_type!=RZ){
+    weight[q0*n+q0] = weight[q0*n+q0] + 1;
+  }
+  return;
+}
+
+/*
+ * optimize_subsystem_order picks a Hilbert space ordering (see
+ * set_subsystem_order) that keeps strongly interacting subsystems on small
+ * strides, so that gate and coupling matrices have fewer nonzeros off of
+ * each core. The weights are the gates added with add_gate, the circuits
+ * registered with start_circuit_at_time, and a list of coupled operators,
+ * such as the pairs in the add_to_ham_mult2 and add_lin_mult2 terms that
+ * will be added. The subsystem with the most weight is put last (smallest
+ * stride); the others follow, toward larger strides, by their weight to
+ * the subsystems already placed. With no weights the order is unchanged.
+ * Must be called after the gates and circuits are added and before
+ * anything is added to the Hamiltonian or Lindblad.
+ * Inputs:
+ *        PetscInt n_couplings: number of coupled pairs
+ *        operator couplings[]: 2*n_couplings operators; couplings[2*k]
+ *                              and couplings[2*k+1] are coupled
+ */
+void optimize_subsystem_order(PetscInt n_couplings,operator couplings[]){
+  PetscReal *weight,*total,*to_placed;
+  PetscInt  n,i,s,t,p,best,q0,q1,*placed,*order;
+
+  n = num_subsystems;
+  PetscCalloc1(n*n,&weight);
+  PetscCalloc1(n,&total);
+  PetscCalloc1(n,&to_placed);
+  PetscCalloc1(n,&placed);
+  PetscMalloc1(n,&order);
+
+  for (i=0;i<_num_quantum_gates;i++){
+    _add_gate_weight(_quantum_gate_list[i],n,weight);
+  }
+  for (s=0;s<_num_circuits;s++){
+    for (i=0;i<_circuit_list[s].num_gates;i++){
+      _add_gate_weight(_circuit_gate(_circuit_list[s],i),n,weight);
+    }
+  }
+  for (i=0;i<n_couplings;i++){
+    q0 = _subsystem_index(couplings[2*i]);
+    q1 = _subsystem_index(couplings[2*i+1]);
+    if (q0!=q1){
+      weight[q0*n+q1] = weight[q0*n+q1] + 1;
+      weight[q1*n+q0] = weight[q1*n+q0] + 1;
+    }
+  }
+  for (s=0;s<n;s++){
+    for (t=0;t<n;t++){
+      total[s] = total[s] + weight[s*n+t];
+    }
+  }
+
+  /*
+   * Fill the positions from the smallest stride up. Ties go to the latest
+   * created subsystem, which keeps creation order when nothing interacts.
+   */
+  for (p=n-1;p>=0;p--){
+    best = -1;
+    for (s=n-1;s>=0;s--){
+      if (placed[s]) continue;
+      if (best<0||to_placed[s]>to_placed[best]||
+          (to_placed[s]==to_placed[best]&&total[s]>total[best])){
+        best = s;
+      }
+    }
+    order[p]     = best;
+    placed[best] = 1;
+    for (s=0;s<n;s++){
+      to_placed[s] = to_placed[s] + weight[s*n+best];
+    }
+  }
+
+  set_subsystem_order(order);
+
+  PetscFree(weight);
+  PetscFree(total);
+  PetscFree(to_placed);
+  PetscFree(placed);
+  PetscFree(order);
+  return;
+}
+
 /*
  *
  * tensor_control - switch on which superoperator to compute
@@ -1011,7 +1652,7 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
        * Get the i_sub in the permuted basis
        */
       i_tmp = i;
-      _change_basis_ij_pair(&i_tmp,&j1,gate.qubit_numbers[control]+1,moved_system); // j1 useless here
+      _change_basis_ij_pair(&i_tmp,&j1,_subsystem_after(gate.qubit_numbers[control]),moved_system); // j1 useless here
 
       i_sub = i_tmp/n_after%my_levels; //Use integer arithmetic to get floor function
 
@@ -1055,7 +1696,7 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
             j1   = (j_sub) * n_after + k1 + k2*my_levels*n_after; // 3 = j_sub
 
             /* Permute back to computational basis */
-            _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+            _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
             js[0] = j1;
           }
 
@@ -1070,7 +1711,7 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
             j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
 
             /* Permute back to computational basis */
-            _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+            _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
             js[0] = j1;
           } else {
             // Diagonal
@@ -1094,7 +1735,7 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
             j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
           }
           /* Permute back to computational basis */
-          _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1);//i_tmp useless here
+          _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control]));//i_tmp useless here
           js[0] = j1;
         } else {
           if (nid==0){
@@ -1144,7 +1785,7 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
             j1   = (j_sub) * n_after + k1 + k2*my_levels*n_after; // 3 = j_sub
 
             /* Permute back to computational basis */
-            _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+            _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
             js[0] = j1;
           }
 
@@ -1159,7 +1800,7 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
             j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
 
             /* Permute back to computational basis */
-            _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+            _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
             js[0] = j1;
           } else {
             // Diagonal
@@ -1184,7 +1825,7 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
             j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
           }
           /* Permute back to computational basis */
-          _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1);//i_tmp useless here
+          _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control]));//i_tmp useless here
           js[0] = j1;
         } else {
           if (nid==0){
@@ -1233,7 +1874,7 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
             j1   = (j_sub) * n_after + k1 + k2*my_levels*n_after; // 3 = j_sub
 
             /* Permute back to computational basis */
-            _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+            _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
             js[0] = j1;
           }
 
@@ -1248,7 +1889,7 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
             j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
 
             /* Permute back to computational basis */
-            _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+            _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
             js[0] = j1;
           } else {
             // Diagonal
@@ -1272,7 +1913,7 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
             j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
           }
           /* Permute back to computational basis */
-          _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1);//i_tmp useless here
+          _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control]));//i_tmp useless here
           js[0] = j1;
         } else {
           if (nid==0){
@@ -1431,188 +2072,216 @@ void _get_val_j_from_global_i_gates(PetscInt i,struct quantum_gate_struct gate,P
 }
 
 
-void combine_circuit_to_mat2(Mat *matrix_out,circuit circ){
-  PetscScalar op_val,op_vals[total_levels],vals[2]={0};
-  PetscInt Istart,Iend;
-  PetscInt i,j,k,l,this_i,these_js[total_levels],js[2]={0},num_js_tmp=0,num_js,num_js_current;
-
-  // Should this inherit its stucture from full_A?
-  MatCreate(PETSC_COMM_WORLD,matrix_out);
-  MatSetType(*matrix_out,MATMPIAIJ);
-  MatSetSizes(*matrix_out,PETSC_DECIDE,PETSC_DECIDE,total_levels,total_levels);
-  MatSetFromOptions(*matrix_out);
+/*
+ * row_accumulator holds one sparse row while it is pushed through the
+ * gates of a circuit: n (col,val) pairs, with room for size.
+ */
+typedef struct row_entry{
+  PetscInt    col;
+  PetscScalar val;
+} row_entry;
+
+typedef struct row_accumulator{
+  PetscInt  n,size;
+  row_entry *entries;
+} row_accumulator;
+
+static int _row_entry_compare(const void *a,const void *b){
+  PetscInt ca = ((row_entry*)a)->col,cb = ((row_entry*)b)->col;
+
+  if (ca<cb) return -1;
+  if (ca>cb) return 1;
+  return 0;
+}
 
-  MatMPIAIJSetPreallocation(*matrix_out,16,NULL,16,NULL);
+static void _row_accumulator_reserve(row_accumulator *acc,PetscInt size){
+  if (size<=(*acc).size) return;
+  while ((*acc).size<size){
+    (*acc).size = 2*(*acc).size;
+  }
+  (*acc).entries = realloc((*acc).entries,(*acc).size*sizeof(row_entry));
+  if ((*acc).entries==NULL){
+    printf("ERROR! Could not grow row accumulator in combine_circuit\n");
+    exit(0);
+  }
+  return;
+}
 
+/*
+ * _row_times_gate sets out = in * G for a sparse row in, using
+ * in*G = sum_k in_k G[k,:]. Columns reached from more than one k are
+ * summed, and values that cancel (e.g. H*H) are dropped; a sum counts as
+ * cancelled when it is at rounding level relative to the largest term.
+ * Inputs:
+ *        row_accumulator *in:   the row; its columns are unique
+ *        struct quantum_gate_struct gate: the gate G
+ *        PetscInt tensor_control: -1 for U, 0 for U* cross U
+ * Outputs:
+ *        row_accumulator *out:  the product, with unique columns
+ */
+static void _row_times_gate(row_accumulator *in,struct quantum_gate_struct gate,
+                            PetscInt tensor_control,row_accumulator *out){
+  PetscScalar vals[4];
+  PetscReal   scale=0.0;
+  PetscInt    k,l,m,num_js,js[4];
+  int         branched=0;
+
+  (*out).n = 0;
+  _row_accumulator_reserve(out,4*(*in).n);
+  for (k=0;k<(*in).n;k++){
+    gate._get_val_j_from_global_i((*in).entries[k].col,gate,&num_js,js,vals,tensor_control);
+    if (num_js>1) branched = 1;
+    for (l=0;l<num_js;l++){
+      if (js[l]<0) continue;
+      (*out).entries[(*out).n].col = js[l];
+      (*out).entries[(*out).n].val = (*in).entries[k].val*vals[l];
+      scale = PetscMax(scale,PetscAbsComplex((*out).entries[(*out).n].val));
+      (*out).n = (*out).n + 1;
+    }
+  }
   /*
-   * Calculate G1*G2*G3*.. using the following observation:
-   *     Each gate is very sparse - having no more than
-   *          2 values per row. This allows us to efficiently do the
-   *          multiplication by just touching the nonzero values
+   * A gate with one nonzero per row is a unitary permutation up to
+   * phases, so distinct columns stay distinct and nothing can cancel
    */
-  MatGetOwnershipRange(*matrix_out,&Istart,&Iend);
-  for (i=Istart;i<Iend;i++){
-    this_i = i; // The leading index which we check
-    // Reset the result for the row
-    num_js = 1;
-    these_js[0] = i;
-    op_vals[0]  = 1.0;
-    for (j=0;j<circ.num_gates;j++){
-      num_js_current = num_js;
-      for (k=0;k<num_js_current;k++){
-        // Loop through all of the js from the previous gate multiplications
-        this_i = these_js[k];
-        op_val = op_vals[k];
-
-        _get_val_j_from_global_i_gates(this_i,circ.gate_list[j],&num_js_tmp,js,vals,-1); // Get the corresponding j and val
-        /*
-         * Assume there is always at least 1 nonzero per row. This is a good assumption
-         * because all basic quantum gates have at least 1 nonzero per row
-         */
-        // WARNING! CODE NOT FINISHED
-        // WILL NOT WORK FOR HADAMARD * HADAMARD
+  if (!branched) return;
 
-        these_js[k] = js[0];
-        op_vals[k]  = op_val*vals[0];
-
-        for (l=1;l<num_js_tmp;l++){
-          //If we have more than 1 num_js_tmp, we append to the end of the list
-          these_js[num_js+l-1] = js[l];
-          op_vals[num_js+l-1]  = op_val*vals[l];
-        }
-         num_js = num_js + num_js_tmp - 1; //If we spawned an extra j, add it here
-      }
+  qsort((*out).entries,(*out).n,sizeof(row_entry),_row_entry_compare);
+  m = 0;
+  for (k=0;k<(*out).n;k++){
+    if (m>0 && (*out).entries[m-1].col==(*out).entries[k].col){
+      (*out).entries[m-1].val = (*out).entries[m-1].val + (*out).entries[k].val;
+    } else {
+      (*out).entries[m] = (*out).entries[k];
+      m = m + 1;
+    }
+  }
+  (*out).n = 0;
+  for (k=0;k<m;k++){
+    if (PetscAbsComplex((*out).entries[k].val)>10*PETSC_MACHINE_EPSILON*scale){
+      (*out).entries[(*out).n] = (*out).entries[k];
+      (*out).n = (*out).n + 1;
     }
-    MatSetValues(*matrix_out,1,&i,num_js,these_js,op_vals,ADD_VALUES);
   }
-
-  MatAssemblyBegin(*matrix_out,MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(*matrix_out,MAT_FINAL_ASSEMBLY);
-
   return;
 }
 
+/*
+ * _combine_circuit_rows builds the matrix of a whole circuit,
+ * G_n*...*G_2*G_1 (gate 1 acts first), in a single assembly. Each
+ * local row e_i^T is pushed through G_n, then G_{n-1}, ..., then G_1,
+ * as a sparse row that is merged after every gate, so the cost is
+ * linear in the number of gates rather than one matrix-matrix product
+ * per gate.
+ * Inputs:
+ *        circuit circ:            the circuit
+ *        PetscInt dim:            size of the matrix
+ *        PetscInt tensor_control: -1 for the unitary, 0 for the
+ *                                 superoperator U* cross U
+ * Outputs:
+ *        Mat *matrix_out:         the new, assembled matrix
+ */
+static void _combine_circuit_rows(Mat *matrix_out,circuit circ,PetscInt dim,PetscInt tensor_control){
+  PetscInt Istart,Iend,num_threads;
+  coo_list circ_coo,*thread_coo;
 
-void combine_circuit_to_mat(Mat *matrix_out,circuit circ){
-  PetscScalar op_vals[2];
-  PetscInt Istart,Iend,i_mat;
-  PetscInt i,these_js[2],num_js;
-  Mat tmp_mat1,tmp_mat2,tmp_mat3;
-
-  // Should this inherit its stucture from full_A?
-
-  MatCreate(PETSC_COMM_WORLD,&tmp_mat1);
-  MatSetType(tmp_mat1,MATMPIAIJ);
-  MatSetSizes(tmp_mat1,PETSC_DECIDE,PETSC_DECIDE,total_levels,total_levels);
-  MatSetFromOptions(tmp_mat1);
-
-  MatMPIAIJSetPreallocation(tmp_mat1,2,NULL,2,NULL);
+  MatCreate(quac_comm,matrix_out);
+  MatSetType(*matrix_out,MATMPIAIJ);
+  MatSetSizes(*matrix_out,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
+  MatSetFromOptions(*matrix_out);
+  MatSetUp(*matrix_out);
+  MatGetOwnershipRange(*matrix_out,&Istart,&Iend);
 
-  /* Construct the first matrix in tmp_mat1 */
-  MatGetOwnershipRange(tmp_mat1,&Istart,&Iend);
-  for (i=Istart;i<Iend;i++){
-    circ.gate_list[0]._get_val_j_from_global_i(i,circ.gate_list[0],&num_js,these_js,op_vals,-1); // Get the corresponding j and val
-    MatSetValues(tmp_mat1,1,&i,num_js,these_js,op_vals,ADD_VALUES);
+  if (_gate_array_initialized==0){
+    //Initialize the array of gate function pointers
+    _initialize_gate_function_array();
+    _gate_array_initialized = 1;
   }
 
-  MatAssemblyBegin(tmp_mat1,MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(tmp_mat1,MAT_FINAL_ASSEMBLY);
-
-  for (i_mat=1;i_mat<circ.num_gates;i_mat++){
-    // Create the next matrix
-    MatCreate(PETSC_COMM_WORLD,&tmp_mat2);
-    MatSetType(tmp_mat2,MATMPIAIJ);
-    MatSetSizes(tmp_mat2,PETSC_DECIDE,PETSC_DECIDE,total_levels,total_levels);
-    MatSetFromOptions(tmp_mat2);
-
-    MatMPIAIJSetPreallocation(tmp_mat2,2,NULL,2,NULL);
-
-    /* Construct new matrix */
-    MatGetOwnershipRange(tmp_mat2,&Istart,&Iend);
+  num_threads = _coo_get_num_threads();
+  thread_coo  = _coo_create_thread_lists(num_threads,4*(Iend-Istart));
+
+#if defined(_OPENMP)
+#pragma omp parallel num_threads(num_threads)
+#endif
+  {
+    row_accumulator row_a,row_b,*current,*next,*tmp;
+    PetscInt        i,g,k;
+    coo_list        *my_coo = &thread_coo[_coo_get_thread_num()];
+
+    row_a.n    = 0;
+    row_a.size = 16;
+    row_a.entries = malloc(row_a.size*sizeof(row_entry));
+    row_b.n    = 0;
+    row_b.size = 16;
+    row_b.entries = malloc(row_b.size*sizeof(row_entry));
+
+#if defined(_OPENMP)
+#pragma omp for schedule(static)
+#endif
     for (i=Istart;i<Iend;i++){
-      _get_val_j_from_global_i_gates(i,circ.gate_list[i_mat],&num_js,these_js,op_vals,-1); // Get the corresponding j and val
-      MatSetValues(tmp_mat2,1,&i,num_js,these_js,op_vals,ADD_VALUES);
+      current = &row_a;
+      next    = &row_b;
+      (*current).n = 1;
+      (*current).entries[0].col = i;
+      (*current).entries[0].val = 1.0;
+      for (g=circ.num_gates-1;g>=0&&(*current).n>0;g--){
+        _row_times_gate(current,_circuit_gate(circ,g),tensor_control,next);
+        tmp     = current;
+        current = next;
+        next    = tmp;
+      }
+      for (k=0;k<(*current).n;k++){
+        _coo_add(my_coo,i,(*current).entries[k].col,(*current).entries[k].val);
+      }
     }
-
-    MatAssemblyBegin(tmp_mat2,MAT_FINAL_ASSEMBLY);
-    MatAssemblyEnd(tmp_mat2,MAT_FINAL_ASSEMBLY);
-
-    // Now do matrix matrix multiply
-    MatMatMult(tmp_mat2,tmp_mat1,MAT_INITIAL_MATRIX,PETSC_DEFAULT,&tmp_mat3);
-    MatDestroy(&tmp_mat1);
-    MatDestroy(&tmp_mat2); //Do I need to destroy it?
-
-    //Store tmp_mat3 into tmp_mat1
-    MatConvert(tmp_mat3,MATSAME,MAT_INITIAL_MATRIX,&tmp_mat1);
-    MatDestroy(&tmp_mat3);
+    free(row_a.entries);
+    free(row_b.entries);
   }
 
-  //Copy tmp_mat1 into *matrix_out
-  MatConvert(tmp_mat1,MATSAME,MAT_INITIAL_MATRIX,matrix_out);;
+  _coo_create(&circ_coo,4*(Iend-Istart));
+  _coo_merge_thread_lists(&circ_coo,num_threads,thread_coo);
+  _coo_set_mat(*matrix_out,&circ_coo);
+  _coo_destroy(&circ_coo);
 
-  MatDestroy(&tmp_mat1);
+  MatAssemblyBegin(*matrix_out,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(*matrix_out,MAT_FINAL_ASSEMBLY);
   return;
 }
 
+/*
+ * combine_circuit_to_mat makes the unitary of a whole circuit,
+ * G_n*...*G_1 with the gates applied in circuit order. Gate noise
+ * is ignored.
+ * Inputs:
+ *        circuit circ:    the circuit
+ * Outputs:
+ *        Mat *matrix_out: the new total_levels x total_levels matrix
+ */
+void combine_circuit_to_mat(Mat *matrix_out,circuit circ){
+  _combine_circuit_rows(matrix_out,circ,total_levels,-1);
+  return;
+}
 
-void combine_circuit_to_super_mat(Mat *matrix_out,circuit circ){
-  PetscScalar op_vals[4];
-  PetscInt Istart,Iend,i_mat,dim;
-  PetscInt i,these_js[4],num_js;
-  Mat tmp_mat1,tmp_mat2,tmp_mat3;
-
-  // Should this inherit its stucture from full_A?
-  dim = total_levels*total_levels;
-  MatCreate(PETSC_COMM_WORLD,&tmp_mat1);
-  MatSetType(tmp_mat1,MATMPIAIJ);
-  MatSetSizes(tmp_mat1,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
-  MatSetFromOptions(tmp_mat1);
-
-  MatMPIAIJSetPreallocation(tmp_mat1,8,NULL,8,NULL);
-
-  /* Construct the first matrix in tmp_mat1 */
-  MatGetOwnershipRange(tmp_mat1,&Istart,&Iend);
-  for (i=Istart;i<Iend;i++){
-    _get_val_j_from_global_i_gates(i,circ.gate_list[0],&num_js,these_js,op_vals,0); // Get the corresponding j and val
-    MatSetValues(tmp_mat1,1,&i,num_js,these_js,op_vals,ADD_VALUES);
-  }
-
-  MatAssemblyBegin(tmp_mat1,MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(tmp_mat1,MAT_FINAL_ASSEMBLY);
-
-  for (i_mat=1;i_mat<circ.num_gates;i_mat++){
-    // Create the next matrix
-    MatCreate(PETSC_COMM_WORLD,&tmp_mat2);
-    MatSetType(tmp_mat2,MATMPIAIJ);
-    MatSetSizes(tmp_mat2,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
-    MatSetFromOptions(tmp_mat2);
-
-    MatMPIAIJSetPreallocation(tmp_mat2,8,NULL,8,NULL);
-
-    /* Construct new matrix */
-    MatGetOwnershipRange(tmp_mat2,&Istart,&Iend);
-    for (i=Istart;i<Iend;i++){
-      _get_val_j_from_global_i_gates(i,circ.gate_list[i_mat],&num_js,these_js,op_vals,0); // Get the corresponding j and val
-      MatSetValues(tmp_mat2,1,&i,num_js,these_js,op_vals,ADD_VALUES);
-    }
-
-    MatAssemblyBegin(tmp_mat2,MAT_FINAL_ASSEMBLY);
-    MatAssemblyEnd(tmp_mat2,MAT_FINAL_ASSEMBLY);
-
-    // Now do matrix matrix multiply
-    MatMatMult(tmp_mat2,tmp_mat1,MAT_INITIAL_MATRIX,PETSC_DEFAULT,&tmp_mat3);
-    MatDestroy(&tmp_mat1);
-    MatDestroy(&tmp_mat2); //Do I need to destroy it?
-
-    //Store tmp_mat3 into tmp_mat1
-    MatConvert(tmp_mat3,MATSAME,MAT_INITIAL_MATRIX,&tmp_mat1);
-    MatDestroy(&tmp_mat3);
-  }
-
-  //Copy tmp_mat1 into *matrix_out
-  MatConvert(tmp_mat1,MATSAME,MAT_INITIAL_MATRIX,matrix_out);;
+/*
+ * combine_circuit_to_mat2 is the same as combine_circuit_to_mat;
+ * it is kept for older codes.
+ */
+void combine_circuit_to_mat2(Mat *matrix_out,circuit circ){
+  _combine_circuit_rows(matrix_out,circ,total_levels,-1);
+  return;
+}
 
-  MatDestroy(&tmp_mat1);
+/*
+ * combine_circuit_to_super_mat makes the superoperator of a whole
+ * circuit, S_n*...*S_1 with S_k = G_k* cross G_k, acting on the
+ * vectorized density matrix. Gate noise is ignored.
+ * Inputs:
+ *        circuit circ:    the circuit
+ * Outputs:
+ *        Mat *matrix_out: the new total_levels^2 x total_levels^2 matrix
+ */
+void combine_circuit_to_super_mat(Mat *matrix_out,circuit circ){
+  _combine_circuit_rows(matrix_out,circ,total_levels*total_levels,0);
   return;
 }
 
@@ -1680,7 +2349,7 @@ void CNOT_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,Pet
         j1   = (j_sub) * n_after + k1 + k2*my_levels*n_after; // 3 = j_sub
 
         /* Permute back to computational basis */
-        _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+        _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
         js[0] = j1;
       }
 
@@ -1694,7 +2363,7 @@ void CNOT_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,Pet
         j_sub   = 3;
         j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
         /* Permute back to computational basis */
-        _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+        _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
         js[0] = j1;
       } else {
         // Diagonal
@@ -1718,7 +2387,7 @@ void CNOT_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,Pet
         j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
       }
       /* Permute back to computational basis */
-      _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1);//i_tmp useless here
+      _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control]));//i_tmp useless here
       js[0] = j1;
     } else {
       if (nid==0){
@@ -1824,7 +2493,7 @@ void CXZ_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,Pets
         j1   = (j_sub) * n_after + k1 + k2*my_levels*n_after; // 3 = j_sub
 
         /* Permute back to computational basis */
-        _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+        _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
         js[0] = j1;
       }
 
@@ -1839,7 +2508,7 @@ void CXZ_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,Pets
         j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
 
         /* Permute back to computational basis */
-        _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+        _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
         js[0] = j1;
       } else {
         // Diagonal
@@ -1864,7 +2533,7 @@ void CXZ_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,Pets
         j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
       }
       /* Permute back to computational basis */
-      _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1);//i_tmp useless here
+      _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control]));//i_tmp useless here
       js[0] = j1;
     } else {
       if (nid==0){
@@ -2179,7 +2848,7 @@ void CZX_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,Pets
         j1   = (j_sub) * n_after + k1 + k2*my_levels*n_after; // 3 = j_sub
 
         /* Permute back to computational basis */
-        _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+        _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
         js[0] = j1;
       }
 
@@ -2194,7 +2863,7 @@ void CZX_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,Pets
         j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
 
         /* Permute back to computational basis */
-        _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1); // i_tmp useless here
+        _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control])); // i_tmp useless here
         js[0] = j1;
       } else {
         // Diagonal
@@ -2218,7 +2887,7 @@ void CZX_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,Pets
         j1     = j_sub * n_after + k1 + k2*my_levels*n_after;
       }
       /* Permute back to computational basis */
-      _change_basis_ij_pair(&i_tmp,&j1,moved_system,gate.qubit_numbers[control]+1);//i_tmp useless here
+      _change_basis_ij_pair(&i_tmp,&j1,moved_system,_subsystem_after(gate.qubit_numbers[control]));//i_tmp useless here
       js[0] = j1;
     } else {
       if (nid==0){
@@ -3047,7 +3716,7 @@ void _get_n_after_2qbit(PetscInt *i,int qubit_numbers[],PetscInt tensor_control,
    * Permute to temporary basis
    * Get the i_sub in the permuted basis
    */
-  _change_basis_ij_pair(i,&j1,qubit_numbers[*control]+1,*moved_system); // j1 useless here
+  _change_basis_ij_pair(i,&j1,_subsystem_after(qubit_numbers[*control]),*moved_system); // j1 useless here
 
   *i_sub = *i/(*n_after)%my_levels; //Use integer arithmetic to get floor function
 
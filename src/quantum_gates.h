@@ -25,36 +25,99 @@ typedef enum {
   U3     = 9
 } gate_type;
 
+typedef enum {
+  NO_NOISE          = 0,
+  DEPOLARIZING      = 1,
+  AMPLITUDE_DAMPING = 2,
+  DEPHASING         = 3
+} noise_type;
+
+/*
+ * gate_noise is a single qubit channel applied to every qubit of a gate
+ * right after it. p is the depolarizing probability, the damping
+ * probability gamma, or the phase flip probability.
+ */
+typedef struct gate_noise{
+  noise_type my_noise_type;
+  PetscReal  p;
+} gate_noise;
+
 struct quantum_gate_struct{
   PetscReal time;
   gate_type my_gate_type;
   int *qubit_numbers;
   void (*_get_val_j_from_global_i)(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
   PetscReal theta,lambda,phi; //Only used for rotation gates
+  gate_noise noise;
 };
 
+typedef enum {
+  ASAP = 0,
+  ALAP = 1
+} layer_type;
+
+/*
+ * circuit stores its gates as a struct of arrays: gate g has type
+ * gate_types[g], time times[g], angles theta[g], phi[g], lambda[g], noise
+ * noise[g], and its qubits at qubits[qubit_start[g]]. The qubits of all
+ * gates share one arena. The arrays grow by doubling, so a circuit has no
+ * size limit and adding a gate does not allocate. _circuit_gate gives
+ * gate g as a quantum_gate_struct whose qubit_numbers point into the arena
+ * (valid until the circuit grows).
+ */
 typedef struct circuit{
-  PetscInt num_gates,gate_list_size,current_gate;
-  PetscReal start_time;
-  struct quantum_gate_struct *gate_list;
+  PetscInt   num_gates,gate_list_size,current_gate;
+  PetscInt   num_qubit_entries,qubit_arena_size;
+  PetscReal  start_time;
+  gate_type  *gate_types;
+  PetscReal  *times,*theta,*phi,*lambda;
+  gate_noise *noise;
+  PetscInt   *qubit_start;
+  int        *qubits;
 } circuit;
 
+/*
+ * circuit_dag is the dependency graph of a circuit: a gate depends on the
+ * last earlier gate (in circuit order) on each of its qubits. asap and
+ * alap are the earliest and latest layer of each gate; num_layers is the
+ * depth. The predecessors of gate g are preds[pred_start[g]..pred_start[g+1]).
+ */
+typedef struct circuit_dag{
+  PetscInt num_gates,num_layers;
+  PetscInt *pred_start,*preds;
+  PetscInt *asap,*alap;
+} circuit_dag;
+
 
 PetscScalar _get_val_in_subspace_gate(PetscInt,gate_type,PetscInt,PetscInt*,PetscInt*);
 void add_gate(PetscReal,gate_type,...);
 void _construct_gate_mat(gate_type,int*,Mat);
 void _apply_gate(struct quantum_gate_struct,Vec);
 void _change_basis_ij_pair(PetscInt*,PetscInt*,PetscInt,PetscInt);
-PetscErrorCode _QG_EventFunction(TS,PetscReal,Vec,PetscScalar*,void*);
-PetscErrorCode _QG_PostEventFunction(TS,PetscInt,PetscInt [],PetscReal,Vec,PetscBool,void*);
+int _gate_next_time(PetscReal*);
+void _apply_gates(PetscReal,Vec);
 
-PetscErrorCode _QC_EventFunction(TS,PetscReal,Vec,PetscScalar*,void*);
-PetscErrorCode _QC_PostEventFunction(TS,PetscInt,PetscInt [],PetscReal,Vec,PetscBool,void*);
+int _circuit_next_gate_time(PetscReal*);
+void _apply_circuit_gates(PetscReal,Vec);
 
 void create_circuit(circuit*,PetscInt);
+void destroy_circuit(circuit*);
 void add_gate_to_circuit(circuit*,PetscReal,gate_type,...);
+PetscInt _circuit_append(circuit*,PetscReal,gate_type,int,int[],PetscReal,PetscReal,PetscReal);
+struct quantum_gate_struct _circuit_gate(circuit,PetscInt);
 void add_circuit_to_circuit(circuit*,circuit,PetscReal);
 void start_circuit_at_time(circuit*,PetscReal);
+void _destroy_circuit_list();
+void optimize_subsystem_order(PetscInt,operator[]);
+void add_noise_to_last_gate(circuit*,noise_type,PetscReal);
+void add_noise_to_circuit(circuit*,noise_type,PetscReal);
+void apply_circuit(circuit,Vec);
+void create_circuit_dag(circuit_dag*,circuit);
+void destroy_circuit_dag(circuit_dag*);
+void layer_circuit(circuit*,layer_type,PetscReal,PetscInt*);
+void _apply_gate_noise(struct quantum_gate_struct,Vec);
+void _get_noise_superop(gate_noise,PetscScalar[4][4]);
+void _apply_qubit_channel(PetscInt,PetscScalar[4][4],Vec);
 
 void _get_val_j_from_global_i_gates(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
 void combine_circuit_to_mat(Mat*,circuit);
@@ -82,6 +145,8 @@ void U3_get_val_j_from_global_i(PetscInt,struct quantum_gate_struct,PetscInt*,Pe
 
 struct quantum_gate_struct _quantum_gate_list[MAX_GATES];
 extern int _num_quantum_gates;
+extern int _current_gate;
+extern int _current_circuit;
 extern int _min_gate_enum; // Minimum gate enumeration number
 extern int _gate_array_initialized;
 void (*_get_val_j_functions_gates[MAX_GATES])(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
@@ -7,13 +7,20 @@
 #include "dm_utilities.h"
 #include "quantum_gates.h"
 #include "error_correction.h"
+#include "symmetry.h"
+#include "tensor_pc.h"
+#include "event_scheduler.h"
 #include <stdlib.h>
 #include <stdio.h>
+#if defined(QUAC_USE_SLEPC)
+#include <slepceps.h>
+#endif
 
 static PetscReal default_rtol     = 1e-11;
 static PetscInt  default_restart  = 100;
-static int       stab_added       = 0;
-static int       matrix_assembled = 0;
+int              stab_added       = 0;
+int              matrix_assembled = 0;
+int              _eigen_steady_state = 0;
 
 
 PetscErrorCode _RHS_time_dep_ham(TS,PetscReal,Vec,Mat,Mat,void*); // Move to header?
@@ -24,38 +31,144 @@ void          *_tsctx;
 PetscErrorCode _Normalize_EventFunction(TS,PetscReal,Vec,PetscScalar*,void*);
 PetscErrorCode _Normalize_PostEventFunction(TS,PetscInt,PetscInt[],PetscReal,Vec,void*);
 /*
- * steady_state solves for the steady_state of the system
- * that was previously setup using the add_to_ham and add_lin
- * routines. Solver selection and parameterscan be controlled via PETSc
- * command line options.
+ * use_eigen_steady_state tells steady_state to find the steady state as
+ * the null vector of the Liouvillian, using a SLEPc shift-invert eigen
+ * solve, rather than adding a stabilization row to full_A. full_A is
+ * never modified, so no dense row ends up on the first core. Requires
+ * QuaC to be built with SLEPc. Can also be turned on with the command
+ * line option -quac_eigen_steady_state.
  */
-void steady_state(Vec x){
-  PetscViewer    mat_view;
-  PC             pc;
-  Vec            b;
-  KSP            ksp; /* linear solver context */
-  PetscInt       row,col,its,j,i,Istart,Iend;
-  PetscScalar    mat_tmp;
-  long           dim;
-  int            num_pop;
-  double         *populations;
-  Mat            solve_A;
+void use_eigen_steady_state(){
+  _eigen_steady_state = 1;
+  return;
+}
 
-  if (_lindblad_terms) {
-    dim = total_levels*total_levels;
-    solve_A = full_A;
-    if (nid==0) {
-      printf("Lindblad terms found, using Lindblad solver.");
-    }
+/*
+ * _steady_state_eigen solves L x = 0 for the steady state. The eigenvalue
+ * of L closest to a small shift below 0 is the steady state's 0; with
+ * shift-invert it is the dominant one, so it converges in a few
+ * iterations. L minus the shift is nearly singular, so the inner solves
+ * use a direct LU (MUMPS in parallel); iterative inner solves stall on
+ * it. Everything can be changed with -eps_* and -st_* options (e.g.,
+ * -quac_eigen_shift to change the shift).
+ * Inputs:
+ *        Vec x: created with create_full_dm
+ * Outputs:
+ *        Vec x: the steady state, normalized to trace 1
+ */
+static void _steady_state_eigen(Vec x){
+#if defined(QUAC_USE_SLEPC)
+  EPS         eps;
+  ST          st;
+  KSP         ksp;
+  PC          pc;
+  PetscInt    i,Istart,Iend,nconv,its;
+  PetscScalar mat_tmp,eigenvalue,trace;
+  PetscReal   norm,shift;
+
+  /*
+   * Explicitly add 0.0 to all diagonal elements, for the
+   * shifted solves and to keep PETSc happy.
+   */
+  MatGetOwnershipRange(full_A,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    mat_tmp = 0 + 0.*PETSC_i;
+    _coo_mat_add_value(full_A,i,i,mat_tmp);
+  }
+  _coo_assemble_mat(full_A);
+  MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
+  if (nid==0) printf("Matrix Assembled.\n");
+
+  /* Shift slightly into the stable half plane, relative to the size of L */
+  MatNorm(full_A,NORM_INFINITY,&norm);
+  shift = -1e-8*norm;
+  PetscOptionsGetReal(NULL,NULL,"-quac_eigen_shift",&shift,NULL);
+
+  EPSCreate(quac_comm,&eps);
+  EPSSetOperators(eps,full_A,NULL);
+  EPSSetProblemType(eps,EPS_NHEP);
+  EPSSetDimensions(eps,1,PETSC_DEFAULT,PETSC_DEFAULT);
+  EPSSetWhichEigenpairs(eps,EPS_TARGET_MAGNITUDE);
+  EPSSetTarget(eps,shift);
+  EPSSetTolerances(eps,default_rtol,PETSC_DEFAULT);
+
+  EPSGetST(eps,&st);
+  STSetType(st,STSINVERT);
+  STGetKSP(st,&ksp);
+  KSPGetPC(ksp,&pc);
+#if defined(PETSC_HAVE_MUMPS)
+  KSPSetType(ksp,KSPPREONLY);
+  PCSetType(pc,PCLU);
+  if (np>1) PCFactorSetMatSolverType(pc,MATSOLVERMUMPS);
+#else
+  if (np==1){
+    KSPSetType(ksp,KSPPREONLY);
+    PCSetType(pc,PCLU);
   } else {
-    if (nid==0) {
-      printf("Warning! Steady state not supported for Schrodinger.\n");
-      printf("         Defaulting to (less efficient) Lindblad Solver\n");
+    if (nid==0){
+      printf("Warning! PETSc was built without MUMPS, so the eigen steady state\n");
+      printf("         uses GMRES/ASM inner solves, which can converge slowly.\n");
+    }
+    KSPSetType(ksp,KSPGMRES);
+    KSPGMRESSetRestart(ksp,default_restart);
+    KSPSetTolerances(ksp,default_rtol,PETSC_DEFAULT,PETSC_DEFAULT,PETSC_DEFAULT);
+    PCSetType(pc,PCASM);
+  }
+#endif
+
+  /* Start from the maximally mixed state */
+  VecSet(x,0.0);
+  MatGetOwnershipRange(full_A,&Istart,&Iend);
+  for (i=0;i<total_levels;i++){
+    if (i*(total_levels+1)>=Istart&&i*(total_levels+1)<Iend){
+      VecSetValue(x,i*(total_levels+1),1.0/total_levels,INSERT_VALUES);
+    }
+  }
+  VecAssemblyBegin(x);
+  VecAssemblyEnd(x);
+  EPSSetInitialSpace(eps,1,&x);
+
+  EPSSetFromOptions(eps);
+  if (nid==0) printf("EPS set. Solving for steady state...\n");
+  EPSSolve(eps);
+
+  EPSGetConverged(eps,&nconv);
+  if (nconv<1){
+    if (nid==0){
+      printf("ERROR! Eigen steady state solve did not converge!\n");
       exit(0);
     }
-    dim = total_levels*total_levels;
-    solve_A = ham_A;
   }
+  EPSGetEigenpair(eps,0,&eigenvalue,NULL,x,NULL);
+  EPSGetIterationNumber(eps,&its);
+  PetscPrintf(quac_comm,"Iterations %D, eigenvalue %e %e\n",its,
+              (double)PetscRealPart(eigenvalue),(double)PetscImaginaryPart(eigenvalue));
+
+  /* The eigenvector has arbitrary norm and phase; fix the trace to 1 */
+  trace_dm(&trace,x);
+  VecScale(x,1.0/trace);
+
+  EPSDestroy(&eps);
+#else
+  if (nid==0){
+    printf("ERROR! use_eigen_steady_state requires QuaC to be built with SLEPc!\n");
+    exit(0);
+  }
+#endif
+  return;
+}
+
+/*
+ * _steady_state_prepare adds the stabilization row to full_A (once),
+ * adds 0.0 to the diagonal, and assembles full_A for the linear
+ * steady state solve. Later calls only rebuild values that changed
+ * (e.g., through update_term_coefficient).
+ */
+static void _steady_state_prepare(){
+  PetscInt    row,col,i,j,Istart,Iend;
+  PetscScalar mat_tmp;
+
   if (!stab_added){
     if (nid==0) printf("Adding stabilization...\n");
     /*
@@ -68,7 +181,7 @@ void steady_state(Vec x){
       for (i=0;i<total_levels;i++){
         col = i*(total_levels+1);
         mat_tmp = 1.0 + 0.*PETSC_i;
-        MatSetValue(full_A,row,col,mat_tmp,ADD_VALUES);
+        _coo_mat_add_value(full_A,row,col,mat_tmp);
       }
 
       /* Print dense ham, if it was asked for */
@@ -96,28 +209,159 @@ void steady_state(Vec x){
     stab_added = 1;
   }
 
-  //  if (!matrix_assembled) {
-    MatGetOwnershipRange(full_A,&Istart,&Iend);
-    /*
-     * Explicitly add 0.0 to all diagonal elements;
-     * this fixes a 'matrix in wrong state' message that PETSc
-     * gives if the diagonal was never initialized.
-     */
-    if (nid==0) printf("Adding 0 to diagonal elements...\n");
-    for (i=Istart;i<Iend;i++){
-      mat_tmp = 0 + 0.*PETSC_i;
-      MatSetValue(full_A,i,i,mat_tmp,ADD_VALUES);
+  MatGetOwnershipRange(full_A,&Istart,&Iend);
+  /*
+   * Explicitly add 0.0 to all diagonal elements;
+   * this fixes a 'matrix in wrong state' message that PETSc
+   * gives if the diagonal was never initialized.
+   */
+  if (nid==0) printf("Adding 0 to diagonal elements...\n");
+  for (i=Istart;i<Iend;i++){
+    mat_tmp = 0 + 0.*PETSC_i;
+    _coo_mat_add_value(full_A,i,i,mat_tmp);
+  }
+
+  /* Tell PETSc to assemble the matrix */
+  _coo_assemble_mat(full_A);
+  MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
+  if (nid==0) printf("Matrix Assembled.\n");
+  matrix_assembled = 1;
+  return;
+}
+
+/*
+ * _print_steady_populations prints the populations of the steady state x
+ */
+static void _print_steady_populations(Vec x){
+  int    i,num_pop;
+  double *populations;
+
+  num_pop = get_num_populations();
+  populations = malloc(num_pop*sizeof(double));
+  get_populations(x,&populations);
+  if(nid==0){
+    printf("Final populations: ");
+    for(i=0;i<num_pop;i++){
+      printf(" %e ",populations[i]);
     }
+    printf("\n");
+  }
+  free(populations);
+  return;
+}
 
+/*
+ * _steady_state_permutation solves for the steady state in the
+ * permutation invariant basis (see use_permutation_symmetry), with the
+ * same stabilization and solver defaults as steady_state
+ */
+static void _steady_state_permutation(Vec x){
+  Mat      A;
+  Vec      b;
+  KSP      ksp;
+  PC       pc;
+  PetscInt its;
+
+  _permutation_build_mat(&A,1);
+  MatCreateVecs(A,NULL,&b);
+  VecSet(b,0.0);
+  VecSet(x,0.0);
+  if (nid==0){
+    VecSetValue(x,0,1.0,INSERT_VALUES);
+    VecSetValue(b,0,1.0,INSERT_VALUES);
+  }
+  VecAssemblyBegin(x);
+  VecAssemblyEnd(x);
+  VecAssemblyBegin(b);
+  VecAssemblyEnd(b);
+
+  KSPCreate(quac_comm,&ksp);
+  KSPSetOperators(ksp,A,A);
+  KSPSetTolerances(ksp,default_rtol,PETSC_DEFAULT,PETSC_DEFAULT,PETSC_DEFAULT);
+  KSPGetPC(ksp,&pc);
+  PCSetType(pc,PCASM);
+  KSPSetType(ksp,KSPGMRES);
+  KSPGMRESSetRestart(ksp,default_restart);
+  KSPSetFromOptions(ksp);
+
+  if (nid==0) printf("KSP set. Solving for steady state...\n");
+  KSPSolve(ksp,b,x);
+  _print_steady_populations(x);
+  KSPGetIterationNumber(ksp,&its);
+  PetscPrintf(quac_comm,"Iterations %D\n",its);
+
+  KSPDestroy(&ksp);
+  VecDestroy(&b);
+  MatDestroy(&A);
+  return;
+}
+
+/*
+ * steady_state solves for the steady_state of the system
+ * that was previously setup using the add_to_ham and add_lin
+ * routines. Solver selection and parameterscan be controlled via PETSc
+ * command line options.
+ */
+void steady_state(Vec x){
+  PetscViewer    mat_view;
+  PC             pc;
+  Vec            b;
+  KSP            ksp; /* linear solver context */
+  PetscInt       row,its;
+  PetscScalar    mat_tmp;
+  long           dim;
+  Mat            solve_A;
+  Vec            x_sub,b_sub;
+  int            reduced;
+  symmetry_reduction reduction;
+  PetscBool      eigen_flag,tensor_flag;
+
+  if (_lindblad_terms) {
+    dim = total_levels*total_levels;
+    solve_A = full_A;
+    if (nid==0) {
+      printf("Lindblad terms found, using Lindblad solver.");
+    }
+  } else {
+    if (nid==0) {
+      printf("Warning! Steady state not supported for Schrodinger.\n");
+      printf("         Defaulting to (less efficient) Lindblad Solver\n");
+      exit(0);
+    }
+    dim = total_levels*total_levels;
+    solve_A = ham_A;
+  }
+  if (_stiff_solver){
+    if (nid==0){
+      printf("ERROR! steady_state does not support stiff terms.\n");
+      printf("       Add them with add_to_ham or add_lin instead.\n");
+      exit(0);
+    }
+  }
+  if (_permutation_reduce){
+    _steady_state_permutation(x);
+    return;
+  }
+  PetscOptionsHasName(NULL,NULL,"-quac_eigen_steady_state",&eigen_flag);
+  if (eigen_flag) _eigen_steady_state = 1;
+  if (_eigen_steady_state){
+    if (stab_added){
+      if (nid==0){
+        printf("Warning! full_A still has the stabilization row of an earlier steady_state;\n");
+        printf("         taking it out for the eigen steady state.\n");
+      }
+      _remove_stabilization();
+    }
+    _steady_state_eigen(x);
+    _print_steady_populations(x);
+    return;
+  }
+
+  _steady_state_prepare();
 
-    /* Tell PETSc to assemble the matrix */
-    MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
-    MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
-    if (nid==0) printf("Matrix Assembled.\n");
-    matrix_assembled = 1;
-    //  }
   /* Print information about the matrix. */
-  PetscViewerASCIIOpen(PETSC_COMM_WORLD,NULL,&mat_view);
+  PetscViewerASCIIOpen(quac_comm,NULL,&mat_view);
   PetscViewerPushFormat(mat_view,PETSC_VIEWER_ASCII_INFO);
   MatView(full_A,mat_view);
   PetscViewerPopFormat(mat_view);
@@ -129,7 +373,7 @@ void steady_state(Vec x){
    * dimension; the parallel partitioning is determined at runtime.
    * - Note: We form 1 vector from scratch and then duplicate as needed.
    */
-  VecCreate(PETSC_COMM_WORLD,&b);
+  VecCreate(quac_comm,&b);
   VecSetSizes(b,PETSC_DECIDE,dim);
   VecSetFromOptions(b);
 
@@ -156,6 +400,18 @@ void steady_state(Vec x){
   VecAssemblyBegin(b);
   VecAssemblyEnd(b);
 
+  /*
+   * If there is a symmetry (conserved excitation number, or identical
+   * subsystems), solve only on the reduced system. Both keep the
+   * populations and the stabilization row.
+   */
+  reduced = _symmetry_reduce_system(full_A,x,1,1,&reduction);
+  if (reduced){
+    MatCreateVecs(reduction.A,&x_sub,&b_sub);
+    _symmetry_restrict(&reduction,x,x_sub);
+    _symmetry_restrict(&reduction,b,b_sub);
+  }
+
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*
      *           Create the linear solver and set various options         *
      *- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
@@ -163,13 +419,17 @@ void steady_state(Vec x){
   /*
    * Create linear solver context
    */
-  KSPCreate(PETSC_COMM_WORLD,&ksp);
+  KSPCreate(quac_comm,&ksp);
 
   /*
    * Set operators. Here the matrix that defines the linear system
    * also serves as the preconditioning matrix.
    */
-  KSPSetOperators(ksp,full_A,full_A);
+  if (reduced){
+    KSPSetOperators(ksp,reduction.A,reduction.A);
+  } else {
+    KSPSetOperators(ksp,full_A,full_A);
+  }
 
   /*
    * Set good default options for solver
@@ -177,9 +437,18 @@ void steady_state(Vec x){
   /* relative tolerance */
   KSPSetTolerances(ksp,default_rtol,PETSC_DEFAULT,PETSC_DEFAULT,PETSC_DEFAULT);
 
-  /* bjacobi preconditioner */
+  /*
+   * ASM preconditioner, or the Kronecker structured one if asked for
+   * (it needs the full, unreduced Liouvillian)
+   */
   KSPGetPC(ksp,&pc);
-  PCSetType(pc,PCASM);
+  PetscOptionsHasName(NULL,NULL,"-quac_tensor_pc",&tensor_flag);
+  if (tensor_flag) _tensor_pc = 1;
+  if (_tensor_pc&&!reduced){
+    _set_tensor_pc(pc,full_A);
+  } else {
+    PCSetType(pc,PCASM);
+  }
 
   /* gmres solver with 100 restart*/
   KSPSetType(ksp,KSPGMRES);
@@ -194,80 +463,312 @@ void steady_state(Vec x){
                       Solve the linear system
      - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
   if (nid==0) printf("KSP set. Solving for steady state...\n");
-  KSPSolve(ksp,b,x);
-
-  num_pop = get_num_populations();
-  populations = malloc(num_pop*sizeof(double));
-  get_populations(x,&populations);
-  if(nid==0){
-    printf("Final populations: ");
-    for(i=0;i<num_pop;i++){
-      printf(" %e ",populations[i]);
-    }
-    printf("\n");
+  if (reduced){
+    KSPSolve(ksp,b_sub,x_sub);
+    _symmetry_expand(&reduction,x_sub,x);
+    VecDestroy(&x_sub);
+    VecDestroy(&b_sub);
+  } else {
+    KSPSolve(ksp,b,x);
   }
 
+  _print_steady_populations(x);
+
   KSPGetIterationNumber(ksp,&its);
 
-  PetscPrintf(PETSC_COMM_WORLD,"Iterations %D\n",its);
+  PetscPrintf(quac_comm,"Iterations %D\n",its);
 
   /* Free work space */
   KSPDestroy(&ksp);
   //  VecDestroy(&x);
   VecDestroy(&b);
+  _symmetry_destroy(&reduction);
 
   return;
 }
 
 /*
- * time_step solves for the time_dependence of the system
- * that was previously setup using the add_to_ham and add_lin
- * routines. Solver selection and parameters can be controlled via PETSc
- * command line options. Default solver is TSRK3BS
- *
+ * create_steady_state_continuation sets up a continuation for a sequence
+ * of steady state solves of the same system at nearby parameter values
+ * (e.g., a drive strength changed with update_term_coefficient between
+ * calls). The KSP, its preconditioner, and the previous solutions are
+ * kept alive between calls to steady_state_continue.
  * Inputs:
- *       Vec     x:       The density matrix, with appropriate inital conditions
- *       double dt:       initial timestep. For certain explicit methods, this timestep
- *                        can be changed, as those methods have adaptive time steps
- *       double time_max: the maximum time to integrate to
- *       int steps_max:   max number of steps to take
+ *        int extrapolate: if 1, start from the linear extrapolation of the
+ *                         last two steady states, rather than the last one
+ *        int recycle:     if 1, recycle Krylov subspaces between solves
+ *                         (GCRO-DR, requires PETSc built with HPDDM)
+ * Outputs:
+ *        steady_state_continuation *cont: new continuation
  */
-void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,PetscInt steps_max){
+void create_steady_state_continuation(steady_state_continuation *cont,int extrapolate,int recycle){
+  steady_state_continuation temp;
+  PC        pc;
+  PetscBool flag,set_recycle=PETSC_FALSE;
+
+  temp = malloc(sizeof(struct steady_state_continuation_struct));
+  temp->extrapolate = extrapolate;
+  temp->recycle     = recycle;
+  temp->num_solves  = 0;
+  temp->x_prev      = NULL;
+  temp->x_prev2     = NULL;
+  temp->b           = NULL;
+
+  PetscOptionsHasName(NULL,NULL,"-quac_continuation_extrapolate",&flag);
+  if (flag) temp->extrapolate = 1;
+  PetscOptionsHasName(NULL,NULL,"-quac_continuation_recycle",&flag);
+  if (flag) temp->recycle = 1;
+
+  KSPCreate(quac_comm,&temp->ksp);
+  KSPSetTolerances(temp->ksp,default_rtol,PETSC_DEFAULT,PETSC_DEFAULT,PETSC_DEFAULT);
+  KSPGetPC(temp->ksp,&pc);
+  PCSetType(pc,PCASM);
+  if (temp->recycle){
+#if defined(PETSC_HAVE_HPDDM)
+    KSPSetType(temp->ksp,KSPHPDDM);
+    KSPHPDDMSetType(temp->ksp,KSP_HPDDM_TYPE_GCRODR);
+    /*
+     * The number of recycled vectors is only an option; it is set for
+     * this KSP's KSPSetFromOptions and taken out again below, so that
+     * other KSPs do not see it
+     */
+    PetscOptionsHasName(NULL,NULL,"-ksp_hpddm_recycle",&flag);
+    if (!flag){
+      PetscOptionsSetValue(NULL,"-ksp_hpddm_recycle","20");
+      set_recycle = PETSC_TRUE;
+    }
+#else
+    if (nid==0){
+      printf("Warning! Krylov recycling requires PETSc built with HPDDM.\n");
+      printf("         Continuing without recycling.\n");
+    }
+    temp->recycle = 0;
+#endif
+  }
+  if (!temp->recycle){
+    KSPSetType(temp->ksp,KSPGMRES);
+    KSPGMRESSetRestart(temp->ksp,default_restart);
+  }
+  /* The previous steady state (or extrapolation) is the initial guess */
+  KSPSetInitialGuessNonzero(temp->ksp,PETSC_TRUE);
+  /*
+   * The preconditioner is rebuilt whenever the matrix values change;
+   * -quac_continuation_reuse_pc keeps the one built at the first point
+   */
+  PetscOptionsHasName(NULL,NULL,"-quac_continuation_reuse_pc",&flag);
+  if (flag) KSPSetReusePreconditioner(temp->ksp,PETSC_TRUE);
+  KSPSetFromOptions(temp->ksp);
+  if (set_recycle) PetscOptionsClearValue(NULL,"-ksp_hpddm_recycle");
+
+  *cont = temp;
+  return;
+}
+
+/*
+ * steady_state_continue solves for the steady state of the current system,
+ * starting from the steady state(s) of the previous call(s) on cont.
+ * The system must keep its operators and nonzero pattern between calls;
+ * only values (e.g., through update_term_coefficient) may change.
+ * Symmetry reductions and the eigen solver are not used here.
+ * Inputs:
+ *        steady_state_continuation cont: from create_steady_state_continuation
+ *        PetscReal param: the value of the continuation parameter at this
+ *                         point (only used for the extrapolation)
+ *        Vec x:           created with create_full_dm
+ * Outputs:
+ *        Vec x: the steady state
+ */
+void steady_state_continue(steady_state_continuation cont,PetscReal param,Vec x){
+  PetscInt    its;
+  PetscScalar alpha;
+  Vec         tmp;
+
+  if (!_lindblad_terms||_stiff_solver||_permutation_reduce){
+    if (nid==0){
+      printf("ERROR! steady_state_continue requires Lindblad terms, no stiff terms,\n");
+      printf("       and the full Liouvillian (no use_permutation_symmetry)!\n");
+      exit(0);
+    }
+  }
+
+  /*
+   * The stabilization row and the diagonal go in once, at the first
+   * point; after that only the changed values are rebuilt
+   */
+  if (cont->num_solves==0||!stab_added){
+    _steady_state_prepare();
+  } else {
+    _coo_assemble_mat(full_A);
+    MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
+  }
+
+  if (cont->num_solves==0){
+    /* Same rhs and first guess as steady_state */
+    MatCreateVecs(full_A,&cont->x_prev,&cont->b);
+    VecDuplicate(cont->x_prev,&cont->x_prev2);
+    VecSet(cont->b,0.0);
+    VecSet(x,0.0);
+    if (nid==0){
+      VecSetValue(cont->b,0,1.0,INSERT_VALUES);
+      VecSetValue(x,0,1.0,INSERT_VALUES);
+    }
+    VecAssemblyBegin(cont->b);
+    VecAssemblyEnd(cont->b);
+    VecAssemblyBegin(x);
+    VecAssemblyEnd(x);
+    KSPSetOperators(cont->ksp,full_A,full_A);
+  } else if (cont->extrapolate&&cont->num_solves>1&&cont->p_prev!=cont->p_prev2){
+    /* x = x_prev + (param - p_prev)/(p_prev - p_prev2) * (x_prev - x_prev2) */
+    alpha = (param - cont->p_prev)/(cont->p_prev - cont->p_prev2);
+    VecCopy(cont->x_prev,x);
+    VecScale(x,1.0+alpha);
+    VecAXPY(x,-alpha,cont->x_prev2);
+  } else {
+    VecCopy(cont->x_prev,x);
+  }
+
+  if (nid==0) printf("Solving for steady state (continuation point %d)...\n",cont->num_solves);
+  KSPSolve(cont->ksp,cont->b,x);
+  KSPGetIterationNumber(cont->ksp,&its);
+  PetscPrintf(quac_comm,"Iterations %D\n",its);
+  _print_steady_populations(x);
+
+  /* Shift the history */
+  tmp           = cont->x_prev2;
+  cont->x_prev2 = cont->x_prev;
+  cont->x_prev  = tmp;
+  VecCopy(x,cont->x_prev);
+  cont->p_prev2 = cont->p_prev;
+  cont->p_prev  = param;
+  cont->num_solves++;
+  return;
+}
+
+/*
+ * destroy_steady_state_continuation frees the KSP and stored solutions
+ */
+void destroy_steady_state_continuation(steady_state_continuation *cont){
+
+  KSPDestroy(&(*cont)->ksp);
+  if ((*cont)->x_prev!=NULL){
+    VecDestroy(&(*cont)->x_prev);
+    VecDestroy(&(*cont)->x_prev2);
+    VecDestroy(&(*cont)->b);
+  }
+  free(*cont);
+  *cont = NULL;
+  return;
+}
+
+/*
+ * _IMEX_IFunction is the implicit part of the IMEX time step,
+ * F = Udot - S U, for the stiff part S of the operator
+ */
+PetscErrorCode _IMEX_IFunction(TS ts,PetscReal t,Vec U,Vec Udot,Vec F,void *ctx){
+  imex_ctx *ictx = (imex_ctx*) ctx;
+
+  MatMult(ictx->S,U,F);
+  VecAYPX(F,-1.0,Udot);
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _IMEX_IJacobian is the Jacobian of _IMEX_IFunction, J = shift I - S.
+ * It is only rebuilt when the shift (i.e., the step size) changes, so
+ * the factorization or preconditioner of J is reused otherwise.
+ */
+PetscErrorCode _IMEX_IJacobian(TS ts,PetscReal t,Vec U,Vec Udot,PetscReal shift,Mat J,Mat P,void *ctx){
+  imex_ctx *ictx = (imex_ctx*) ctx;
+
+  if (shift!=ictx->shift){
+    MatCopy(ictx->S,J,SAME_NONZERO_PATTERN);
+    MatScale(J,-1.0);
+    MatShift(J,shift);
+    ictx->shift = shift;
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _remove_stabilization takes the stabilization row added by steady_state
+ * back out of full_A, if it is there, so that full_A is the Liouvillian
+ * again. A later steady_state adds it back.
+ */
+void _remove_stabilization(){
+  PetscInt    i,row,col;
+  PetscScalar mat_tmp;
+
+  if (stab_added){
+    if (nid==0) printf("Removing stabilization...\n");
+    /*
+     * We add 1.0 in the 0th spot and every n+1 after
+     */
+    if (nid==0) {
+      row = 0;
+      for (i=0;i<total_levels;i++){
+        col = i*(total_levels+1);
+        mat_tmp = -1.0 + 0.*PETSC_i;
+        _coo_mat_add_value(full_A,row,col,mat_tmp);
+      }
+    }
+    stab_added = 0;
+  }
+  return;
+}
+
+/*
+ * quac_integrator_create sets up a time integrator for the system
+ * that was previously setup using the add_to_ham and add_lin routines.
+ * The operator is assembled, and the TS, event handlers, monitor, and
+ * any symmetry reduction are created once, so that repeated calls to
+ * quac_integrator_advance only integrate. The time step monitor (and its
+ * context) set with set_ts_monitor* when this is called is used for all
+ * advances. Solver selection and parameters can be controlled via PETSc
+ * command line options. Default solver is TSRK3BS.
+ * Inputs:
+ *        Vec x: the initial state, only used to look for a symmetry
+ *               reduction (the integrator can then only advance states
+ *               in the same symmetry block). Pass NULL to never reduce.
+ * Outputs:
+ *        quac_integrator *integ: new integrator
+ */
+void quac_integrator_create(quac_integrator *integ,Vec x){
+  quac_integrator temp;
   PetscViewer    mat_view;
   TS             ts; /* timestepping context */
-  PetscInt       i,j,Istart,Iend,steps,row,col;
+  PetscInt       i,j,Istart,Iend;
   PetscScalar    mat_tmp;
   PetscReal      tmp_real;
-  Mat            AA;
-  PetscInt       nevents,direction;
-  PetscBool      terminate;
-  operator       op;
-  int            num_pop;
-  double         *populations;
   Mat            solve_A,solve_stiff_A;
 
+  temp = malloc(sizeof(struct quac_integrator_struct));
+  temp->permutation = _permutation_reduce;
 
-  PetscLogStagePop();
-  PetscLogStagePush(solve_stage);
-  if (_lindblad_terms) {
+  if (temp->permutation){
+    /* The Liouvillian is built in the permutation invariant basis, x's basis */
+    if (_num_scheduled_sources()>0){
+      if (nid==0){
+        printf("ERROR! Gates, circuits, error correction and timed actions act on the\n");
+        printf("       full dm, so they can not be used with use_permutation_symmetry!\n");
+        exit(0);
+      }
+    }
+    _permutation_build_mat(&temp->AA,0);
+    solve_A = temp->AA;
+    solve_stiff_A = NULL;
+  } else if (_lindblad_terms) {
     if (nid==0) {
       printf("Lindblad terms found, using Lindblad solver.\n");
     }
     solve_A = full_A;
-    if (_stiff_solver) {
-      if(nid==0) printf("ERROR! Lindblad-stiff solver untested.");
-      exit(0);
-    }
+    solve_stiff_A = full_stiff_A;
   } else {
     if (nid==0) {
       printf("No Lindblad terms found, using (more efficient) Schrodinger solver.\n");
     }
     solve_A = ham_A;
     solve_stiff_A = ham_stiff_A;
-    if (_num_time_dep&&_stiff_solver) {
-      if(nid==0) printf("ERROR! Schrodinger-stiff + timedep solver untested.");
-      exit(0);
-    }
   }
 
   /* Possibly print dense ham. No stabilization is needed? */
@@ -295,40 +796,30 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
   }
 
 
-  /* Remove stabilization if it was previously added */
-  if (stab_added){
-    if (nid==0) printf("Removing stabilization...\n");
+  if (!temp->permutation){
+    /* Remove stabilization if it was previously added */
+    _remove_stabilization();
+
+    MatGetOwnershipRange(solve_A,&Istart,&Iend);
     /*
-     * We add 1.0 in the 0th spot and every n+1 after
+     * Explicitly add 0.0 to all diagonal elements;
+     * this fixes a 'matrix in wrong state' message that PETSc
+     * gives if the diagonal was never initialized.
      */
-    if (nid==0) {
-      row = 0;
-      for (i=0;i<total_levels;i++){
-        col = i*(total_levels+1);
-        mat_tmp = -1.0 + 0.*PETSC_i;
-        MatSetValue(full_A,row,col,mat_tmp,ADD_VALUES);
-      }
+    //if (nid==0) printf("Adding 0 to diagonal elements...\n");
+    for (i=Istart;i<Iend;i++){
+      mat_tmp = 0 + 0.*PETSC_i;
+      _coo_mat_add_value(solve_A,i,i,mat_tmp);
     }
   }
-
-  MatGetOwnershipRange(solve_A,&Istart,&Iend);
-  /*
-   * Explicitly add 0.0 to all diagonal elements;
-   * this fixes a 'matrix in wrong state' message that PETSc
-   * gives if the diagonal was never initialized.
-   */
-  //if (nid==0) printf("Adding 0 to diagonal elements...\n");
-  for (i=Istart;i<Iend;i++){
-    mat_tmp = 0 + 0.*PETSC_i;
-    MatSetValue(solve_A,i,i,mat_tmp,ADD_VALUES);
-  }
   if(_stiff_solver){
     MatGetOwnershipRange(solve_stiff_A,&Istart,&Iend);
     for (i=Istart;i<Iend;i++){
       mat_tmp = 0 + 0.*PETSC_i;
       MatSetValue(solve_stiff_A,i,i,mat_tmp,ADD_VALUES);
     }
-
+    MatAssemblyBegin(solve_stiff_A,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(solve_stiff_A,MAT_FINAL_ASSEMBLY);
   }
 
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*
@@ -338,16 +829,15 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
   /*
    * Create timestepping solver context
    */
-  TSCreate(PETSC_COMM_WORLD,&ts);
+  TSCreate(quac_comm,&ts);
   TSSetProblemType(ts,TS_LINEAR);
+  temp->ts       = ts;
+  temp->stiff    = _stiff_solver;
+  temp->time_dep = 0;
+  temp->reduced  = 0;
+  temp->reduction.type = NO_REDUCTION;
 
 
-  /*
-   * Set function to get information at every timestep
-   */
-  if (_ts_monitor!=NULL){
-    TSMonitorSet(ts,_ts_monitor,_tsctx,NULL);
-  }
   /*
    * Set up ODE system
    */
@@ -355,12 +845,17 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
   TSSetRHSFunction(ts,NULL,TSComputeRHSFunctionLinear,NULL);
 
   if(_stiff_solver) {
-    /* TSSetIFunction(ts,NULL,TSComputeRHSFunctionLinear,NULL); */
-    if (nid==0) {
-      printf("Stiff solver not implemented!\n");
-      exit(0);
-    }
-    if(nid==0) printf("Using stiff solver - TSROSW\n");
+    /*
+     * IMEX: the stiff part is the implicit IFunction, the rest stays in
+     * the explicit RHS. The implicit Jacobian only changes with the
+     * step size, so its preconditioner is reused between steps.
+     */
+    if(nid==0) printf("Using stiff solver - TSARKIMEX\n");
+    temp->imex.S     = solve_stiff_A;
+    temp->imex.shift = -1.0;
+    MatDuplicate(solve_stiff_A,MAT_COPY_VALUES,&temp->J);
+    TSSetIFunction(ts,NULL,_IMEX_IFunction,&temp->imex);
+    TSSetIJacobian(ts,temp->J,temp->J,_IMEX_IJacobian,&temp->imex);
   }
 
   if(_num_time_dep+_num_time_dep_lin) {
@@ -376,106 +871,81 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
     }
 
     /* Tell PETSc to assemble the matrix */
+    _coo_assemble_mat(solve_A);
     MatAssemblyBegin(solve_A,MAT_FINAL_ASSEMBLY);
     MatAssemblyEnd(solve_A,MAT_FINAL_ASSEMBLY);
     if (nid==0) printf("Matrix Assembled.\n");
 
-    MatDuplicate(solve_A,MAT_COPY_VALUES,&AA);
-    MatAssemblyBegin(AA,MAT_FINAL_ASSEMBLY);
-    MatAssemblyEnd(AA,MAT_FINAL_ASSEMBLY);
+    MatDuplicate(solve_A,MAT_COPY_VALUES,&temp->AA);
+    MatAssemblyBegin(temp->AA,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(temp->AA,MAT_FINAL_ASSEMBLY);
+    temp->time_dep = 1;
 
-    TSSetRHSJacobian(ts,AA,AA,_RHS_time_dep_ham_p,NULL);
+    TSSetRHSJacobian(ts,temp->AA,temp->AA,_RHS_time_dep_ham_p,NULL);
   } else {
     /* Tell PETSc to assemble the matrix */
+    _coo_assemble_mat(solve_A);
     MatAssemblyBegin(solve_A,MAT_FINAL_ASSEMBLY);
     MatAssemblyEnd(solve_A,MAT_FINAL_ASSEMBLY);
-    if (_stiff_solver){
-      MatAssemblyBegin(solve_stiff_A,MAT_FINAL_ASSEMBLY);
-      MatAssemblyEnd(solve_stiff_A,MAT_FINAL_ASSEMBLY);
-      /* TSSetIJacobian(ts,solve_stiff_A,solve_stiff_A,TSComputeRHSJacobianConstant,NULL); */
-      if (nid==0) {
-        printf("Stiff solver not implemented!\n");
-        exit(0);
-      }
-    }
     if (nid==0) printf("Matrix Assembled.\n");
-    TSSetRHSJacobian(ts,solve_A,solve_A,TSComputeRHSJacobianConstant,NULL);
+
+    /*
+     * If there is a symmetry (conserved excitation number, or identical
+     * subsystems), step only the reduced system. Gates and discrete
+     * error correction act on the full dm, so they turn the reduction off.
+     */
+    if (x!=NULL&&!_stiff_solver&&!temp->permutation&&_num_scheduled_sources()==0){
+      temp->reduced = _symmetry_reduce_system(solve_A,x,_lindblad_terms,0,&temp->reduction);
+    }
+    if (temp->reduced){
+      MatCreateVecs(temp->reduction.A,&temp->x_sub,NULL);
+      TSSetRHSJacobian(ts,temp->reduction.A,temp->reduction.A,TSComputeRHSJacobianConstant,NULL);
+    } else {
+      TSSetRHSJacobian(ts,solve_A,solve_A,TSComputeRHSJacobianConstant,NULL);
+    }
   }
 
-  /* Print information about the matrix. */
-  PetscViewerASCIIOpen(PETSC_COMM_WORLD,NULL,&mat_view);
-  PetscViewerPushFormat(mat_view,PETSC_VIEWER_ASCII_INFO);
-  /* PetscViewerPushFormat(mat_view,PETSC_VIEWER_ASCII_MATLAB); */
-  /* MatView(solve_A,mat_view); */
-
-  /* PetscInt          ncols; */
-  /* const PetscInt    *cols; */
-  /* const PetscScalar *vals; */
-
-  /* for(i=0;i<total_levels*total_levels;i++){ */
-  /*   MatGetRow(solve_A,i,&ncols,&cols,&vals); */
-  /*   for (j=0;j<ncols;j++){ */
-
-  /*     if(PetscAbsComplex(vals[j])>1e-5){ */
-  /*       printf("%d %d %lf %lf\n",i,cols[j],vals[j]); */
-  /*     } */
-  /*   } */
-  /*   MatRestoreRow(solve_A,i,&ncols,&cols,&vals); */
-  /* } */
+  /*
+   * Set function to get information at every timestep
+   */
+  if (_ts_monitor!=NULL){
+    if (temp->reduced){
+      /* The user's monitor sees the full dm */
+      temp->sym_ctx.full_x    = x;
+      temp->sym_ctx.reduction = &temp->reduction;
+      temp->sym_ctx.monitor   = _ts_monitor;
+      temp->sym_ctx.ctx       = _tsctx;
+      TSMonitorSet(ts,_symmetry_ts_monitor,&temp->sym_ctx,NULL);
+    } else {
+      TSMonitorSet(ts,_ts_monitor,_tsctx,NULL);
+    }
+  }
 
+  /* Print information about the matrix. */
   if(_stiff_solver){
+    PetscViewerASCIIOpen(quac_comm,NULL,&mat_view);
+    PetscViewerPushFormat(mat_view,PETSC_VIEWER_ASCII_INFO);
     MatView(solve_stiff_A,mat_view);
+    PetscViewerPopFormat(mat_view);
+    PetscViewerDestroy(&mat_view);
   }
-  PetscViewerPopFormat(mat_view);
-  PetscViewerDestroy(&mat_view);
-
-  TSSetTimeStep(ts,dt);
 
   /*
    * Set default options, can be changed at runtime
    */
-
-  TSSetMaxSteps(ts,steps_max);
-  TSSetMaxTime(ts,time_max);
-  TSSetTime(ts,init_time);
   TSSetExactFinalTime(ts,TS_EXACTFINALTIME_STEPOVER);
   if (_stiff_solver) {
-    TSSetType(ts,TSROSW);
+    TSSetType(ts,TSARKIMEX);
   } else {
     TSSetType(ts,TSRK);
     TSRKSetType(ts,TSRK3BS);
   }
 
-  /* If we have gates to apply, set up the event handler. */
-  if (_num_quantum_gates > 0) {
-    nevents   =  1; //Only one event for now (did we cross a gate?)
-    direction = -1; //We only want to count an event if we go from positive to negative
-    terminate = PETSC_FALSE; //Keep time stepping after we passed our event
-    /* Arguments are: ts context, nevents, direction of zero crossing, whether to terminate,
-     * a function to check event status, a function to apply events, private data context.
-     */
-    TSSetEventHandler(ts,nevents,&direction,&terminate,_QG_EventFunction,_QG_PostEventFunction,NULL);
-  }
-
-  if (_num_circuits > 0) {
-    nevents   =  1; //Only one event for now (did we cross a gate?)
-    direction = -1; //We only want to count an event if we go from positive to negative
-    terminate = PETSC_FALSE; //Keep time stepping after we passed our event
-    /* Arguments are: ts context, nevents, direction of zero crossing, whether to terminate,
-     * a function to check event status, a function to apply events, private data context.
-     */
-    TSSetEventHandler(ts,nevents,&direction,&terminate,_QC_EventFunction,_QC_PostEventFunction,NULL);
-  }
-
-  if (_discrete_ec > 0) {
-    nevents   =  1; //Only one event for now (did we cross an ec step?)
-    direction = -1; //We only want to count an event if we go from positive to negative
-    terminate = PETSC_FALSE; //Keep time stepping after we passed our event
-    /* Arguments are: ts context, nevents, direction of zero crossing, whether to terminate,
-     * a function to check event status, a function to apply events, private data context.
-     */
-    TSSetEventHandler(ts,nevents,&direction,&terminate,_DQEC_EventFunction,_DQEC_PostEventFunction,NULL);
-  }
+  /*
+   * Gates, circuits, error correction and user actions are not TS events;
+   * their times are known in advance, so quac_integrator_advance merges
+   * them into one event_scheduler and integrates exactly up to each one.
+   */
 
   /* if (_lindblad_terms) { */
   /*   nevents   =  1; //Only one event for now (did we cross a gate?) */
@@ -484,35 +954,133 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
   /*   TSSetEventHandler(ts,nevents,&direction,&terminate,_Normalize_EventFunction,_Normalize_PostEventFunction,NULL); */
   /* } */
   TSSetFromOptions(ts);
-  TSSolve(ts,x);
-  TSGetStepNumber(ts,&steps);
 
-  num_pop = get_num_populations();
-  populations = malloc(num_pop*sizeof(double));
-  get_populations(x,&populations);
-  /* if(nid==0){ */
-  /*   printf("Final populations: "); */
-  /*   for(i=0;i<num_pop;i++){ */
-  /*     printf(" %e ",populations[i]); */
-  /*   } */
-  /*   printf("\n"); */
-  /* } */
+  *integ = temp;
+  return;
+}
 
-  /* PetscPrintf(PETSC_COMM_WORLD,"Steps %D\n",steps); */
+/*
+ * quac_integrator_advance integrates x from init_time to time_max with
+ * an integrator made by quac_integrator_create. Only the integration is
+ * done; the operator, TS, and handlers are reused.
+ * Inputs:
+ *       quac_integrator integ: the integrator
+ *       Vec     x:       The density matrix, with appropriate inital conditions
+ *       double  init_time: the time x is at
+ *       double  time_max: the maximum time to integrate to
+ *       double  dt:       initial timestep. For certain explicit methods, this timestep
+ *                         can be changed, as those methods have adaptive time steps
+ *       int     steps_max: max number of steps to take
+ * Outputs:
+ *       Vec     x:       The density matrix at time_max
+ *
+ * If there are timed actions (gates, circuits, error correction, or
+ * add_timed_action), the integration is split at the times from the
+ * event_scheduler: each segment is integrated exactly to its end
+ * (TS_EXACTFINALTIME_MATCHSTEP), the actions due then are applied, and the
+ * next segment continues with the step size the adaptor last chose (the TS
+ * keeps it between solves). steps_max counts steps over all segments.
+ */
+void quac_integrator_advance(quac_integrator integ,Vec x,PetscReal init_time,PetscReal time_max,PetscReal dt,PetscInt steps_max){
+  TS ts = integ->ts;
+  TSExactFinalTimeOption final_time_option;
+  TSConvergedReason      reason;
+  PetscReal              t,t_end,event_time;
+  event_scheduler        sched;
 
-  /* Free work space */
-  TSDestroy(&ts);
-  if(_num_time_dep+_num_time_dep_lin){
-    MatDestroy(&AA);
+  TSSetTime(ts,init_time);
+  TSSetMaxTime(ts,time_max);
+  TSSetTimeStep(ts,dt);
+  TSSetStepNumber(ts,0);
+  TSSetMaxSteps(ts,steps_max);
+
+  if (integ->reduced){
+    integ->sym_ctx.full_x = x;
+    _symmetry_restrict(&integ->reduction,x,integ->x_sub);
+    TSSolve(ts,integ->x_sub);
+    _symmetry_expand(&integ->reduction,integ->x_sub,x);
+  } else if (_num_scheduled_sources()>0) {
+    _scheduler_create(&sched);
+    TSGetExactFinalTime(ts,&final_time_option);
+    t = init_time;
+    /* Actions due at (or, if never applied, before) the start act first */
+    _scheduler_fire(sched,t,x);
+    while (t<time_max){
+      if (_scheduler_next_time(sched,&event_time)&&event_time<time_max){
+        t_end = event_time;
+        TSSetExactFinalTime(ts,TS_EXACTFINALTIME_MATCHSTEP);
+      } else {
+        t_end = time_max;
+        TSSetExactFinalTime(ts,final_time_option);
+      }
+      TSSetTime(ts,t);
+      TSSetMaxTime(ts,t_end);
+      TSSolve(ts,x);
+      TSGetConvergedReason(ts,&reason);
+      if (reason==TS_CONVERGED_ITS||reason<0) break;
+      t = t_end;
+      _scheduler_fire(sched,t,x);
+    }
+    TSSetExactFinalTime(ts,final_time_option);
+    _scheduler_destroy(&sched);
+  } else {
+    TSSolve(ts,x);
   }
-  free(populations);
+  return;
+}
+
+/*
+ * quac_integrator_destroy frees an integrator
+ */
+void quac_integrator_destroy(quac_integrator *integ){
+
+  TSDestroy(&(*integ)->ts);
+  if ((*integ)->time_dep||(*integ)->permutation){
+    MatDestroy(&(*integ)->AA);
+  }
+  if ((*integ)->stiff){
+    MatDestroy(&(*integ)->J);
+  }
+  if ((*integ)->reduced){
+    VecDestroy(&(*integ)->x_sub);
+  }
+  _symmetry_destroy(&(*integ)->reduction);
+  free(*integ);
+  *integ = NULL;
+  return;
+}
+
+/*
+ * time_step solves for the time_dependence of the system
+ * that was previously setup using the add_to_ham and add_lin
+ * routines. Solver selection and parameters can be controlled via PETSc
+ * command line options. Default solver is TSRK3BS. For repeated
+ * integrations of the same system, use quac_integrator_create/advance/destroy
+ * directly, so that the setup is only done once.
+ *
+ * Inputs:
+ *       Vec     x:       The density matrix, with appropriate inital conditions
+ *       double dt:       initial timestep. For certain explicit methods, this timestep
+ *                        can be changed, as those methods have adaptive time steps
+ *       double time_max: the maximum time to integrate to
+ *       int steps_max:   max number of steps to take
+ */
+void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,PetscInt steps_max){
+  quac_integrator integ;
+
+  PetscLogStagePop();
+  PetscLogStagePush(solve_stage);
+
+  quac_integrator_create(&integ,x);
+  quac_integrator_advance(integ,x,init_time,time_max,dt,steps_max);
+  quac_integrator_destroy(&integ);
+
   PetscLogStagePop();
   PetscLogStagePush(post_solve_stage);
 
   return;
 }
 
-
 /*
  *
  * set_ts_monitor accepts a user function which can calculate observables, print output, etc
@@ -646,6 +1214,195 @@ PetscErrorCode _Normalize_PostEventFunction(TS ts,PetscInt nevents,PetscInt even
 
 
 
+/*
+ * _g2_block_rhs is the right hand side of the batched tau evolution:
+ * F = L X for a block of density matrices X, stored column by column
+ * (the local rows of each column contiguous) in one Vec, so that L is
+ * applied to the whole block with one MatMatMult.
+ */
+static PetscErrorCode _g2_block_rhs(TS ts,PetscReal t,Vec X,Vec F,void *ctx){
+  g2_block_ctx      *bctx = (g2_block_ctx*) ctx;
+  const PetscScalar *xa,*ya;
+  PetscScalar       *fa;
+  PetscInt          n;
+
+  VecGetLocalSize(F,&n);
+  VecGetArrayRead(X,&xa);
+  MatDensePlaceArray(bctx->X,(PetscScalar*)xa);
+  MatMatMult(bctx->L,bctx->X,MAT_REUSE_MATRIX,PETSC_DEFAULT,&bctx->Y);
+  MatDenseResetArray(bctx->X);
+  VecRestoreArrayRead(X,&xa);
+
+  VecGetArray(F,&fa);
+  MatDenseGetArrayRead(bctx->Y,&ya);
+  PetscArraycpy(fa,ya,n);
+  MatDenseRestoreArrayRead(bctx->Y,&ya);
+  VecRestoreArray(F,&fa);
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _g2_block_values adds w . x_i, for each column x_i of the block,
+ * to g2_values[first_st+i][i_tau]. Must be called from all cores.
+ */
+static void _g2_block_values(Vec block,Vec w,PetscInt n_cols,PetscInt first_st,PetscInt i_tau,PetscScalar **g2_values){
+  const PetscScalar *xa,*wa;
+  PetscScalar       *ev;
+  PetscInt          n_local,i,k;
+
+  ev = calloc(n_cols,sizeof(PetscScalar));
+  VecGetLocalSize(w,&n_local);
+  VecGetArrayRead(block,&xa);
+  VecGetArrayRead(w,&wa);
+  for (i=0;i<n_cols;i++){
+    for (k=0;k<n_local;k++){
+      ev[i] = ev[i] + wa[k]*xa[i*n_local+k];
+    }
+  }
+  VecRestoreArrayRead(w,&wa);
+  VecRestoreArrayRead(block,&xa);
+  MPI_Allreduce(MPI_IN_PLACE,ev,n_cols,MPIU_SCALAR,MPI_SUM,quac_comm);
+  for (i=0;i<n_cols;i++){
+    g2_values[first_st+i][i_tau] += ev[i];
+  }
+  free(ev);
+  return;
+}
+
+/*
+ * _g2_correlation_batched computes g2 with a single forward evolution
+ * of dm0. At each start time, the jump applied state is stored as one
+ * column of a block; once block_size columns are collected (or the
+ * start times run out), the whole block is evolved through the taus
+ * together. Requires a time independent Liouvillian, so that every
+ * start time shares the same tau evolution.
+ */
+static void _g2_correlation_batched(TSCtx *tsctx,Mat A_star_A,Vec dm0,PetscInt n_tau,PetscReal tau_max,
+                                    PetscInt n_st,PetscReal st_max,PetscInt steps_max){
+  quac_integrator integ;
+  g2_block_ctx    bctx;
+  TS              ts;
+  Vec             block,w,trace_vec,jump_dm;
+  PetscInt        i,j,k,n_local,Istart,Iend,block_size,n_cols,first_st;
+  PetscReal       st_dt,dt_tau,dt;
+  PetscScalar       *ba;
+  const PetscScalar *ja;
+
+  block_size = 64;
+  PetscOptionsGetInt(NULL,NULL,"-quac_g2_block_size",&block_size,NULL);
+  if (block_size>n_st) block_size = n_st;
+
+  /* The forward evolution; this also assembles full_A */
+  quac_integrator_create(&integ,NULL);
+
+  /*
+   * g2 at each tau is tr((I x A)^dag (I x A) x) = w . x, with
+   * w = (I x A)^T conj((I x A) t) and t the vectorized identity
+   */
+  MatCreateVecs(full_A,&w,&trace_vec);
+  VecDuplicate(w,&jump_dm);
+  VecSet(trace_vec,0.0);
+  VecGetOwnershipRange(trace_vec,&Istart,&Iend);
+  for (i=0;i<total_levels;i++){
+    k = i*(total_levels+1);
+    if (k>=Istart&&k<Iend) VecSetValue(trace_vec,k,1.0,INSERT_VALUES);
+  }
+  VecAssemblyBegin(trace_vec);
+  VecAssemblyEnd(trace_vec);
+  MatMult(tsctx->I_cross_A,trace_vec,jump_dm);
+  VecConjugate(jump_dm);
+  MatMultTranspose(tsctx->I_cross_A,jump_dm,w);
+
+  /* The block and the dense views used to apply L to it */
+  MatGetLocalSize(full_A,&n_local,NULL);
+  VecCreateMPI(quac_comm,n_local*block_size,PETSC_DETERMINE,&block);
+  bctx.L = full_A;
+  MatCreateDense(quac_comm,n_local,PETSC_DECIDE,PETSC_DETERMINE,block_size,NULL,&bctx.X);
+  MatAssemblyBegin(bctx.X,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(bctx.X,MAT_FINAL_ASSEMBLY);
+  MatMatMult(bctx.L,bctx.X,MAT_INITIAL_MATRIX,PETSC_DEFAULT,&bctx.Y);
+
+  TSCreate(quac_comm,&ts);
+  TSSetProblemType(ts,TS_LINEAR);
+  TSSetRHSFunction(ts,NULL,_g2_block_rhs,&bctx);
+  TSSetType(ts,TSRK);
+  TSRKSetType(ts,TSRK3BS);
+  TSSetExactFinalTime(ts,TS_EXACTFINALTIME_MATCHSTEP);
+  TSSetOptionsPrefix(ts,"g2_");
+  TSSetFromOptions(ts);
+
+  st_dt  = st_max/n_st;
+  dt_tau = tau_max/n_tau;
+  n_cols   = 0;
+  first_st = 1; /* Row 0 of g2_values is start time 0, which is not computed */
+  VecSet(block,0.0);
+  for (i=1;i<=n_st;i++){
+    /* Go from the previous start time to this one */
+    dt = st_dt/500; //500 is arbitrary, should be picked better
+    quac_integrator_advance(integ,dm0,(i-1)*st_dt,i*st_dt,dt,steps_max);
+
+    /* Force an 'emission' and store it as the next column */
+    MatMult(A_star_A,dm0,jump_dm);
+    VecGetArrayRead(jump_dm,&ja);
+    VecGetArray(block,&ba);
+    PetscArraycpy(ba+n_cols*n_local,ja,n_local);
+    VecRestoreArray(block,&ba);
+    VecRestoreArrayRead(jump_dm,&ja);
+    n_cols++;
+
+    if (n_cols==block_size||i==n_st){
+      /* Evolve the whole block through the taus */
+      _g2_block_values(block,w,n_cols,first_st,0,tsctx->g2_values);
+      for (j=0;j<n_tau;j++){
+        TSSetTime(ts,j*dt_tau);
+        TSSetMaxTime(ts,(j+1)*dt_tau);
+        TSSetTimeStep(ts,dt_tau);
+        TSSetStepNumber(ts,0);
+        TSSetMaxSteps(ts,steps_max);
+        TSSolve(ts,block);
+        _g2_block_values(block,w,n_cols,first_st,j+1,tsctx->g2_values);
+      }
+      first_st = i+1;
+      n_cols   = 0;
+      VecSet(block,0.0);
+    }
+  }
+
+  TSDestroy(&ts);
+  MatDestroy(&bctx.X);
+  MatDestroy(&bctx.Y);
+  VecDestroy(&block);
+  VecDestroy(&w);
+  VecDestroy(&trace_vec);
+  VecDestroy(&jump_dm);
+  quac_integrator_destroy(&integ);
+  return;
+}
+
+/*
+ * g2_correlation calculates the two time correlation function
+ * g2(t,tau) = <A^dag(t) A^dag(t+tau) A(t+tau) A(t)>, for A the sum of the
+ * given operators, at n_st start times t in (0,st_max] and n_tau+1 delays
+ * tau in [0,tau_max]. The start times are reached with one forward
+ * evolution of dm0; for a time independent system, the jump applied
+ * states are then evolved through the taus in blocks of
+ * -quac_g2_block_size (default 64) start times at a time. Systems with
+ * time dependence, gates, or error correction evolve each start time on
+ * its own, as do systems with stiff terms.
+ * Inputs:
+ *        Vec dm0:            initial density matrix
+ *        PetscInt n_tau:     number of tau steps
+ *        PetscReal tau_max:  maximum tau
+ *        PetscInt n_st:      number of start times
+ *        PetscReal st_max:   maximum start time
+ *        PetscInt number_of_ops: number of operators in A
+ *        operator op1...:    the operators (can be vecs)
+ * Outputs:
+ *        PetscScalar ***g2_values: g2_values[i][j] is g2 at start time
+ *                                  i*st_max/n_st and tau j*tau_max/n_tau
+ *                                  (allocated here)
+ *        Vec dm0:            the density matrix at st_max
+ */
 void g2_correlation(PetscScalar ***g2_values,Vec dm0,PetscInt n_tau,PetscReal tau_max,PetscInt n_st,PetscReal st_max,PetscInt number_of_ops,...){
   TSCtx tsctx;
   PetscReal st_dt,previous_start_time,this_start_time,dt;
@@ -653,7 +1410,16 @@ void g2_correlation(PetscScalar ***g2_values,Vec dm0,PetscInt n_tau,PetscReal ta
   PetscInt i,j,dim,steps_max;
   Mat A_star_A,tmp_mat;
   Vec init_dm;
+  quac_integrator integ;
   va_list ap;
+
+  if (_permutation_reduce){
+    if (nid==0){
+      printf("ERROR! g2_correlation needs the full dm, which is not built\n");
+      printf("       with use_permutation_symmetry!\n");
+      exit(0);
+    }
+  }
   /*Explicitly construct our jump matrix by adding up all of the operators
    * \rho = A \rho A^\dag
    * Vectorized:
@@ -661,7 +1427,7 @@ void g2_correlation(PetscScalar ***g2_values,Vec dm0,PetscInt n_tau,PetscReal ta
    */
   dim = total_levels*total_levels; //Assumes Lindblad
 
-  MatCreate(PETSC_COMM_WORLD,&tmp_mat);
+  MatCreate(quac_comm,&tmp_mat);
   MatSetType(tmp_mat,MATMPIAIJ);
   MatSetSizes(tmp_mat,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
   MatSetFromOptions(tmp_mat);
@@ -673,7 +1439,7 @@ void g2_correlation(PetscScalar ***g2_values,Vec dm0,PetscInt n_tau,PetscReal ta
   va_end(ap);
 
 
-  MatCreate(PETSC_COMM_WORLD,&tsctx.I_cross_A);
+  MatCreate(quac_comm,&tsctx.I_cross_A);
   MatSetType(tsctx.I_cross_A,MATMPIAIJ);
   MatSetSizes(tsctx.I_cross_A,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
   MatSetFromOptions(tsctx.I_cross_A);
@@ -687,9 +1453,6 @@ void g2_correlation(PetscScalar ***g2_values,Vec dm0,PetscInt n_tau,PetscReal ta
   //Get (A* \cross I) (I \cross A)
   MatMatMult(tmp_mat,tsctx.I_cross_A,MAT_INITIAL_MATRIX,PETSC_DEFAULT,&A_star_A);
   MatDestroy(&tmp_mat);
-  VecDuplicate(dm0,&(tsctx.tmp_dm));
-  VecDuplicate(dm0,&(tsctx.tmp_dm2));
-  VecDuplicate(dm0,&init_dm);
 
   //Arbitrary, set this better
   steps_max = 51000;
@@ -705,7 +1468,24 @@ void g2_correlation(PetscScalar ***g2_values,Vec dm0,PetscInt n_tau,PetscReal ta
   }
   tsctx.g2_values = (*g2_values);
 
+  if (_num_time_dep+_num_time_dep_lin==0&&!_stiff_solver&&_num_scheduled_sources()==0){
+    _g2_correlation_batched(&tsctx,A_star_A,dm0,n_tau,tau_max,n_st,st_max,steps_max);
+    MatDestroy(&A_star_A);
+    MatDestroy(&tsctx.I_cross_A);
+    return;
+  }
+
+  VecDuplicate(dm0,&(tsctx.tmp_dm));
+  VecDuplicate(dm0,&(tsctx.tmp_dm2));
+  VecDuplicate(dm0,&init_dm);
+
   set_ts_monitor_ctx(_g2_ts_monitor,&tsctx);
+  /*
+   * One integrator for all of the evolutions; only the integration is
+   * repeated. The jump can take the state out of dm0's symmetry block,
+   * so the integrator is not reduced.
+   */
+  quac_integrator_create(&integ,NULL);
   st_dt = st_max/n_st;
   previous_start_time = 0;
   tsctx.i_st = 0;
@@ -715,7 +1495,7 @@ void g2_correlation(PetscScalar ***g2_values,Vec dm0,PetscInt n_tau,PetscReal ta
     //Go from previous start time to this_start_time
     tsctx.tau_evolve = 0;
     dt = (this_start_time - previous_start_time)/500; //500 is arbitrary, should be picked better
-    time_step(dm0,previous_start_time,this_start_time,dt,steps_max);
+    quac_integrator_advance(integ,dm0,previous_start_time,this_start_time,dt,steps_max);
 
     //Timestep through taus
     tau_t_max = this_start_time + tau_max;
@@ -730,11 +1510,12 @@ void g2_correlation(PetscScalar ***g2_values,Vec dm0,PetscInt n_tau,PetscReal ta
     VecCopy(dm0,init_dm);
     MatMult(A_star_A,dm0,init_dm); //init_dm = A * dm0
     tsctx.i_tau = 0;
-    time_step(init_dm,this_start_time,tau_t_max,dt_tau,steps_max);
+    quac_integrator_advance(integ,init_dm,this_start_time,tau_t_max,dt_tau,steps_max);
 
     previous_start_time = this_start_time;
     tsctx.i_st = tsctx.i_st + 1;
   }
+  quac_integrator_destroy(&integ);
 
   return;
 }
@@ -3,13 +3,59 @@
 
 #include <petscksp.h>
 #include <petscts.h>
+#include "symmetry.h"
+
+/*
+ * steady_state_continuation keeps the linear solver and the last two
+ * steady states of a sequence of steady state solves
+ */
+typedef struct steady_state_continuation_struct{
+  KSP       ksp;
+  Vec       b,x_prev,x_prev2;
+  PetscReal p_prev,p_prev2;
+  int       num_solves,extrapolate,recycle;
+} *steady_state_continuation;
 
 void steady_state(Vec);
+void create_steady_state_continuation(steady_state_continuation*,int,int);
+void steady_state_continue(steady_state_continuation,PetscReal,Vec);
+void destroy_steady_state_continuation(steady_state_continuation*);
+void use_eigen_steady_state();
+/*
+ * imex_ctx holds the stiff (implicit) part of the operator for IMEX
+ * time stepping, and the shift its Jacobian was last built with
+ */
+typedef struct {
+  Mat       S;
+  PetscReal shift;
+} imex_ctx;
+
+/*
+ * quac_integrator keeps the TS, assembled operator, event handlers,
+ * and work vectors for repeated integrations of one system
+ */
+typedef struct quac_integrator_struct{
+  TS                   ts;
+  Mat                  AA;      /* time dependent or permutation symmetric operator, if any */
+  Mat                  J;       /* implicit Jacobian, if stiff */
+  Vec                  x_sub;   /* reduced state, if reduced */
+  int                  time_dep,reduced,stiff,permutation;
+  imex_ctx             imex;
+  symmetry_reduction   reduction;
+  symmetry_monitor_ctx sym_ctx;
+} *quac_integrator;
+
 void time_step(Vec,PetscReal,PetscReal,PetscReal,PetscInt);
+void quac_integrator_create(quac_integrator*,Vec);
+void quac_integrator_advance(quac_integrator,Vec,PetscReal,PetscReal,PetscReal,PetscInt);
+void quac_integrator_destroy(quac_integrator*);
 void set_ts_monitor(PetscErrorCode (*monitor)(TS,PetscInt,PetscReal,Vec,void*));
 void set_ts_monitor_ctx(PetscErrorCode (*monitor)(TS,PetscInt,PetscReal,Vec,void*),void*);
 void g2_correlation(PetscScalar ***,Vec,PetscInt,PetscReal,PetscInt,PetscReal,PetscInt,...);
 PetscErrorCode _g2_ts_monitor(TS,PetscInt,PetscReal,Vec,void*);
+void _remove_stabilization();
+PetscErrorCode _IMEX_IFunction(TS,PetscReal,Vec,Vec,Vec,void*);
+PetscErrorCode _IMEX_IJacobian(TS,PetscReal,Vec,Vec,PetscReal,Mat,Mat,void*);
 typedef struct {
   Mat I_cross_A;
   PetscInt i_tau,i_st,tau_evolve;
@@ -17,4 +63,16 @@ typedef struct {
   PetscScalar **g2_values;
 } TSCtx;
 
+/*
+ * g2_block_ctx holds the Liouvillian and the dense views of a block of
+ * density matrices, for the batched g2 tau evolution
+ */
+typedef struct {
+  Mat L,X,Y;
+} g2_block_ctx;
+
+extern int stab_added,matrix_assembled,_eigen_steady_state;
+extern PetscErrorCode (*_ts_monitor)(TS,PetscInt,PetscReal,Vec,void*);
+extern void *_tsctx;
+
 #endif
@@ -0,0 +1,600 @@
+#include "spectral.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "quac_p.h"
+#include <petscblaslapack.h>
+#include <stdlib.h>
+#include <stdio.h>
+#if defined(QUAC_USE_SLEPC)
+#include <slepceps.h>
+#endif
+
+/*
+ * _assemble_liouvillian makes sure full_A is the assembled Liouvillian
+ * itself (without the steady state stabilization row)
+ */
+static void _assemble_liouvillian(){
+  PetscInt    i,Istart,Iend;
+  PetscScalar mat_tmp;
+
+  _remove_stabilization();
+  MatGetOwnershipRange(full_A,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    mat_tmp = 0 + 0.*PETSC_i;
+    _coo_mat_add_value(full_A,i,i,mat_tmp);
+  }
+  _coo_assemble_mat(full_A);
+  MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
+  return;
+}
+
+/*
+ * _spectrum_dense finds all of the eigenpairs of full_A with LAPACK.
+ * full_A is gathered onto every core, so this is only for small systems
+ * (dim of a few thousand at most).
+ */
+static void _spectrum_dense(liouvillian_spectrum spec){
+  PetscInt          Istart,Iend,i,j,k,ncols,n;
+  const PetscInt    *cols;
+  const PetscScalar *vals;
+  PetscScalar       *dense,*vr,*rinv,*work,*array,vl_dummy;
+  PetscReal         *rwork;
+  PetscBLASInt      lwork,lierr,nb,one=1,*ipiv;
+  Vec               tmp;
+
+  n     = spec->dim;
+  dense = calloc(n*n,sizeof(PetscScalar));
+  MatGetOwnershipRange(full_A,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    MatGetRow(full_A,i,&ncols,&cols,&vals);
+    for (j=0;j<ncols;j++){
+      dense[i+cols[j]*n] = vals[j];
+    }
+    MatRestoreRow(full_A,i,&ncols,&cols,&vals);
+  }
+  MPI_Allreduce(MPI_IN_PLACE,dense,n*n,MPIU_SCALAR,MPI_SUM,quac_comm);
+
+  spec->nev  = n;
+  spec->eigs = malloc(n*sizeof(PetscScalar));
+  vr    = malloc(n*n*sizeof(PetscScalar));
+  rinv  = calloc(n*n,sizeof(PetscScalar));
+  ipiv  = malloc(n*sizeof(PetscBLASInt));
+  lwork = 5*n;
+  work  = malloc(5*n*sizeof(PetscScalar));
+  rwork = malloc(2*n*sizeof(PetscReal));
+  PetscBLASIntCast(n,&nb);
+
+  /* Call LAPACK through PETSc to ensure portability */
+  LAPACKgeev_("N","V",&nb,dense,&nb,spec->eigs,&vl_dummy,&one,vr,&nb,work,&lwork,rwork,&lierr);
+  if (lierr!=0){
+    if (nid==0){
+      printf("ERROR! Dense diagonalization of the Liouvillian failed!\n");
+      exit(0);
+    }
+  }
+
+  /*
+   * The dual basis is the rows of R^-1, which gives L_k^dag R_j = delta_kj
+   * even within a degenerate eigenspace (where LAPACK's left and right
+   * vectors need not be biorthogonal). dense is overwritten by the LU of R.
+   */
+  for (i=0;i<n*n;i++) dense[i] = vr[i];
+  for (i=0;i<n;i++) rinv[i+i*n] = 1.0;
+  LAPACKgesv_(&nb,&nb,dense,&nb,ipiv,rinv,&nb,&lierr);
+  if (lierr!=0){
+    if (nid==0){
+      printf("ERROR! The eigenvectors of the Liouvillian are not a basis (it is not diagonalizable)!\n");
+      exit(0);
+    }
+  }
+
+  /* Copy the local part of each vector; L_k is the conjugate of row k of R^-1 */
+  MatCreateVecs(full_A,&tmp,NULL);
+  VecDuplicateVecs(tmp,n,&spec->R);
+  VecDuplicateVecs(tmp,n,&spec->L);
+  VecDestroy(&tmp);
+  for (k=0;k<n;k++){
+    VecGetArray(spec->R[k],&array);
+    for (i=Istart;i<Iend;i++){
+      array[i-Istart] = vr[i+k*n];
+    }
+    VecRestoreArray(spec->R[k],&array);
+    VecGetArray(spec->L[k],&array);
+    for (i=Istart;i<Iend;i++){
+      array[i-Istart] = PetscConj(rinv[k+i*n]);
+    }
+    VecRestoreArray(spec->L[k],&array);
+  }
+
+  free(dense);
+  free(vr);
+  free(rinv);
+  free(ipiv);
+  free(work);
+  free(rwork);
+  return;
+}
+
+/*
+ * _spectrum_slepc finds the nev eigenpairs of full_A closest to 0 (the
+ * slowest decaying modes, which dominate long times) and their left
+ * eigenvectors, with a two sided SLEPc shift-invert eigen solve. The
+ * shifted systems are solved with LU by default, since both they and
+ * their transposes are needed; change this with -st_ksp_type,
+ * -st_pc_type, and -st_pc_factor_mat_solver_type (e.g., mumps in parallel).
+ */
+static void _spectrum_slepc(liouvillian_spectrum spec,PetscInt nev){
+#if defined(QUAC_USE_SLEPC)
+  EPS          eps;
+  ST           st;
+  KSP          ksp;
+  PC           pc;
+  PetscInt     j,k,nconv;
+  PetscScalar  *gram,*ginv,*coeff;
+  PetscReal    mat_norm,shift;
+  PetscBLASInt nb,lierr,*ipiv;
+  Vec          tmp,*left;
+
+  MatNorm(full_A,NORM_INFINITY,&mat_norm);
+  shift = -1e-8*mat_norm;
+  PetscOptionsGetReal(NULL,NULL,"-quac_eigen_shift",&shift,NULL);
+
+  EPSCreate(quac_comm,&eps);
+  EPSSetOperators(eps,full_A,NULL);
+  EPSSetProblemType(eps,EPS_NHEP);
+  EPSSetTwoSided(eps,PETSC_TRUE);
+  EPSSetDimensions(eps,nev,PETSC_DEFAULT,PETSC_DEFAULT);
+  EPSSetWhichEigenpairs(eps,EPS_TARGET_MAGNITUDE);
+  EPSSetTarget(eps,shift);
+
+  EPSGetST(eps,&st);
+  STSetType(st,STSINVERT);
+  STGetKSP(st,&ksp);
+  KSPSetType(ksp,KSPPREONLY);
+  KSPGetPC(ksp,&pc);
+  PCSetType(pc,PCLU);
+
+  EPSSetFromOptions(eps);
+  if (nid==0) printf("EPS set. Solving for %d eigenpairs of the Liouvillian...\n",(int)nev);
+  EPSSolve(eps);
+  EPSGetConverged(eps,&nconv);
+  if (nconv<nev){
+    if (nid==0){
+      printf("Warning! Only %d of %d eigenpairs of the Liouvillian converged.\n",(int)nconv,(int)nev);
+    }
+    nev = nconv;
+  }
+
+  spec->nev  = nev;
+  spec->eigs = malloc(nev*sizeof(PetscScalar));
+  MatCreateVecs(full_A,&tmp,NULL);
+  VecDuplicateVecs(tmp,nev,&spec->R);
+  VecDuplicateVecs(tmp,nev,&spec->L);
+  VecDuplicateVecs(tmp,nev,&left);
+  VecDestroy(&tmp);
+  for (k=0;k<nev;k++){
+    EPSGetEigenpair(eps,k,&spec->eigs[k],NULL,spec->R[k],NULL);
+    EPSGetLeftEigenvector(eps,k,left[k],NULL);
+  }
+  EPSDestroy(&eps);
+
+  /*
+   * Left and right vectors of a degenerate eigenvalue need not be
+   * biorthogonal, so take L = left G^-dag, with G_jk = left_j^dag R_k,
+   * which gives L_k^dag R_j = delta_kj (G is diagonal otherwise)
+   */
+  gram  = malloc(nev*nev*sizeof(PetscScalar));
+  ginv  = calloc(nev*nev,sizeof(PetscScalar));
+  coeff = malloc(nev*sizeof(PetscScalar));
+  ipiv  = malloc(nev*sizeof(PetscBLASInt));
+  for (k=0;k<nev;k++){
+    VecMDot(spec->R[k],nev,left,coeff); /* left_j^dag R_k */
+    for (j=0;j<nev;j++) gram[j+k*nev] = coeff[j];
+    ginv[k+k*nev] = 1.0;
+  }
+  PetscBLASIntCast(nev,&nb);
+  LAPACKgesv_(&nb,&nb,gram,&nb,ipiv,ginv,&nb,&lierr);
+  if (lierr!=0){
+    if (nid==0){
+      printf("ERROR! The left and right eigenvectors of the Liouvillian are not dual!\n");
+      exit(0);
+    }
+  }
+  for (k=0;k<nev;k++){
+    for (j=0;j<nev;j++) coeff[j] = PetscConj(ginv[k+j*nev]);
+    VecSet(spec->L[k],0.0);
+    VecMAXPY(spec->L[k],nev,coeff,left);
+  }
+  VecDestroyVecs(nev,&left);
+  free(gram);
+  free(ginv);
+  free(coeff);
+  free(ipiv);
+#else
+  if (nid==0){
+    printf("ERROR! A partial Liouvillian spectrum requires QuaC to be built with SLEPc!\n");
+    printf("       Use nev = 0 for a dense, full diagonalization.\n");
+    exit(0);
+  }
+#endif
+  return;
+}
+
+/*
+ * create_liouvillian_spectrum decomposes the Liouvillian of the system
+ * that was previously setup using the add_to_ham and add_lin routines.
+ * After that, rho(t) and two time correlations at any number of times
+ * only need a few dot products each. The system must be time independent.
+ * Inputs:
+ *        PetscInt nev: number of eigenpairs to keep (those closest to 0,
+ *                      with SLEPc); 0 for a dense diagonalization of all
+ *                      of them (small systems only). Can be changed with
+ *                      -quac_spectrum_nev.
+ * Outputs:
+ *        liouvillian_spectrum *spec: the decomposition
+ */
+void create_liouvillian_spectrum(liouvillian_spectrum *spec,PetscInt nev){
+  liouvillian_spectrum temp;
+
+  if (!_lindblad_terms||_num_time_dep+_num_time_dep_lin>0||_stiff_solver){
+    if (nid==0){
+      printf("ERROR! create_liouvillian_spectrum requires a time independent\n");
+      printf("       system with Lindblad terms and no stiff terms!\n");
+      exit(0);
+    }
+  }
+  PetscOptionsGetInt(NULL,NULL,"-quac_spectrum_nev",&nev,NULL);
+
+  _assemble_liouvillian();
+
+  temp = malloc(sizeof(struct liouvillian_spectrum_struct));
+  temp->dim = total_levels*total_levels;
+  if (nev<=0||nev>=temp->dim){
+    _spectrum_dense(temp);
+  } else {
+    _spectrum_slepc(temp,nev);
+  }
+  *spec = temp;
+  return;
+}
+
+/*
+ * destroy_liouvillian_spectrum frees a decomposition
+ */
+void destroy_liouvillian_spectrum(liouvillian_spectrum *spec){
+
+  VecDestroyVecs((*spec)->nev,&(*spec)->R);
+  VecDestroyVecs((*spec)->nev,&(*spec)->L);
+  free((*spec)->eigs);
+  free(*spec);
+  *spec = NULL;
+  return;
+}
+
+/*
+ * spectrum_evolve calculates rho(t) = sum_k e^(lambda_k t) R_k (L_k^dag rho0)
+ * Inputs:
+ *        liouvillian_spectrum spec: from create_liouvillian_spectrum
+ *        Vec rho0:    initial density matrix
+ *        PetscReal t: time
+ * Outputs:
+ *        Vec rho_t:   density matrix at time t (can not be rho0)
+ */
+void spectrum_evolve(liouvillian_spectrum spec,Vec rho0,PetscReal t,Vec rho_t){
+  PetscScalar *coeff;
+  PetscInt    k;
+
+  coeff = malloc(spec->nev*sizeof(PetscScalar));
+  VecMDot(rho0,spec->nev,spec->L,coeff);
+  for (k=0;k<spec->nev;k++){
+    coeff[k] = coeff[k]*PetscExpScalar(spec->eigs[k]*t);
+  }
+  VecSet(rho_t,0.0);
+  VecMAXPY(rho_t,spec->nev,coeff,spec->R);
+  free(coeff);
+  return;
+}
+
+/*
+ * _spectrum_series evaluates tr(M e^(L tau) x0) = sum_k (u . R_k) (L_k^dag x0) e^(lambda_k tau),
+ * where u is the vector with u . x = tr(M x), at tau = j*tau_max/n_tau,
+ * j = 0..n_tau.
+ */
+static void _spectrum_series(liouvillian_spectrum spec,Vec x0,Vec u,PetscInt n_tau,PetscReal tau_max,PetscScalar *values){
+  PetscScalar *c,*d;
+  PetscInt    j,k;
+
+  c = malloc(spec->nev*sizeof(PetscScalar));
+  d = malloc(spec->nev*sizeof(PetscScalar));
+  VecMDot(x0,spec->nev,spec->L,c);
+  VecMTDot(u,spec->nev,spec->R,d);
+  for (k=0;k<spec->nev;k++){
+    c[k] = c[k]*d[k];
+  }
+  for (j=0;j<=n_tau;j++){
+    values[j] = 0.0;
+    for (k=0;k<spec->nev;k++){
+      values[j] = values[j] + c[k]*PetscExpScalar(spec->eigs[k]*j*tau_max/n_tau);
+    }
+  }
+  free(c);
+  free(d);
+  return;
+}
+
+/*
+ * _spectrum_superop creates the superoperator of op (see add_ops_to_mat
+ * for tensor_control)
+ */
+static void _spectrum_superop(Mat *M,PetscInt tensor_control,operator op){
+  PetscInt dim;
+
+  dim = total_levels*total_levels;
+  MatCreate(quac_comm,M);
+  MatSetType(*M,MATMPIAIJ);
+  MatSetSizes(*M,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
+  MatSetFromOptions(*M);
+  MatMPIAIJSetPreallocation(*M,4,NULL,4,NULL);
+  add_ops_to_mat(*M,tensor_control,1,op);
+  return;
+}
+
+/*
+ * _spectrum_trace_vec sets t to the vectorized identity, so that t . x = tr(x)
+ */
+static void _spectrum_trace_vec(Vec t){
+  PetscInt i,k,Istart,Iend;
+
+  VecSet(t,0.0);
+  VecGetOwnershipRange(t,&Istart,&Iend);
+  for (i=0;i<total_levels;i++){
+    k = i*(total_levels+1);
+    if (k>=Istart&&k<Iend) VecSetValue(t,k,1.0,INSERT_VALUES);
+  }
+  VecAssemblyBegin(t);
+  VecAssemblyEnd(t);
+  return;
+}
+
+/*
+ * spectrum_correlation calculates the two time correlation
+ * <A(t+tau) B(t)> = tr(A e^(L tau) (B rho(t))) through the quantum
+ * regression theorem, at tau = j*tau_max/n_tau, j = 0..n_tau.
+ * Inputs:
+ *        liouvillian_spectrum spec: from create_liouvillian_spectrum
+ *        Vec rho:           density matrix at t (e.g., the steady state)
+ *        operator a_op,b_op: A and B
+ *        PetscInt n_tau:    number of tau steps
+ *        PetscReal tau_max: maximum tau
+ * Outputs:
+ *        PetscScalar *values: n_tau+1 correlation values
+ */
+void spectrum_correlation(liouvillian_spectrum spec,Vec rho,operator a_op,operator b_op,PetscInt n_tau,PetscReal tau_max,PetscScalar *values){
+  Mat A_super,B_super;
+  Vec x0,t,u;
+
+  /* x0 = B rho, and u . x = tr(A x) = t . (I x A) x */
+  _spectrum_superop(&B_super,-1,b_op);
+  _spectrum_superop(&A_super,-1,a_op);
+  VecDuplicate(rho,&x0);
+  VecDuplicate(rho,&t);
+  VecDuplicate(rho,&u);
+  MatMult(B_super,rho,x0);
+  _spectrum_trace_vec(t);
+  MatMultTranspose(A_super,t,u);
+
+  _spectrum_series(spec,x0,u,n_tau,tau_max,values);
+
+  MatDestroy(&A_super);
+  MatDestroy(&B_super);
+  VecDestroy(&x0);
+  VecDestroy(&t);
+  VecDestroy(&u);
+  return;
+}
+
+/*
+ * spectrum_g1 calculates <op^dag(t+tau) op(t)>; see spectrum_correlation
+ */
+void spectrum_g1(liouvillian_spectrum spec,Vec rho,operator op,PetscInt n_tau,PetscReal tau_max,PetscScalar *values){
+  spectrum_correlation(spec,rho,op->dag,op,n_tau,tau_max,values);
+  return;
+}
+
+/*
+ * spectrum_g2 calculates <op^dag(t) op^dag(t+tau) op(t+tau) op(t)>
+ * = tr(op^dag op e^(L tau) (op rho op^dag)), at tau = j*tau_max/n_tau,
+ * j = 0..n_tau (not normalized, as in g2_correlation).
+ */
+void spectrum_g2(liouvillian_spectrum spec,Vec rho,operator op,PetscInt n_tau,PetscReal tau_max,PetscScalar *values){
+  Mat jump,I_cross_A;
+  Vec x0,t,u;
+
+  /* x0 = op rho op^dag, and u = (I x A)^T conj((I x A) t) */
+  _spectrum_superop(&jump,0,op);
+  _spectrum_superop(&I_cross_A,-1,op);
+  VecDuplicate(rho,&x0);
+  VecDuplicate(rho,&t);
+  VecDuplicate(rho,&u);
+  MatMult(jump,rho,x0);
+  _spectrum_trace_vec(t);
+  MatMult(I_cross_A,t,u);
+  VecConjugate(u);
+  VecCopy(u,t);
+  MatMultTranspose(I_cross_A,t,u);
+
+  _spectrum_series(spec,x0,u,n_tau,tau_max,values);
+
+  MatDestroy(&jump);
+  MatDestroy(&I_cross_A);
+  VecDestroy(&x0);
+  VecDestroy(&t);
+  VecDestroy(&u);
+  return;
+}
+
+/*
+ * _spectrum_to_comm copies the global vector x onto y, a vector with the
+ * same global size on a (sub)communicator. Each core only gathers its own
+ * range of y, straight into y's storage.
+ */
+static void _spectrum_to_comm(Vec x,Vec y){
+  VecScatter  scatter;
+  Vec         local;
+  IS          is_from;
+  PetscScalar *ya;
+  PetscInt    Istart,Iend;
+
+  VecGetOwnershipRange(y,&Istart,&Iend);
+  ISCreateStride(PETSC_COMM_SELF,Iend-Istart,Istart,1,&is_from);
+  VecGetArray(y,&ya);
+  VecCreateSeqWithArray(PETSC_COMM_SELF,1,Iend-Istart,ya,&local);
+  VecScatterCreate(x,is_from,local,NULL,&scatter);
+  VecScatterBegin(scatter,x,local,INSERT_VALUES,SCATTER_FORWARD);
+  VecScatterEnd(scatter,x,local,INSERT_VALUES,SCATTER_FORWARD);
+  VecRestoreArray(y,&ya);
+  VecScatterDestroy(&scatter);
+  VecDestroy(&local);
+  ISDestroy(&is_from);
+  return;
+}
+
+/*
+ * emission_spectrum calculates the (incoherent) emission spectrum
+ * S(w) = 2 Re int_0^inf e^(-i w tau) <op^dag(tau) op(0)> dtau
+ * in the steady state, from one linear solve per frequency:
+ * (L - i w) x = -(op rho_ss - <op> rho_ss), S(w) = 2 Re tr(op^dag x).
+ * Each KSP solve starts from the solution at the previous frequency, and
+ * the preconditioner is only rebuilt every -quac_spectrum_pc_lag
+ * frequencies (default 10), so closely spaced, sorted frequency lists are
+ * cheapest. With -quac_spectrum_groups <n>, the cores are split into n
+ * groups, each with its own copy of L, which solve contiguous chunks of
+ * the frequency list at the same time. KSP options take the
+ * -spectrum_ prefix; -quac_spectrum_monitor prints S and the iteration
+ * count of each frequency.
+ * Inputs:
+ *        Vec rho_ss:         the steady state (from steady_state)
+ *        operator op:        the emitting operator (e.g., a cavity or qubit)
+ *        PetscInt n_omega:   number of frequencies
+ *        PetscReal *omega:   the frequencies
+ * Outputs:
+ *        PetscReal *spectrum: S(omega[i]), on all cores
+ */
+void emission_spectrum(Vec rho_ss,operator op,PetscInt n_omega,PetscReal *omega,PetscReal *spectrum){
+  MPI_Comm    group_comm;
+  Mat         op_super,dag_super,L,shifted;
+  Vec         x0,t,u,b_sub,u_sub,x_sub;
+  KSP         ksp;
+  PC          pc;
+  PetscInt    i,pc_lag,n_groups,my_group,first,last,*its;
+  PetscScalar ev,val;
+  PetscBool   monitor=PETSC_FALSE;
+  int         group_nid,size;
+
+  if (!_lindblad_terms||_num_time_dep+_num_time_dep_lin>0||_stiff_solver){
+    if (nid==0){
+      printf("ERROR! emission_spectrum requires a time independent\n");
+      printf("       system with Lindblad terms and no stiff terms!\n");
+      exit(0);
+    }
+  }
+  pc_lag   = 10;
+  n_groups = 1;
+  PetscOptionsGetInt(NULL,NULL,"-quac_spectrum_pc_lag",&pc_lag,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-quac_spectrum_groups",&n_groups,NULL);
+  PetscOptionsGetBool(NULL,NULL,"-quac_spectrum_monitor",&monitor,NULL);
+  MPI_Comm_size(quac_comm,&size);
+  if (n_groups>size) n_groups = size;
+  if (n_groups<1) n_groups = 1;
+  _assemble_liouvillian();
+
+  /* rhs -(op rho_ss - <op> rho_ss), and u with u . x = tr(op^dag x) */
+  _spectrum_superop(&op_super,-1,op);
+  _spectrum_superop(&dag_super,-1,op->dag);
+  VecDuplicate(rho_ss,&x0);
+  VecDuplicate(rho_ss,&t);
+  VecDuplicate(rho_ss,&u);
+  _spectrum_trace_vec(t);
+  MatMult(op_super,rho_ss,x0);
+  VecDot(x0,t,&ev); /* tr(op rho_ss); t is real */
+  VecAXPY(x0,-ev,rho_ss);
+  VecScale(x0,-1.0);
+  MatMultTranspose(dag_super,t,u);
+
+  /* Split the cores into groups with contiguous ranks, each with a copy of L */
+  if (n_groups>1){
+    my_group = (nid*n_groups)/size;
+    MPI_Comm_split(quac_comm,my_group,nid,&group_comm);
+    MatCreateRedundantMatrix(full_A,n_groups,group_comm,MAT_INITIAL_MATRIX,&L);
+  } else {
+    my_group   = 0;
+    group_comm = quac_comm;
+    L          = full_A;
+  }
+  MPI_Comm_rank(group_comm,&group_nid);
+  MatCreateVecs(L,&x_sub,&b_sub);
+  VecDuplicate(b_sub,&u_sub);
+  _spectrum_to_comm(x0,b_sub);
+  _spectrum_to_comm(u,u_sub);
+  MatDuplicate(L,MAT_COPY_VALUES,&shifted);
+
+  /* Same solver defaults as steady_state */
+  KSPCreate(group_comm,&ksp);
+  KSPSetOperators(ksp,shifted,shifted);
+  KSPSetType(ksp,KSPGMRES);
+  KSPGMRESSetRestart(ksp,100);
+  KSPSetTolerances(ksp,1e-11,PETSC_DEFAULT,PETSC_DEFAULT,PETSC_DEFAULT);
+  KSPGetPC(ksp,&pc);
+  PCSetType(pc,PCASM);
+  KSPSetInitialGuessNonzero(ksp,PETSC_TRUE);
+  KSPSetOptionsPrefix(ksp,"spectrum_");
+  KSPSetFromOptions(ksp);
+
+  its = calloc(n_omega,sizeof(PetscInt));
+  for (i=0;i<n_omega;i++){
+    spectrum[i] = 0.0;
+  }
+  first = (my_group*n_omega)/n_groups;
+  last  = ((my_group+1)*n_omega)/n_groups;
+  VecSet(x_sub,0.0);
+  for (i=first;i<last;i++){
+    MatCopy(L,shifted,SAME_NONZERO_PATTERN);
+    MatShift(shifted,-omega[i]*PETSC_i);
+    KSPSetReusePreconditioner(ksp,((i-first)%pc_lag==0)?PETSC_FALSE:PETSC_TRUE);
+    KSPSolve(ksp,b_sub,x_sub);
+    VecTDot(x_sub,u_sub,&val);
+    if (group_nid==0){
+      spectrum[i] = 2*PetscRealPart(val);
+      KSPGetIterationNumber(ksp,&its[i]);
+    }
+  }
+  MPI_Allreduce(MPI_IN_PLACE,spectrum,n_omega,MPIU_REAL,MPI_SUM,quac_comm);
+  if (monitor){
+    MPI_Allreduce(MPI_IN_PLACE,its,n_omega,MPIU_INT,MPI_SUM,quac_comm);
+    if (nid==0){
+      for (i=0;i<n_omega;i++){
+        printf("omega %e: S %e (%d iterations)\n",(double)omega[i],(double)spectrum[i],(int)its[i]);
+      }
+    }
+  }
+  free(its);
+
+  KSPDestroy(&ksp);
+  MatDestroy(&shifted);
+  MatDestroy(&op_super);
+  MatDestroy(&dag_super);
+  VecDestroy(&x0);
+  VecDestroy(&t);
+  VecDestroy(&u);
+  VecDestroy(&x_sub);
+  VecDestroy(&b_sub);
+  VecDestroy(&u_sub);
+  if (n_groups>1){
+    MatDestroy(&L);
+    MPI_Comm_free(&group_comm);
+  }
+  return;
+}
@@ -0,0 +1,27 @@
+#ifndef SPECTRAL_H_
+#define SPECTRAL_H_
+
+#include <petscmat.h>
+#include "operators.h"
+
+/*
+ * liouvillian_spectrum holds (some of) the eigendecomposition of the
+ * Liouvillian, L = sum_k lambda_k R_k L_k^dag, with the left vectors
+ * scaled so that L_k^dag R_j = delta_kj. Any rho(t) or two time
+ * correlation is then a sum of exponentials e^(lambda_k t).
+ */
+typedef struct liouvillian_spectrum_struct{
+  PetscInt    dim,nev;
+  PetscScalar *eigs;  /* eigenvalues lambda_k */
+  Vec         *R,*L;  /* right eigenvectors, and their dual left vectors */
+} *liouvillian_spectrum;
+
+void create_liouvillian_spectrum(liouvillian_spectrum*,PetscInt);
+void destroy_liouvillian_spectrum(liouvillian_spectrum*);
+void spectrum_evolve(liouvillian_spectrum,Vec,PetscReal,Vec);
+void spectrum_correlation(liouvillian_spectrum,Vec,operator,operator,PetscInt,PetscReal,PetscScalar*);
+void spectrum_g1(liouvillian_spectrum,Vec,operator,PetscInt,PetscReal,PetscScalar*);
+void spectrum_g2(liouvillian_spectrum,Vec,operator,PetscInt,PetscReal,PetscScalar*);
+void emission_spectrum(Vec,operator,PetscInt,PetscReal*,PetscReal*);
+
+#endif
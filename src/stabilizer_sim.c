@@ -0,0 +1,596 @@
+#include "stabilizer_sim.h"
+#include "quac_p.h"
+#include "operators.h"
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Stabilizer (Clifford) simulation of circuits with Pauli noise, after
+ * Aaronson and Gottesman, PRA 70, 052328 (2004). A state of n qubits takes
+ * O(n^2) bits, gates take O(n) and measurements O(n^2) time, so codes far
+ * beyond the reach of the density matrix can be studied. Only Clifford
+ * gates are allowed: H, the Paulis, CNOT, CZ, CXZ, CZX, CmZ, and
+ * rotations by multiples of pi/2.
+ */
+
+#define _TAB_WORD(q) ((q)/64)
+#define _TAB_BIT(q)  (((uint64_t)1)<<((q)%64))
+
+static int _popcount64(uint64_t m){
+  int count = 0;
+
+  while (m){
+    m = m & (m-1);
+    count = count + 1;
+  }
+  return count;
+}
+
+/*
+ * _stab_rand is a small random number generator (splitmix64) giving a
+ * uniform PetscReal in [0,1). Each rank keeps its own state.
+ */
+PetscReal _stab_rand(uint64_t *state){
+  uint64_t z;
+
+  *state = *state + 0x9E3779B97F4A7C15ULL;
+  z = *state;
+  z = (z ^ (z>>30))*0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z>>27))*0x94D049BB133111EBULL;
+  z = z ^ (z>>31);
+  return (z>>11)*(1.0/9007199254740992.0);
+}
+
+/*
+ * _tableau_reset sets the tableau to |0...0>: destabilizer i is X_i and
+ * stabilizer i is Z_i
+ */
+static void _tableau_reset(tableau tab){
+  PetscInt i,n=tab->n,n_words=tab->n_words;
+
+  for (i=0;i<(2*n+1)*n_words;i++){
+    tab->x[i] = 0;
+    tab->z[i] = 0;
+  }
+  for (i=0;i<2*n+1;i++){
+    tab->r[i] = 0;
+  }
+  for (i=0;i<n;i++){
+    tab->x[i*n_words+_TAB_WORD(i)]     = _TAB_BIT(i);
+    tab->z[(i+n)*n_words+_TAB_WORD(i)] = _TAB_BIT(i);
+  }
+  return;
+}
+
+/*
+ * create_tableau creates the stabilizer state |0...0> of n qubits
+ * Inputs:
+ *        PetscInt n:    number of qubits
+ * Outputs:
+ *        tableau *tab:  new tableau
+ */
+void create_tableau(tableau *tab,PetscInt n){
+  tableau temp;
+
+  if (n<1){
+    if (nid==0){
+      printf("ERROR! A tableau needs at least one qubit!\n");
+      exit(0);
+    }
+  }
+  temp = malloc(sizeof(struct tableau_struct));
+  temp->n       = n;
+  temp->n_words = (n+63)/64;
+  temp->x = malloc((2*n+1)*temp->n_words*sizeof(uint64_t));
+  temp->z = malloc((2*n+1)*temp->n_words*sizeof(uint64_t));
+  temp->r = malloc((2*n+1)*sizeof(int));
+  _tableau_reset(temp);
+  *tab = temp;
+  return;
+}
+
+void destroy_tableau(tableau *tab){
+  free((*tab)->x);
+  free((*tab)->z);
+  free((*tab)->r);
+  free(*tab);
+  *tab = NULL;
+  return;
+}
+
+static void _tableau_h(tableau tab,PetscInt a){
+  PetscInt i,w=_TAB_WORD(a),n_words=tab->n_words;
+  uint64_t bit=_TAB_BIT(a),xa,za;
+
+  for (i=0;i<2*tab->n;i++){
+    xa = tab->x[i*n_words+w] & bit;
+    za = tab->z[i*n_words+w] & bit;
+    if (xa && za) tab->r[i] ^= 1;
+    /* Swap x and z */
+    tab->x[i*n_words+w] = (tab->x[i*n_words+w] & ~bit) | za;
+    tab->z[i*n_words+w] = (tab->z[i*n_words+w] & ~bit) | xa;
+  }
+  return;
+}
+
+static void _tableau_s(tableau tab,PetscInt a){
+  PetscInt i,w=_TAB_WORD(a),n_words=tab->n_words;
+  uint64_t bit=_TAB_BIT(a),xa,za;
+
+  for (i=0;i<2*tab->n;i++){
+    xa = tab->x[i*n_words+w] & bit;
+    za = tab->z[i*n_words+w] & bit;
+    if (xa && za) tab->r[i] ^= 1;
+    tab->z[i*n_words+w] ^= xa;
+  }
+  return;
+}
+
+static void _tableau_cnot(tableau tab,PetscInt a,PetscInt b){
+  PetscInt i,wa=_TAB_WORD(a),wb=_TAB_WORD(b),n_words=tab->n_words;
+  uint64_t bita=_TAB_BIT(a),bitb=_TAB_BIT(b);
+  int      xa,za,xb,zb;
+
+  for (i=0;i<2*tab->n;i++){
+    xa = (tab->x[i*n_words+wa] & bita)!=0;
+    za = (tab->z[i*n_words+wa] & bita)!=0;
+    xb = (tab->x[i*n_words+wb] & bitb)!=0;
+    zb = (tab->z[i*n_words+wb] & bitb)!=0;
+    if (xa && zb && (xb ^ za ^ 1)) tab->r[i] ^= 1;
+    if (xa) tab->x[i*n_words+wb] ^= bitb;
+    if (zb) tab->z[i*n_words+wa] ^= bita;
+  }
+  return;
+}
+
+static void _tableau_cz(tableau tab,PetscInt a,PetscInt b){
+  _tableau_h(tab,b);
+  _tableau_cnot(tab,a,b);
+  _tableau_h(tab,b);
+  return;
+}
+
+/*
+ * tableau_apply_pauli applies a Pauli (SIGMA_X, SIGMA_Y or SIGMA_Z) to
+ * qubit a; it only changes the signs of the rows that anticommute with it
+ */
+void tableau_apply_pauli(tableau tab,PetscInt a,op_type pauli){
+  PetscInt i,w=_TAB_WORD(a),n_words=tab->n_words;
+  uint64_t bit=_TAB_BIT(a),flip;
+
+  for (i=0;i<2*tab->n;i++){
+    if (pauli==SIGMA_X){
+      flip = tab->z[i*n_words+w] & bit;
+    } else if (pauli==SIGMA_Z){
+      flip = tab->x[i*n_words+w] & bit;
+    } else {
+      flip = (tab->x[i*n_words+w] ^ tab->z[i*n_words+w]) & bit;
+    }
+    if (flip) tab->r[i] ^= 1;
+  }
+  return;
+}
+
+/*
+ * _tableau_rotation applies RX, RY or RZ by a multiple of pi/2, which are
+ * (up to a global phase) powers of S in the Z, X or Y basis
+ */
+static void _tableau_rotation(tableau tab,struct quantum_gate_struct gate){
+  PetscInt a=gate.qubit_numbers[0],k,i;
+
+  k = (PetscInt)floor(gate.theta/(PETSC_PI/2)+0.5);
+  if (PetscAbsReal(gate.theta-k*PETSC_PI/2)>1e-10){
+    if (nid==0){
+      printf("ERROR! Only rotations by multiples of pi/2 are Clifford gates!\n");
+      exit(0);
+    }
+  }
+  k = ((k%4)+4)%4;
+  if (gate.my_gate_type==RY){
+    /* RY = S RX S^dag */
+    for (i=0;i<3;i++) _tableau_s(tab,a);
+  }
+  if (gate.my_gate_type==RX||gate.my_gate_type==RY){
+    _tableau_h(tab,a);
+  }
+  for (i=0;i<k;i++) _tableau_s(tab,a);
+  if (gate.my_gate_type==RX||gate.my_gate_type==RY){
+    _tableau_h(tab,a);
+  }
+  if (gate.my_gate_type==RY){
+    _tableau_s(tab,a);
+  }
+  return;
+}
+
+/*
+ * tableau_apply_gate applies one (Clifford) circuit gate to the tableau
+ */
+void tableau_apply_gate(tableau tab,struct quantum_gate_struct gate){
+  PetscInt i,num_qubits=1;
+
+  if (gate.my_gate_type<0){
+    num_qubits = 2;
+  }
+  for (i=0;i<num_qubits;i++){
+    if (gate.qubit_numbers[i]<0||gate.qubit_numbers[i]>=tab->n){
+      if (nid==0){
+        printf("ERROR! Gate qubit %d is outside of the tableau!\n",gate.qubit_numbers[i]);
+        exit(0);
+      }
+    }
+  }
+
+  switch (gate.my_gate_type){
+  case HADAMARD:
+    _tableau_h(tab,gate.qubit_numbers[0]);
+    break;
+  case SIGMAX:
+    tableau_apply_pauli(tab,gate.qubit_numbers[0],SIGMA_X);
+    break;
+  case SIGMAY:
+    tableau_apply_pauli(tab,gate.qubit_numbers[0],SIGMA_Y);
+    break;
+  case SIGMAZ:
+    tableau_apply_pauli(tab,gate.qubit_numbers[0],SIGMA_Z);
+    break;
+  case EYE:
+    break;
+  case RX:
+  case RY:
+  case RZ:
+    _tableau_rotation(tab,gate);
+    break;
+  case CNOT:
+    _tableau_cnot(tab,gate.qubit_numbers[0],gate.qubit_numbers[1]);
+    break;
+  case CZ:
+    _tableau_cz(tab,gate.qubit_numbers[0],gate.qubit_numbers[1]);
+    break;
+  case CXZ:
+    /* Controlled XZ: the Z acts first */
+    _tableau_cz(tab,gate.qubit_numbers[0],gate.qubit_numbers[1]);
+    _tableau_cnot(tab,gate.qubit_numbers[0],gate.qubit_numbers[1]);
+    break;
+  case CZX:
+    _tableau_cnot(tab,gate.qubit_numbers[0],gate.qubit_numbers[1]);
+    _tableau_cz(tab,gate.qubit_numbers[0],gate.qubit_numbers[1]);
+    break;
+  case CmZ:
+    /* Controlled -Z is CZ times Z on the control */
+    _tableau_cz(tab,gate.qubit_numbers[0],gate.qubit_numbers[1]);
+    tableau_apply_pauli(tab,gate.qubit_numbers[0],SIGMA_Z);
+    break;
+  default:
+    if (nid==0){
+      printf("ERROR! Gate type %d is not a Clifford gate and cannot be used\n",gate.my_gate_type);
+      printf("       in the stabilizer simulator!\n");
+      exit(0);
+    }
+  }
+  return;
+}
+
+/*
+ * _tableau_rowsum sets row h to row h times row i, keeping track of the
+ * sign. The phase of the product is summed 64 qubits at a time: for each
+ * qubit, (x1,z1) of row i times (x2,z2) of row h adds +1, -1 or 0 powers
+ * of i (the g function of Aaronson and Gottesman).
+ */
+static void _tableau_rowsum(tableau tab,PetscInt h,PetscInt i){
+  PetscInt w,n_words=tab->n_words,sum;
+  uint64_t x1,z1,x2,z2,pos,neg;
+
+  sum = 2*tab->r[h] + 2*tab->r[i];
+  for (w=0;w<n_words;w++){
+    x1 = tab->x[i*n_words+w];
+    z1 = tab->z[i*n_words+w];
+    x2 = tab->x[h*n_words+w];
+    z2 = tab->z[h*n_words+w];
+    pos = (x1 & z1 & z2 & ~x2) | (x1 & ~z1 & z2 & x2) | (~x1 & z1 & x2 & ~z2);
+    neg = (x1 & z1 & x2 & ~z2) | (x1 & ~z1 & z2 & ~x2) | (~x1 & z1 & x2 & z2);
+    sum = sum + _popcount64(pos) - _popcount64(neg);
+    tab->x[h*n_words+w] = x1 ^ x2;
+    tab->z[h*n_words+w] = z1 ^ z2;
+  }
+  tab->r[h] = (((sum%4)+4)%4==0) ? 0 : 1;
+  return;
+}
+
+static void _tableau_rowcopy(tableau tab,PetscInt h,PetscInt i){
+  PetscInt w,n_words=tab->n_words;
+
+  for (w=0;w<n_words;w++){
+    tab->x[h*n_words+w] = tab->x[i*n_words+w];
+    tab->z[h*n_words+w] = tab->z[i*n_words+w];
+  }
+  tab->r[h] = tab->r[i];
+  return;
+}
+
+static void _tableau_rowzero(tableau tab,PetscInt h){
+  PetscInt w,n_words=tab->n_words;
+
+  for (w=0;w<n_words;w++){
+    tab->x[h*n_words+w] = 0;
+    tab->z[h*n_words+w] = 0;
+  }
+  tab->r[h] = 0;
+  return;
+}
+
+/*
+ * tableau_measure measures qubit a in the Z basis, collapsing the state
+ * Inputs:
+ *        tableau tab:       the state
+ *        PetscInt a:        qubit to measure
+ *        uint64_t *rng:     random number state, for random outcomes
+ * Outputs:
+ *        tableau tab:       the state after the measurement
+ *        int *deterministic: 1 if the outcome was certain (may be NULL)
+ * Return:
+ *        the outcome, 0 or 1
+ */
+int tableau_measure(tableau tab,PetscInt a,uint64_t *rng,int *deterministic){
+  PetscInt i,p,n=tab->n,w=_TAB_WORD(a),n_words=tab->n_words;
+  uint64_t bit=_TAB_BIT(a);
+
+  /* The outcome is random if some stabilizer anticommutes with Z_a */
+  p = -1;
+  for (i=n;i<2*n;i++){
+    if (tab->x[i*n_words+w] & bit){
+      p = i;
+      break;
+    }
+  }
+
+  if (p>=0){
+    if (deterministic!=NULL) *deterministic = 0;
+    for (i=0;i<2*n;i++){
+      if (i!=p && (tab->x[i*n_words+w] & bit)){
+        _tableau_rowsum(tab,i,p);
+      }
+    }
+    _tableau_rowcopy(tab,p-n,p);
+    _tableau_rowzero(tab,p);
+    tab->z[p*n_words+w] = bit;
+    tab->r[p] = (_stab_rand(rng)<0.5) ? 0 : 1;
+    return tab->r[p];
+  }
+
+  /* Deterministic; build +/- Z_a from the stabilizers in the scratch row */
+  if (deterministic!=NULL) *deterministic = 1;
+  _tableau_rowzero(tab,2*n);
+  for (i=0;i<n;i++){
+    if (tab->x[i*n_words+w] & bit){
+      _tableau_rowsum(tab,2*n,i+n);
+    }
+  }
+  return tab->r[2*n];
+}
+
+/*
+ * _tableau_pauli_noise applies an X, Y, or Z error to qubit a with
+ * probabilities p_x, p_y, p_z
+ */
+static void _tableau_pauli_noise(tableau tab,PetscInt a,stabilizer_noise noise,uint64_t *rng){
+  PetscReal u;
+
+  if (noise.p_x+noise.p_y+noise.p_z<=0) return;
+  u = _stab_rand(rng);
+  if (u<noise.p_x){
+    tableau_apply_pauli(tab,a,SIGMA_X);
+  } else if (u<noise.p_x+noise.p_y){
+    tableau_apply_pauli(tab,a,SIGMA_Y);
+  } else if (u<noise.p_x+noise.p_y+noise.p_z){
+    tableau_apply_pauli(tab,a,SIGMA_Z);
+  }
+  return;
+}
+
+/*
+ * _tableau_gate_noise applies the noise channel attached to a gate (see
+ * add_noise_to_last_gate), which must be a Pauli channel, to qubit a
+ */
+static void _tableau_gate_noise(tableau tab,PetscInt a,gate_noise noise,uint64_t *rng){
+  PetscReal u;
+
+  if (noise.my_noise_type==NO_NOISE) return;
+  u = _stab_rand(rng);
+  if (noise.my_noise_type==DEPOLARIZING){
+    if (u<noise.p/3){
+      tableau_apply_pauli(tab,a,SIGMA_X);
+    } else if (u<2*noise.p/3){
+      tableau_apply_pauli(tab,a,SIGMA_Y);
+    } else if (u<noise.p){
+      tableau_apply_pauli(tab,a,SIGMA_Z);
+    }
+  } else if (noise.my_noise_type==DEPHASING){
+    if (u<noise.p){
+      tableau_apply_pauli(tab,a,SIGMA_Z);
+    }
+  } else {
+    if (nid==0){
+      printf("ERROR! Only Pauli channels (depolarizing, dephasing) can be used\n");
+      printf("       in the stabilizer simulator!\n");
+      exit(0);
+    }
+  }
+  return;
+}
+
+typedef struct gate_order_entry{
+  PetscReal time;
+  PetscInt  index;
+} gate_order_entry;
+
+static int _gate_order_compare(const void *a,const void *b){
+  const gate_order_entry *ga = (const gate_order_entry*)a,*gb = (const gate_order_entry*)b;
+
+  if (ga->time<gb->time) return -1;
+  if (ga->time>gb->time) return 1;
+  return (ga->index>gb->index) - (ga->index<gb->index);
+}
+
+/*
+ * _circuit_gate_order sorts the gates of a circuit by time, keeping the
+ * order they were added in for gates at the same time
+ */
+static void _circuit_gate_order(circuit circ,PetscInt order[]){
+  gate_order_entry *entries;
+  PetscInt         i;
+
+  entries = malloc(circ.num_gates*sizeof(gate_order_entry));
+  for (i=0;i<circ.num_gates;i++){
+    entries[i].time  = circ.times[i];
+    entries[i].index = i;
+  }
+  qsort(entries,circ.num_gates,sizeof(gate_order_entry),_gate_order_compare);
+  for (i=0;i<circ.num_gates;i++){
+    order[i] = entries[i].index;
+  }
+  free(entries);
+  return;
+}
+
+/*
+ * tableau_apply_circuit runs a circuit on the tableau, in gate time order,
+ * with Pauli noise on the qubits of every gate after it is applied: the
+ * gate's own noise channel, if any, then the global stabilizer_noise
+ * Inputs:
+ *        tableau tab:            the state
+ *        circuit circ:           the circuit; all gates must be Clifford
+ *        stabilizer_noise noise: the noise
+ *        uint64_t *rng:          random number state
+ * Outputs:
+ *        tableau tab:            the state after the circuit
+ */
+void tableau_apply_circuit(tableau tab,circuit circ,stabilizer_noise noise,uint64_t *rng){
+  PetscInt *order,i,j,num_qubits;
+  struct quantum_gate_struct gate;
+
+  order = malloc(circ.num_gates*sizeof(PetscInt));
+  _circuit_gate_order(circ,order);
+  for (i=0;i<circ.num_gates;i++){
+    gate = _circuit_gate(circ,order[i]);
+    tableau_apply_gate(tab,gate);
+    num_qubits = (gate.my_gate_type<0) ? 2 : 1;
+    for (j=0;j<num_qubits;j++){
+      _tableau_gate_noise(tab,gate.qubit_numbers[j],gate.noise,rng);
+      _tableau_pauli_noise(tab,gate.qubit_numbers[j],noise,rng);
+    }
+  }
+  free(order);
+  return;
+}
+
+/*
+ * _tableau_z_parity_deterministic checks that the product of Z on the
+ * given qubits commutes with every stabilizer, i.e., has a definite value
+ */
+static int _tableau_z_parity_deterministic(tableau tab,PetscInt n_measured,PetscInt measured[]){
+  PetscInt i,k,n=tab->n,n_words=tab->n_words;
+  int      overlap;
+
+  for (i=n;i<2*n;i++){
+    overlap = 0;
+    for (k=0;k<n_measured;k++){
+      if (tab->x[i*n_words+_TAB_WORD(measured[k])] & _TAB_BIT(measured[k])) overlap ^= 1;
+    }
+    if (overlap) return 0;
+  }
+  return 1;
+}
+
+/*
+ * stabilizer_logical_error_rate estimates a logical error rate by Monte
+ * Carlo. The circuit is run once without noise to get the reference
+ * outcomes of Z measurements on the measured qubits at the end, and then
+ * n_shots times with noise, split over the cores of quac_comm. A shot
+ * fails if its outcomes differ from the reference (or, with parity, if
+ * the parity of its outcomes does, e.g. for a logical Z of several qubits).
+ * Must be called from all cores.
+ * Inputs:
+ *        circuit circ:           the (Clifford) circuit, e.g. encode, idle, decode
+ *        PetscInt n_qubits:      number of qubits
+ *        stabilizer_noise noise: Pauli noise per gate and measurement
+ *        PetscInt n_measured:    number of qubits measured at the end
+ *        PetscInt measured[]:    qubits measured at the end
+ *        int parity:             1 to compare only the parity of the outcomes
+ *        PetscInt n_shots:       total number of shots
+ *        uint64_t seed:          random seed; each core gets its own stream
+ * Outputs:
+ *        PetscReal *error_rate:  fraction of failed shots, on every core
+ */
+void stabilizer_logical_error_rate(circuit circ,PetscInt n_qubits,stabilizer_noise noise,
+                                   PetscInt n_measured,PetscInt measured[],int parity,
+                                   PetscInt n_shots,uint64_t seed,PetscReal *error_rate){
+  tableau          tab;
+  stabilizer_noise no_noise = {0.0,0.0,0.0,0.0};
+  PetscInt         k,shot,my_shots,n_failed=0;
+  uint64_t         rng;
+  int              *reference,outcome,deterministic,failed,ref_parity=0,my_parity;
+
+  if (n_shots<1){
+    if (nid==0){
+      printf("ERROR! stabilizer_logical_error_rate needs at least one shot!\n");
+      exit(0);
+    }
+  }
+  for (k=0;k<n_measured;k++){
+    if (measured[k]<0||measured[k]>=n_qubits){
+      if (nid==0){
+        printf("ERROR! Measured qubit %d is outside of the tableau!\n",measured[k]);
+        exit(0);
+      }
+    }
+  }
+
+  reference = malloc(n_measured*sizeof(int));
+  create_tableau(&tab,n_qubits);
+
+  /* Noiseless reference run; the compared outcomes must be certain */
+  rng = seed;
+  tableau_apply_circuit(tab,circ,no_noise,&rng);
+  if (parity && !_tableau_z_parity_deterministic(tab,n_measured,measured)){
+    if (nid==0){
+      printf("ERROR! The noiseless parity of the measured qubits is random!\n");
+      exit(0);
+    }
+  }
+  for (k=0;k<n_measured;k++){
+    reference[k] = tableau_measure(tab,measured[k],&rng,&deterministic);
+    ref_parity   = ref_parity ^ reference[k];
+    if (!parity && !deterministic){
+      if (nid==0){
+        printf("ERROR! The noiseless outcome of qubit %d is random!\n",measured[k]);
+        exit(0);
+      }
+    }
+  }
+
+  /* Split the shots over the cores, each with its own random stream */
+  my_shots = n_shots/np + ((nid<n_shots%np) ? 1 : 0);
+  rng = seed ^ (0xD1B54A32D192ED03ULL*(uint64_t)(nid+1));
+  for (shot=0;shot<my_shots;shot++){
+    _tableau_reset(tab);
+    tableau_apply_circuit(tab,circ,noise,&rng);
+    failed    = 0;
+    my_parity = 0;
+    for (k=0;k<n_measured;k++){
+      outcome = tableau_measure(tab,measured[k],&rng,NULL);
+      if (_stab_rand(&rng)<noise.p_meas) outcome = 1 - outcome;
+      my_parity = my_parity ^ outcome;
+      if (outcome!=reference[k]) failed = 1;
+    }
+    if (parity) failed = (my_parity!=ref_parity);
+    n_failed = n_failed + failed;
+  }
+  MPI_Allreduce(MPI_IN_PLACE,&n_failed,1,MPIU_INT,MPI_SUM,quac_comm);
+  *error_rate = ((PetscReal)n_failed)/n_shots;
+
+  destroy_tableau(&tab);
+  free(reference);
+  return;
+}
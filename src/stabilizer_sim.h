@@ -0,0 +1,40 @@
+#ifndef STABILIZER_SIM_H_
+#define STABILIZER_SIM_H_
+
+#include <petsc.h>
+#include <stdint.h>
+#include "quantum_gates.h"
+
+/*
+ * tableau is a stabilizer state of n qubits in the Aaronson-Gottesman
+ * form: rows 0..n-1 are the destabilizers, rows n..2n-1 the stabilizers,
+ * and row 2n is scratch space. Each row is a Pauli string (+/-) X^x Z^z,
+ * with the x and z bits packed into n_words 64 bit words per row.
+ */
+typedef struct tableau_struct{
+  PetscInt n,n_words;
+  uint64_t *x,*z;
+  int      *r;
+} *tableau;
+
+/*
+ * stabilizer_noise is the Pauli noise of a stabilizer simulation. After
+ * every gate, each qubit the gate acts on gets an X, Y or Z error with
+ * probability p_x, p_y or p_z; each measurement outcome is flipped with
+ * probability p_meas.
+ */
+typedef struct stabilizer_noise{
+  PetscReal p_x,p_y,p_z,p_meas;
+} stabilizer_noise;
+
+void create_tableau(tableau*,PetscInt);
+void destroy_tableau(tableau*);
+void tableau_apply_gate(tableau,struct quantum_gate_struct);
+void tableau_apply_pauli(tableau,PetscInt,op_type);
+void tableau_apply_circuit(tableau,circuit,stabilizer_noise,uint64_t*);
+int tableau_measure(tableau,PetscInt,uint64_t*,int*);
+void stabilizer_logical_error_rate(circuit,PetscInt,stabilizer_noise,PetscInt,PetscInt[],int,
+                                   PetscInt,uint64_t,PetscReal*);
+PetscReal _stab_rand(uint64_t*);
+
+#endif
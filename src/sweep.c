@@ -0,0 +1,110 @@
+#include "sweep.h"
+#include "quac_p.h"
+#include "quac.h"
+#include "quac_system.h"
+#include "operators.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * run_sweep runs a parameter sweep by task farming. The world communicator
+ * is split into groups of group_size cores; each group builds and solves
+ * one parameter point at a time on its own sub-communicator. Points are
+ * handed out dynamically, through an atomic counter on world rank 0, so
+ * groups that finish early take more points. Each group's first core puts
+ * its results straight into the results array on world rank 0.
+ *
+ * Each group runs in its own quac_system on the group's communicator, so
+ * func can use the usual create_op / add_to_ham / add_lin / steady_state
+ * / time_step calls, and nid and np refer to the group. func should
+ * destroy its own operators and dms; run_sweep calls QuaC_clear after
+ * every point. The system that was active when run_sweep was called is
+ * active again when it returns.
+ * Must be called from all cores.
+ *
+ * Inputs:
+ *        PetscInt npoints:  number of parameter points
+ *        PetscInt nresults: number of doubles func returns per point
+ *        int group_size:    number of cores per group (pick the smallest
+ *                           size that scales well for one point)
+ *        func:              func(point,results,ctx) solves point and fills
+ *                           results[0..nresults-1] (on the group's first core)
+ *        void *ctx:         user context passed to func
+ * Outputs:
+ *        double *results:   npoints*nresults array, point-major. Only needs
+ *                           to be allocated, and is only filled, on world rank 0
+ */
+void run_sweep(PetscInt npoints,PetscInt nresults,int group_size,
+               void (*func)(PetscInt,double*,void*),void *ctx,double *results){
+  MPI_Comm    world_comm,group_comm;
+  MPI_Win     counter_win,results_win;
+  quac_system group_system,caller_system;
+  int         world_nid,world_np;
+  PetscInt    counter=0,next,one=1;
+  double      *point_results;
+
+  caller_system = quac_system_get_active();
+  world_comm    = quac_comm;
+  MPI_Comm_rank(world_comm,&world_nid);
+  MPI_Comm_size(world_comm,&world_np);
+
+  if (group_size<1||group_size>world_np){
+    if (world_nid==0){
+      printf("ERROR! group_size in run_sweep must be between 1 and the number of cores!\n");
+      exit(0);
+    }
+  }
+  if (world_nid==0&&results==NULL&&npoints*nresults>0){
+    printf("ERROR! results must be allocated on rank 0 in run_sweep!\n");
+    exit(0);
+  }
+
+  /* The counter and the results only live on world rank 0 */
+  if (world_nid==0){
+    MPI_Win_create(&counter,sizeof(PetscInt),sizeof(PetscInt),MPI_INFO_NULL,world_comm,&counter_win);
+    MPI_Win_create(results,npoints*nresults*sizeof(double),sizeof(double),MPI_INFO_NULL,
+                   world_comm,&results_win);
+  } else {
+    MPI_Win_create(NULL,0,sizeof(PetscInt),MPI_INFO_NULL,world_comm,&counter_win);
+    MPI_Win_create(NULL,0,sizeof(double),MPI_INFO_NULL,world_comm,&results_win);
+  }
+
+  MPI_Comm_split(world_comm,world_nid/group_size,world_nid,&group_comm);
+  create_quac_system(&group_system,group_comm);
+  quac_system_activate(group_system);
+
+  point_results = malloc(nresults*sizeof(double));
+
+  while (1) {
+    /* The group's first core grabs the next point for the whole group */
+    if (nid==0){
+      MPI_Win_lock(MPI_LOCK_SHARED,0,0,counter_win);
+      MPI_Fetch_and_op(&one,&next,MPIU_INT,0,0,MPI_SUM,counter_win);
+      MPI_Win_unlock(0,counter_win);
+    }
+    MPI_Bcast(&next,1,MPIU_INT,0,group_comm);
+    if (next>=npoints) break;
+
+    func(next,point_results,ctx);
+    QuaC_clear();
+
+    if (nid==0&&nresults>0){
+      MPI_Win_lock(MPI_LOCK_SHARED,0,0,results_win);
+      MPI_Put(point_results,nresults,MPI_DOUBLE,0,next*nresults,nresults,MPI_DOUBLE,results_win);
+      MPI_Win_unlock(0,results_win);
+    }
+  }
+
+  free(point_results);
+
+  /* Go back to the caller's system */
+  quac_system_activate(caller_system);
+  destroy_quac_system(&group_system);
+  MPI_Comm_free(&group_comm);
+
+  /* Freeing the windows synchronizes, so all results are on rank 0 afterwards */
+  MPI_Win_free(&counter_win);
+  MPI_Win_free(&results_win);
+
+  return;
+}
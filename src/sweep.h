@@ -0,0 +1,8 @@
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#include <petsc.h>
+
+void run_sweep(PetscInt,PetscInt,int,void (*)(PetscInt,double*,void*),void*,double*);
+
+#endif
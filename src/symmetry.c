@@ -0,0 +1,1212 @@
+#include "symmetry.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "quac_p.h"
+#include "coo_p.h"
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+int _symmetry_reduce    = 0;
+int _permutation_reduce = 0;
+/* Terms recorded by add_to_ham* and add_lin* with permutation symmetry */
+permutation_term *_permutation_terms    = NULL;
+int              _num_permutation_terms = 0;
+
+/*
+ * use_symmetry_reduction tells steady_state and time_step to look for a
+ * conserved excitation number (U(1) symmetry) in the assembled matrix and,
+ * if there is one, to solve only on the block of elements that the
+ * initial state can reach. Jaynes-Cummings type models with decay only
+ * shrink by orders of magnitude. The dm passed in and out is still the
+ * full dm, so get_populations, get_expectation_value, and time step
+ * monitors work as before. Can also be turned on with the command line
+ * option -quac_symmetry_reduce.
+ */
+void use_symmetry_reduction(){
+  _symmetry_reduce = 1;
+  return;
+}
+
+/*
+ * use_permutation_symmetry solves the system in the permutation invariant
+ * basis of its largest group of identical subsystems, i.e., with the
+ * same type and number of levels (e.g., the emitters of a Tavis-Cummings
+ * model, created with repeated create_op calls and given identical terms). Its size grows polynomially rather than
+ * exponentially in the number of identical subsystems, so hundreds of
+ * emitters fit. The full Liouvillian is never built: add_to_ham* and
+ * add_lin* only record their terms, and steady_state and time_step build
+ * the Liouvillian in the invariant basis directly from them (and exit
+ * with an error if the terms are not invariant under the permutations).
+ * create_full_dm then creates the dm in that basis, with one element per
+ * orbit of dm elements (the sum of the elements of the orbit); values
+ * added to it with add_value_to_dm or set_dm_from_initial_pop go to the
+ * whole orbit, i.e., the dm is symmetrized. Only get_populations can be
+ * used on it. Time dependent and stiff terms, add_lin_mat, gates,
+ * set_subsystem_order and the other dm utilities need the full
+ * Liouvillian or dm, and are not available.
+ * Must be called before any operators are created; can also be turned
+ * on with the command line option -quac_permutation_reduce.
+ */
+void use_permutation_symmetry(){
+  if (op_initialized&&num_subsystems>0){
+    if (nid==0){
+      printf("ERROR! use_permutation_symmetry must be called before creating any operators!\n");
+      exit(0);
+    }
+  }
+  _permutation_reduce = 1;
+  return;
+}
+
+/*
+ * _excitation_number returns the total excitation number of the
+ * basis state i, i.e., the sum of the level indices of all subsystems
+ * (the number of quanta in each ladder, or the level of each vec).
+ * Inputs:
+ *        PetscInt i: basis state in the full Hilbert space
+ * Return value:
+ *        PetscInt:   excitation number of i
+ */
+PetscInt _excitation_number(PetscInt i){
+  PetscInt n_after,level,number=0;
+  int      s;
+
+  for (s=0;s<num_subsystems;s++){
+    n_after = total_levels/(subsystem_list[s]->n_before*subsystem_list[s]->my_levels);
+    level   = (i/n_after)%subsystem_list[s]->my_levels;
+    number  = number + level;
+  }
+  return number;
+}
+
+/*
+ * _get_charge returns the conserved charge of element k of the
+ * state vector: N(a)-N(b) for the dm element rho_ab, or N(k) for a psi.
+ */
+static PetscInt _get_charge(PetscInt k,int lindblad){
+  if (lindblad){
+    return _excitation_number(k/total_levels) - _excitation_number(k%total_levels);
+  }
+  return _excitation_number(k);
+}
+
+/*
+ * _build_symmetry_is finds the elements of the state vector that can be
+ * reached from the initial state. The charge of every element of x that is
+ * nonzero (or only charge 0, for the steady state) is in the sector. The
+ * reduction is only used if the matrix never takes an element in the
+ * sector to one outside of it, which is checked directly on the assembled
+ * matrix, so it covers every way a term could have been added.
+ * Must be called from all cores.
+ * Inputs:
+ *        Mat A:        assembled full_A or ham_A
+ *        Vec x:        initial state (not used if steady)
+ *        int lindblad: 1 if x is a dm, 0 if x is a psi
+ *        int steady:   1 to take only charge 0 (steady_state)
+ * Outputs:
+ *        IS *is:       locally owned elements in the sector
+ * Return value:
+ *        int:          1 if the sector is closed and smaller than the full space
+ */
+int _build_symmetry_is(Mat A,Vec x,int lindblad,int steady,IS *is){
+  PetscInt          n_max,nq,offset,Istart,Iend,k,j,ncols,n_local,n_global,dim,*idx;
+  const PetscInt    *cols;
+  const PetscScalar *vals,*xa;
+  int               *in_sector,broken=0,s;
+
+  /* Largest possible excitation number */
+  n_max = 0;
+  for (s=0;s<num_subsystems;s++){
+    n_max = n_max + subsystem_list[s]->my_levels - 1;
+  }
+  if (lindblad){
+    nq     = 2*n_max+1;
+    offset = n_max;
+  } else {
+    nq     = n_max+1;
+    offset = 0;
+  }
+  in_sector = calloc(nq,sizeof(int));
+
+  MatGetOwnershipRange(A,&Istart,&Iend);
+  MatGetSize(A,&dim,NULL);
+
+  /* Charges present in the initial state */
+  if (steady){
+    in_sector[offset] = 1;
+  } else {
+    VecGetArrayRead(x,&xa);
+    for (k=Istart;k<Iend;k++){
+      if (PetscAbsComplex(xa[k-Istart])>0){
+        in_sector[_get_charge(k,lindblad)+offset] = 1;
+      }
+    }
+    VecRestoreArrayRead(x,&xa);
+    MPI_Allreduce(MPI_IN_PLACE,in_sector,nq,MPI_INT,MPI_MAX,quac_comm);
+  }
+
+  /* Check that A never leaves the sector */
+  n_local = 0;
+  for (k=Istart;k<Iend;k++){
+    if (in_sector[_get_charge(k,lindblad)+offset]) n_local++;
+    if (broken) continue;
+    MatGetRow(A,k,&ncols,&cols,&vals);
+    for (j=0;j<ncols;j++){
+      if (PetscAbsComplex(vals[j])==0) continue;
+      if (in_sector[_get_charge(cols[j],lindblad)+offset]&&
+          !in_sector[_get_charge(k,lindblad)+offset]){
+        broken = 1;
+        break;
+      }
+    }
+    MatRestoreRow(A,k,&ncols,&cols,&vals);
+  }
+  MPI_Allreduce(MPI_IN_PLACE,&broken,1,MPI_INT,MPI_MAX,quac_comm);
+  MPI_Allreduce(&n_local,&n_global,1,MPIU_INT,MPI_SUM,quac_comm);
+
+  if (broken||n_global==dim){
+    if (nid==0) printf("No excitation number symmetry reduction possible.\n");
+    free(in_sector);
+    return 0;
+  }
+
+  idx = malloc(n_local*sizeof(PetscInt));
+  j   = 0;
+  for (k=Istart;k<Iend;k++){
+    if (in_sector[_get_charge(k,lindblad)+offset]){
+      idx[j] = k;
+      j++;
+    }
+  }
+  ISCreateGeneral(quac_comm,n_local,idx,PETSC_OWN_POINTER,is);
+  if (nid==0) printf("Excitation number symmetry: solving on %ld of %ld elements.\n",(long)n_global,(long)dim);
+
+  free(in_sector);
+  return 1;
+}
+
+/*
+ * _binomial returns n choose k
+ */
+static PetscInt _binomial(PetscInt n,PetscInt k){
+  PetscInt64 i,result=1;
+
+  if (k<0||k>n) return 0;
+  if (k>n-k) k = n-k;
+  for (i=1;i<=k;i++){
+    result = result*(n-k+i)/i;
+  }
+  return (PetscInt)result;
+}
+
+/*
+ * permutation_basis describes the permutation invariant basis of a dm.
+ * An orbit of dm elements rho_ab is set by the (ket,bra) levels of the
+ * other subsystems (rest, mixed radix in creation order) and by how many
+ * ensemble members have each (ket,bra) pair of levels (pair = ket*levels
+ * + bra); that multiset is ranked with the combinatorial number system:
+ * orbit = rest*n_count + rank.
+ */
+typedef struct permutation_basis{
+  int      in_ens[MAX_SUB];
+  PetscInt ens_index[MAX_SUB]; /* position of a member in the ensemble */
+  PetscInt ens_sub[MAX_SUB];   /* subsystem of each member */
+  PetscInt stride[MAX_SUB];    /* stride of a non-member's pair in rest */
+  PetscInt n_ens,levels,n_pair,n_count,n_orbits;
+} permutation_basis;
+
+static permutation_basis _basis;
+
+/*
+ * _find_ensemble finds the largest group of subsystems with the same
+ * type and number of levels; these are the candidates for permutation
+ * symmetry.
+ * Outputs:
+ *        int *in_ens: in_ens[s] is 1 if subsystem s is in the group
+ * Return value:
+ *        int:         number of subsystems in the group
+ */
+static int _find_ensemble(int *in_ens){
+  int s,t,count,best_count=0,best_s=0;
+
+  for (s=0;s<num_subsystems;s++){
+    count = 0;
+    for (t=0;t<num_subsystems;t++){
+      if (subsystem_list[t]->my_levels==subsystem_list[s]->my_levels&&
+          subsystem_list[t]->my_op_type==subsystem_list[s]->my_op_type){
+        count++;
+      }
+    }
+    if (count>best_count){
+      best_count = count;
+      best_s     = s;
+    }
+  }
+  for (t=0;t<num_subsystems;t++){
+    in_ens[t] = (subsystem_list[t]->my_levels==subsystem_list[best_s]->my_levels&&
+                 subsystem_list[t]->my_op_type==subsystem_list[best_s]->my_op_type);
+  }
+  return best_count;
+}
+
+/*
+ * _permutation_basis_setup sets up _basis for the current subsystems
+ */
+static void _permutation_basis_setup(){
+  PetscInt  levels,stride=1;
+  PetscReal log_orbits;
+  int       s;
+
+  if (!op_initialized||num_subsystems==0){
+    if (nid==0){
+      printf("ERROR! You need to create operators before using the dm!\n");
+      exit(0);
+    }
+  }
+  _basis.n_ens = _find_ensemble(_basis.in_ens);
+  if (_basis.n_ens<2){
+    if (nid==0){
+      printf("ERROR! use_permutation_symmetry needs at least two identical subsystems!\n");
+      exit(0);
+    }
+  }
+
+  _basis.n_ens = 0;
+  log_orbits   = 0;
+  for (s=num_subsystems-1;s>=0;s--){
+    levels = subsystem_list[s]->my_levels;
+    if (_basis.in_ens[s]){
+      _basis.levels = levels;
+    } else {
+      _basis.stride[s] = stride;
+      stride           = stride*levels*levels;
+      log_orbits       = log_orbits + 2*log((double)levels);
+    }
+  }
+  for (s=0;s<num_subsystems;s++){
+    if (_basis.in_ens[s]){
+      _basis.ens_index[s]            = _basis.n_ens;
+      _basis.ens_sub[_basis.n_ens] = s;
+      _basis.n_ens++;
+    }
+  }
+  _basis.n_pair = _basis.levels*_basis.levels;
+  /* n_count = (n_pair+n_ens-1) choose n_ens; check the size before computing it */
+  log_orbits = log_orbits + lgamma(_basis.n_pair+_basis.n_ens) - lgamma(_basis.n_ens+1)
+    - lgamma(_basis.n_pair);
+  if (log_orbits>=log((double)PETSC_MAX_INT)){
+    if (nid==0){
+      printf("ERROR! The permutation invariant basis is too large for PetscInt!\n");
+      exit(0);
+    }
+  }
+  _basis.n_count  = _binomial(_basis.n_pair+_basis.n_ens-1,_basis.n_ens);
+  _basis.n_orbits = stride*_basis.n_count;
+  return;
+}
+
+/*
+ * _rank_counts ranks the multiset with cnt[p] ensemble members in pair p.
+ * With the pairs sorted, x_0 <= x_1 <= ..., the rank is
+ * sum_i C(x_i+i,i+1); the members in pair p are at i = start..start+cnt-1,
+ * which sum to C(p+start+cnt,p) - C(p+start,p).
+ */
+static PetscInt _rank_counts(PetscInt *cnt){
+  PetscInt p,start=0,rank=0;
+
+  for (p=0;p<_basis.n_pair;p++){
+    if (p>0&&cnt[p]>0){
+      rank = rank + _binomial(p+start+cnt[p],p) - _binomial(p+start,p);
+    }
+    start = start + cnt[p];
+  }
+  return rank;
+}
+
+/*
+ * _orbit_state gives the representative of orbit o: the other subsystems
+ * at their levels, and the ensemble members (in creation order) in the
+ * sorted pairs of the multiset.
+ * Inputs:
+ *        PetscInt o:    orbit
+ * Outputs:
+ *        PetscInt *ket: ket level of each subsystem
+ *        PetscInt *bra: bra level of each subsystem
+ *        PetscInt *cnt: number of members in each pair
+ */
+static void _orbit_state(PetscInt o,PetscInt *ket,PetscInt *bra,PetscInt *cnt){
+  PetscInt rest,rank,levels,c,p,i;
+  int      s;
+
+  rank = o%_basis.n_count;
+  rest = o/_basis.n_count;
+  for (s=num_subsystems-1;s>=0;s--){
+    if (_basis.in_ens[s]) continue;
+    levels = subsystem_list[s]->my_levels;
+    bra[s] = rest%levels;
+    rest   = rest/levels;
+    ket[s] = rest%levels;
+    rest   = rest/levels;
+  }
+  for (p=0;p<_basis.n_pair;p++){
+    cnt[p] = 0;
+  }
+  /* Unrank: x_i + i is the largest c with C(c,i+1) <= what is left */
+  for (i=_basis.n_ens-1;i>=0;i--){
+    c = i;
+    while (_binomial(c+1,i+1)<=rank) c++;
+    rank = rank - _binomial(c,i+1);
+    p    = c - i;
+    ket[_basis.ens_sub[i]] = p/_basis.levels;
+    bra[_basis.ens_sub[i]] = p%_basis.levels;
+    cnt[p]++;
+  }
+  return;
+}
+
+/*
+ * _orbit_of_levels gives the orbit of the dm element with the given
+ * (ket,bra) levels of each subsystem
+ */
+static PetscInt _orbit_of_levels(PetscInt *ket,PetscInt *bra){
+  PetscInt rest=0,levels,*cnt,rank;
+  int      s;
+
+  cnt = calloc(_basis.n_pair,sizeof(PetscInt));
+  for (s=0;s<num_subsystems;s++){
+    levels = subsystem_list[s]->my_levels;
+    if (_basis.in_ens[s]){
+      cnt[ket[s]*levels+bra[s]]++;
+    } else {
+      rest = (rest*levels + ket[s])*levels + bra[s];
+    }
+  }
+  rank = _rank_counts(cnt);
+  free(cnt);
+  return rest*_basis.n_count + rank;
+}
+
+/*
+ * _permutation_subsystem gives the subsystem op belongs to, by matching
+ * it against the operators made by create_op or create_vec
+ */
+static PetscInt _permutation_subsystem(operator op){
+  operator sub;
+  int      s,j;
+
+  for (s=0;s<num_subsystems;s++){
+    sub = subsystem_list[s];
+    if (sub->my_op_type==VEC){
+      for (j=0;j<sub->my_levels;j++){
+        if (sub->vec_op_list[j]==op) return s;
+      }
+    } else if (op==sub||op==sub->dag||op==sub->n||op==sub->eye||
+               op==sub->sig_x||op==sub->sig_y||op==sub->sig_z){
+      return s;
+    }
+  }
+  if (nid==0){
+    printf("ERROR! Operator does not belong to any subsystem!\n");
+    exit(0);
+  }
+  return -1;
+}
+
+/*
+ * _sort_ops stably sorts the ops of a term by subsystem; ops of
+ * different subsystems commute, so the product does not change
+ */
+static void _sort_ops(PetscInt num_ops,permutation_op *ops){
+  permutation_op tmp;
+  PetscInt       i,j;
+
+  for (i=1;i<num_ops;i++){
+    tmp = ops[i];
+    for (j=i-1;j>=0&&ops[j].sub>tmp.sub;j--){
+      ops[j+1] = ops[j];
+    }
+    ops[j+1] = tmp;
+  }
+  return;
+}
+
+/*
+ * _permutation_add_term records a Hamiltonian (lindblad = 0) or Lindblad
+ * (lindblad = 1) term, a*op_1*...*op_n, in place of adding it to the full
+ * matrices. Consecutive VEC ops of one subsystem make the transition
+ * |op1><op2|, as in add_to_ham_mult2.
+ * Inputs:
+ *        int lindblad:     1 for a Lindblad term
+ *        PetscScalar a:    coefficient
+ *        PetscInt num_ops: number of ops
+ *        operator *ops:    ops of the product
+ */
+void _permutation_add_term(int lindblad,PetscScalar a,PetscInt num_ops,operator *ops){
+  permutation_term *term;
+  PetscInt         i,n;
+
+  if (_print_dense_ham){
+    if (nid==0){
+      printf("ERROR! print_dense_ham can not be used with use_permutation_symmetry!\n");
+      exit(0);
+    }
+  }
+  op_finalized = 1;
+  if (lindblad) _lindblad_terms = 1;
+  if (PetscAbsComplex(a)==0) return;
+
+  _permutation_terms = realloc(_permutation_terms,(_num_permutation_terms+1)*sizeof(permutation_term));
+  term = &_permutation_terms[_num_permutation_terms];
+  term->lindblad = lindblad;
+  term->coeff    = a;
+  term->ops      = malloc(num_ops*sizeof(permutation_op));
+  n = 0;
+  for (i=0;i<num_ops;i++){
+    term->ops[n].sub  = _permutation_subsystem(ops[i]);
+    term->ops[n].type = ops[i]->my_op_type;
+    term->ops[n].row  = ops[i]->position;
+    term->ops[n].col  = ops[i]->position;
+    if (ops[i]->my_op_type==VEC&&i+1<num_ops&&ops[i+1]->my_op_type==VEC&&
+        _permutation_subsystem(ops[i+1])==term->ops[n].sub){
+      term->ops[n].col = ops[i+1]->position;
+      i++;
+    }
+    n++;
+  }
+  term->num_ops = n;
+  _sort_ops(term->num_ops,term->ops);
+  _num_permutation_terms++;
+  return;
+}
+
+/*
+ * _permutation_destroy_terms frees the recorded terms
+ */
+void _permutation_destroy_terms(){
+  int i;
+
+  for (i=0;i<_num_permutation_terms;i++){
+    free(_permutation_terms[i].ops);
+  }
+  free(_permutation_terms);
+  _permutation_terms     = NULL;
+  _num_permutation_terms = 0;
+  return;
+}
+
+/*
+ * _same_product checks if two terms are the same kind of term of the
+ * same product of ops
+ */
+static int _same_product(permutation_term *t1,permutation_term *t2){
+  PetscInt i;
+
+  if (t1->lindblad!=t2->lindblad||t1->num_ops!=t2->num_ops) return 0;
+  for (i=0;i<t1->num_ops;i++){
+    if (t1->ops[i].sub!=t2->ops[i].sub||t1->ops[i].type!=t2->ops[i].type||
+        t1->ops[i].row!=t2->ops[i].row||t1->ops[i].col!=t2->ops[i].col){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * _merge_terms sums the coefficients of terms with the same product and
+ * drops the ones that cancel. The merged terms share the ops arrays of
+ * the recorded terms.
+ * Outputs:
+ *        permutation_term **merged: the merged terms (free only the array)
+ * Return value:
+ *        int:                       number of merged terms
+ */
+static int _merge_terms(permutation_term **merged){
+  int i,j,n=0;
+
+  *merged = malloc((_num_permutation_terms+1)*sizeof(permutation_term));
+  for (i=0;i<_num_permutation_terms;i++){
+    for (j=0;j<n;j++){
+      if (_same_product(&(*merged)[j],&_permutation_terms[i])) break;
+    }
+    if (j<n){
+      (*merged)[j].coeff = (*merged)[j].coeff + _permutation_terms[i].coeff;
+    } else {
+      (*merged)[n] = _permutation_terms[i];
+      n++;
+    }
+  }
+  for (i=0,j=0;i<n;i++){
+    if (PetscAbsComplex((*merged)[i].coeff)!=0){
+      (*merged)[j] = (*merged)[i];
+      j++;
+    }
+  }
+  return j;
+}
+
+/*
+ * _terms_invariant checks that the terms are unchanged when the ensemble
+ * members are permuted. It is enough to check a swap of the first two
+ * members and a cyclic shift of all of them, which generate all
+ * permutations.
+ */
+static int _terms_invariant(permutation_term *terms,int n_terms){
+  permutation_term image;
+  PetscScalar      coeff;
+  PetscInt         i,k,max_ops=1;
+  int              t,t2,g,s;
+
+  for (t=0;t<n_terms;t++){
+    max_ops = PetscMax(max_ops,terms[t].num_ops);
+  }
+  image.ops = malloc(max_ops*sizeof(permutation_op));
+  for (g=0;g<2;g++){
+    for (t=0;t<n_terms;t++){
+      image.lindblad = terms[t].lindblad;
+      image.num_ops  = terms[t].num_ops;
+      for (i=0;i<terms[t].num_ops;i++){
+        image.ops[i] = terms[t].ops[i];
+        s = terms[t].ops[i].sub;
+        if (!_basis.in_ens[s]) continue;
+        k = _basis.ens_index[s];
+        if (g==0){
+          k = (k==0) ? 1 : ((k==1) ? 0 : k);
+        } else {
+          k = (k+1)%_basis.n_ens;
+        }
+        image.ops[i].sub = _basis.ens_sub[k];
+      }
+      _sort_ops(image.num_ops,image.ops);
+      coeff = 0.0;
+      for (t2=0;t2<n_terms;t2++){
+        if (_same_product(&terms[t2],&image)){
+          coeff = terms[t2].coeff;
+          break;
+        }
+      }
+      if (PetscAbsComplex(coeff-terms[t].coeff)>1e-12*PetscAbsComplex(terms[t].coeff)){
+        free(image.ops);
+        return 0;
+      }
+    }
+  }
+  free(image.ops);
+  return 1;
+}
+
+/*
+ * _op_row gives the nonzero in row m of a single subsystem op; all ops
+ * have at most one nonzero per row and per column
+ * Return value:
+ *        int: 0 if row m is zero
+ */
+static int _op_row(permutation_op *op,PetscInt levels,PetscInt m,PetscInt *col,PetscScalar *val){
+  *col = m;
+  *val = 1.0;
+  if (op->type==LOWER){
+    *col = m+1;
+    *val = PetscSqrtReal((PetscReal)m+1);
+    return m+1<levels;
+  } else if (op->type==RAISE){
+    *col = m-1;
+    *val = PetscSqrtReal((PetscReal)m);
+    return m>0;
+  } else if (op->type==NUMBER){
+    *val = (PetscReal)m;
+    return m>0;
+  } else if (op->type==SIGMA_X){
+    *col = 1-m;
+  } else if (op->type==SIGMA_Y){
+    *col = 1-m;
+    *val = (m==0) ? -PETSC_i : PETSC_i;
+  } else if (op->type==SIGMA_Z){
+    *val = (m==0) ? 1.0 : -1.0;
+  } else if (op->type==VEC){
+    *col = op->col;
+    return m==op->row;
+  }
+  return 1;
+}
+
+/*
+ * _op_col gives the nonzero in column m of a single subsystem op
+ * Return value:
+ *        int: 0 if column m is zero
+ */
+static int _op_col(permutation_op *op,PetscInt levels,PetscInt m,PetscInt *row,PetscScalar *val){
+  *row = m;
+  *val = 1.0;
+  if (op->type==LOWER){
+    *row = m-1;
+    *val = PetscSqrtReal((PetscReal)m);
+    return m>0;
+  } else if (op->type==RAISE){
+    *row = m+1;
+    *val = PetscSqrtReal((PetscReal)m+1);
+    return m+1<levels;
+  } else if (op->type==NUMBER){
+    *val = (PetscReal)m;
+    return m>0;
+  } else if (op->type==SIGMA_X){
+    *row = 1-m;
+  } else if (op->type==SIGMA_Y){
+    *row = 1-m;
+    *val = (m==0) ? PETSC_i : -PETSC_i;
+  } else if (op->type==SIGMA_Z){
+    *val = (m==0) ? 1.0 : -1.0;
+  } else if (op->type==VEC){
+    *row = op->row;
+    return m==op->col;
+  }
+  return 1;
+}
+
+/*
+ * _term_row moves lev (the levels of a ket or bra) to the nonzero of
+ * its row in the product of the term's ops, and multiplies val by it
+ * Return value:
+ *        int: 0 if the row is zero (lev is then partly moved)
+ */
+static int _term_row(permutation_term *term,PetscInt *lev,PetscScalar *val){
+  PetscScalar v;
+  PetscInt    i,s;
+
+  for (i=0;i<term->num_ops;i++){
+    s = term->ops[i].sub;
+    if (!_op_row(&term->ops[i],subsystem_list[s]->my_levels,lev[s],&lev[s],&v)) return 0;
+    *val = *val*v;
+  }
+  return 1;
+}
+
+/*
+ * _term_col is _term_row for the column of the product
+ */
+static int _term_col(permutation_term *term,PetscInt *lev,PetscScalar *val){
+  PetscScalar v;
+  PetscInt    i,s;
+
+  for (i=term->num_ops-1;i>=0;i--){
+    s = term->ops[i].sub;
+    if (!_op_col(&term->ops[i],subsystem_list[s]->my_levels,lev[s],&lev[s],&v)) return 0;
+    *val = *val*v;
+  }
+  return 1;
+}
+
+/*
+ * permutation_row holds the representative of the row being built,
+ * and the levels of the subsystems a term touches before it was applied
+ */
+typedef struct permutation_row{
+  PetscInt  o,rest,*ket,*bra,*cnt,*new_cnt,*old_ket,*old_bra;
+  PetscInt  *start,*used; /* first member in each pair; members a term uses */
+  PetscReal log_fact;
+} permutation_row;
+
+static void _save_levels(permutation_row *row,permutation_term *term){
+  PetscInt i;
+
+  for (i=0;i<term->num_ops;i++){
+    row->old_ket[i] = row->ket[term->ops[i].sub];
+    row->old_bra[i] = row->bra[term->ops[i].sub];
+  }
+  return;
+}
+
+static void _restore_levels(permutation_row *row,permutation_term *term){
+  PetscInt i;
+
+  /* Backwards, so a subsystem that appears twice gets its first saved level */
+  for (i=term->num_ops-1;i>=0;i--){
+    row->ket[term->ops[i].sub] = row->old_ket[i];
+    row->bra[term->ops[i].sub] = row->old_bra[i];
+  }
+  return;
+}
+
+/*
+ * _term_multiplicity gives how many terms act on the row's representative
+ * the same way as term. The members of the representative are sorted by
+ * pair, so permuting the members within a block of one pair leaves it
+ * unchanged, and maps the (invariant) terms onto each other. Only the
+ * term that uses the first k members of each block it touches is kept,
+ * standing in for the C(cnt,k) choices of members.
+ * Return value:
+ *        PetscReal: number of equivalent terms, or 0 to skip the term
+ */
+static PetscReal _term_multiplicity(permutation_row *row,permutation_term *term){
+  PetscReal mult=1.0;
+  PetscInt  i,j,k,p,s,n_used=0;
+
+  for (i=0;i<term->num_ops;i++){
+    s = term->ops[i].sub;
+    if (!_basis.in_ens[s]) continue;
+    for (j=0;j<n_used&&row->used[j]!=s;j++);
+    if (j<n_used) continue; /* Already counted */
+    row->used[n_used] = s;
+    n_used++;
+  }
+  for (i=0;i<n_used;i++){
+    k = _basis.ens_index[row->used[i]];
+    p = row->ket[row->used[i]]*_basis.levels + row->bra[row->used[i]];
+    /* Number of members of this block that the term uses */
+    for (j=0,s=0;j<n_used;j++){
+      if (row->ket[row->used[j]]*_basis.levels+row->bra[row->used[j]]==p) s++;
+    }
+    if (k>=row->start[p]+s) return 0;
+    if (k==row->start[p]) mult = mult*_binomial(row->cnt[p],s);
+  }
+  return mult;
+}
+
+/*
+ * _permutation_add_entry adds val times the dm element (ket,bra), which
+ * differs from the row's representative only in the subsystems of term,
+ * to the row. In the basis of orbit sums, y_o, the element is y_o/|o|,
+ * and the row is summed over the |row| elements of its orbit, so val is
+ * scaled by |row|/|o| = prod_p cnt_o[p]! / prod_p cnt_row[p]!.
+ */
+static void _permutation_add_entry(permutation_row *row,permutation_term *term,PetscScalar val,coo_list *coo){
+  PetscInt  i,j,s,levels,rest,col;
+  PetscReal log_fact=0;
+
+  memcpy(row->new_cnt,row->cnt,_basis.n_pair*sizeof(PetscInt));
+  rest = row->rest;
+  for (i=0;i<term->num_ops;i++){
+    s = term->ops[i].sub;
+    for (j=0;j<i&&term->ops[j].sub!=s;j++);
+    if (j<i) continue; /* Already counted */
+    levels = subsystem_list[s]->my_levels;
+    if (_basis.in_ens[s]){
+      row->new_cnt[row->old_ket[i]*levels+row->old_bra[i]]--;
+      row->new_cnt[row->ket[s]*levels+row->bra[s]]++;
+    } else {
+      rest = rest + ((row->ket[s]-row->old_ket[i])*levels + row->bra[s]-row->old_bra[i])*_basis.stride[s];
+    }
+  }
+  for (i=0;i<_basis.n_pair;i++){
+    log_fact = log_fact + lgamma(row->new_cnt[i]+1);
+  }
+  col = rest*_basis.n_count + _rank_counts(row->new_cnt);
+  _coo_add(coo,row->o,col,val*PetscExpReal(log_fact-row->log_fact));
+  return;
+}
+
+/*
+ * _permutation_row_entries adds the entries of row o of the Liouvillian
+ * in the orbit basis, -i[H,rho] + sum_L c (L rho L^dag - 1/2 {L^dag L,rho}),
+ * by applying the terms to the representative of o (one of each set of
+ * equivalent terms, see _term_multiplicity)
+ */
+static void _permutation_row_entries(permutation_row *row,permutation_term *terms,int n_terms,coo_list *coo){
+  permutation_term *term,term_copy;
+  PetscScalar      u,w;
+  PetscReal        mult;
+  PetscInt         p,start=0;
+  int              t;
+
+  row->rest = row->o/_basis.n_count;
+  _orbit_state(row->o,row->ket,row->bra,row->cnt);
+  row->log_fact = 0;
+  for (p=0;p<_basis.n_pair;p++){
+    row->log_fact = row->log_fact + lgamma(row->cnt[p]+1);
+    row->start[p] = start;
+    start         = start + row->cnt[p];
+  }
+
+  for (t=0;t<n_terms;t++){
+    mult = _term_multiplicity(row,&terms[t]);
+    if (mult==0) continue;
+    /* Apply mult copies of the term at once */
+    term_copy       = terms[t];
+    term_copy.coeff = mult*terms[t].coeff;
+    term            = &term_copy;
+    _save_levels(row,term);
+    if (!term->lindblad){
+      /* -i (H rho)_ab = -i H_aa' rho_a'b */
+      u = 1.0;
+      if (_term_row(term,row->ket,&u)){
+        _permutation_add_entry(row,term,-PETSC_i*term->coeff*u,coo);
+      }
+      _restore_levels(row,term);
+      /* i (rho H)_ab = i rho_ab' H_b'b */
+      u = 1.0;
+      if (_term_col(term,row->bra,&u)){
+        _permutation_add_entry(row,term,PETSC_i*term->coeff*u,coo);
+      }
+      _restore_levels(row,term);
+    } else {
+      /* (L rho L^dag)_ab = L_aa' rho_a'b' conj(L_bb') */
+      u = 1.0;
+      w = 1.0;
+      if (_term_row(term,row->ket,&u)&&_term_row(term,row->bra,&w)){
+        _permutation_add_entry(row,term,term->coeff*u*PetscConj(w),coo);
+      }
+      _restore_levels(row,term);
+      /* -1/2 (L^dag L rho)_ab, with (L^dag L)_aa' = conj(L_ca) L_ca' */
+      u = 1.0;
+      w = 1.0;
+      if (_term_col(term,row->ket,&u)&&_term_row(term,row->ket,&w)){
+        _permutation_add_entry(row,term,-0.5*term->coeff*PetscConj(u)*w,coo);
+      }
+      _restore_levels(row,term);
+      /* -1/2 (rho L^dag L)_ab, with (L^dag L)_b'b = conj(L_cb') L_cb */
+      u = 1.0;
+      w = 1.0;
+      if (_term_col(term,row->bra,&w)&&_term_row(term,row->bra,&u)){
+        _permutation_add_entry(row,term,-0.5*term->coeff*PetscConj(u)*w,coo);
+      }
+      _restore_levels(row,term);
+    }
+  }
+  return;
+}
+
+/*
+ * _orbit_is_diagonal checks if the representative (ket,bra) of an orbit
+ * is a diagonal dm element
+ */
+static int _orbit_is_diagonal(PetscInt *ket,PetscInt *bra){
+  int s;
+
+  for (s=0;s<num_subsystems;s++){
+    if (ket[s]!=bra[s]) return 0;
+  }
+  return 1;
+}
+
+/*
+ * _permutation_num_orbits gives the size of the dm in the permutation
+ * invariant basis
+ */
+PetscInt _permutation_num_orbits(){
+  _permutation_basis_setup();
+  return _basis.n_orbits;
+}
+
+/*
+ * _permutation_create_dm creates a dm in the permutation invariant basis,
+ * initialized to 0. Its layout matches _permutation_build_mat.
+ * Outputs:
+ *        Vec *new_dm: the new dm
+ */
+void _permutation_create_dm(Vec *new_dm){
+
+  _permutation_basis_setup();
+  VecCreate(quac_comm,new_dm);
+  VecSetType(*new_dm,VECMPI);
+  VecSetSizes(*new_dm,PETSC_DECIDE,_basis.n_orbits);
+  VecSet(*new_dm,0.0);
+  return;
+}
+
+/*
+ * _permutation_add_value adds val at (row,col) of the full dm to a dm
+ * in the permutation invariant basis, i.e., to the orbit of (row,col).
+ * row and col number the states with the subsystems in creation order.
+ */
+void _permutation_add_value(Vec dm,PetscInt row,PetscInt col,PetscScalar val){
+  PetscInt *ket,*bra,levels,orbit,low,high;
+  int      s;
+
+  _permutation_basis_setup();
+  ket = malloc(num_subsystems*sizeof(PetscInt));
+  bra = malloc(num_subsystems*sizeof(PetscInt));
+  for (s=num_subsystems-1;s>=0;s--){
+    levels = subsystem_list[s]->my_levels;
+    ket[s] = row%levels;
+    bra[s] = col%levels;
+    row    = row/levels;
+    col    = col/levels;
+  }
+  orbit = _orbit_of_levels(ket,bra);
+  VecGetOwnershipRange(dm,&low,&high);
+  if (orbit>=low&&orbit<high){
+    VecSetValue(dm,orbit,val,ADD_VALUES);
+  }
+  free(ket);
+  free(bra);
+  return;
+}
+
+/*
+ * _permutation_set_initial_pop puts all of the population of a dm in the
+ * permutation invariant basis in the product state of the subsystems'
+ * initial_pop (symmetrized over the ensemble, if the members differ)
+ */
+void _permutation_set_initial_pop(Vec x){
+  PetscInt *ket,orbit;
+  int      s;
+
+  _permutation_basis_setup();
+  ket = malloc(num_subsystems*sizeof(PetscInt));
+  for (s=0;s<num_subsystems;s++){
+    if (subsystem_list[s]->my_op_type==VEC){
+      if (nid==0){
+        printf("ERROR! set_dm_from_initial_pop does not support VEC operators\n");
+        printf("       with use_permutation_symmetry. Use add_value_to_dm instead.\n");
+        exit(0);
+      }
+    }
+    ket[s] = (PetscInt)subsystem_list[s]->initial_pop;
+  }
+  orbit = _orbit_of_levels(ket,ket);
+  if (nid==0){
+    VecSetValue(x,orbit,1.0,INSERT_VALUES);
+  }
+  VecAssemblyBegin(x);
+  VecAssemblyEnd(x);
+  free(ket);
+  return;
+}
+
+/*
+ * _permutation_build_mat builds the Liouvillian in the permutation
+ * invariant basis directly from the recorded terms. Each core generates
+ * only its own rows, from the representatives of its orbits, so nothing
+ * of the size of the full space (or of the whole basis) is ever built.
+ * Exits with an error if the terms are not invariant under permuting the
+ * ensemble.
+ * Must be called from all cores.
+ * Inputs:
+ *        int stabilize: if 1, add the trace of the dm to row 0, as the
+ *                       stabilization of the steady state solve does
+ * Outputs:
+ *        Mat *A:        the new matrix, acting on orbit sums
+ */
+void _permutation_build_mat(Mat *A,int stabilize){
+  permutation_term *terms;
+  permutation_row  row;
+  coo_list         coo,row_coo,merged;
+  PetscInt         Istart,Iend,max_ops=1;
+  int              n_terms,t;
+
+  _permutation_basis_setup();
+  n_terms = _merge_terms(&terms);
+  if (!_terms_invariant(terms,n_terms)){
+    if (nid==0){
+      printf("ERROR! The terms are not invariant under permuting the identical subsystems,\n");
+      printf("       so use_permutation_symmetry can not be used for this system!\n");
+      exit(0);
+    }
+  }
+  for (t=0;t<n_terms;t++){
+    max_ops = PetscMax(max_ops,terms[t].num_ops);
+  }
+  row.ket     = malloc(num_subsystems*sizeof(PetscInt));
+  row.bra     = malloc(num_subsystems*sizeof(PetscInt));
+  row.cnt     = malloc(_basis.n_pair*sizeof(PetscInt));
+  row.new_cnt = malloc(_basis.n_pair*sizeof(PetscInt));
+  row.old_ket = malloc(max_ops*sizeof(PetscInt));
+  row.old_bra = malloc(max_ops*sizeof(PetscInt));
+  row.start   = malloc(_basis.n_pair*sizeof(PetscInt));
+  row.used    = malloc(max_ops*sizeof(PetscInt));
+
+  MatCreate(quac_comm,A);
+  MatSetSizes(*A,PETSC_DECIDE,PETSC_DECIDE,_basis.n_orbits,_basis.n_orbits);
+  MatSetType(*A,MATMPIAIJ);
+  _coo_get_ownership_range(*A,&Istart,&Iend);
+
+  /* Merge each row before keeping it, since many terms hit the same orbits */
+  _coo_create(&coo,10*(Iend-Istart)+1);
+  _coo_create(&row_coo,3*n_terms+2);
+  for (row.o=Istart;row.o<Iend;row.o++){
+    _coo_clear(&row_coo);
+    _permutation_row_entries(&row,terms,n_terms,&row_coo);
+    /* The diagonal must be in the pattern */
+    _coo_add(&row_coo,row.o,row.o,0.0);
+    _coo_sort_and_merge(&row_coo,&merged,NULL);
+    _coo_append(&coo,&merged);
+    _coo_destroy(&merged);
+    /* Tr(rho) is the sum of the diagonal orbits */
+    if (stabilize&&_orbit_is_diagonal(row.ket,row.bra)){
+      _coo_add(&coo,0,row.o,1.0);
+    }
+  }
+  _coo_set_mat(*A,&coo);
+  _coo_destroy(&coo);
+  _coo_destroy(&row_coo);
+  MatAssemblyBegin(*A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(*A,MAT_FINAL_ASSEMBLY);
+
+  free(row.ket);
+  free(row.bra);
+  free(row.cnt);
+  free(row.new_cnt);
+  free(row.old_ket);
+  free(row.old_bra);
+  free(row.start);
+  free(row.used);
+  free(terms);
+  if (nid==0) printf("Permutation symmetry over %ld subsystems: solving on %ld elements.\n",
+                     (long)_basis.n_ens,(long)_basis.n_orbits);
+  return;
+}
+
+/*
+ * _permutation_populations is get_populations for a dm in the
+ * permutation invariant basis. The value of a diagonal orbit is the total
+ * probability of its states, so the populations are sums over the local
+ * diagonal orbits; every ensemble member gets the ensemble's mean.
+ * Inputs:
+ *        Vec x:               dm in the permutation invariant basis
+ * Outputs:
+ *        double *populations: the populations (on core 0)
+ */
+void _permutation_populations(Vec x,double *populations){
+  PetscInt          Istart,Iend,o,p,*ket,*bra,*cnt,dim;
+  const PetscScalar *xa;
+  PetscReal         val,*ens_pop;
+  int               s,num_pop,*i_sub_to_i_pop;
+
+  _permutation_basis_setup();
+  VecGetSize(x,&dim);
+  if (dim!=_basis.n_orbits){
+    if (nid==0){
+      printf("ERROR! The input density matrix is not in the permutation invariant basis!\n");
+      printf("       Populations cannot be calculated.\n");
+      exit(0);
+    }
+  }
+
+  i_sub_to_i_pop = malloc(num_subsystems*sizeof(int));
+  num_pop = 0;
+  for (s=0;s<num_subsystems;s++){
+    i_sub_to_i_pop[s] = num_pop;
+    if (subsystem_list[s]->my_op_type==VEC){
+      num_pop += subsystem_list[s]->my_levels;
+    } else {
+      num_pop += 1;
+    }
+  }
+  for (s=0;s<num_pop;s++){
+    populations[s] = 0.0;
+  }
+  /* Total population of the ensemble in each level */
+  ens_pop = calloc(_basis.levels,sizeof(PetscReal));
+  ket     = malloc(num_subsystems*sizeof(PetscInt));
+  bra     = malloc(num_subsystems*sizeof(PetscInt));
+  cnt     = malloc(_basis.n_pair*sizeof(PetscInt));
+
+  VecGetOwnershipRange(x,&Istart,&Iend);
+  VecGetArrayRead(x,&xa);
+  for (o=Istart;o<Iend;o++){
+    _orbit_state(o,ket,bra,cnt);
+    if (!_orbit_is_diagonal(ket,bra)) continue;
+    val = PetscRealPart(xa[o-Istart]);
+    for (s=0;s<num_subsystems;s++){
+      if (_basis.in_ens[s]) continue;
+      if (subsystem_list[s]->my_op_type==VEC){
+        populations[i_sub_to_i_pop[s]+ket[s]] += val;
+      } else {
+        populations[i_sub_to_i_pop[s]] += val*ket[s];
+      }
+    }
+    for (p=0;p<_basis.levels;p++){
+      ens_pop[p] = ens_pop[p] + val*cnt[p*_basis.levels+p];
+    }
+  }
+  VecRestoreArrayRead(x,&xa);
+
+  for (s=0;s<num_subsystems;s++){
+    if (!_basis.in_ens[s]) continue;
+    for (p=0;p<_basis.levels;p++){
+      if (subsystem_list[s]->my_op_type==VEC){
+        populations[i_sub_to_i_pop[s]+p] += ens_pop[p]/_basis.n_ens;
+      } else {
+        populations[i_sub_to_i_pop[s]] += p*ens_pop[p]/_basis.n_ens;
+      }
+    }
+  }
+  if (nid==0){
+    MPI_Reduce(MPI_IN_PLACE,populations,num_pop,MPI_DOUBLE,MPI_SUM,0,quac_comm);
+  } else {
+    MPI_Reduce(populations,populations,num_pop,MPI_DOUBLE,MPI_SUM,0,quac_comm);
+  }
+
+  free(ens_pop);
+  free(ket);
+  free(bra);
+  free(cnt);
+  free(i_sub_to_i_pop);
+  return;
+}
+
+/*
+ * _symmetry_reduce_system reduces the system to the block of elements
+ * with a conserved excitation number, if use_symmetry_reduction was
+ * called. (Permutation symmetry is not a reduction of the full system;
+ * see use_permutation_symmetry.)
+ * Must be called from all cores.
+ * Inputs:
+ *        Mat A:        assembled full_A or ham_A
+ *        Vec x:        initial state (not used if steady)
+ *        int lindblad: 1 if x is a dm, 0 if x is a psi
+ *        int steady:   1 if called from steady_state
+ * Outputs:
+ *        symmetry_reduction *red: the reduction (type NO_REDUCTION if none)
+ * Return value:
+ *        int:          1 if the system was reduced
+ */
+int _symmetry_reduce_system(Mat A,Vec x,int lindblad,int steady,symmetry_reduction *red){
+  PetscBool flag;
+
+  PetscOptionsHasName(NULL,NULL,"-quac_symmetry_reduce",&flag);
+  if (flag) _symmetry_reduce = 1;
+
+  red->type = NO_REDUCTION;
+  if (_symmetry_reduce&&_build_symmetry_is(A,x,lindblad,steady,&red->is)){
+    red->type = U1_REDUCTION;
+    MatCreateSubMatrix(A,red->is,red->is,MAT_INITIAL_MATRIX,&red->A);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * _symmetry_restrict maps the full state x onto the reduced state y
+ * (created with MatCreateVecs from the reduced matrix).
+ */
+void _symmetry_restrict(symmetry_reduction *red,Vec x,Vec y){
+
+  if (red->type==U1_REDUCTION){
+    VecISCopy(x,red->is,SCATTER_REVERSE,y);
+  }
+  return;
+}
+
+/*
+ * _symmetry_expand maps the reduced state y back onto the full state x
+ */
+void _symmetry_expand(symmetry_reduction *red,Vec y,Vec x){
+
+  if (red->type==U1_REDUCTION){
+    VecISCopy(x,red->is,SCATTER_FORWARD,y);
+  }
+  return;
+}
+
+/*
+ * _symmetry_destroy frees the reduced matrix and index set
+ */
+void _symmetry_destroy(symmetry_reduction *red){
+  if (red->type==NO_REDUCTION) return;
+  MatDestroy(&red->A);
+  ISDestroy(&red->is);
+  red->type = NO_REDUCTION;
+  return;
+}
+
+/*
+ * _symmetry_ts_monitor copies the reduced state into the full dm and
+ * calls the user's monitor with it.
+ */
+PetscErrorCode _symmetry_ts_monitor(TS ts,PetscInt step,PetscReal time,Vec y,void *ctx){
+  symmetry_monitor_ctx *sym_ctx = (symmetry_monitor_ctx*)ctx;
+
+  _symmetry_expand(sym_ctx->reduction,y,sym_ctx->full_x);
+  return sym_ctx->monitor(ts,step,time,sym_ctx->full_x,sym_ctx->ctx);
+}
@@ -0,0 +1,77 @@
+#ifndef SYMMETRY_H_
+#define SYMMETRY_H_
+
+#include <petscts.h>
+#include "operators.h"
+
+typedef enum {
+  NO_REDUCTION          = 0,
+  U1_REDUCTION          = 1
+} reduction_type;
+
+/*
+ * symmetry_reduction describes how the full state vector maps onto a
+ * smaller, reduced one: the block of elements in is.
+ */
+typedef struct symmetry_reduction{
+  reduction_type type;
+  Mat            A;       /* reduced matrix */
+  IS             is;      /* U1: kept elements */
+} symmetry_reduction;
+
+/*
+ * permutation_op is one factor of a term recorded with permutation
+ * symmetry: a ladder, number, identity or Pauli op of subsystem sub, or,
+ * for a VEC, the transition |row><col| (|row><row| for a single VEC op)
+ */
+typedef struct permutation_op{
+  PetscInt sub;
+  op_type  type;
+  int      row,col;
+} permutation_op;
+
+/*
+ * permutation_term is a Hamiltonian term coeff*op_1*...*op_n, or a
+ * Lindblad term coeff*L(op_1*...*op_n). The ops are sorted by subsystem.
+ */
+typedef struct permutation_term{
+  int            lindblad,num_ops;
+  PetscScalar    coeff;
+  permutation_op *ops;
+} permutation_term;
+
+/*
+ * symmetry_monitor_ctx wraps the user's time step monitor when time_step
+ * runs on a reduced system, so that the monitor still sees the full dm.
+ */
+typedef struct symmetry_monitor_ctx{
+  Vec full_x;
+  symmetry_reduction *reduction;
+  PetscErrorCode (*monitor)(TS,PetscInt,PetscReal,Vec,void*);
+  void *ctx;
+} symmetry_monitor_ctx;
+
+void use_symmetry_reduction();
+void use_permutation_symmetry();
+PetscInt _excitation_number(PetscInt);
+int _build_symmetry_is(Mat,Vec,int,int,IS*);
+int _symmetry_reduce_system(Mat,Vec,int,int,symmetry_reduction*);
+void _symmetry_restrict(symmetry_reduction*,Vec,Vec);
+void _symmetry_expand(symmetry_reduction*,Vec,Vec);
+void _symmetry_destroy(symmetry_reduction*);
+PetscErrorCode _symmetry_ts_monitor(TS,PetscInt,PetscReal,Vec,void*);
+void _permutation_add_term(int,PetscScalar,PetscInt,operator*);
+void _permutation_destroy_terms();
+PetscInt _permutation_num_orbits();
+void _permutation_create_dm(Vec*);
+void _permutation_add_value(Vec,PetscInt,PetscInt,PetscScalar);
+void _permutation_set_initial_pop(Vec);
+void _permutation_build_mat(Mat*,int);
+void _permutation_populations(Vec,double*);
+
+extern int _symmetry_reduce;
+extern int _permutation_reduce;
+extern permutation_term *_permutation_terms;
+extern int _num_permutation_terms;
+
+#endif
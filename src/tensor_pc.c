@@ -0,0 +1,332 @@
+#include "tensor_pc.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "quac_p.h"
+#include <petscblaslapack.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+int _tensor_pc = 0;
+
+/*
+ * use_tensor_preconditioner tells steady_state to precondition GMRES with
+ * the inverse of the local (single subsystem) part of the Liouvillian,
+ * applied through its Kronecker structure (fast diagonalization), rather
+ * than with PCASM. It helps most when the subsystems are strongly damped
+ * or detuned compared to their couplings. Can also be turned on with the
+ * command line option -quac_tensor_pc.
+ */
+void use_tensor_preconditioner(){
+  _tensor_pc = 1;
+  return;
+}
+
+/*
+ * _get_pair returns the (row level, column level) pair index of
+ * subsystem s for element k of the dm, where k = column*total_levels + row
+ */
+static PetscInt _get_pair(PetscInt k,PetscInt levels,PetscInt n_after){
+  PetscInt a,b;
+
+  a = (k%total_levels/n_after)%levels;
+  b = (k/total_levels/n_after)%levels;
+  return a*levels + b;
+}
+
+/*
+ * _apply_pair_mode multiplies each of the n_fibers contiguous fibers of
+ * length d2 in w by the d2 x d2 matrix M (column major)
+ */
+static void _apply_pair_mode(PetscScalar *w,PetscInt n_fibers,PetscInt d2,PetscScalar *M){
+  PetscInt    f,p,q;
+  PetscScalar *out;
+
+  out = malloc(d2*sizeof(PetscScalar));
+  for (f=0;f<n_fibers;f++){
+    for (p=0;p<d2;p++){
+      out[p] = 0.0;
+      for (q=0;q<d2;q++){
+        out[p] = out[p] + M[p+q*d2]*w[f*d2+q];
+      }
+    }
+    for (p=0;p<d2;p++){
+      w[f*d2+p] = out[p];
+    }
+  }
+  free(out);
+  return;
+}
+
+/*
+ * _create_fiber_scatter makes the vector that holds the dm grouped into
+ * the level pair fibers of one subsystem, with whole fibers on each core,
+ * and the scatter to it from the usual layout of x
+ * Inputs:
+ *        Vec x:             vector with the layout of full_A
+ *        PetscInt levels:   levels of the subsystem
+ *        PetscInt n_after:  stride of the subsystem
+ * Outputs:
+ *        Vec *fibers:       fiber f, pair p is element f*levels^2+p
+ *        VecScatter *scatter: from x to fibers
+ */
+static void _create_fiber_scatter(Vec x,PetscInt levels,PetscInt n_after,Vec *fibers,VecScatter *scatter){
+  PetscInt dim,d2,n_fibers,n_local,n_rest,Fstart,Fend,m,f,p,row,col,*idx;
+  IS       is_from,is_to;
+
+  VecGetSize(x,&dim);
+  d2       = levels*levels;
+  n_fibers = dim/d2;
+  n_local  = PETSC_DECIDE;
+  PetscSplitOwnership(quac_comm,&n_local,&n_fibers);
+  VecCreateMPI(quac_comm,n_local*d2,dim,fibers);
+  VecGetOwnershipRange(*fibers,&Fstart,&Fend);
+
+  /* Rows (and columns) of the dm without the subsystem's own level */
+  n_rest = total_levels/levels;
+  idx    = malloc((Fend-Fstart)*sizeof(PetscInt));
+  for (m=Fstart;m<Fend;m++){
+    f   = m/d2;
+    p   = m%d2;
+    row = (f%n_rest/n_after)*levels*n_after + f%n_rest%n_after + (p/levels)*n_after;
+    col = (f/n_rest/n_after)*levels*n_after + f/n_rest%n_after + (p%levels)*n_after;
+    idx[m-Fstart] = col*total_levels + row;
+  }
+  ISCreateGeneral(quac_comm,Fend-Fstart,idx,PETSC_OWN_POINTER,&is_from);
+  ISCreateStride(quac_comm,Fend-Fstart,Fstart,1,&is_to);
+  VecScatterCreate(x,is_from,*fibers,is_to,scatter);
+  ISDestroy(&is_from);
+  ISDestroy(&is_to);
+  return;
+}
+
+/*
+ * _set_tensor_pc extracts the local Liouvillians L_s from the assembled
+ * matrix A and sets pc to apply the inverse of their Kronecker sum.
+ * Entries of A that change only subsystem s are averaged over the other
+ * subsystems to give the off diagonal of L_s; the diagonal of A is split
+ * into per-subsystem parts with an additive (ANOVA) fit. Entries that
+ * change more than one subsystem (couplings) are left to GMRES.
+ * Must be called from all cores.
+ * Inputs:
+ *        PC pc: preconditioner of the steady state KSP
+ *        Mat A: assembled full_A
+ */
+void _set_tensor_pc(PC pc,Mat A){
+  tensor_pc_ctx     *ctx;
+  PetscInt          Istart,Iend,k,j,ncols,d,d2,p,n_diff,s_diff,rest;
+  PetscInt          *pk,*pcol;
+  const PetscInt    *cols;
+  const PetscScalar *vals;
+  PetscScalar       **local_L,**diag_sum,mean;
+  PetscScalar       *work,sdummy;
+  PetscReal         *rwork,scale;
+  PetscBLASInt      idummy,lwork,lierr,nb,*ipiv;
+  int               s;
+  Vec               x;
+
+  ctx = malloc(sizeof(tensor_pc_ctx));
+  ctx->num_sys = num_subsystems;
+  MatGetSize(A,&ctx->dim,NULL);
+  ctx->levels  = malloc(num_subsystems*sizeof(PetscInt));
+  ctx->n_after = malloc(num_subsystems*sizeof(PetscInt));
+  ctx->V       = malloc(num_subsystems*sizeof(PetscScalar*));
+  ctx->Vinv    = malloc(num_subsystems*sizeof(PetscScalar*));
+  ctx->eigs    = malloc(num_subsystems*sizeof(PetscScalar*));
+  local_L      = malloc(num_subsystems*sizeof(PetscScalar*));
+  diag_sum     = malloc(num_subsystems*sizeof(PetscScalar*));
+  pk           = malloc(num_subsystems*sizeof(PetscInt));
+  pcol         = malloc(num_subsystems*sizeof(PetscInt));
+
+  for (s=0;s<num_subsystems;s++){
+    d  = subsystem_list[s]->my_levels;
+    d2 = d*d;
+    ctx->levels[s]  = d;
+    ctx->n_after[s] = total_levels/(subsystem_list[s]->n_before*d);
+    local_L[s]      = calloc(d2*d2,sizeof(PetscScalar));
+    diag_sum[s]     = calloc(d2,sizeof(PetscScalar));
+  }
+
+  /* Sort the local nonzeros of A into the per-subsystem parts */
+  mean = 0.0;
+  MatGetOwnershipRange(A,&Istart,&Iend);
+  for (k=Istart;k<Iend;k++){
+    for (s=0;s<num_subsystems;s++){
+      pk[s] = _get_pair(k,ctx->levels[s],ctx->n_after[s]);
+    }
+    MatGetRow(A,k,&ncols,&cols,&vals);
+    for (j=0;j<ncols;j++){
+      if (cols[j]==k){
+        mean = mean + vals[j];
+        for (s=0;s<num_subsystems;s++){
+          diag_sum[s][pk[s]] = diag_sum[s][pk[s]] + vals[j];
+        }
+        continue;
+      }
+      n_diff = 0;
+      s_diff = 0;
+      for (s=0;s<num_subsystems&&n_diff<2;s++){
+        pcol[s] = _get_pair(cols[j],ctx->levels[s],ctx->n_after[s]);
+        if (pcol[s]!=pk[s]){
+          n_diff++;
+          s_diff = s;
+        }
+      }
+      if (n_diff==1){
+        d2 = ctx->levels[s_diff]*ctx->levels[s_diff];
+        local_L[s_diff][pk[s_diff]+pcol[s_diff]*d2] = local_L[s_diff][pk[s_diff]+pcol[s_diff]*d2] + vals[j];
+      }
+    }
+    MatRestoreRow(A,k,&ncols,&cols,&vals);
+  }
+  MPI_Allreduce(MPI_IN_PLACE,&mean,1,MPIU_SCALAR,MPI_SUM,quac_comm);
+  mean = mean/ctx->dim;
+
+  /* Average over the other subsystems, then diagonalize each L_s */
+  scale = 0.0;
+  for (s=0;s<num_subsystems;s++){
+    d  = ctx->levels[s];
+    d2 = d*d;
+    rest = ctx->dim/d2;
+    MPI_Allreduce(MPI_IN_PLACE,local_L[s],d2*d2,MPIU_SCALAR,MPI_SUM,quac_comm);
+    MPI_Allreduce(MPI_IN_PLACE,diag_sum[s],d2,MPIU_SCALAR,MPI_SUM,quac_comm);
+    for (p=0;p<d2*d2;p++){
+      local_L[s][p] = local_L[s][p]/rest;
+    }
+    for (p=0;p<d2;p++){
+      local_L[s][p+p*d2] = diag_sum[s][p]/rest - mean*(num_subsystems-1)/num_subsystems;
+    }
+
+    ctx->eigs[s] = malloc(d2*sizeof(PetscScalar));
+    ctx->V[s]    = malloc(d2*d2*sizeof(PetscScalar));
+    ctx->Vinv[s] = calloc(d2*d2,sizeof(PetscScalar));
+    idummy = d2;
+    lwork  = 5*d2;
+    work   = malloc(5*d2*sizeof(PetscScalar));
+    rwork  = malloc(2*d2*sizeof(PetscReal));
+    ipiv   = malloc(d2*sizeof(PetscBLASInt));
+    PetscBLASIntCast(d2,&nb);
+
+    /* Call LAPACK through PETSc to ensure portability */
+    LAPACKgeev_("N","V",&nb,local_L[s],&nb,ctx->eigs[s],&sdummy,&idummy,ctx->V[s],&nb,work,&lwork,rwork,&lierr);
+    /* V^-1, by solving V X = I; local_L[s] is overwritten by geev anyway */
+    for (p=0;p<d2*d2;p++){
+      local_L[s][p] = ctx->V[s][p];
+    }
+    for (p=0;p<d2;p++){
+      ctx->Vinv[s][p+p*d2] = 1.0;
+    }
+    LAPACKgesv_(&nb,&nb,local_L[s],&nb,ipiv,ctx->Vinv[s],&nb,&lierr);
+    if (lierr!=0&&nid==0){
+      printf("Warning! Local Liouvillian %d is defective; tensor preconditioner may be poor.\n",s);
+    }
+    for (p=0;p<d2;p++){
+      scale = PetscMax(scale,PetscAbsComplex(ctx->eigs[s][p]));
+    }
+    free(work);
+    free(rwork);
+    free(ipiv);
+    free(local_L[s]);
+    free(diag_sum[s]);
+  }
+  /* L_loc has a zero eigenvalue at the steady state; keep away from it */
+  ctx->shift = 1e-6*scale;
+
+  /* Each factor is applied on whole fibers, redistributed over the cores */
+  ctx->scatter = malloc(num_subsystems*sizeof(VecScatter));
+  ctx->fibers  = malloc(num_subsystems*sizeof(Vec));
+  MatCreateVecs(A,&x,NULL);
+  for (s=0;s<num_subsystems;s++){
+    _create_fiber_scatter(x,ctx->levels[s],ctx->n_after[s],&ctx->fibers[s],&ctx->scatter[s]);
+  }
+  VecDestroy(&x);
+
+  PCSetType(pc,PCSHELL);
+  PCShellSetContext(pc,ctx);
+  PCShellSetApply(pc,_tensor_pc_apply);
+  PCShellSetDestroy(pc,_tensor_pc_destroy);
+  PCShellSetName(pc,"QuaC tensor (fast diagonalization) preconditioner");
+
+  free(local_L);
+  free(diag_sum);
+  free(pk);
+  free(pcol);
+  return;
+}
+
+/*
+ * _tensor_pc_apply applies y = (L_loc - shift)^-1 x. Every factor
+ * works on the local fibers only, so each core does O(dim/np) work.
+ */
+PetscErrorCode _tensor_pc_apply(PC pc,Vec x,Vec y){
+  tensor_pc_ctx *ctx;
+  PetscScalar   *w,*ya,denom;
+  PetscInt      k,Istart,Iend,n_local,d2;
+  int           s;
+
+  PCShellGetContext(pc,&ctx);
+
+  /* Into the eigenbasis of every L_s */
+  VecCopy(x,y);
+  for (s=0;s<ctx->num_sys;s++){
+    d2 = ctx->levels[s]*ctx->levels[s];
+    VecScatterBegin(ctx->scatter[s],y,ctx->fibers[s],INSERT_VALUES,SCATTER_FORWARD);
+    VecScatterEnd(ctx->scatter[s],y,ctx->fibers[s],INSERT_VALUES,SCATTER_FORWARD);
+    VecGetLocalSize(ctx->fibers[s],&n_local);
+    VecGetArray(ctx->fibers[s],&w);
+    _apply_pair_mode(w,n_local/d2,d2,ctx->Vinv[s]);
+    VecRestoreArray(ctx->fibers[s],&w);
+    VecScatterBegin(ctx->scatter[s],ctx->fibers[s],y,INSERT_VALUES,SCATTER_REVERSE);
+    VecScatterEnd(ctx->scatter[s],ctx->fibers[s],y,INSERT_VALUES,SCATTER_REVERSE);
+  }
+  /* Divide by the sum of the local eigenvalues */
+  VecGetOwnershipRange(y,&Istart,&Iend);
+  VecGetArray(y,&ya);
+  for (k=Istart;k<Iend;k++){
+    denom = -ctx->shift;
+    for (s=0;s<ctx->num_sys;s++){
+      denom = denom + ctx->eigs[s][_get_pair(k,ctx->levels[s],ctx->n_after[s])];
+    }
+    if (PetscAbsComplex(denom)<ctx->shift) denom = -ctx->shift;
+    ya[k-Istart] = ya[k-Istart]/denom;
+  }
+  VecRestoreArray(y,&ya);
+  /* And back */
+  for (s=0;s<ctx->num_sys;s++){
+    d2 = ctx->levels[s]*ctx->levels[s];
+    VecScatterBegin(ctx->scatter[s],y,ctx->fibers[s],INSERT_VALUES,SCATTER_FORWARD);
+    VecScatterEnd(ctx->scatter[s],y,ctx->fibers[s],INSERT_VALUES,SCATTER_FORWARD);
+    VecGetLocalSize(ctx->fibers[s],&n_local);
+    VecGetArray(ctx->fibers[s],&w);
+    _apply_pair_mode(w,n_local/d2,d2,ctx->V[s]);
+    VecRestoreArray(ctx->fibers[s],&w);
+    VecScatterBegin(ctx->scatter[s],ctx->fibers[s],y,INSERT_VALUES,SCATTER_REVERSE);
+    VecScatterEnd(ctx->scatter[s],ctx->fibers[s],y,INSERT_VALUES,SCATTER_REVERSE);
+  }
+  return 0;
+}
+
+/*
+ * _tensor_pc_destroy frees the preconditioner context
+ */
+PetscErrorCode _tensor_pc_destroy(PC pc){
+  tensor_pc_ctx *ctx;
+  int           s;
+
+  PCShellGetContext(pc,&ctx);
+  for (s=0;s<ctx->num_sys;s++){
+    free(ctx->V[s]);
+    free(ctx->Vinv[s]);
+    free(ctx->eigs[s]);
+    VecScatterDestroy(&ctx->scatter[s]);
+    VecDestroy(&ctx->fibers[s]);
+  }
+  free(ctx->V);
+  free(ctx->Vinv);
+  free(ctx->eigs);
+  free(ctx->levels);
+  free(ctx->n_after);
+  free(ctx->scatter);
+  free(ctx->fibers);
+  free(ctx);
+  return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef TENSOR_PC_H_
+#define TENSOR_PC_H_
+
+#include <petscksp.h>
+
+/*
+ * tensor_pc_ctx holds the fast diagonalization of the local part of the
+ * Liouvillian: L_loc = sum_s I x ... x L_s x ... x I, where L_s acts on
+ * the (row,column) level pair of subsystem s. With L_s = V_s D_s V_s^-1,
+ * L_loc^-1 = (x_s V_s) (sum_s D_s)^-1 (x_s V_s^-1), which is applied
+ * one subsystem at a time, without forming any big matrix. For subsystem
+ * s, scatter[s] redistributes the dm into fibers[s], where the d^2
+ * elements that differ only in the level pair of s are contiguous and on
+ * one core, so each factor is applied to local data only.
+ */
+typedef struct tensor_pc_ctx{
+  PetscInt    num_sys,dim;
+  PetscInt    *levels,*n_after;
+  PetscScalar **V,**Vinv,**eigs;
+  PetscReal   shift;
+  VecScatter  *scatter;
+  Vec         *fibers;
+} tensor_pc_ctx;
+
+void use_tensor_preconditioner();
+void _set_tensor_pc(PC,Mat);
+PetscErrorCode _tensor_pc_apply(PC,Vec,Vec);
+PetscErrorCode _tensor_pc_destroy(PC);
+
+extern int _tensor_pc;
+
+#endif
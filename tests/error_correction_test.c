@@ -0,0 +1,114 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "quantum_gates.h"
+#include "error_correction.h"
+#include "petsc.h"
+
+/*
+ * A bit flip on the middle qubit of the 3 qubit bit flip code is undone by
+ * the first round of discrete error correction, and the trace is kept
+ */
+void test_discrete_error_correction(void)
+{
+  operator qubits[3];
+  encoded_qubit L0;
+  circuit circ;
+  Vec rho;
+  double *populations;
+  PetscScalar trace;
+  int i;
+
+  populations = malloc(3*sizeof(double));
+  for (i=0;i<3;i++){
+    create_op(2,&qubits[i]);
+  }
+  create_encoded_qubit(&L0,BIT,0,1,2);
+
+  create_circuit(&circ,1);
+  add_gate_to_circuit(&circ,0.5,SIGMAX,1);
+  start_circuit_at_time(&circ,0.0);
+  add_discrete_error_correction(L0,1.0);
+  create_full_dm(&rho);
+  add_value_to_dm(rho,0,0,1.0);
+  assemble_dm(rho);
+
+  time_step(rho,0.0,0.75,0.01,100000);
+  get_populations(rho,&populations);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,1.0,populations[1]);
+
+  time_step(rho,0.75,1.5,0.01,100000);
+  get_populations(rho,&populations);
+  for (i=0;i<3;i++){
+    TEST_ASSERT_FLOAT_WITHIN(1e-10,0.0,populations[i]);
+  }
+  trace_dm(&trace,rho);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,1.0,PetscRealPart(trace));
+
+  destroy_dm(rho);
+  for (i=0;i<3;i++){
+    destroy_op(&qubits[i]);
+  }
+  free(populations);
+}
+
+/*
+ * A six qubit repetition code has five stabilizers; continuous recovery of
+ * a bit flip on the first qubit returns it to |000000> at the recovery rate
+ */
+void test_lin_recovery_five_stabilizers(void)
+{
+  operator qubits[6];
+  stabilizer stabs[5];
+  Vec rho;
+  double *populations;
+  PetscScalar trace;
+  int i;
+
+  populations = malloc(6*sizeof(double));
+  for (i=0;i<6;i++){
+    create_op(2,&qubits[i]);
+  }
+  for (i=0;i<5;i++){
+    create_stabilizer(&stabs[i],2,qubits[i]->sig_z,qubits[i+1]->sig_z);
+  }
+  add_lin_recovery(1.0,0,qubits[0]->sig_x,(char *)"01111",5,
+                   stabs[0],stabs[1],stabs[2],stabs[3],stabs[4]);
+  create_full_dm(&rho);
+  /* |100000>; the first qubit is the slowest index */
+  add_value_to_dm(rho,32,32,1.0);
+  assemble_dm(rho);
+
+  time_step(rho,0.0,2.0,0.001,100000);
+  get_populations(rho,&populations);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4,exp(-2.0),populations[0]);
+  for (i=1;i<6;i++){
+    TEST_ASSERT_FLOAT_WITHIN(1e-10,0.0,populations[i]);
+  }
+  trace_dm(&trace,rho);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,1.0,PetscRealPart(trace));
+
+  destroy_dm(rho);
+  for (i=0;i<5;i++){
+    destroy_stabilizer(&stabs[i]);
+  }
+  for (i=0;i<6;i++){
+    destroy_op(&qubits[i]);
+  }
+  free(populations);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_discrete_error_correction);
+  QuaC_clear();
+  RUN_TEST(test_lin_recovery_five_stabilizers);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -6,6 +6,7 @@
 #include "solver.h"
 #include "dm_utilities.h"
 #include "quantum_gates.h"
+#include "event_scheduler.h"
 #include "petsc.h"
 #include "tests.h"
 
@@ -83,6 +84,230 @@ void test_real_ham_psi(void)
 
 }
 
+/*
+ * Advancing a decaying qubit in pieces with one integrator should
+ * match exp(-gamma t)
+ */
+void test_integrator_advance(void)
+{
+  operator qubit;
+  quac_integrator integ;
+  Vec rho;
+  double *populations,t;
+  int i;
+
+  populations = malloc(sizeof(double));
+  create_op(2,&qubit);
+  add_lin(0.5,qubit);
+  create_full_dm(&rho);
+  add_value_to_dm(rho,1,1,1.0);
+  assemble_dm(rho);
+
+  quac_integrator_create(&integ,rho);
+  t = 0;
+  for (i=0;i<4;i++){
+    quac_integrator_advance(integ,rho,t,t+0.5,0.01,1000);
+    t = t + 0.5;
+    get_populations(rho,&populations);
+    TEST_ASSERT_FLOAT_WITHIN(1e-3,exp(-0.5*t),populations[0]);
+  }
+  quac_integrator_destroy(&integ);
+
+  destroy_dm(rho);
+  destroy_op(&qubit);
+  free(populations);
+}
+/*
+ * Driven qubit g2, starting from the steady state: 0 at tau=0, <n>^2 at
+ * long tau, and the same for every start time and every block size
+ */
+void _driven_qubit_g2(PetscScalar ***g2_values,double *n_ss)
+{
+  operator qubit;
+  Vec rho;
+  double *populations;
+
+  populations = malloc(sizeof(double));
+  create_op(2,&qubit);
+  add_to_ham(0.5,qubit);
+  add_to_ham(0.5,qubit->dag);
+  add_lin(1.0,qubit);
+  create_full_dm(&rho);
+  steady_state(rho);
+  get_populations(rho,&populations);
+  *n_ss = populations[0];
+
+  g2_correlation(g2_values,rho,40,20.0,4,2.0,1,qubit);
+
+  destroy_dm(rho);
+  destroy_op(&qubit);
+  free(populations);
+}
+
+void test_g2_correlation(void)
+{
+  PetscScalar **g2_batched,**g2_single;
+  double n_ss;
+  int i,j;
+
+  _driven_qubit_g2(&g2_batched,&n_ss);
+  QuaC_clear();
+  PetscOptionsSetValue(NULL,"-quac_g2_block_size","1");
+  _driven_qubit_g2(&g2_single,&n_ss);
+  PetscOptionsClearValue(NULL,"-quac_g2_block_size");
+
+  for (i=1;i<=4;i++){
+    TEST_ASSERT_FLOAT_WITHIN(1e-8,0.0,PetscRealPart(g2_batched[i][0]));
+    TEST_ASSERT_FLOAT_WITHIN(1e-3,n_ss*n_ss,PetscRealPart(g2_batched[i][40]));
+    for (j=0;j<=40;j++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-4,PetscRealPart(g2_batched[1][j]),PetscRealPart(g2_batched[i][j]));
+      TEST_ASSERT_FLOAT_WITHIN(1e-6,PetscRealPart(g2_batched[i][j]),PetscRealPart(g2_single[i][j]));
+    }
+  }
+  for (i=0;i<=4;i++){
+    free(g2_batched[i]);
+    free(g2_single[i]);
+  }
+  free(g2_batched);
+  free(g2_single);
+}
+/*
+ * A driven qubit with strong dephasing should evolve the same with the
+ * dephasing as a stiff (implicit) term as with it explicit
+ */
+void _dephased_qubit_population(int stiff,double *population)
+{
+  operator qubit;
+  Vec rho;
+  double *populations;
+
+  populations = malloc(sizeof(double));
+  create_op(2,&qubit);
+  add_to_ham(0.5,qubit);
+  add_to_ham(0.5,qubit->dag);
+  add_lin(0.1,qubit);
+  if (stiff){
+    add_lin_stiff(50.0,qubit->n);
+  } else {
+    add_lin(50.0,qubit->n);
+  }
+  create_full_dm(&rho);
+  time_step(rho,0.0,2.0,0.001,100000);
+  get_populations(rho,&populations);
+  *population = populations[0];
+
+  destroy_dm(rho);
+  destroy_op(&qubit);
+  free(populations);
+}
+
+void test_stiff_imex(void)
+{
+  double explicit_pop,imex_pop;
+
+  _dephased_qubit_population(0,&explicit_pop);
+  QuaC_clear();
+  _dephased_qubit_population(1,&imex_pop);
+  TEST_ASSERT_FLOAT_WITHIN(1e-3,explicit_pop,imex_pop);
+}
+
+/*
+ * A SIGMAX gate at t=1 flips a decaying qubit from the ground to the
+ * excited state; integrating in segments must hit the gate time exactly,
+ * leaving exp(-gamma) excited population at t=2, and a second gate layer
+ * at the end of the integration is still applied. The circuit is grown
+ * and destroyed after it is registered, which must not affect the run.
+ */
+void test_circuit_segments(void)
+{
+  operator qubit;
+  circuit circ;
+  Vec rho;
+  double *populations;
+  int i;
+
+  populations = malloc(sizeof(double));
+  create_op(2,&qubit);
+  add_to_ham(1.0,qubit->n);
+  add_lin(0.5,qubit);
+  create_full_dm(&rho);
+
+  create_circuit(&circ,2);
+  add_gate_to_circuit(&circ,1.0,SIGMAX,0);
+  add_gate_to_circuit(&circ,2.0,SIGMAX,0);
+  start_circuit_at_time(&circ,0.0);
+  /* The registered copy must not see the original grow or be freed */
+  for (i=0;i<200;i++){
+    add_gate_to_circuit(&circ,3.0,SIGMAX,0);
+  }
+  destroy_circuit(&circ);
+
+  time_step(rho,0.0,1.5,0.01,100000);
+  get_populations(rho,&populations);
+  TEST_ASSERT_FLOAT_WITHIN(1e-3,exp(-0.25),populations[0]);
+
+  time_step(rho,1.5,2.0,0.01,100000);
+  get_populations(rho,&populations);
+  TEST_ASSERT_FLOAT_WITHIN(1e-3,1-exp(-0.5),populations[0]);
+
+  destroy_dm(rho);
+  destroy_op(&qubit);
+  free(populations);
+}
+
+typedef struct action_record{
+  int       num_calls;
+  PetscReal times[10];
+  double    populations[10];
+} action_record;
+
+static void _record_action(PetscReal t,Vec rho,void *ctx){
+  action_record *record = (action_record*)ctx;
+  double *populations;
+
+  populations = malloc(sizeof(double));
+  get_populations(rho,&populations);
+  record->times[record->num_calls]       = t;
+  record->populations[record->num_calls] = populations[0];
+  record->num_calls = record->num_calls + 1;
+  free(populations);
+}
+
+/*
+ * A periodic user action and a circuit share one event stream: the action
+ * fires at exactly t=0.5,1.0,1.5,2.0, and at t=1 it sees the state after
+ * the SIGMAX gate due at the same time.
+ */
+void test_timed_actions(void)
+{
+  operator qubit;
+  circuit circ;
+  action_record record;
+  Vec rho;
+  int i;
+
+  create_op(2,&qubit);
+  add_lin(0.5,qubit);
+  create_full_dm(&rho);
+
+  create_circuit(&circ,1);
+  add_gate_to_circuit(&circ,1.0,SIGMAX,0);
+  start_circuit_at_time(&circ,0.0);
+  record.num_calls = 0;
+  add_timed_action(0.5,0.5,_record_action,&record);
+
+  time_step(rho,0.0,2.0,0.01,100000);
+
+  TEST_ASSERT_EQUAL_INT(4,record.num_calls);
+  for (i=0;i<4;i++){
+    TEST_ASSERT_FLOAT_WITHIN(1e-12,0.5*(i+1),record.times[i]);
+  }
+  TEST_ASSERT_FLOAT_WITHIN(1e-6,1.0,record.populations[1]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-3,exp(-0.5),record.populations[3]);
+
+  destroy_dm(rho);
+  destroy_op(&qubit);
+}
 
 int main(int argc, char** argv)
 {
@@ -98,6 +323,16 @@ int main(int argc, char** argv)
   QuaC_clear();
   RUN_TEST(test_real_ham_psi);
   QuaC_clear();
+  RUN_TEST(test_integrator_advance);
+  QuaC_clear();
+  RUN_TEST(test_g2_correlation);
+  QuaC_clear();
+  RUN_TEST(test_stiff_imex);
+  QuaC_clear();
+  RUN_TEST(test_circuit_segments);
+  QuaC_clear();
+  RUN_TEST(test_timed_actions);
+  QuaC_clear();
   QuaC_finalize();
   return UNITY_END();
 }
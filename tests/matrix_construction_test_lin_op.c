@@ -59,6 +59,90 @@ void test_add_lin_1op_basic_real(void)
   TEST_ASSERT(equal==PETSC_TRUE);
 }
 
+/*
+ * Same as test_add_lin_1op_basic_real, but with the terms
+ * collected and assembled through the COO path
+ */
+void test_add_lin_1op_basic_real_coo(void)
+{
+  PetscViewer ham;
+  PetscScalar omega2,omega3,omega4;
+  PetscBool equal;
+  omega2 = 2.0;
+  omega3 = 1.0;
+  omega4 = 0.5;
+
+  add_lin_p(omega2,1,op2);
+  add_lin_p(omega2,1,op2->dag);
+  add_lin_p(omega2,1,op2->n);
+
+  add_lin_p(omega3,1,op3);
+  add_lin_p(omega3,1,op3->dag);
+  add_lin_p(omega3,1,op3->n);
+
+  add_lin_p(omega4,1,op4);
+  add_lin_p(omega4,1,op4->dag);
+  add_lin_p(omega4,1,op4->n);
+
+  assemble_operators();
+
+  PetscViewerBinaryOpen(PETSC_COMM_WORLD,"tests/lin_1op_br",FILE_MODE_READ,&ham);
+  MatDuplicate(full_A,MAT_DO_NOT_COPY_VALUES,&mat_pristine);
+  MatLoad(mat_pristine,ham);
+  PetscViewerDestroy(&ham);
+
+  MatEqual(mat_pristine,full_A,&equal);
+  MatDestroy(&mat_pristine);
+
+  TEST_ASSERT(equal==PETSC_TRUE);
+}
+
+/*
+ * Same as test_add_lin_1op_basic_real_coo, but with some of the
+ * coefficients set through update_term_coefficient after assembly
+ */
+void test_add_lin_1op_basic_real_update(void)
+{
+  PetscViewer ham;
+  PetscScalar omega2,omega3,omega4;
+  PetscBool equal;
+  quac_term term1,term2,term3;
+  omega2 = 2.0;
+  omega3 = 1.0;
+  omega4 = 0.5;
+
+  add_lin_p(omega2,1,op2);
+  add_lin_p(omega2,1,op2->dag);
+  add_lin_p(omega2,1,op2->n);
+
+  add_lin_p(omega3,1,op3);
+  add_lin_p(omega3,1,op3->dag);
+  add_lin_p(omega3,1,op3->n);
+
+  term1 = add_lin_p(0.0,1,op4);
+  term2 = add_lin_p(3.0,1,op4->dag);
+  term3 = add_lin_p(omega4,1,op4->n);
+
+  assemble_operators();
+
+  update_term_coefficient(term1,omega4);
+  update_term_coefficient(term2,omega4);
+  update_term_coefficient(term3,0.0);
+  assemble_operators();
+  update_term_coefficient(term3,omega4);
+  assemble_operators();
+
+  PetscViewerBinaryOpen(PETSC_COMM_WORLD,"tests/lin_1op_br",FILE_MODE_READ,&ham);
+  MatDuplicate(full_A,MAT_DO_NOT_COPY_VALUES,&mat_pristine);
+  MatLoad(mat_pristine,ham);
+  PetscViewerDestroy(&ham);
+
+  MatEqual(mat_pristine,full_A,&equal);
+  MatDestroy(&mat_pristine);
+
+  TEST_ASSERT(equal==PETSC_TRUE);
+}
+
 void test_add_lin_1op_pauli_real(void)
 {
   PetscViewer ham;
@@ -595,6 +679,23 @@ int main(int argc, char** argv)
 
   RUN_TEST(test_add_lin_3op_basic_complex); //Qutip
 
+  QuaC_clear();
+  //Create some operators
+  create_op(2,&op2);
+  create_op(3,&op3);
+  create_op(4,&op4);
+  use_coo_assembly();
+
+  RUN_TEST(test_add_lin_1op_basic_real_coo); //Qutip
+
+  QuaC_clear();
+  //Create some operators
+  create_op(2,&op2);
+  create_op(3,&op3);
+  create_op(4,&op4);
+  use_coo_assembly();
+
+  RUN_TEST(test_add_lin_1op_basic_real_update); //Qutip
 
   QuaC_finalize();
   return UNITY_END();
@@ -0,0 +1,115 @@
+/*
+ * Models shared by the solver tests, which solve the same system twice
+ * (e.g., with and without a reduction) and compare the results.
+ */
+
+#include "unity.h"
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+#include "tests.h"
+
+/*
+ * build_cavity_qubits adds the operators and terms of a driven,
+ * dissipative cavity coupled to num_qubits identical qubits:
+ * H = a^dag a + sum_q 1.2 n_q + 0.3 sum_q (a^dag s_q + a s_q^dag) + drive (a + a^dag),
+ * with cavity loss 0.2 (1 + n_th) and thermal pumping 0.2 n_th, and qubit
+ * decay 0.1 and pumping qubit_pump. Without the drive it conserves the
+ * excitation number, and the qubits can always be permuted.
+ * Inputs:
+ *        cavity_qubits_model *model: with cavity_levels, num_qubits, drive,
+ *                                    n_th, and qubit_pump set
+ * Outputs:
+ *        cavity_qubits_model *model: the operators, and the drive terms
+ *                                    (if there is a drive)
+ */
+void build_cavity_qubits(cavity_qubits_model *model){
+  int i;
+
+  create_op((*model).cavity_levels,&(*model).cavity);
+  for (i=0;i<(*model).num_qubits;i++){
+    create_op(2,&(*model).qubits[i]);
+  }
+
+  add_to_ham(1.0,(*model).cavity->n);
+  add_lin(0.2*(1+(*model).n_th),(*model).cavity);
+  if ((*model).n_th>0){
+    add_lin(0.2*(*model).n_th,(*model).cavity->dag);
+  }
+  for (i=0;i<(*model).num_qubits;i++){
+    add_to_ham(1.2,(*model).qubits[i]->n);
+    add_to_ham_mult2(0.3,(*model).cavity->dag,(*model).qubits[i]);
+    add_to_ham_mult2(0.3,(*model).cavity,(*model).qubits[i]->dag);
+    add_lin(0.1,(*model).qubits[i]);
+    if ((*model).qubit_pump>0){
+      add_lin((*model).qubit_pump,(*model).qubits[i]->dag);
+    }
+  }
+  (*model).drive_terms[0] = NULL;
+  (*model).drive_terms[1] = NULL;
+  if ((*model).drive!=0){
+    (*model).drive_terms[0] = add_to_ham((*model).drive,(*model).cavity);
+    (*model).drive_terms[1] = add_to_ham((*model).drive,(*model).cavity->dag);
+  }
+  return;
+}
+
+void destroy_cavity_qubits(cavity_qubits_model *model){
+  int i;
+
+  destroy_op(&(*model).cavity);
+  for (i=0;i<(*model).num_qubits;i++){
+    destroy_op(&(*model).qubits[i]);
+  }
+  return;
+}
+
+/*
+ * cavity_qubits_populations builds the model with the solver settings
+ * that are currently on, solves for its steady state (steady = 1) or
+ * time steps it to t=5 from the cavity's first excited state (steady = 0),
+ * and clears QuaC, which also turns those settings off again.
+ * Inputs:
+ *        cavity_qubits_model model: the model parameters
+ *        int steady:                steady state or time step
+ * Outputs:
+ *        double *populations:       the populations; must hold one per
+ *                                   subsystem
+ *        int *num_pop:              number of populations
+ */
+void cavity_qubits_populations(cavity_qubits_model model,int steady,double *populations,int *num_pop){
+  Vec rho;
+
+  build_cavity_qubits(&model);
+  create_full_dm(&rho);
+  if (steady){
+    steady_state(rho);
+  } else {
+    /* The cavity's stride is the size of the qubits' space */
+    add_value_to_dm(rho,1<<model.num_qubits,1<<model.num_qubits,1.0);
+    assemble_dm(rho);
+    time_step(rho,0.0,5.0,0.01,100000);
+  }
+  get_populations(rho,&populations);
+  *num_pop = get_num_populations();
+
+  destroy_dm(rho);
+  destroy_cavity_qubits(&model);
+  QuaC_clear();
+  return;
+}
+
+/*
+ * assert_populations_within checks that two sets of populations agree
+ */
+void assert_populations_within(double tol,int num_pop,double *expected,double *actual){
+  int i;
+
+  for (i=0;i<num_pop;i++){
+    TEST_ASSERT_FLOAT_WITHIN(tol,expected[i],actual[i]);
+  }
+  return;
+}
@@ -0,0 +1,67 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "quac_system.h"
+#include "petsc.h"
+
+/*
+ * Build two thermal qubits in separate systems, interleaving their
+ * construction, then solve each one. The excited state population
+ * should be n_th/(2 n_th + 1) in both.
+ */
+void test_two_systems_thermal_qubit(void)
+{
+  quac_system sys1,sys2;
+  operator qubit1,qubit2;
+  Vec rho1,rho2;
+  PetscScalar pop1,pop2;
+
+  create_quac_system(&sys1,PETSC_COMM_WORLD);
+  create_quac_system(&sys2,PETSC_COMM_WORLD);
+
+  quac_system_activate(sys1);
+  create_op(2,&qubit1);
+
+  quac_system_activate(sys2);
+  create_op(2,&qubit2);
+  add_lin(3.0,qubit2);
+  add_lin(2.0,qubit2->dag);
+
+  quac_system_activate(sys1);
+  add_lin(2.0,qubit1);
+  add_lin(1.0,qubit1->dag);
+  create_full_dm(&rho1);
+  steady_state(rho1);
+  get_expectation_value(rho1,&pop1,1,qubit1->n);
+
+  quac_system_activate(sys2);
+  create_full_dm(&rho2);
+  steady_state(rho2);
+  get_expectation_value(rho2,&pop2,1,qubit2->n);
+
+  TEST_ASSERT_FLOAT_WITHIN(1e-6,1.0/3.0,PetscRealPart(pop1));
+  TEST_ASSERT_FLOAT_WITHIN(1e-6,2.0/5.0,PetscRealPart(pop2));
+
+  destroy_dm(rho2);
+  destroy_op(&qubit2);
+  quac_system_activate(sys1);
+  destroy_dm(rho1);
+  destroy_op(&qubit1);
+
+  quac_system_activate(NULL);
+  destroy_quac_system(&sys1);
+  destroy_quac_system(&sys2);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_two_systems_thermal_qubit);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -1314,6 +1314,274 @@ void test_hadamard(void)
 }
 
 
+/*
+ * Hadamard times hadamard: the branches from the two gates cancel, so
+ * the circuit unitary and superoperator are exactly the identity
+ */
+void test_hadamard_squared(void)
+{
+  circuit  circ;
+  Mat      circ_mat,circ_super_mat;
+  operator qubits[2];
+  PetscInt Istart,Iend,i,equal_int;
+
+  PetscInt          ncols;
+  const PetscInt    *cols;
+  const PetscScalar *vals;
+
+  //Create 2 two level systems
+  create_op(2,&qubits[0]);
+  create_op(2,&qubits[1]);
+
+  create_circuit(&circ,6);
+  add_gate_to_circuit(&circ,1.0,HADAMARD,0);
+  add_gate_to_circuit(&circ,2.0,HADAMARD,1);
+  add_gate_to_circuit(&circ,3.0,CNOT,0,1);
+  add_gate_to_circuit(&circ,4.0,CNOT,0,1);
+  add_gate_to_circuit(&circ,5.0,HADAMARD,1);
+  add_gate_to_circuit(&circ,6.0,HADAMARD,0);
+  combine_circuit_to_mat(&circ_mat,circ);
+  combine_circuit_to_super_mat(&circ_super_mat,circ);
+
+  equal_int = 1;
+  MatGetOwnershipRange(circ_mat,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    MatGetRow(circ_mat,i,&ncols,&cols,&vals);
+    if (ncols!=1||cols[0]!=i||PetscAbsComplex(vals[0]-1.0)>1e-10){
+      equal_int = 0;
+    }
+    MatRestoreRow(circ_mat,i,&ncols,&cols,&vals);
+  }
+  MatGetOwnershipRange(circ_super_mat,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    MatGetRow(circ_super_mat,i,&ncols,&cols,&vals);
+    if (ncols!=1||cols[0]!=i||PetscAbsComplex(vals[0]-1.0)>1e-10){
+      equal_int = 0;
+    }
+    MatRestoreRow(circ_super_mat,i,&ncols,&cols,&vals);
+  }
+
+  TEST_ASSERT_EQUAL_INT(1,equal_int);
+  destroy_op(&qubits[0]);
+  destroy_op(&qubits[1]);
+  destroy_circuit(&circ);
+  MatDestroy(&circ_mat);
+  MatDestroy(&circ_super_mat);
+}
+
+
+/*
+ * Gate noise, applied gate by gate with no time integration:
+ * X then amplitude damping (gamma=0.3) leaves 0.7 excited, H then dephasing
+ * (p=0.25) leaves <X> = 1-2p, and depolarizing (p=0.3) excites 2p/3
+ */
+void test_gate_noise(void)
+{
+  circuit  circ;
+  operator qubits[3];
+  Vec      rho;
+  double   *populations;
+  PetscScalar val,trace;
+  int i;
+
+  populations = malloc(3*sizeof(double));
+  for (i=0;i<3;i++){
+    create_op(2,&qubits[i]);
+  }
+
+  create_circuit(&circ,3);
+  add_gate_to_circuit(&circ,1.0,SIGMAX,0);
+  add_noise_to_last_gate(&circ,AMPLITUDE_DAMPING,0.3);
+  add_gate_to_circuit(&circ,2.0,HADAMARD,1);
+  add_noise_to_last_gate(&circ,DEPHASING,0.25);
+  add_gate_to_circuit(&circ,3.0,EYE,2);
+  add_noise_to_last_gate(&circ,DEPOLARIZING,0.3);
+
+  create_full_dm(&rho);
+  add_value_to_dm(rho,0,0,1.0);
+  assemble_dm(rho);
+  apply_circuit(circ,rho);
+
+  get_populations(rho,&populations);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.7,populations[0]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.2,populations[2]);
+  get_expectation_value(rho,&val,1,qubits[1]->sig_x);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.5,PetscRealPart(val));
+  trace_dm(&trace,rho);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,1.0,PetscRealPart(trace));
+
+  destroy_dm(rho);
+  for (i=0;i<3;i++){
+    destroy_op(&qubits[i]);
+  }
+  free(populations);
+}
+
+
+/*
+ * Layering: gates on disjoint qubits share a layer, ASAP puts the X on
+ * qubit 2 in the first layer and ALAP in the last
+ */
+void test_layer_circuit(void)
+{
+  circuit  circ;
+  PetscInt depth;
+  gate_type asap_types[5] = {HADAMARD,HADAMARD,SIGMAX,CNOT,SIGMAZ};
+  PetscReal asap_times[5] = {1.0,1.0,1.0,2.0,3.0};
+  gate_type alap_types[5] = {HADAMARD,HADAMARD,CNOT,SIGMAX,SIGMAZ};
+  PetscReal alap_times[5] = {1.0,1.0,2.0,3.0,3.0};
+  int i;
+
+  create_circuit(&circ,5);
+  add_gate_to_circuit(&circ,1.0,HADAMARD,0);
+  add_gate_to_circuit(&circ,2.0,HADAMARD,1);
+  add_gate_to_circuit(&circ,3.0,CNOT,0,1);
+  add_gate_to_circuit(&circ,4.0,SIGMAX,2);
+  add_gate_to_circuit(&circ,5.0,SIGMAZ,0);
+
+  layer_circuit(&circ,ASAP,1.0,&depth);
+  TEST_ASSERT_EQUAL_INT(3,depth);
+  for (i=0;i<5;i++){
+    TEST_ASSERT_EQUAL_INT(asap_types[i],circ.gate_types[i]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-12,asap_times[i],circ.times[i]);
+  }
+
+  layer_circuit(&circ,ALAP,1.0,&depth);
+  TEST_ASSERT_EQUAL_INT(3,depth);
+  for (i=0;i<5;i++){
+    TEST_ASSERT_EQUAL_INT(alap_types[i],circ.gate_types[i]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-12,alap_times[i],circ.times[i]);
+  }
+  destroy_circuit(&circ);
+}
+
+/*
+ * Circuits grow past their size estimate, and adding a circuit (also to
+ * itself) copies its gates with the new time
+ */
+void test_circuit_growth(void)
+{
+  circuit circ,circ2;
+  struct quantum_gate_struct gate;
+  int i;
+
+  create_circuit(&circ,1);
+  for (i=0;i<1000;i++){
+    if (i%2==0){
+      add_gate_to_circuit(&circ,(PetscReal)i,RX,i%7,0.5*i);
+    } else {
+      add_gate_to_circuit(&circ,(PetscReal)i,CNOT,i%7,(i+1)%7);
+    }
+  }
+  TEST_ASSERT_EQUAL_INT(1000,circ.num_gates);
+
+  create_circuit(&circ2,-1);
+  add_gate_to_circuit(&circ2,1.0,HADAMARD,3);
+  add_circuit_to_circuit(&circ2,circ,2.0);
+  add_noise_to_last_gate(&circ2,DEPHASING,0.1);
+  add_circuit_to_circuit(&circ2,circ2,3.0);
+  TEST_ASSERT_EQUAL_INT(2002,circ2.num_gates);
+
+  for (i=0;i<1000;i++){
+    gate = _circuit_gate(circ2,1002+i);
+    TEST_ASSERT_FLOAT_WITHIN(1e-12,3.0,gate.time);
+    TEST_ASSERT_EQUAL_INT(circ.gate_types[i],gate.my_gate_type);
+    TEST_ASSERT_EQUAL_INT(i%7,gate.qubit_numbers[0]);
+    if (i%2==0){
+      TEST_ASSERT_FLOAT_WITHIN(1e-12,0.5*i,gate.theta);
+    } else {
+      TEST_ASSERT_EQUAL_INT((i+1)%7,gate.qubit_numbers[1]);
+    }
+  }
+  gate = _circuit_gate(circ2,1000);
+  TEST_ASSERT_EQUAL_INT(DEPHASING,gate.noise.my_noise_type);
+  gate = _circuit_gate(circ2,2001);
+  TEST_ASSERT_EQUAL_INT(DEPHASING,gate.noise.my_noise_type);
+  gate = _circuit_gate(circ2,1001);
+  TEST_ASSERT_EQUAL_INT(HADAMARD,gate.my_gate_type);
+  TEST_ASSERT_EQUAL_INT(3,gate.qubit_numbers[0]);
+  TEST_ASSERT_EQUAL_INT(NO_NOISE,gate.noise.my_noise_type);
+
+  destroy_circuit(&circ);
+  destroy_circuit(&circ2);
+}
+
+/*
+ * Subsystem order: the CNOT moves qubits 0 and 2 to the smallest strides,
+ * but user facing indices keep creation order. The state is
+ * |1> on qubit 1 and a Bell pair on qubits 0 and 2.
+ */
+void test_subsystem_order(void)
+{
+  circuit  circ;
+  operator qubits[3];
+  Vec      rho,ptraced_dm;
+  double   *populations;
+  PetscScalar val;
+  int i;
+
+  populations = malloc(3*sizeof(double));
+  for (i=0;i<3;i++){
+    create_op(2,&qubits[i]);
+  }
+
+  create_circuit(&circ,3);
+  add_gate_to_circuit(&circ,1.0,SIGMAX,1);
+  add_gate_to_circuit(&circ,1.0,HADAMARD,0);
+  add_gate_to_circuit(&circ,2.0,CNOT,0,2);
+  start_circuit_at_time(&circ,0.0);
+
+  optimize_subsystem_order(0,NULL);
+  TEST_ASSERT_EQUAL_INT(1,qubits[1]->n_before);
+  TEST_ASSERT_EQUAL_INT(2,qubits[2]->n_before);
+  TEST_ASSERT_EQUAL_INT(4,qubits[0]->n_before);
+  TEST_ASSERT_EQUAL_INT(4,qubits[0]->sig_x->n_before);
+  /* Density matrix mode */
+  add_lin(0.0,qubits[0]);
+
+  create_full_dm(&rho);
+  add_value_to_dm(rho,0,0,1.0);
+  assemble_dm(rho);
+  apply_circuit(circ,rho);
+
+  /* |010> and |111> */
+  get_dm_element(rho,2,2,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.5,PetscRealPart(val));
+  get_dm_element(rho,7,7,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.5,PetscRealPart(val));
+  get_dm_element(rho,2,7,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.5,PetscRealPart(val));
+
+  get_populations(rho,&populations);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.5,populations[0]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,1.0,populations[1]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.5,populations[2]);
+
+  /* Qubits 0 and 1, in that order: |01> and |11> */
+  create_dm(&ptraced_dm,4);
+  partial_trace_keep(rho,ptraced_dm,2,qubits[0],qubits[1]);
+  get_dm_element(ptraced_dm,1,1,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.5,PetscRealPart(val));
+  get_dm_element(ptraced_dm,3,3,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.5,PetscRealPart(val));
+  get_dm_element(ptraced_dm,2,2,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.0,PetscRealPart(val));
+
+  partial_trace_over(rho,ptraced_dm,1,qubits[2]);
+  get_dm_element(ptraced_dm,1,1,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.5,PetscRealPart(val));
+  get_dm_element(ptraced_dm,3,3,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-10,0.5,PetscRealPart(val));
+
+  destroy_dm(ptraced_dm);
+  destroy_dm(rho);
+  for (i=0;i<3;i++){
+    destroy_op(&qubits[i]);
+  }
+  free(populations);
+}
+
+
 int main(int argc, char** argv)
 {
   UNITY_BEGIN();
@@ -1334,9 +1602,19 @@ int main(int argc, char** argv)
   QuaC_clear();
   RUN_TEST(test_hadamard2);
   QuaC_clear();
+  RUN_TEST(test_hadamard_squared);
+  QuaC_clear();
   RUN_TEST(test_cnot);
   QuaC_clear();
   RUN_TEST(test_cxz);
+  QuaC_clear();
+  RUN_TEST(test_gate_noise);
+  QuaC_clear();
+  RUN_TEST(test_layer_circuit);
+  QuaC_clear();
+  RUN_TEST(test_circuit_growth);
+  QuaC_clear();
+  RUN_TEST(test_subsystem_order);
   QuaC_finalize();
   return UNITY_END();
 }
@@ -0,0 +1,181 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "spectral.h"
+#include "petsc.h"
+
+/*
+ * rho(t) of a decaying qubit from the spectrum should be exp(-gamma t)
+ */
+void test_spectrum_evolve(void)
+{
+  operator qubit;
+  liouvillian_spectrum spec;
+  Vec rho,rho_t;
+  double *populations;
+  int i;
+
+  populations = malloc(sizeof(double));
+  create_op(2,&qubit);
+  add_to_ham(1.0,qubit->n);
+  add_lin(0.5,qubit);
+  create_full_dm(&rho);
+  create_full_dm(&rho_t);
+  add_value_to_dm(rho,1,1,1.0);
+  assemble_dm(rho);
+
+  create_liouvillian_spectrum(&spec,0);
+  for (i=0;i<5;i++){
+    spectrum_evolve(spec,rho,0.5*i,rho_t);
+    get_populations(rho_t,&populations);
+    TEST_ASSERT_FLOAT_WITHIN(1e-10,exp(-0.25*i),populations[0]);
+  }
+  destroy_liouvillian_spectrum(&spec);
+
+  destroy_dm(rho);
+  destroy_dm(rho_t);
+  destroy_op(&qubit);
+  free(populations);
+}
+
+/*
+ * Two identical decaying qubits have a degenerate spectrum (each decay
+ * rate, and each coherence frequency, appears twice), where the left and
+ * right eigenvectors are not automatically dual. Starting from both
+ * excited, each population should still be exp(-gamma t), and the
+ * two time evolution should agree with time_step.
+ */
+void test_spectrum_evolve_degenerate(void)
+{
+  operator qubit1,qubit2;
+  liouvillian_spectrum spec;
+  Vec rho,rho_t;
+  PetscReal diff_norm;
+  double *populations;
+  int i;
+
+  populations = malloc(2*sizeof(double));
+  create_op(2,&qubit1);
+  create_op(2,&qubit2);
+  add_to_ham(1.0,qubit1->n);
+  add_to_ham(1.0,qubit2->n);
+  add_lin(0.5,qubit1);
+  add_lin(0.5,qubit2);
+  create_full_dm(&rho);
+  create_full_dm(&rho_t);
+  add_value_to_dm(rho,3,3,1.0);
+  assemble_dm(rho);
+
+  create_liouvillian_spectrum(&spec,0);
+  for (i=0;i<5;i++){
+    spectrum_evolve(spec,rho,0.5*i,rho_t);
+    get_populations(rho_t,&populations);
+    TEST_ASSERT_FLOAT_WITHIN(1e-10,exp(-0.25*i),populations[0]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-10,exp(-0.25*i),populations[1]);
+  }
+  spectrum_evolve(spec,rho,2.0,rho_t);
+  destroy_liouvillian_spectrum(&spec);
+
+  time_step(rho,0.0,2.0,0.01,100000);
+  VecAXPY(rho_t,-1.0,rho);
+  VecNorm(rho_t,NORM_INFINITY,&diff_norm);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4,0.0,diff_norm);
+
+  destroy_dm(rho);
+  destroy_dm(rho_t);
+  destroy_op(&qubit1);
+  destroy_op(&qubit2);
+  free(populations);
+}
+
+/*
+ * g2 of a driven qubit from the spectrum should match g2_correlation,
+ * and g1 at tau=0 is the excited population
+ */
+void test_spectrum_g1_g2(void)
+{
+  operator qubit;
+  liouvillian_spectrum spec;
+  Vec rho;
+  PetscScalar **g2_values,g1[41],g2[41];
+  double *populations;
+  int j;
+
+  populations = malloc(sizeof(double));
+  create_op(2,&qubit);
+  add_to_ham(0.5,qubit);
+  add_to_ham(0.5,qubit->dag);
+  add_lin(1.0,qubit);
+  create_full_dm(&rho);
+  steady_state(rho);
+  get_populations(rho,&populations);
+
+  create_liouvillian_spectrum(&spec,0);
+  spectrum_g1(spec,rho,qubit,40,20.0,g1);
+  spectrum_g2(spec,rho,qubit,40,20.0,g2);
+  destroy_liouvillian_spectrum(&spec);
+
+  TEST_ASSERT_FLOAT_WITHIN(1e-8,populations[0],PetscRealPart(g1[0]));
+  g2_correlation(&g2_values,rho,40,20.0,1,1e-8,1,qubit);
+  for (j=0;j<=40;j++){
+    TEST_ASSERT_FLOAT_WITHIN(1e-4,PetscRealPart(g2_values[1][j]),PetscRealPart(g2[j]));
+  }
+
+  free(g2_values[0]);
+  free(g2_values[1]);
+  free(g2_values);
+  destroy_dm(rho);
+  destroy_op(&qubit);
+  free(populations);
+}
+
+/*
+ * A pumped, decaying qubit has a Lorentzian emission spectrum,
+ * S(w) = n Gamma/((Gamma/2)^2 + (w-w0)^2), with Gamma = gamma + pump
+ */
+void test_emission_spectrum(void)
+{
+  operator qubit;
+  Vec rho;
+  PetscReal omega[5],spectrum[5],gamma_tot,n_ss;
+  int i;
+
+  create_op(2,&qubit);
+  add_to_ham(1.0,qubit->n);
+  add_lin(0.3,qubit);
+  add_lin(0.1,qubit->dag);
+  create_full_dm(&rho);
+  steady_state(rho);
+
+  for (i=0;i<5;i++){
+    omega[i] = 0.8 + 0.1*i;
+  }
+  emission_spectrum(rho,qubit,5,omega,spectrum);
+
+  gamma_tot = 0.4;
+  n_ss      = 0.1/gamma_tot;
+  for (i=0;i<5;i++){
+    TEST_ASSERT_FLOAT_WITHIN(1e-6,n_ss*gamma_tot/(gamma_tot*gamma_tot/4+(omega[i]-1.0)*(omega[i]-1.0)),spectrum[i]);
+  }
+  destroy_dm(rho);
+  destroy_op(&qubit);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_spectrum_evolve);
+  QuaC_clear();
+  RUN_TEST(test_spectrum_evolve_degenerate);
+  QuaC_clear();
+  RUN_TEST(test_spectrum_g1_g2);
+  QuaC_clear();
+  RUN_TEST(test_emission_spectrum);
+  QuaC_finalize();
+  return UNITY_END();
+}
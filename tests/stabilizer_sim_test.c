@@ -0,0 +1,105 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "quantum_gates.h"
+#include "stabilizer_sim.h"
+#include "petsc.h"
+
+/*
+ * A Bell pair: the first outcome is random, the second always matches it
+ */
+void test_tableau_bell_pair(void)
+{
+  circuit circ;
+  tableau tab;
+  stabilizer_noise no_noise = {0.0,0.0,0.0,0.0};
+  uint64_t rng = 12345;
+  int i,outcome0,outcome1,deterministic,n_ones=0;
+
+  create_circuit(&circ,2);
+  add_gate_to_circuit(&circ,0.0,HADAMARD,0);
+  add_gate_to_circuit(&circ,1.0,CNOT,0,1);
+
+  for (i=0;i<100;i++){
+    create_tableau(&tab,2);
+    tableau_apply_circuit(tab,circ,no_noise,&rng);
+    outcome0 = tableau_measure(tab,0,&rng,&deterministic);
+    TEST_ASSERT_EQUAL_INT(0,deterministic);
+    outcome1 = tableau_measure(tab,1,&rng,&deterministic);
+    TEST_ASSERT_EQUAL_INT(1,deterministic);
+    TEST_ASSERT_EQUAL_INT(outcome0,outcome1);
+    n_ones = n_ones + outcome0;
+    destroy_tableau(&tab);
+  }
+  TEST_ASSERT_TRUE(n_ones>20&&n_ones<80);
+}
+
+/*
+ * Clifford rotations: RY(pi/2) twice and H RZ(pi) H both flip |0>
+ */
+void test_tableau_rotations(void)
+{
+  circuit circ;
+  tableau tab;
+  stabilizer_noise no_noise = {0.0,0.0,0.0,0.0};
+  uint64_t rng = 1;
+  int deterministic;
+
+  create_circuit(&circ,5);
+  add_gate_to_circuit(&circ,0.0,RY,0,PETSC_PI/2);
+  add_gate_to_circuit(&circ,1.0,RY,0,PETSC_PI/2);
+  add_gate_to_circuit(&circ,0.0,HADAMARD,1);
+  add_gate_to_circuit(&circ,1.0,RZ,1,PETSC_PI);
+  add_gate_to_circuit(&circ,2.0,HADAMARD,1);
+
+  create_tableau(&tab,2);
+  tableau_apply_circuit(tab,circ,no_noise,&rng);
+  TEST_ASSERT_EQUAL_INT(1,tableau_measure(tab,0,&rng,&deterministic));
+  TEST_ASSERT_EQUAL_INT(1,deterministic);
+  TEST_ASSERT_EQUAL_INT(1,tableau_measure(tab,1,&rng,&deterministic));
+  TEST_ASSERT_EQUAL_INT(1,deterministic);
+  destroy_tableau(&tab);
+}
+
+/*
+ * With X and Y errors after a single idle gate, a Z measurement fails
+ * with probability p_x + p_y. The Z parity of a 100 qubit GHZ state
+ * (more than one word per row) is unaffected by Z errors.
+ */
+void test_stabilizer_logical_error_rate(void)
+{
+  circuit circ,ghz;
+  stabilizer_noise noise = {0.1,0.05,0.2,0.0},z_noise = {0.0,0.0,0.3,0.0};
+  PetscInt measured[100];
+  PetscReal error_rate;
+  int i;
+
+  create_circuit(&circ,1);
+  add_gate_to_circuit(&circ,0.0,EYE,0);
+  measured[0] = 0;
+  stabilizer_logical_error_rate(circ,1,noise,1,measured,0,20000,7,&error_rate);
+  TEST_ASSERT_FLOAT_WITHIN(0.01,0.15,error_rate);
+
+  create_circuit(&ghz,100);
+  add_gate_to_circuit(&ghz,0.0,HADAMARD,0);
+  for (i=1;i<100;i++){
+    add_gate_to_circuit(&ghz,(PetscReal)i,CNOT,i-1,i);
+  }
+  for (i=0;i<100;i++){
+    measured[i] = i;
+  }
+  stabilizer_logical_error_rate(ghz,100,z_noise,100,measured,1,200,7,&error_rate);
+  TEST_ASSERT_FLOAT_WITHIN(1e-12,0.0,error_rate);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_tableau_bell_pair);
+  RUN_TEST(test_tableau_rotations);
+  RUN_TEST(test_stabilizer_logical_error_rate);
+  QuaC_finalize();
+  return UNITY_END();
+}
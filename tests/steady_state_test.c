@@ -0,0 +1,167 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "tensor_pc.h"
+#include "petsc.h"
+#include "tests.h"
+
+/* Driven-dissipative Jaynes-Cummings model */
+static cavity_qubits_model _jc_model(double drive)
+{
+  cavity_qubits_model model;
+
+  model.cavity_levels = 5;
+  model.num_qubits    = 1;
+  model.drive         = drive;
+  model.n_th          = 0.0;
+  model.qubit_pump    = 0.0;
+  return model;
+}
+
+/*
+ * The eigen (null vector) steady state should match the
+ * stabilization row steady state
+ */
+void test_eigen_steady_state(void)
+{
+#if defined(QUAC_USE_SLEPC)
+  double stab_pops[2],eigen_pops[2];
+  int num_pop;
+
+  cavity_qubits_populations(_jc_model(0.1),1,stab_pops,&num_pop);
+  use_eigen_steady_state();
+  cavity_qubits_populations(_jc_model(0.1),1,eigen_pops,&num_pop);
+  assert_populations_within(1e-6,num_pop,stab_pops,eigen_pops);
+#else
+  TEST_IGNORE_MESSAGE("QuaC built without SLEPc");
+#endif
+}
+
+/*
+ * Switching to the eigen steady state after a stabilized solve on the
+ * same system should take the stabilization row back out and agree
+ */
+void test_eigen_after_stabilized(void)
+{
+#if defined(QUAC_USE_SLEPC)
+  cavity_qubits_model model;
+  double stab_pops[2],eigen_pops[2],*populations;
+  Vec rho;
+
+  model = _jc_model(0.1);
+  build_cavity_qubits(&model);
+  create_full_dm(&rho);
+  steady_state(rho);
+  populations = stab_pops;
+  get_populations(rho,&populations);
+  use_eigen_steady_state();
+  steady_state(rho);
+  populations = eigen_pops;
+  get_populations(rho,&populations);
+  assert_populations_within(1e-6,2,stab_pops,eigen_pops);
+
+  destroy_dm(rho);
+  destroy_cavity_qubits(&model);
+  QuaC_clear();
+#else
+  TEST_IGNORE_MESSAGE("QuaC built without SLEPc");
+#endif
+}
+
+/*
+ * The tensor preconditioner should give the same steady state as ASM
+ */
+void test_tensor_pc_steady_state(void)
+{
+  double asm_pops[2],tensor_pops[2];
+  int num_pop;
+
+  cavity_qubits_populations(_jc_model(0.1),1,asm_pops,&num_pop);
+  use_tensor_preconditioner();
+  cavity_qubits_populations(_jc_model(0.1),1,tensor_pops,&num_pop);
+  assert_populations_within(1e-6,num_pop,asm_pops,tensor_pops);
+}
+
+/*
+ * A continuation across drive strengths should match fresh steady
+ * state solves at every point
+ */
+void test_steady_state_continuation(void)
+{
+  cavity_qubits_model model;
+  steady_state_continuation cont;
+  double drives[3] = {0.05,0.1,0.15};
+  double cont_pops[3][2],fresh_pops[2],*populations;
+  Vec rho;
+  int i,num_pop;
+
+  model = _jc_model(drives[0]);
+  use_coo_assembly();
+  build_cavity_qubits(&model);
+  create_full_dm(&rho);
+  create_steady_state_continuation(&cont,1,0);
+  for (i=0;i<3;i++){
+    update_term_coefficient(model.drive_terms[0],drives[i]);
+    update_term_coefficient(model.drive_terms[1],drives[i]);
+    steady_state_continue(cont,drives[i],rho);
+    populations = cont_pops[i];
+    get_populations(rho,&populations);
+  }
+  destroy_steady_state_continuation(&cont);
+  destroy_dm(rho);
+  destroy_cavity_qubits(&model);
+  QuaC_clear();
+
+  for (i=0;i<3;i++){
+    cavity_qubits_populations(_jc_model(drives[i]),1,fresh_pops,&num_pop);
+    assert_populations_within(1e-6,num_pop,fresh_pops,cont_pops[i]);
+  }
+}
+
+/*
+ * Assembling, solving, changing a coefficient and solving again
+ * should keep the stabilization row and the new values in sync
+ * with the COO pattern
+ */
+void test_steady_state_after_update(void)
+{
+  cavity_qubits_model model;
+  double updated_pops[2],fresh_pops[2],*populations;
+  Vec rho;
+  int num_pop;
+
+  model = _jc_model(0.05);
+  use_coo_assembly();
+  build_cavity_qubits(&model);
+  assemble_operators();
+  create_full_dm(&rho);
+  steady_state(rho);
+  update_term_coefficient(model.drive_terms[0],0.1);
+  update_term_coefficient(model.drive_terms[1],0.1);
+  steady_state(rho);
+  populations = updated_pops;
+  get_populations(rho,&populations);
+  destroy_dm(rho);
+  destroy_cavity_qubits(&model);
+  QuaC_clear();
+
+  cavity_qubits_populations(_jc_model(0.1),1,fresh_pops,&num_pop);
+  assert_populations_within(1e-6,num_pop,fresh_pops,updated_pops);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_eigen_steady_state);
+  RUN_TEST(test_eigen_after_stabilized);
+  RUN_TEST(test_tensor_pc_steady_state);
+  RUN_TEST(test_steady_state_continuation);
+  RUN_TEST(test_steady_state_after_update);
+  QuaC_finalize();
+  return UNITY_END();
+}
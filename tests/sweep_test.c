@@ -0,0 +1,83 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "sweep.h"
+#include "quac_system.h"
+#include "petsc.h"
+
+/*
+ * Steady state of a two level system coupled to a thermal bath with
+ * n_th = point. The excited state population is n_th/(2 n_th + 1).
+ */
+void _thermal_qubit_point(PetscInt point,double *results,void *ctx)
+{
+  operator qubit;
+  Vec rho;
+  PetscScalar pop;
+  double gamma,n_th;
+
+  gamma = *(double*)ctx;
+  n_th  = point;
+
+  create_op(2,&qubit);
+  add_lin(gamma*(n_th+1),qubit);
+  add_lin(gamma*n_th,qubit->dag);
+
+  create_full_dm(&rho);
+  steady_state(rho);
+  get_expectation_value(rho,&pop,1,qubit->n);
+  results[0] = PetscRealPart(pop);
+
+  destroy_dm(rho);
+  destroy_op(&qubit);
+}
+
+/*
+ * Sweep n_th with one core per group, so that with more than one core
+ * the points are farmed out to several groups.
+ */
+void test_sweep_thermal_qubit(void)
+{
+  PetscInt npoints=4,i;
+  double results[4],gamma=1.0;
+
+  run_sweep(npoints,1,1,_thermal_qubit_point,&gamma,results);
+
+  if (nid==0){
+    for (i=0;i<npoints;i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-6,(double)i/(2*i+1),results[i]);
+    }
+  }
+}
+
+/*
+ * A sweep started from a user's own system should leave that system
+ * active, not the default one
+ */
+void test_sweep_keeps_active_system(void)
+{
+  quac_system sys;
+  double results[2],gamma=1.0;
+
+  create_quac_system(&sys,PETSC_COMM_WORLD);
+  quac_system_activate(sys);
+  run_sweep(2,1,1,_thermal_qubit_point,&gamma,results);
+  TEST_ASSERT_TRUE(quac_system_get_active()==sys);
+
+  quac_system_activate(NULL);
+  destroy_quac_system(&sys);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_sweep_thermal_qubit);
+  RUN_TEST(test_sweep_keeps_active_system);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,104 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "symmetry.h"
+#include "petsc.h"
+#include "tests.h"
+
+/*
+ * A Jaynes-Cummings model with a thermal cavity bath and qubit decay,
+ * which conserves the total excitation number
+ */
+static cavity_qubits_model _jc_model()
+{
+  cavity_qubits_model model;
+
+  model.cavity_levels = 6;
+  model.num_qubits    = 1;
+  model.drive         = 0.0;
+  model.n_th          = 0.5;
+  model.qubit_pump    = 0.0;
+  return model;
+}
+
+/*
+ * A Tavis-Cummings model (cavity + 3 identical qubits with the same
+ * coupling, decay and pumping), which is invariant under permuting the
+ * qubits
+ */
+static cavity_qubits_model _tc_model()
+{
+  cavity_qubits_model model;
+
+  model.cavity_levels = 4;
+  model.num_qubits    = 3;
+  model.drive         = 0.0;
+  model.n_th          = 0.0;
+  model.qubit_pump    = 0.05;
+  return model;
+}
+
+/*
+ * The populations from the reduced solve should match the full solve
+ */
+void test_jc_symmetry(int steady)
+{
+  double full_pops[2],reduced_pops[2];
+  int num_pop;
+
+  cavity_qubits_populations(_jc_model(),steady,full_pops,&num_pop);
+  use_symmetry_reduction();
+  cavity_qubits_populations(_jc_model(),steady,reduced_pops,&num_pop);
+  assert_populations_within(1e-6,num_pop,full_pops,reduced_pops);
+}
+
+void test_jc_symmetry_steady_state(void)
+{
+  test_jc_symmetry(1);
+}
+
+void test_jc_symmetry_time_step(void)
+{
+  test_jc_symmetry(0);
+}
+
+/*
+ * The populations from the permutation reduced solve should match
+ * the full solve
+ */
+void test_tc_permutation(int steady)
+{
+  double full_pops[4],reduced_pops[4];
+  int num_pop;
+
+  cavity_qubits_populations(_tc_model(),steady,full_pops,&num_pop);
+  use_permutation_symmetry();
+  cavity_qubits_populations(_tc_model(),steady,reduced_pops,&num_pop);
+  assert_populations_within(1e-6,num_pop,full_pops,reduced_pops);
+}
+
+void test_tc_permutation_steady_state(void)
+{
+  test_tc_permutation(1);
+}
+
+void test_tc_permutation_time_step(void)
+{
+  test_tc_permutation(0);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_jc_symmetry_steady_state);
+  RUN_TEST(test_jc_symmetry_time_step);
+  RUN_TEST(test_tc_permutation_steady_state);
+  RUN_TEST(test_tc_permutation_time_step);
+  QuaC_finalize();
+  return UNITY_END();
+}
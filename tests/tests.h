@@ -1,10 +1,30 @@
 #ifndef TESTS_H_
 #define TESTS_H_
 
+#include "operators.h"
+
 void timedep_test(double**,int*);
 void imag_ham_dm_test(double**,int*);
 void imag_ham_psi_test(double**,int*);
 void real_ham_dm_test(double**,int*);
 void real_ham_psi_test(double**,int*);
 
+#define MAX_MODEL_QUBITS 4
+
+/*
+ * cavity_qubits_model is a cavity coupled to identical qubits, shared by
+ * the solver tests (see models.c)
+ */
+typedef struct cavity_qubits_model{
+  int       cavity_levels,num_qubits;
+  double    drive,n_th,qubit_pump;
+  operator  cavity,qubits[MAX_MODEL_QUBITS];
+  quac_term drive_terms[2];
+} cavity_qubits_model;
+
+void build_cavity_qubits(cavity_qubits_model*);
+void destroy_cavity_qubits(cavity_qubits_model*);
+void cavity_qubits_populations(cavity_qubits_model,int,double*,int*);
+void assert_populations_within(double,int,double*,double*);
+
 #endif